@@ -26,6 +26,13 @@
 #include <time.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <signal.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#if defined(CPRT_HAVE_RDTSCP)
+#include <cpuid.h>
+#endif
 
 #if defined(_WIN32)
 LARGE_INTEGER cprt_frequency;
@@ -91,7 +98,27 @@ void cprt_inittime()
 #endif
 
 
-void cprt_sleep_ns(uint64_t duration_ns)
+/* The tail of cprt_sleep_ns() that is spun rather than slept, because
+ * the OS may wake us late by about this much. See cprt_sleep_calibrate(). */
+static uint64_t cprt_sleep_spin_ns = 60000;
+
+
+/* Give up the CPU for at least duration_us. */
+static void cprt_os_sleep_us(uint32_t duration_us)
+{
+#if defined(_WIN32)
+  Sleep((duration_us + 999) / 1000);
+#else
+  struct timespec req_ts;
+  req_ts.tv_sec = duration_us / 1000000;
+  req_ts.tv_nsec = (long)(duration_us % 1000000) * 1000;
+  (void)nanosleep(&req_ts, NULL);
+#endif
+}  /* cprt_os_sleep_us */
+
+
+/* Busy-wait; precise, but holds the CPU the whole time. */
+void cprt_spin_ns(uint64_t duration_ns)
 {
   uint64_t ns_so_far;
   struct cprt_timespec cur_ts;
@@ -100,12 +127,269 @@ void cprt_sleep_ns(uint64_t duration_ns)
   CPRT_GETTIME(&start_ts);
   cur_ts = start_ts;
   do {  /* while */
+    CPRT_CPU_RELAX();
     CPRT_DIFF_TS(ns_so_far, cur_ts, start_ts);
     CPRT_GETTIME(&cur_ts);
   } while (ns_so_far < duration_ns);
+}  /* cprt_spin_ns */
+
+
+/* Let the OS sleep for all but the last cprt_sleep_spin_ns, then spin to
+ * the deadline. Never returns early. */
+void cprt_sleep_ns(uint64_t duration_ns)
+{
+  uint64_t ns_so_far;
+  struct cprt_timespec cur_ts;
+  struct cprt_timespec start_ts;
+  uint64_t spin_ns = cprt_sleep_spin_ns;
+
+  CPRT_GETTIME(&start_ts);
+  if (duration_ns > spin_ns) {
+#if defined(_WIN32)
+    uint64_t sleep_ms = (duration_ns - spin_ns) / 1000000;  /* Sleep() is coarse. */
+    if (sleep_ms > 0) { Sleep((DWORD)sleep_ms); }
+#elif defined(__linux__)
+    /* Absolute deadline, so an EINTR retry does not drift. */
+    struct timespec wake_ts;
+    uint64_t wake_ns = (uint64_t)start_ts.tv_nsec + (duration_ns - spin_ns);
+    wake_ts.tv_sec = start_ts.tv_sec + (time_t)(wake_ns / 1000000000);
+    wake_ts.tv_nsec = (long)(wake_ns % 1000000000);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_ts, NULL) == EINTR) { }
+#else
+    struct timespec req_ts;
+    uint64_t sleep_ns = duration_ns - spin_ns;
+    req_ts.tv_sec = (time_t)(sleep_ns / 1000000000);
+    req_ts.tv_nsec = (long)(sleep_ns % 1000000000);
+    (void)nanosleep(&req_ts, NULL);
+#endif
+  }
+
+  cur_ts = start_ts;
+  do {  /* while */
+    CPRT_CPU_RELAX();
+    CPRT_GETTIME(&cur_ts);
+    CPRT_DIFF_TS(ns_so_far, cur_ts, start_ts);
+  } while (ns_so_far < duration_ns);
 }  /* cprt_sleep_ns */
 
 
+/* Measure how late the OS wakes a short sleep, and spin for that much
+ * (plus margin) at the end of later cprt_sleep_ns() calls. Takes a few
+ * ms. Returns the new spin window in ns. */
+uint64_t cprt_sleep_calibrate()
+{
+  uint64_t late_ns[16];
+  uint64_t ns, spin_ns;
+  struct cprt_timespec start_ts, end_ts;
+  int i, j;
+
+  for (i = 0; i < 16; i++) {
+    CPRT_GETTIME(&start_ts);
+    cprt_os_sleep_us(1);
+    CPRT_GETTIME(&end_ts);
+    CPRT_DIFF_TS(ns, end_ts, start_ts);
+    for (j = i; j > 0 && late_ns[j - 1] > ns; j--) { late_ns[j] = late_ns[j - 1]; }
+    late_ns[j] = ns;
+  }
+
+  /* Second highest, so one preemption doesn't set it. */
+  spin_ns = late_ns[14] + late_ns[14] / 4;
+  if (spin_ns < 2000) { spin_ns = 2000; }
+  if (spin_ns > 2000000) { spin_ns = 2000000; }
+  cprt_sleep_spin_ns = spin_ns;
+
+  return spin_ns;
+}  /* cprt_sleep_calibrate */
+
+
+/* 0 = never spin (all OS sleep); large = always spin (cprt_spin_ns()). */
+void cprt_sleep_set_spin_ns(uint64_t spin_ns)
+{
+  cprt_sleep_spin_ns = spin_ns;
+}  /* cprt_sleep_set_spin_ns */
+
+
+/* CPU time used by the calling thread. */
+uint64_t cprt_thread_cpu_ns()
+{
+#if defined(_WIN32)
+  FILETIME create_ft, exit_ft, kernel_ft, user_ft;
+  GetThreadTimes(GetCurrentThread(), &create_ft, &exit_ft, &kernel_ft, &user_ft);
+  return ((((uint64_t)kernel_ft.dwHighDateTime << 32) | kernel_ft.dwLowDateTime)
+      + (((uint64_t)user_ft.dwHighDateTime << 32) | user_ft.dwLowDateTime)) * 100;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}  /* cprt_thread_cpu_ns */
+
+
+void cprt_backoff_init(cprt_backoff_t *backoff, uint32_t max_spins, uint32_t max_yields, uint32_t max_sleep_us)
+{
+  backoff->max_spins = max_spins;
+  backoff->max_yields = max_yields;
+  backoff->max_sleep_us = (max_sleep_us == 0) ? 1 : max_sleep_us;
+  cprt_backoff_reset(backoff);
+}  /* cprt_backoff_init */
+
+
+/* Call after the awaited condition was seen, before the next wait. */
+void cprt_backoff_reset(cprt_backoff_t *backoff)
+{
+  backoff->num_waits = 0;
+  backoff->sleep_us = 1;
+}  /* cprt_backoff_reset */
+
+
+void cprt_backoff_wait(cprt_backoff_t *backoff)
+{
+  uint32_t n = backoff->num_waits++;
+
+  if (n < backoff->max_spins) {
+    uint32_t pauses = 1u << ((n < 10) ? n : 10);  /* Up to 1024. */
+    while (pauses-- > 0) { CPRT_CPU_RELAX(); }
+  }
+  else if (n < backoff->max_spins + backoff->max_yields) {
+    CPRT_YIELD();
+  }
+  else {
+    cprt_os_sleep_us(backoff->sleep_us);
+    if (backoff->sleep_us < backoff->max_sleep_us) {
+      backoff->sleep_us *= 2;
+      if (backoff->sleep_us > backoff->max_sleep_us) { backoff->sleep_us = backoff->max_sleep_us; }
+    }
+    backoff->num_waits--;  /* Stay in this phase without overflowing. */
+  }
+}  /* cprt_backoff_wait */
+
+
+static cprt_contention_t cprt_contentions[CPRT_CONTENTION_MAX_LOCKS];
+static cprt_contention_hook_t cprt_contention_hook = NULL;
+static void *cprt_contention_hook_arg = NULL;
+static CPRT_THREAD_LOCAL int cprt_in_contention_hook = 0;
+
+
+/* Find or claim the lock's slot; NULL if the table is full. */
+static cprt_contention_t *cprt_contention_slot(void *lock, int type, const char *file_name, int file_line)
+{
+  uint32_t i = (uint32_t)(((uintptr_t)lock >> 3) * 2654435761u) % CPRT_CONTENTION_MAX_LOCKS;
+  uint32_t probes;
+
+  for (probes = 0; probes < CPRT_CONTENTION_MAX_LOCKS; probes++) {
+    cprt_contention_t *entry = &cprt_contentions[i];
+    void *entry_lock = *(void * volatile *)&entry->lock;
+    if (entry_lock == lock) { return entry; }
+    if (entry_lock == NULL) {
+      if (CPRT_ATOMIC_CASPTR(&entry->lock, NULL, lock)) {
+        entry->type = type;
+        entry->file_line = file_line;
+        CPRT_ORDER_BARRIER();
+        entry->file_name = file_name;  /* Dumps show "?" until this is set. */
+        return entry;
+      }
+      if (*(void * volatile *)&entry->lock == lock) { return entry; }
+    }
+    i = (i + 1) % CPRT_CONTENTION_MAX_LOCKS;
+  }
+  return NULL;
+}  /* cprt_contention_slot */
+
+
+static uint64_t cprt_contention_now_ns()
+{
+  struct cprt_timespec ts;
+  CPRT_GETTIME(&ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}  /* cprt_contention_now_ns */
+
+
+/* Slow path of the CPRT_CONTENTION_TRACE lock macros. Returns the start time. */
+uint64_t cprt_contention_begin(void *lock, int type, const char *file_name, int file_line)
+{
+  cprt_contention_hook_t hook = cprt_contention_hook;
+
+  if (hook != NULL && ! cprt_in_contention_hook) {
+    cprt_in_contention_hook = 1;  /* The hook's own locks are not traced. */
+    (*hook)(cprt_contention_hook_arg, 0, lock, type, file_name, file_line, 0);
+    cprt_in_contention_hook = 0;
+  }
+  return cprt_contention_now_ns();
+}  /* cprt_contention_begin */
+
+
+void cprt_contention_end(void *lock, int type, const char *file_name, int file_line, uint64_t start_ns)
+{
+  uint64_t wait_ns = cprt_contention_now_ns() - start_ns;
+  cprt_contention_t *entry = cprt_contention_slot(lock, type, file_name, file_line);
+  cprt_contention_hook_t hook = cprt_contention_hook;
+
+  if (entry != NULL) {
+    uint64_t max_ns;
+    CPRT_ATOMIC_INC_VAL(&entry->count);
+    CPRT_ATOMIC_ADD_VAL(&entry->total_ns, wait_ns);
+    do {
+      max_ns = entry->max_ns;
+    } while (wait_ns > max_ns && ! CPRT_ATOMIC_CAS64(&entry->max_ns, max_ns, wait_ns));
+  }
+  if (hook != NULL && ! cprt_in_contention_hook) {
+    cprt_in_contention_hook = 1;
+    (*hook)(cprt_contention_hook_arg, 1, lock, type, file_name, file_line, wait_ns);
+    cprt_in_contention_hook = 0;
+  }
+}  /* cprt_contention_end */
+
+
+/* hook is called on the waiting thread; NULL removes it. */
+void cprt_contention_set_hook(cprt_contention_hook_t hook, void *hook_arg)
+{
+  cprt_contention_hook = NULL;
+  CPRT_MEM_BARRIER();
+  cprt_contention_hook_arg = hook_arg;
+  CPRT_MEM_BARRIER();
+  cprt_contention_hook = hook;
+}  /* cprt_contention_set_hook */
+
+
+/* Return 0 on success, -1 if the lock was never contended (errno ENOENT). */
+int cprt_contention_get(void *lock, cprt_contention_t *stats_rtn)
+{
+  int i;
+
+  for (i = 0; i < CPRT_CONTENTION_MAX_LOCKS; i++) {
+    if (cprt_contentions[i].lock == lock && lock != NULL) {
+      *stats_rtn = cprt_contentions[i];
+      return 0;
+    }
+  }
+  errno = ENOENT;
+  return -1;
+}  /* cprt_contention_get */
+
+
+void cprt_contention_dump(FILE *fp)
+{
+  static const char *type_names[3] = { "mutex", "spin", "sem" };
+  int i;
+
+  for (i = 0; i < CPRT_CONTENTION_MAX_LOCKS; i++) {
+    cprt_contention_t *entry = &cprt_contentions[i];
+    if (entry->lock == NULL) { continue; }
+    fprintf(fp, "contention %s %p (%s:%d): count=%"PRIu64", total_ns=%"PRIu64", avg_ns=%"PRIu64", max_ns=%"PRIu64"\n",
+        type_names[entry->type], entry->lock,
+        (entry->file_name == NULL) ? "?" : CPRT_BASENAME(entry->file_name), entry->file_line,
+        entry->count, entry->total_ns, (entry->count > 0) ? entry->total_ns / entry->count : 0, entry->max_ns);
+  }
+}  /* cprt_contention_dump */
+
+
+/* Forget all statistics; no thread may be waiting on a traced lock. */
+void cprt_contention_reset()
+{
+  memset(cprt_contentions, 0, sizeof(cprt_contentions));
+}  /* cprt_contention_reset */
+
+
 void cprt_localtime_r(time_t *timep, struct tm *result)
 {
 #if defined(_WIN32)
@@ -188,13 +472,22 @@ void cprt_perrno(char *in_str, char *file, int line)
  * Returns passed-in string pointer for convenience. */
 char *cprt_timestamp(char *str, int bufsz, int do_date, int precision)
 {
-  static unsigned long long pow_10[7] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
   struct cprt_timeval cur_time_tv;
+
+  CPRT_TIMEOFDAY(&cur_time_tv, NULL);
+  return cprt_format_timestamp(str, bufsz, do_date, precision, &cur_time_tv);
+}  /* cprt_timestamp */
+
+
+/* As cprt_timestamp(), for a time taken earlier. */
+char *cprt_format_timestamp(char *str, int bufsz, int do_date, int precision, struct cprt_timeval *tv)
+{
+  static unsigned long long pow_10[7] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+  struct cprt_timeval cur_time_tv = *tv;
   struct tm tm_buf;
   char *rtn_str = str;
 
-  CPRT_TIMEOFDAY(&cur_time_tv, NULL);
-  CPRT_LOCALTIME_R(&cur_time_tv.tv_sec, &tm_buf);  /* Break down current time. */
+  CPRT_LOCALTIME_R(&cur_time_tv.tv_sec, &tm_buf);  /* Break down the time. */
 
   if (do_date && precision > 0) {
     CPRT_SNPRINTF(str, bufsz, "%04d-%02d-%02d %02d:%02d:%02d.%0*d",
@@ -218,7 +511,250 @@ char *cprt_timestamp(char *str, int bufsz, int do_date, int precision)
   }
 
   return rtn_str;
-}  /* cprt_timestamp */
+}  /* cprt_format_timestamp */
+
+
+/* Asynchronous printing (see cprt_async_printf_start()). Each thread has
+ * its own single-producer queue of fixed-size messages, allocated on the
+ * thread's first message; after that, callers only vsnprintf into a slot.
+ * The writer thread adds timestamps, prints in call order, and flushes
+ * once per batch. Queues of exited threads are not reclaimed. */
+#define CPRT_ASYNC_KIND_TS 0
+#define CPRT_ASYNC_KIND_MS 1
+
+struct cprt_async_msg_s {
+  uint64_t seq;  /* Global call order. */
+  FILE *fp;
+  int kind;
+  struct cprt_timeval tv;  /* CPRT_ASYNC_KIND_TS. */
+  uint64_t delta_ms;       /* CPRT_ASYNC_KIND_MS. */
+  char text[CPRT_ASYNC_MSG_SIZE];
+};
+typedef struct cprt_async_msg_s cprt_async_msg_t;
+
+struct cprt_async_queue_s {
+  volatile uint64_t head;  /* Written only by the owning thread. */
+  volatile uint64_t tail;  /* Written only while holding cprt_async_mutex. */
+  uint32_t num_entries;
+  struct cprt_async_queue_s *next;
+  cprt_async_msg_t *msgs;
+};
+typedef struct cprt_async_queue_s cprt_async_queue_t;
+
+static volatile int cprt_async_active = 0;
+static volatile int cprt_async_stop_requested = 0;
+static int cprt_async_hooks_installed = 0;
+static uint32_t cprt_async_queue_entries = 0;
+static uint64_t cprt_async_seq = 0;
+static cprt_async_queue_t *cprt_async_queues = NULL;
+static CPRT_MUTEX_T cprt_async_mutex;
+static CPRT_THREAD_T cprt_async_thread;
+static CPRT_THREAD_LOCAL cprt_async_queue_t *cprt_my_async_queue = NULL;
+
+
+/* Returns 1 if queued, 0 if async printing is off (caller prints). */
+static int cprt_async_put(FILE *fp, int kind, uint64_t start_ms, const char *format, va_list argp)
+{
+  cprt_async_queue_t *queue = cprt_my_async_queue;
+  cprt_async_msg_t *msg;
+  int len;
+
+  if (queue == NULL) {
+    queue = (cprt_async_queue_t *)calloc(1, sizeof(cprt_async_queue_t));
+    if (queue == NULL) { return 0; }
+    queue->num_entries = cprt_async_queue_entries;
+    queue->msgs = (cprt_async_msg_t *)malloc(queue->num_entries * sizeof(cprt_async_msg_t));
+    if (queue->msgs == NULL) { free(queue); return 0; }
+    do {
+      queue->next = cprt_async_queues;
+    } while (! CPRT_ATOMIC_CASPTR(&cprt_async_queues, queue->next, queue));
+    cprt_my_async_queue = queue;
+  }
+
+  /* Full: wait for the writer rather than lose the message. */
+  if (queue->head - queue->tail >= queue->num_entries) {
+    cprt_backoff_t backoff;
+    cprt_backoff_init(&backoff, 10, 10, 1000);
+    while (queue->head - queue->tail >= queue->num_entries) {
+      if (! cprt_async_active) { return 0; }
+      cprt_backoff_wait(&backoff);
+    }
+  }
+
+  msg = &queue->msgs[queue->head % queue->num_entries];
+  msg->fp = fp;
+  msg->kind = kind;
+  if (kind == CPRT_ASYNC_KIND_TS) {
+    CPRT_TIMEOFDAY(&msg->tv, NULL);
+  }
+  else {
+    msg->delta_ms = cprt_get_ms_time() - start_ms;
+  }
+  len = vsnprintf(msg->text, sizeof(msg->text), format, argp);
+  if (len >= (int)sizeof(msg->text)) {  /* Mark the truncation. */
+    strcpy(&msg->text[sizeof(msg->text) - 5], "...\n");
+  }
+  msg->seq = CPRT_ATOMIC_INC_VAL(&cprt_async_seq);
+
+  CPRT_ORDER_BARRIER();  /* Message before head. */
+  queue->head++;
+  return 1;
+}  /* cprt_async_put */
+
+
+static void cprt_async_write(cprt_async_msg_t *msg)
+{
+  char ts_buf[32];
+
+  if (msg->kind == CPRT_ASYNC_KIND_TS) {
+    cprt_format_timestamp(ts_buf, sizeof(ts_buf), 1, 3, &msg->tv);
+    fprintf(msg->fp, "%s: %s", ts_buf, msg->text);
+  }
+  else {
+    fprintf(msg->fp, "%"PRIu64".%03"PRIu64": %s", msg->delta_ms / 1000, msg->delta_ms % 1000, msg->text);
+  }
+}  /* cprt_async_write */
+
+
+/* Print everything queued, oldest call first. Caller holds the mutex.
+ * Returns the number of messages printed. */
+static uint32_t cprt_async_drain_locked()
+{
+  uint32_t num_written = 0;
+
+  for (;;) {
+    cprt_async_queue_t *queue;
+    cprt_async_queue_t *oldest = NULL;
+    cprt_async_msg_t *msg;
+
+    for (queue = cprt_async_queues; queue != NULL; queue = queue->next) {
+      if (queue->head == queue->tail) { continue; }
+      CPRT_ORDER_BARRIER();  /* Head before message. */
+      msg = &queue->msgs[queue->tail % queue->num_entries];
+      if (oldest == NULL || msg->seq < oldest->msgs[oldest->tail % oldest->num_entries].seq) {
+        oldest = queue;
+      }
+    }
+    if (oldest == NULL) { break; }
+
+    cprt_async_write(&oldest->msgs[oldest->tail % oldest->num_entries]);
+    CPRT_ORDER_BARRIER();  /* Done with the slot before freeing it. */
+    oldest->tail++;
+    num_written++;
+  }
+
+  if (num_written > 0) {
+    fflush(NULL);  /* One flush per batch, for every stream written. */
+  }
+  return num_written;
+}  /* cprt_async_drain_locked */
+
+
+CPRT_THREAD_ENTRYPOINT cprt_async_thread_main(void *in_arg)
+{
+  uint32_t num_written;
+  (void)in_arg;
+
+  while (! cprt_async_stop_requested) {
+    CPRT_MUTEX_LOCK(cprt_async_mutex);
+    num_written = cprt_async_drain_locked();
+    CPRT_MUTEX_UNLOCK(cprt_async_mutex);
+    if (num_written == 0) {
+      CPRT_SLEEP_MS(1);
+    }
+  }
+
+  return 0;
+}  /* cprt_async_thread_main */
+
+
+/* Print everything queued so far before returning. */
+void cprt_async_printf_flush()
+{
+  if (cprt_async_queue_entries == 0) { return; }
+  CPRT_MUTEX_LOCK(cprt_async_mutex);
+  (void)cprt_async_drain_locked();
+  CPRT_MUTEX_UNLOCK(cprt_async_mutex);
+}  /* cprt_async_printf_flush */
+
+
+/* Stop the writer and print what is left. Later calls print directly. */
+void cprt_async_printf_stop()
+{
+  if (! cprt_async_active) { return; }
+  cprt_async_active = 0;
+  cprt_async_stop_requested = 1;
+  CPRT_THREAD_JOIN(cprt_async_thread);
+  /* Queues are not freed: threads keep pointers to them, and they are
+   * reused if printing is started again. */
+  cprt_async_printf_flush();
+}  /* cprt_async_printf_stop */
+
+
+#if ! defined(_WIN32)
+static int cprt_async_crash_sigs[] = { SIGABRT, SIGSEGV, SIGBUS, SIGFPE, SIGILL };
+
+/* Best effort: the process is going down; get the queued messages out
+ * (e.g. CPRT_ASSERT's) before the default action. */
+static void cprt_async_crash_handler(int sig)
+{
+  int got_it = 0;
+  int tries;
+
+  if (cprt_async_active) {
+    for (tries = 0; tries < 100 && ! got_it; tries++) {
+      CPRT_MUTEX_TRYLOCK(got_it, cprt_async_mutex);
+      if (! got_it) { CPRT_SLEEP_MS(1); }
+    }
+    (void)cprt_async_drain_locked();  /* Even if the writer is stuck holding it. */
+  }
+  signal(sig, SIG_DFL);
+  raise(sig);
+}  /* cprt_async_crash_handler */
+#endif
+
+
+static void cprt_async_atexit()
+{
+  cprt_async_printf_stop();
+}  /* cprt_async_atexit */
+
+
+/* Make cprt_ts_printf() and friends queue their messages for a writer
+ * thread instead of printing. Messages longer than CPRT_ASYNC_MSG_SIZE
+ * are truncated. Returns 0 on success, -1 if already started. */
+int cprt_async_printf_start(uint32_t queue_entries)
+{
+  if (cprt_async_active || queue_entries == 0) { return -1; }
+
+  if (! cprt_async_hooks_installed) {
+    CPRT_MUTEX_INIT(cprt_async_mutex);
+    atexit(cprt_async_atexit);
+#if ! defined(_WIN32)
+    {
+      int i;
+      for (i = 0; i < (int)(sizeof(cprt_async_crash_sigs) / sizeof(cprt_async_crash_sigs[0])); i++) {
+        struct sigaction sa;
+        /* Leave the application's own handlers alone. */
+        if (sigaction(cprt_async_crash_sigs[i], NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+          memset(&sa, 0, sizeof(sa));
+          sa.sa_handler = cprt_async_crash_handler;
+          sigemptyset(&sa.sa_mask);
+          sigaction(cprt_async_crash_sigs[i], &sa, NULL);
+        }
+      }
+    }
+#endif
+    cprt_async_hooks_installed = 1;
+  }
+
+  cprt_async_queue_entries = queue_entries;
+  cprt_async_stop_requested = 0;
+  cprt_async_active = 1;
+  CPRT_THREAD_CREATE(cprt_async_thread, cprt_async_thread_main, NULL);
+
+  return 0;
+}  /* cprt_async_printf_start */
 
 
 /* Called like printf but prints ms-resolution "delta" timestamp.
@@ -226,11 +762,18 @@ char *cprt_timestamp(char *str, int bufsz, int do_date, int precision)
 void cprt_vts_fprintf(FILE *fp, const char *format, va_list argp)
 {
   size_t fmt_len, ts_len;
-  char *fmt_buf;
+  char fmt_stack[256];
+  char *fmt_buf = fmt_stack;
+
+  if (cprt_async_active && cprt_async_put(fp, CPRT_ASYNC_KIND_TS, 0, format, argp)) {
+    return;
+  }
 
   /* Create new format string with timestamp prepended to it. */
   fmt_len = strlen(format) + 32;  /* Allows yyyy-mmm-dd hh:mm:ss.uuuuuuuu: */
-  fmt_buf = malloc(fmt_len);
+  if (fmt_len > sizeof(fmt_stack)) {
+    fmt_buf = malloc(fmt_len);
+  }
   cprt_timestamp(fmt_buf, 32, 1, 3);  /* Include date and 3 decimals for seconds. */
   ts_len = strlen(fmt_buf);
   snprintf(&fmt_buf[ts_len], fmt_len - ts_len, ": %s", format);
@@ -238,7 +781,9 @@ void cprt_vts_fprintf(FILE *fp, const char *format, va_list argp)
   vfprintf(fp, fmt_buf, argp);   /* Pass in new format string. */
   fflush(fp);
 
-  free(fmt_buf);
+  if (fmt_buf != fmt_stack) {
+    free(fmt_buf);
+  }
 }  /* cprt_vts_fprintf */
 
 
@@ -275,12 +820,20 @@ uint64_t cprt_get_ms_time()
 void cprt_vms_fprintf(FILE *fp, uint64_t start_ms, const char *format, va_list argp)
 {
   size_t fmt_len;
-  char *fmt_buf;
-  uint64_t cur_ms = cprt_get_ms_time();
+  char fmt_stack[256];
+  char *fmt_buf = fmt_stack;
+  uint64_t cur_ms;
+
+  if (cprt_async_active && cprt_async_put(fp, CPRT_ASYNC_KIND_MS, start_ms, format, argp)) {
+    return;
+  }
+  cur_ms = cprt_get_ms_time();
 
   /* Create new format string with timestamp prepended to it. */
   fmt_len = strlen(format) + 30;  /* Allows up to 24 digits of seconds. */
-  fmt_buf = malloc(fmt_len);
+  if (fmt_len > sizeof(fmt_stack)) {
+    fmt_buf = malloc(fmt_len);
+  }
   snprintf(fmt_buf, fmt_len, "%"PRIu64".%03"PRIu64": %s",
       (cur_ms - start_ms)/1000, (cur_ms - start_ms) % 1000, format);
 
@@ -288,7 +841,9 @@ void cprt_vms_fprintf(FILE *fp, uint64_t start_ms, const char *format, va_list a
   vfprintf(fp, fmt_buf, argp);   /* Pass in new format string. */
   fflush(fp);
 
-  free(fmt_buf);
+  if (fmt_buf != fmt_stack) {
+    free(fmt_buf);
+  }
 }  /* cprt_vms_fprintf */
 
 
@@ -311,65 +866,617 @@ void cprt_ms_eprintf(uint64_t start_ms, const char *format, ...)
 
 
 void cprt_set_affinity(uint64_t in_mask)
+{
+  if (cprt_try_affinity(in_mask) != 0) {
+    CPRT_PERRNO("cprt_set_affinity");
+  }
+}  /* cprt_set_affinity */
+
+
+/* Return 0 on success, -1 on error (sets errno). */
+int cprt_try_affinity(uint64_t in_mask)
+{
+  cprt_cpuset_t set;
+
+  cprt_cpuset_from_mask(&set, in_mask);
+  return cprt_try_cpuset_affinity(&set);
+}  /* cprt_try_affinity */
+
+
+void cprt_cpuset_from_mask(cprt_cpuset_t *set, uint64_t mask)
+{
+  CPRT_CPUSET_ZERO(set);
+  set->bits[0] = mask;
+}  /* cprt_cpuset_from_mask */
+
+
+/* Parse a list like "0-3,64-67" (the sysfs and taskset format).
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_cpuset_parse(cprt_cpuset_t *set, const char *list)
+{
+  const char *p = list;
+  char *end;
+  long first, last, cpu;
+
+  CPRT_CPUSET_ZERO(set);
+  while (*p != '\0' && *p != '\n') {
+    while (*p == ' ' || *p == ',') { p++; }
+    if (*p == '\0' || *p == '\n') { break; }
+    if (! isdigit((unsigned char)*p)) { errno = EINVAL; return -1; }
+    first = strtol(p, &end, 10);
+    last = first;
+    p = end;
+    if (*p == '-') {
+      p++;
+      if (! isdigit((unsigned char)*p)) { errno = EINVAL; return -1; }
+      last = strtol(p, &end, 10);
+      p = end;
+    }
+    if (first > last || last >= CPRT_MAX_CPUS) { errno = EINVAL; return -1; }
+    for (cpu = first; cpu <= last; cpu++) {
+      CPRT_CPUSET_SET(cpu, set);
+    }
+    if (*p != '\0' && *p != ',' && *p != ' ' && *p != '\n') { errno = EINVAL; return -1; }
+  }
+
+  return 0;
+}  /* cprt_cpuset_parse */
+
+
+/* Inverse of cprt_cpuset_parse(). Returns buf ("" if empty); a list that
+ * does not fit is cut off at a range boundary. */
+char *cprt_cpuset_format(const cprt_cpuset_t *set, char *buf, size_t buf_sz)
+{
+  size_t len = 0;
+  int first, last;
+
+  buf[0] = '\0';
+  for (first = cprt_cpuset_next(set, 0); first >= 0; first = cprt_cpuset_next(set, last + 1)) {
+    char range[32];
+    size_t range_len;
+    last = first;
+    while (CPRT_CPUSET_ISSET(last + 1, set)) { last++; }
+    if (last == first) {
+      CPRT_SNPRINTF(range, sizeof(range), "%s%d", (len > 0) ? "," : "", first);
+    }
+    else {
+      CPRT_SNPRINTF(range, sizeof(range), "%s%d-%d", (len > 0) ? "," : "", first, last);
+    }
+    range_len = strlen(range);
+    if (len + range_len + 1 > buf_sz) { break; }
+    memcpy(&buf[len], range, range_len + 1);
+    len += range_len;
+  }
+
+  return buf;
+}  /* cprt_cpuset_format */
+
+
+int cprt_cpuset_count(const cprt_cpuset_t *set)
+{
+  int count = 0;
+  int cpu;
+
+  for (cpu = cprt_cpuset_next(set, 0); cpu >= 0; cpu = cprt_cpuset_next(set, cpu + 1)) {
+    count++;
+  }
+  return count;
+}  /* cprt_cpuset_count */
+
+
+/* Lowest CPU in the set that is >= cpu, or -1. */
+int cprt_cpuset_next(const cprt_cpuset_t *set, int cpu)
+{
+  for (; cpu < CPRT_MAX_CPUS; cpu++) {
+    uint64_t word = set->bits[cpu / 64] >> (cpu % 64);
+    if (word == 0) {
+      cpu |= 63;  /* Rest of this word is empty. */
+      continue;
+    }
+    while ((word & 1) == 0) { word >>= 1;  cpu++; }
+    return cpu;
+  }
+  return -1;
+}  /* cprt_cpuset_next */
+
+
+/* Pin the calling thread. On Windows all the CPUs must be in one
+ * processor group (64 CPUs each). Return 0 on success, -1 on error
+ * (sets errno). */
+int cprt_try_cpuset_affinity(const cprt_cpuset_t *set)
 {
 #if defined(_WIN32)
-  DWORD_PTR rc;
-  rc = SetThreadAffinityMask(GetCurrentThread(), in_mask);
-  if (rc == 0) {
+  GROUP_AFFINITY group_affinity;
+  int first = cprt_cpuset_next(set, 0);
+  int w;
+
+  if (first < 0) { errno = EINVAL; return -1; }
+  for (w = 0; w < CPRT_MAX_CPUS / 64; w++) {
+    if (w != first / 64 && set->bits[w] != 0) { errno = EINVAL; return -1; }
+  }
+  memset(&group_affinity, 0, sizeof(group_affinity));
+  group_affinity.Group = (WORD)(first / 64);
+  group_affinity.Mask = (KAFFINITY)set->bits[first / 64];
+  if (! SetThreadGroupAffinity(GetCurrentThread(), &group_affinity, NULL)) {
     errno = GetLastError();
-    CPRT_PERRNO("SetThreadAffinityMask");
+    return -1;
   }
 
 #elif defined(__linux__)
-  cpu_set_t cpuset;
-  int i;
-  uint64_t bit = 1;
-  CPU_ZERO(&cpuset);
-  for (i = 0; i < 64; i++) {
-    if ((in_mask & bit) == bit) {
-      CPU_SET(i, &cpuset);
-    }
-    bit = bit << 1;
+  cpu_set_t *cpuset = CPU_ALLOC(CPRT_MAX_CPUS);
+  size_t cpuset_sz = CPU_ALLOC_SIZE(CPRT_MAX_CPUS);
+  int cpu;
+
+  if (cpuset == NULL) { errno = ENOMEM; return -1; }
+  CPU_ZERO_S(cpuset_sz, cpuset);
+  for (cpu = cprt_cpuset_next(set, 0); cpu >= 0; cpu = cprt_cpuset_next(set, cpu + 1)) {
+    CPU_SET_S(cpu, cpuset_sz, cpuset);
+  }
+  errno = pthread_setaffinity_np(pthread_self(), cpuset_sz, cpuset);
+  CPU_FREE(cpuset);
+  if (errno != 0) {
+    return -1;
   }
-  CPRT_EOK0(errno = pthread_setaffinity_np(
-      pthread_self(), sizeof(cpuset), &cpuset));
 
 #else /* Non-Linux Unix. */
+  (void)set;
 #endif
-}  /* cprt_set_affinity */
+  return 0;
+}  /* cprt_try_cpuset_affinity */
 
 
-/* Return 0 on success, -1 on error (sets errno). */
-int cprt_try_affinity(uint64_t in_mask)
+/* The calling thread's current affinity. Return 0 on success, -1 on
+ * error (sets errno). */
+int cprt_get_cpuset_affinity(cprt_cpuset_t *set)
 {
 #if defined(_WIN32)
-  DWORD_PTR rc;
-  rc = SetThreadAffinityMask(GetCurrentThread(), in_mask);
-  if (rc == 0) {
+  GROUP_AFFINITY group_affinity;
+
+  CPRT_CPUSET_ZERO(set);
+  if (! GetThreadGroupAffinity(GetCurrentThread(), &group_affinity)) {
     errno = GetLastError();
     return -1;
   }
+  if (group_affinity.Group < CPRT_MAX_CPUS / 64) {
+    set->bits[group_affinity.Group] = (uint64_t)group_affinity.Mask;
+  }
 
 #elif defined(__linux__)
-  cpu_set_t cpuset;
-  int i;
-  uint64_t bit = 1;
-  CPU_ZERO(&cpuset);
-  for (i = 0; i < 64; i++) {
-    if ((in_mask & bit) == bit) {
-      CPU_SET(i, &cpuset);
-    }
-    bit = bit << 1;
-  }
-  errno = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+  cpu_set_t *cpuset = CPU_ALLOC(CPRT_MAX_CPUS);
+  size_t cpuset_sz = CPU_ALLOC_SIZE(CPRT_MAX_CPUS);
+  int cpu;
+
+  CPRT_CPUSET_ZERO(set);
+  if (cpuset == NULL) { errno = ENOMEM; return -1; }
+  errno = pthread_getaffinity_np(pthread_self(), cpuset_sz, cpuset);
   if (errno != 0) {
+    CPU_FREE(cpuset);
     return -1;
   }
+  for (cpu = 0; cpu < CPRT_MAX_CPUS; cpu++) {
+    if (CPU_ISSET_S(cpu, cpuset_sz, cpuset)) { CPRT_CPUSET_SET(cpu, set); }
+  }
+  CPU_FREE(cpuset);
+
+#else /* Non-Linux Unix: no affinity; report every CPU. */
+  long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  long cpu;
+
+  CPRT_CPUSET_ZERO(set);
+  for (cpu = 0; cpu < num_cpus; cpu++) { CPRT_CPUSET_SET(cpu, set); }
+#endif
+  return 0;
+}  /* cprt_get_cpuset_affinity */
+
+
+#if defined(__linux__)
+/* Read a small sysfs file. Returns 0 on success, -1 if missing. */
+static int cprt_read_sysfs(const char *path, char *buf, size_t buf_sz)
+{
+  FILE *fp = fopen(path, "r");
+  size_t len;
+
+  if (fp == NULL) { return -1; }
+  len = fread(buf, 1, buf_sz - 1, fp);
+  fclose(fp);
+  buf[len] = '\0';
+  return 0;
+}  /* cprt_read_sysfs */
+
+
+static int cprt_read_sysfs_int(const char *path)
+{
+  char buf[64];
+
+  if (cprt_read_sysfs(path, buf, sizeof(buf)) != 0) { return -1; }
+  return atoi(buf);
+}  /* cprt_read_sysfs_int */
+#endif
+
+
+/* Number of distinct values of an id over the online CPUs. */
+static int cprt_topo_distinct(cprt_topo_t *topo, int level)
+{
+  cprt_cpuset_t counted;
+  int count = 0;
+  int cpu;
+
+  CPRT_CPUSET_ZERO(&counted);
+  for (cpu = cprt_cpuset_next(&topo->online_set, 0); cpu >= 0;
+      cpu = cprt_cpuset_next(&topo->online_set, cpu + 1)) {
+    cprt_cpuset_t peers;
+    int peer;
+    if (CPRT_CPUSET_ISSET(cpu, &counted)) { continue; }
+    count++;
+    cprt_topo_peers(topo, cpu, level, &peers);
+    for (peer = cprt_cpuset_next(&peers, 0); peer >= 0; peer = cprt_cpuset_next(&peers, peer + 1)) {
+      CPRT_CPUSET_SET(peer, &counted);
+    }
+  }
+  return count;
+}  /* cprt_topo_distinct */
+
+
+/* Discover the CPU topology (on Linux, from sysfs; elsewhere only the
+ * CPU count is known). Free with cprt_topo_free().
+ * Return 0 on success, -1 on error (sets errno). */
+int cprt_topo_get(cprt_topo_t **topo_rtn)
+{
+  cprt_topo_t *topo;
+  int cpu;
+
+  topo = (cprt_topo_t *)calloc(1, sizeof(cprt_topo_t));
+  if (topo == NULL) { errno = ENOMEM; return -1; }
+  for (cpu = 0; cpu < CPRT_MAX_CPUS; cpu++) {
+    topo->cpus[cpu].socket = -1;
+    topo->cpus[cpu].core = -1;
+    topo->cpus[cpu].numa_node = -1;
+    topo->cpus[cpu].l3_id = -1;
+  }
+
+#if defined(__linux__)
+  {
+    char path[256];
+    char buf[4096];
+    cprt_cpuset_t set;
+    int node, idx, peer;
+
+    if (cprt_read_sysfs("/sys/devices/system/cpu/online", buf, sizeof(buf)) != 0 ||
+        cprt_cpuset_parse(&topo->online_set, buf) != 0) {
+      free(topo);
+      errno = ENOENT;
+      return -1;
+    }
+
+    for (cpu = cprt_cpuset_next(&topo->online_set, 0); cpu >= 0;
+        cpu = cprt_cpuset_next(&topo->online_set, cpu + 1)) {
+      cprt_topo_cpu_t *info = &topo->cpus[cpu];
+      info->online = 1;
+      CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+      info->socket = cprt_read_sysfs_int(path);
+      CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+      info->core = cprt_read_sysfs_int(path);
+
+      for (idx = 0; idx < 16 && info->l3_id < 0; idx++) {
+        CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, idx);
+        if (cprt_read_sysfs(path, buf, sizeof(buf)) != 0) { break; }
+        if (atoi(buf) != 3) { continue; }
+        CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, idx);
+        if (cprt_read_sysfs(path, buf, sizeof(buf)) == 0 && cprt_cpuset_parse(&set, buf) == 0) {
+          info->l3_id = cprt_cpuset_next(&set, 0);
+        }
+      }
+      if (cpu + 1 > topo->num_cpus) { topo->num_cpus = cpu + 1; }
+    }
+
+    /* Node ids can be sparse. */
+    if (cprt_read_sysfs("/sys/devices/system/node/online", buf, sizeof(buf)) == 0) {
+      cprt_cpuset_t nodes;
+      if (cprt_cpuset_parse(&nodes, buf) == 0) {
+        for (node = cprt_cpuset_next(&nodes, 0); node >= 0; node = cprt_cpuset_next(&nodes, node + 1)) {
+          CPRT_SNPRINTF(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+          if (cprt_read_sysfs(path, buf, sizeof(buf)) != 0 || cprt_cpuset_parse(&set, buf) != 0) { continue; }
+          for (peer = cprt_cpuset_next(&set, 0); peer >= 0; peer = cprt_cpuset_next(&set, peer + 1)) {
+            topo->cpus[peer].numa_node = node;
+          }
+        }
+      }
+    }
+  }
+#else
+  {
+#if defined(_WIN32)
+    SYSTEM_INFO sys_info;
+    GetSystemInfo(&sys_info);
+    topo->num_cpus = (int)sys_info.dwNumberOfProcessors;
+#else
+    topo->num_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (topo->num_cpus > CPRT_MAX_CPUS) { topo->num_cpus = CPRT_MAX_CPUS; }
+    for (cpu = 0; cpu < topo->num_cpus; cpu++) {
+      topo->cpus[cpu].online = 1;
+      CPRT_CPUSET_SET(cpu, &topo->online_set);
+    }
+  }
+#endif
+
+  topo->num_online = cprt_cpuset_count(&topo->online_set);
+  topo->num_cores = cprt_topo_distinct(topo, CPRT_TOPO_SMT);
+  topo->num_l3 = cprt_topo_distinct(topo, CPRT_TOPO_L3);
+  topo->num_numa_nodes = cprt_topo_distinct(topo, CPRT_TOPO_NUMA);
+  topo->num_sockets = cprt_topo_distinct(topo, CPRT_TOPO_SOCKET);
+
+  *topo_rtn = topo;
+  return 0;
+}  /* cprt_topo_get */
+
+
+void cprt_topo_free(cprt_topo_t *topo)
+{
+  free(topo);
+}  /* cprt_topo_free */
+
+
+/* The online CPUs sharing cpu's core, L3, NUMA node or socket (level is
+ * CPRT_TOPO_*), including cpu itself. An unknown id is shared with no
+ * other CPU. */
+void cprt_topo_peers(const cprt_topo_t *topo, int cpu, int level, cprt_cpuset_t *set)
+{
+  const cprt_topo_cpu_t *me;
+  int peer;
+
+  CPRT_CPUSET_ZERO(set);
+  if (cpu < 0 || cpu >= CPRT_MAX_CPUS || ! topo->cpus[cpu].online) { return; }
+  me = &topo->cpus[cpu];
+  CPRT_CPUSET_SET(cpu, set);
+
+  for (peer = cprt_cpuset_next(&topo->online_set, 0); peer >= 0;
+      peer = cprt_cpuset_next(&topo->online_set, peer + 1)) {
+    const cprt_topo_cpu_t *other = &topo->cpus[peer];
+    int same = 0;
+    switch (level) {
+      case CPRT_TOPO_SMT:
+        same = (me->core >= 0 && me->socket == other->socket && me->core == other->core);
+        break;
+      case CPRT_TOPO_L3:
+        same = (me->l3_id >= 0 && me->l3_id == other->l3_id);
+        break;
+      case CPRT_TOPO_NUMA:
+        same = (me->numa_node >= 0 && me->numa_node == other->numa_node);
+        break;
+      case CPRT_TOPO_SOCKET:
+        same = (me->socket >= 0 && me->socket == other->socket);
+        break;
+    }
+    if (same) { CPRT_CPUSET_SET(peer, set); }
+  }
+}  /* cprt_topo_peers */
+
+
+void cprt_topo_print(const cprt_topo_t *topo, FILE *fp)
+{
+  char list[1024];
+  int cpu;
+
+  fprintf(fp, "cprt_topo: online=%s, num_online=%d, sockets=%d, cores=%d, numa_nodes=%d, l3=%d\n",
+      cprt_cpuset_format(&topo->online_set, list, sizeof(list)), topo->num_online,
+      topo->num_sockets, topo->num_cores, topo->num_numa_nodes, topo->num_l3);
+  for (cpu = cprt_cpuset_next(&topo->online_set, 0); cpu >= 0;
+      cpu = cprt_cpuset_next(&topo->online_set, cpu + 1)) {
+    const cprt_topo_cpu_t *info = &topo->cpus[cpu];
+    cprt_cpuset_t smt;
+    cprt_topo_peers(topo, cpu, CPRT_TOPO_SMT, &smt);
+    fprintf(fp, "  cpu[%d]: socket=%d, core=%d, numa_node=%d, l3=%d, smt=%s\n",
+        cpu, info->socket, info->core, info->numa_node, info->l3_id,
+        cprt_cpuset_format(&smt, list, sizeof(list)));
+  }
+}  /* cprt_topo_print */
+
+
+/* Current CPU and NUMA node of the calling thread (either may be NULL). */
+void cprt_getcpu(uint32_t *cpu, uint32_t *node)
+{
+#if defined(_WIN32)
+  PROCESSOR_NUMBER pn;
+  USHORT win_node = 0;
+  GetCurrentProcessorNumberEx(&pn);
+  GetNumaProcessorNodeEx(&pn, &win_node);
+  if (cpu != NULL) { *cpu = (uint32_t)pn.Group * 64 + pn.Number; }
+  if (node != NULL) { *node = win_node; }
+
+#elif defined(__linux__)
+  unsigned int linux_cpu = 0, linux_node = 0;
+  if (node == NULL) {
+    /* glibc 2.35+ reads this from the rseq area; else vDSO. */
+    int rc = sched_getcpu();
+    if (cpu != NULL) { *cpu = (rc < 0) ? 0 : (uint32_t)rc; }
+    return;
+  }
+  (void)getcpu(&linux_cpu, &linux_node);  /* vDSO on most architectures. */
+  if (cpu != NULL) { *cpu = linux_cpu; }
+  *node = linux_node;
 
 #else /* Non-Linux Unix. */
+  if (cpu != NULL) { *cpu = 0; }
+  if (node != NULL) { *node = 0; }
+#endif
+}  /* cprt_getcpu */
+
+
+/* Returns 1 if CPRT_RDTSCP's aux value can be trusted to hold the CPU
+ * number (low 12 bits) and NUMA node (upper bits). */
+int cprt_rdtscp_cpu_ok()
+{
+#if defined(CPRT_HAVE_RDTSCP)
+  unsigned int eax, ebx, ecx, edx;
+  uint64_t tsc;
+  uint32_t aux;
+  int try_num;
+
+  if (! __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) { return 0; }
+  if (! (edx & (1u << 27))) { return 0; }  /* No RDTSCP instruction. */
+
+  /* Make sure the kernel actually loads TSC_AUX. Retry in case we migrate
+   * between the two reads. */
+  for (try_num = 0; try_num < 3; try_num++) {
+    CPRT_RDTSCP(tsc, aux);
+    if ((int)(aux & 0xfff) == sched_getcpu()) { return 1; }
+  }
+  (void)tsc;
 #endif
   return 0;
-}  /* cprt_try_affinity */
+}  /* cprt_rdtscp_cpu_ok */
+
+
+/* Number of NUMA nodes (highest online node id + 1); 1 if unknown. */
+int cprt_numa_num_nodes()
+{
+  int num_nodes = 1;
+#if defined(_WIN32)
+  ULONG highest = 0;
+  if (GetNumaHighestNodeNumber(&highest)) {
+    num_nodes = (int)highest + 1;
+  }
+
+#elif defined(__linux__)
+  FILE *fp;
+  char buf[256];
+  char *p;
+
+  fp = fopen("/sys/devices/system/node/online", "r");
+  if (fp == NULL) { return 1; }
+  if (fgets(buf, sizeof(buf), fp) != NULL) {
+    /* List like "0-1,3"; the last number is the highest node. */
+    for (p = buf; *p != '\0'; p++) {
+      if (isdigit(*p) && (p == buf || ! isdigit(p[-1]))) {
+        num_nodes = atoi(p) + 1;
+      }
+    }
+  }
+  fclose(fp);
+
+#else /* Non-Linux Unix. */
+#endif
+  return num_nodes;
+}  /* cprt_numa_num_nodes */
+
+
+/* OS-level thread id (what top, ps and debuggers show). */
+uint64_t cprt_gettid()
+{
+#if defined(_WIN32)
+  return (uint64_t)GetCurrentThreadId();
+#elif defined(__linux__)
+  return (uint64_t)syscall(SYS_gettid);
+#elif defined(__APPLE__)
+  uint64_t tid = 0;
+  pthread_threadid_np(NULL, &tid);
+  return tid;
+#else
+  return (uint64_t)pthread_self();
+#endif
+}  /* cprt_gettid */
+
+
+#if defined(__GNUC__) && ! defined(_WIN32)
+/* Calling thread's stack bounds, cached on first use (lo == NULL: unknown). */
+static CPRT_THREAD_LOCAL char *cprt_stack_lo = NULL;
+static CPRT_THREAD_LOCAL char *cprt_stack_hi = NULL;
+static CPRT_THREAD_LOCAL int cprt_stack_checked = 0;
+
+static void cprt_stack_bounds()
+{
+  cprt_stack_checked = 1;
+#if defined(__linux__)
+  {
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+      if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        cprt_stack_lo = (char *)addr;
+        cprt_stack_hi = (char *)addr + size;
+      }
+      pthread_attr_destroy(&attr);
+    }
+  }
+#elif defined(__APPLE__)
+  cprt_stack_hi = (char *)pthread_get_stackaddr_np(pthread_self());
+  cprt_stack_lo = cprt_stack_hi - pthread_get_stacksize_np(pthread_self());
+#endif
+}  /* cprt_stack_bounds */
+#endif
+
+
+/* Record up to max_addrs return addresses by walking frame pointers, starting
+ * with the frame "frame" (from CPRT_FRAME_ADDRESS()), so addrs[0] is where
+ * that function will return to. Every frame is checked against the thread's
+ * stack bounds, so code built without frame pointers gives a short or
+ * meaningless chain, never a crash. Unused entries are set to NULL.
+ * Returns the number of addresses recorded. */
+int cprt_callers(void **addrs, int max_addrs, void *frame)
+{
+  int num = 0;
+  int i;
+
+#if defined(_WIN32)
+  (void)frame;
+  num = RtlCaptureStackBackTrace(2, max_addrs, addrs, NULL);
+
+#elif defined(__GNUC__)
+  void **fp = (void **)frame;
+
+  if (! cprt_stack_checked) { cprt_stack_bounds(); }
+  while (num < max_addrs && fp != NULL) {
+    void **next_fp;
+    if (cprt_stack_lo != NULL &&
+        ((char *)fp < cprt_stack_lo || (char *)(fp + 2) > cprt_stack_hi)) {
+      break;  /* Not a frame on this stack. */
+    }
+    addrs[num++] = fp[1];
+    if (cprt_stack_lo == NULL) { break; }  /* Can't validate deeper frames. */
+    next_fp = (void **)fp[0];
+    if (next_fp <= fp || ((uintptr_t)next_fp & (sizeof(void *) - 1)) != 0) {
+      break;  /* Stack grows down, so callers' frames must be higher. */
+    }
+    fp = next_fp;
+  }
+#endif
+
+  for (i = num; i < max_addrs; i++) {
+    addrs[i] = NULL;
+  }
+  return num;
+}  /* cprt_callers */
+
+
+/* Name of the calling thread; empty string if not available. */
+void cprt_get_thread_name(char *buf, size_t buf_sz)
+{
+  buf[0] = '\0';
+#if defined(__linux__) || defined(__APPLE__)
+  if (pthread_getname_np(pthread_self(), buf, buf_sz) != 0) {
+    buf[0] = '\0';
+  }
+#endif
+  buf[buf_sz - 1] = '\0';
+}  /* cprt_get_thread_name */
+
+
+/* Name the calling thread (truncated to 15 characters on Linux). */
+void cprt_set_thread_name(const char *name)
+{
+#if defined(__linux__)
+  char buf[16];
+  strncpy(buf, name, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+  (void)pthread_setname_np(pthread_self(), buf);
+#elif defined(__APPLE__)
+  (void)pthread_setname_np(name);
+#else
+  (void)name;
+#endif
+}  /* cprt_set_thread_name */
 
 
 #define CPRT_MAX_EVENTS 1024
@@ -396,6 +1503,223 @@ void cprt_dump_events(FILE *fd)
 }  /* cprt_dump_events */
 
 
+static int cprt_is_pow2(uint32_t n)
+{
+  return n != 0 && (n & (n - 1)) == 0;
+}  /* cprt_is_pow2 */
+
+
+int cprt_spsc_create(cprt_spsc_t **spsc_rtn, uint32_t num_slots)
+{
+  cprt_spsc_t *spsc;
+
+  if (! cprt_is_pow2(num_slots)) { errno = EINVAL; return -1; }
+  spsc = (cprt_spsc_t *)calloc(1, sizeof(cprt_spsc_t));
+  if (spsc == NULL) { errno = ENOMEM; return -1; }
+  spsc->slots = (void **)calloc(num_slots, sizeof(void *));
+  if (spsc->slots == NULL) { free(spsc); errno = ENOMEM; return -1; }
+  spsc->num_slots = num_slots;
+  spsc->mask = num_slots - 1;
+
+  *spsc_rtn = spsc;
+  return 0;
+}  /* cprt_spsc_create */
+
+
+void cprt_spsc_delete(cprt_spsc_t *spsc)
+{
+  free(spsc->slots);
+  free(spsc);
+}  /* cprt_spsc_delete */
+
+
+/* Producer only. Returns the number enqueued (fewer if it filled). */
+uint32_t cprt_spsc_enqueue_batch(cprt_spsc_t *spsc, void **items, uint32_t num_items)
+{
+  uint64_t head = spsc->head;
+  uint32_t num_free = spsc->num_slots - (uint32_t)(head - spsc->cached_tail);
+  uint32_t i;
+
+  /* Only look at the consumer's line when the stale copy says full. */
+  if (num_free < num_items) {
+    spsc->cached_tail = spsc->tail;
+    CPRT_ORDER_BARRIER();  /* Tail before reusing its slots. */
+    num_free = spsc->num_slots - (uint32_t)(head - spsc->cached_tail);
+  }
+  if (num_items > num_free) { num_items = num_free; }
+
+  for (i = 0; i < num_items; i++) {
+    spsc->slots[(head + i) & spsc->mask] = items[i];
+  }
+  CPRT_ORDER_BARRIER();  /* Items before head. */
+  spsc->head = head + num_items;
+
+  return num_items;
+}  /* cprt_spsc_enqueue_batch */
+
+
+/* Consumer only. Returns the number dequeued (0 if empty). */
+uint32_t cprt_spsc_dequeue_batch(cprt_spsc_t *spsc, void **items, uint32_t max_items)
+{
+  uint64_t tail = spsc->tail;
+  uint32_t num_avail = (uint32_t)(spsc->cached_head - tail);
+  uint32_t i;
+
+  if (num_avail < max_items) {
+    spsc->cached_head = spsc->head;
+    CPRT_ORDER_BARRIER();  /* Head before items. */
+    num_avail = (uint32_t)(spsc->cached_head - tail);
+  }
+  if (max_items > num_avail) { max_items = num_avail; }
+
+  for (i = 0; i < max_items; i++) {
+    items[i] = spsc->slots[(tail + i) & spsc->mask];
+  }
+  CPRT_ORDER_BARRIER();  /* Done with the slots before freeing them. */
+  spsc->tail = tail + max_items;
+
+  return max_items;
+}  /* cprt_spsc_dequeue_batch */
+
+
+int cprt_mpsc_create(cprt_mpsc_t **mpsc_rtn, uint32_t num_slots)
+{
+  cprt_mpsc_t *mpsc;
+
+  if (! cprt_is_pow2(num_slots)) { errno = EINVAL; return -1; }
+  mpsc = (cprt_mpsc_t *)calloc(1, sizeof(cprt_mpsc_t));
+  if (mpsc == NULL) { errno = ENOMEM; return -1; }
+  mpsc->slots = (cprt_mpsc_slot_t *)calloc(num_slots, sizeof(cprt_mpsc_slot_t));
+  if (mpsc->slots == NULL) { free(mpsc); errno = ENOMEM; return -1; }
+  mpsc->num_slots = num_slots;
+  mpsc->mask = num_slots - 1;
+
+  *mpsc_rtn = mpsc;
+  return 0;
+}  /* cprt_mpsc_create */
+
+
+void cprt_mpsc_delete(cprt_mpsc_t *mpsc)
+{
+  free(mpsc->slots);
+  free(mpsc);
+}  /* cprt_mpsc_delete */
+
+
+/* Any thread. Claims a run of slots with one CAS. Returns the number
+ * enqueued (fewer if it filled). */
+uint32_t cprt_mpsc_enqueue_batch(cprt_mpsc_t *mpsc, void **items, uint32_t num_items)
+{
+  uint64_t head;
+  uint32_t num_free, i;
+
+  do {
+    head = mpsc->head;
+    CPRT_ORDER_BARRIER();  /* Head before tail, so num_free is not overstated. */
+    num_free = mpsc->num_slots - (uint32_t)(head - mpsc->tail);
+    if (num_items > num_free) { num_items = num_free; }
+    if (num_items == 0) { return 0; }
+  } while (! CPRT_ATOMIC_CAS64(&mpsc->head, head, head + num_items));
+
+  for (i = 0; i < num_items; i++) {
+    cprt_mpsc_slot_t *slot = &mpsc->slots[(head + i) & mpsc->mask];
+    slot->item = items[i];
+    CPRT_ORDER_BARRIER();  /* Item before seq. */
+    slot->seq = head + i + 1;
+  }
+
+  return num_items;
+}  /* cprt_mpsc_enqueue_batch */
+
+
+/* Consumer only. Stops at a slot whose producer has claimed it but not
+ * yet written it. Returns the number dequeued. */
+uint32_t cprt_mpsc_dequeue_batch(cprt_mpsc_t *mpsc, void **items, uint32_t max_items)
+{
+  uint64_t tail = mpsc->tail;
+  uint32_t i;
+
+  for (i = 0; i < max_items; i++) {
+    cprt_mpsc_slot_t *slot = &mpsc->slots[(tail + i) & mpsc->mask];
+    if (slot->seq != tail + i + 1) { break; }
+    CPRT_ORDER_BARRIER();  /* Seq before item. */
+    items[i] = slot->item;
+  }
+  if (i > 0) {
+    CPRT_ORDER_BARRIER();  /* Done with the slots before freeing them. */
+    mpsc->tail = tail + i;
+  }
+
+  return i;
+}  /* cprt_mpsc_dequeue_batch */
+
+
+int cprt_pool_create(cprt_pool_t **pool_rtn, size_t obj_size, uint32_t num_objs)
+{
+  cprt_pool_t *pool;
+  uint32_t i;
+
+  if (obj_size == 0 || num_objs == 0 || num_objs == 0xffffffff) { errno = EINVAL; return -1; }
+  pool = (cprt_pool_t *)calloc(1, sizeof(cprt_pool_t));
+  if (pool == NULL) { errno = ENOMEM; return -1; }
+  pool->obj_size = (obj_size + 7) & ~(size_t)7;  /* Keep objects 8-byte aligned. */
+  pool->num_objs = num_objs;
+  pool->next = (volatile uint32_t *)malloc(num_objs * sizeof(uint32_t));
+  pool->objs = (char *)malloc(num_objs * pool->obj_size);
+  if (pool->next == NULL || pool->objs == NULL) {
+    free((void *)pool->next);  free(pool->objs);  free(pool);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (i = 0; i < num_objs; i++) {
+    pool->next[i] = (i + 1 < num_objs) ? i + 2 : 0;
+  }
+  pool->free_head = 1;  /* Object 0, tag 0. */
+
+  *pool_rtn = pool;
+  return 0;
+}  /* cprt_pool_create */
+
+
+void cprt_pool_delete(cprt_pool_t *pool)
+{
+  free((void *)pool->next);
+  free(pool->objs);
+  free(pool);
+}  /* cprt_pool_delete */
+
+
+/* Returns NULL if every object is in use. */
+void *cprt_pool_get(cprt_pool_t *pool)
+{
+  uint64_t old_head, new_head;
+  uint32_t idx;
+
+  do {
+    old_head = pool->free_head;
+    idx = (uint32_t)old_head;
+    if (idx == 0) { return NULL; }
+    /* May be stale if another thread takes idx first; the tag catches it. */
+    new_head = (((old_head >> 32) + 1) << 32) | pool->next[idx - 1];
+  } while (! CPRT_ATOMIC_CAS64(&pool->free_head, old_head, new_head));
+
+  return pool->objs + (size_t)(idx - 1) * pool->obj_size;
+}  /* cprt_pool_get */
+
+
+void cprt_pool_put(cprt_pool_t *pool, void *obj)
+{
+  uint32_t idx = (uint32_t)(((char *)obj - pool->objs) / pool->obj_size) + 1;
+  uint64_t old_head, new_head;
+
+  do {
+    old_head = pool->free_head;
+    pool->next[idx - 1] = (uint32_t)old_head;
+    new_head = (((old_head >> 32) + 1) << 32) | idx;
+  } while (! CPRT_ATOMIC_CAS64(&pool->free_head, old_head, new_head));
+}  /* cprt_pool_put */
+
+
 /* Portable getopt(). */
 char* cprt_optarg;
 int cprt_optopt;
@@ -68,16 +68,17 @@
   #include <time.h>
   #include <sys/time.h>
   #include <pthread.h>
+  #include <sched.h>
   #if defined(__APPLE__)
     #include <dispatch/dispatch.h>
   #else  /* Non-Apple Unixes. */
-    #include <sched.h>
     #include <semaphore.h>
   #endif
   #include <inttypes.h>
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 
 
 #ifdef __cplusplus
@@ -110,9 +111,71 @@ extern "C" {
 #if defined(_WIN32)
   #define CPRT_ATOMIC_INC_VAL(_p) InterlockedIncrement(_p)
   #define CPRT_ATOMIC_DEC_VAL(_p) InterlockedDecrement(_p)
+  #define CPRT_ATOMIC_ADD_VAL(_p, _v) InterlockedAdd64((LONG64 *)(_p), (_v))
+  /* Returns non-zero if *_p was _old and is now _new. */
+  #define CPRT_ATOMIC_CAS64(_p, _old, _new) \
+    (InterlockedCompareExchange64((LONG64 *)(_p), (_new), (_old)) == (LONG64)(_old))
+  #define CPRT_ATOMIC_CASPTR(_p, _old, _new) \
+    (InterlockedCompareExchangePointer((PVOID *)(_p), (_new), (_old)) == (PVOID)(_old))
+  #define CPRT_MEM_BARRIER() MemoryBarrier()
 #else  /* Unix */
   #define CPRT_ATOMIC_INC_VAL(_p) __sync_add_and_fetch(_p, 1)
   #define CPRT_ATOMIC_DEC_VAL(_p) __sync_sub_and_fetch(_p, 1)
+  #define CPRT_ATOMIC_ADD_VAL(_p, _v) __sync_add_and_fetch(_p, (_v))
+  /* Returns non-zero if *_p was _old and is now _new. */
+  #define CPRT_ATOMIC_CAS64(_p, _old, _new) __sync_bool_compare_and_swap(_p, _old, _new)
+  #define CPRT_ATOMIC_CASPTR(_p, _old, _new) __sync_bool_compare_and_swap(_p, _old, _new)
+  #define CPRT_MEM_BARRIER() __sync_synchronize()
+#endif
+
+/* Orders earlier stores before later ones (and loads before loads) at the
+ * cost of a compiler barrier where the hardware already does that. */
+#if defined(_WIN32)
+  #define CPRT_ORDER_BARRIER() MemoryBarrier()
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  #define CPRT_ORDER_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+  #define CPRT_ORDER_BARRIER() __sync_synchronize()
+#endif
+
+/* For spin loops: tells the CPU (and an SMT sibling) we are waiting. */
+#if defined(_WIN32)
+  #define CPRT_CPU_RELAX() YieldProcessor()
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  #define CPRT_CPU_RELAX() __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__) && defined(__GNUC__)
+  #define CPRT_CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+  #define CPRT_CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* On x86 Linux the kernel loads (node << 12) | cpu into TSC_AUX, so rdtscp
+ * reads the current CPU without a system call. Check cprt_rdtscp_cpu_ok()
+ * once before relying on the aux value. */
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  #define CPRT_HAVE_RDTSCP 1
+  #define CPRT_RDTSCP(_tsc, _aux) do { \
+    uint32_t cprt_rdtscp_lo, cprt_rdtscp_hi; \
+    __asm__ __volatile__("rdtscp" : "=a"(cprt_rdtscp_lo), "=d"(cprt_rdtscp_hi), "=c"(_aux)); \
+    (_tsc) = ((uint64_t)cprt_rdtscp_hi << 32) | cprt_rdtscp_lo; \
+  } while (0)
+#endif
+
+/* Index of the most significant set bit of a non-zero 64-bit value. */
+#if defined(_WIN32)
+  #define CPRT_MSB64(_v) cprt_msb64(_v)
+  static __inline unsigned int cprt_msb64(uint64_t v) {
+    unsigned long idx;  _BitScanReverse64(&idx, v);  return (unsigned int)idx;
+  }
+#else
+  #define CPRT_MSB64(_v) (63 - (unsigned int)__builtin_clzll(_v))
+#endif
+
+/* Frame pointer of the current function, for cprt_callers(). */
+#if defined(__GNUC__)
+  #define CPRT_FRAME_ADDRESS() __builtin_frame_address(0)
+#else
+  #define CPRT_FRAME_ADDRESS() NULL
 #endif
 
 /* Macro to approximate the basename() function. */
@@ -203,6 +266,7 @@ extern "C" {
  *  for why the CPRT_VOL32 macro is needed.
  */
 #define CPRT_VOL32(cprt_vol32_ptr) (*(volatile uint32_t *)&(cprt_vol32_ptr))
+#define CPRT_VOL64(cprt_vol64_ptr) (*(volatile uint64_t *)&(cprt_vol64_ptr))
 
 
 /* See https://github.com/fordsfords/safe_atoi */
@@ -301,7 +365,8 @@ extern "C" {
   #define CPRT_STRDUP _strdup
   #define CPRT_SLEEP_SEC(s_) Sleep((s_)*1000)
   #define CPRT_SLEEP_MS Sleep
-  #define CPRT_SLEEP_NS cprt_sleep_ns  /* Uses busy spinning. */
+  #define CPRT_SLEEP_NS cprt_sleep_ns  /* Sleeps, then spins the last bit. */
+  #define CPRT_YIELD() SwitchToThread()
   #define CPRT_STRTOK strtok_s
 
 #else  /* Unix */
@@ -309,7 +374,8 @@ extern "C" {
   #define CPRT_STRDUP strdup
   #define CPRT_SLEEP_SEC sleep
   #define CPRT_SLEEP_MS(ms_) usleep((ms_)*1000)
-  #define CPRT_SLEEP_NS cprt_sleep_ns  /* Uses busy spinning. */
+  #define CPRT_SLEEP_NS cprt_sleep_ns  /* Sleeps, then spins the last bit. */
+  #define CPRT_YIELD() sched_yield()
   #define CPRT_STRTOK strtok_r
 #endif
 
@@ -325,14 +391,14 @@ extern "C" {
   #define CPRT_MUTEX_T CRITICAL_SECTION
   #define CPRT_MUTEX_INIT(_m) InitializeCriticalSection(&(_m))
   #define CPRT_MUTEX_INIT_RECURSIVE(_m) InitializeCriticalSection(&(_m))
-  #define CPRT_MUTEX_LOCK(_m) EnterCriticalSection(&(_m))
+  #define CPRT_MUTEX_LOCK_RAW(_m) EnterCriticalSection(&(_m))
   #define CPRT_MUTEX_TRYLOCK(_got_it, _m) (_got_it) = TryEnterCriticalSection(&(_m))
   #define CPRT_MUTEX_UNLOCK(_m) LeaveCriticalSection(&(_m))
   #define CPRT_MUTEX_DELETE(_m) DeleteCriticalSection(&(_m))
 
   #define CPRT_SPIN_T CRITICAL_SECTION
   #define CPRT_SPIN_INIT(_m) InitializeCriticalSectionAndSpinCount((&_m), -1)
-  #define CPRT_SPIN_LOCK(_m) EnterCriticalSection(&(_m))
+  #define CPRT_SPIN_LOCK_RAW(_m) EnterCriticalSection(&(_m))
   #define CPRT_SPIN_TRYLOCK(_got_it, _m) (_got_it) = TryEnterCriticalSection(&(_m))
   #define CPRT_SPIN_UNLOCK(_m) LeaveCriticalSection(&(_m))
   #define CPRT_SPIN_DELETE(_m) DeleteCriticalSection(&(_m))
@@ -355,7 +421,7 @@ extern "C" {
     CPRT_EOK0(errno = pthread_mutexattr_destroy(&_mutexattr)); \
   } while(0)
   #define CPRT_MUTEX_INIT(_m) CPRT_EOK0(errno = pthread_mutex_init(&(_m), NULL))
-  #define CPRT_MUTEX_LOCK(_m) CPRT_EOK0(errno = pthread_mutex_lock(&(_m)))
+  #define CPRT_MUTEX_LOCK_RAW(_m) CPRT_EOK0(errno = pthread_mutex_lock(&(_m)))
   #define CPRT_MUTEX_TRYLOCK(_got_it, _m) do { \
     errno = pthread_mutex_trylock(&(_m)); \
     if (errno == 0) { \
@@ -374,7 +440,7 @@ extern "C" {
     /* Apparently spinlocks are a no-no on newer MacOS. */
     #define CPRT_SPIN_T pthread_mutex_t
     #define CPRT_SPIN_INIT(_m) CPRT_EOK0(errno = pthread_mutex_init(&(_m), NULL))
-    #define CPRT_SPIN_LOCK(_m) CPRT_EOK0(errno = pthread_mutex_lock(&(_m)))
+    #define CPRT_SPIN_LOCK_RAW(_m) CPRT_EOK0(errno = pthread_mutex_lock(&(_m)))
     #define CPRT_SPIN_TRYLOCK(_got_it, _m) do { \
       errno = pthread_mutex_trylock(&(_m)); \
       if (errno == 0) { \
@@ -391,7 +457,7 @@ extern "C" {
   #else  /* Non-Apple Unixes */
     #define CPRT_SPIN_T pthread_spinlock_t
     #define CPRT_SPIN_INIT(_m) pthread_spin_init(&(_m), PTHREAD_PROCESS_PRIVATE)
-    #define CPRT_SPIN_LOCK(_m) pthread_spin_lock(&(_m))
+    #define CPRT_SPIN_LOCK_RAW(_m) pthread_spin_lock(&(_m))
     #define CPRT_SPIN_TRYLOCK(_got_it, _m) do { \
       errno = pthread_spin_trylock(&(_m)); \
       if (errno == 0) { \
@@ -435,25 +501,72 @@ extern "C" {
       CPRT_ERR_EXIT; \
     } \
   } while (0)
-  #define CPRT_SEM_WAIT(_s) do { \
+  #define CPRT_SEM_WAIT_RAW(_s) do { \
     WaitForSingleObject(_s, INFINITE); \
   } while (0)
+  #define CPRT_SEM_TRYWAIT(_got_it, _s) (_got_it) = (WaitForSingleObject(_s, 0) == WAIT_OBJECT_0)
 
 #elif defined(__APPLE__)
   #define CPRT_SEM_T dispatch_semaphore_t
   #define CPRT_SEM_INIT(_s, _i) _s = dispatch_semaphore_create(_i)
   #define CPRT_SEM_DELETE(_s) dispatch_release(_s)
   #define CPRT_SEM_POST(_s) dispatch_semaphore_signal(_s)
-  #define CPRT_SEM_WAIT(_s) dispatch_semaphore_wait(_s, DISPATCH_TIME_FOREVER)
+  #define CPRT_SEM_WAIT_RAW(_s) dispatch_semaphore_wait(_s, DISPATCH_TIME_FOREVER)
+  #define CPRT_SEM_TRYWAIT(_got_it, _s) (_got_it) = (dispatch_semaphore_wait(_s, DISPATCH_TIME_NOW) == 0)
 
 #else  /* Non-Apple Unixes */
   #define CPRT_SEM_T sem_t
   #define CPRT_SEM_INIT(_s, _i) CPRT_EOK0(sem_init(&(_s), 0, _i))
   #define CPRT_SEM_DELETE(_s) CPRT_EOK0(sem_destroy(&(_s)))
   #define CPRT_SEM_POST(_s) CPRT_EOK0(sem_post(&(_s)))
-  #define CPRT_SEM_WAIT(_s) CPRT_EOK0(sem_wait(&(_s)))
+  #define CPRT_SEM_WAIT_RAW(_s) CPRT_EOK0(sem_wait(&(_s)))
+  #define CPRT_SEM_TRYWAIT(_got_it, _s) (_got_it) = (sem_trywait(&(_s)) == 0)
+#endif
+
+
+/* Build with -DCPRT_CONTENTION_TRACE to have the lock and wait macros
+ * try first and, only if that fails, time the wait (see
+ * cprt_contention_*()). Uncontended, it costs nothing beyond the try. */
+#define CPRT_CONTENTION_MUTEX 0
+#define CPRT_CONTENTION_SPIN  1
+#define CPRT_CONTENTION_SEM   2
+
+#if defined(CPRT_CONTENTION_TRACE)
+  #define CPRT_CONTENDED_WAIT_(_try, _raw, _obj, _type) do { \
+    int cprt_ct_got_it_; \
+    _try(cprt_ct_got_it_, _obj); \
+    if (! cprt_ct_got_it_) { \
+      uint64_t cprt_ct_start_ns_ = cprt_contention_begin((void *)&(_obj), (_type), __FILE__, __LINE__); \
+      _raw(_obj); \
+      cprt_contention_end((void *)&(_obj), (_type), __FILE__, __LINE__, cprt_ct_start_ns_); \
+    } \
+  } while (0)
+  #define CPRT_MUTEX_LOCK(_m) CPRT_CONTENDED_WAIT_(CPRT_MUTEX_TRYLOCK, CPRT_MUTEX_LOCK_RAW, _m, CPRT_CONTENTION_MUTEX)
+  #define CPRT_SPIN_LOCK(_m) CPRT_CONTENDED_WAIT_(CPRT_SPIN_TRYLOCK, CPRT_SPIN_LOCK_RAW, _m, CPRT_CONTENTION_SPIN)
+  #define CPRT_SEM_WAIT(_s) CPRT_CONTENDED_WAIT_(CPRT_SEM_TRYWAIT, CPRT_SEM_WAIT_RAW, _s, CPRT_CONTENTION_SEM)
+#else
+  #define CPRT_MUTEX_LOCK(_m) CPRT_MUTEX_LOCK_RAW(_m)
+  #define CPRT_SPIN_LOCK(_m) CPRT_SPIN_LOCK_RAW(_m)
+  #define CPRT_SEM_WAIT(_s) CPRT_SEM_WAIT_RAW(_s)
 #endif
 
+/* Per-lock statistics, for locks that were ever contended. */
+#define CPRT_CONTENTION_MAX_LOCKS 1024
+struct cprt_contention_s {
+  void *lock;            /* NULL = free table slot. */
+  int type;              /* CPRT_CONTENTION_*. */
+  const char *file_name; /* First contended call site. */
+  int file_line;
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+};
+typedef struct cprt_contention_s cprt_contention_t;
+
+/* Called at the start (wait_ns = 0) and end of each contended wait. */
+typedef void (*cprt_contention_hook_t)(void *hook_arg, int is_end, void *lock, int type,
+    const char *file_name, int file_line, uint64_t wait_ns);
+
 
 #if defined(_WIN32)
   #define CPRT_THREAD_T HANDLE
@@ -471,6 +584,8 @@ extern "C" {
   #define CPRT_THREAD_EXIT do { ExitThread(0); } while (0)
   #define CPRT_THREAD_JOIN(_tid) WaitForSingleObject(_tid, INFINITE)
   #define CPRT_GET_THREAD_ID() ((CPRT_THREAD_ID_T)GetCurrentThreadId())
+  #define CPRT_THREAD_LOCAL __declspec(thread)
+  #define CPRT_GETPID() ((uint32_t)GetCurrentProcessId())
 
 #else  /* Unix */
   #define CPRT_THREAD_T pthread_t
@@ -482,6 +597,8 @@ extern "C" {
   #define CPRT_THREAD_JOIN(_tid) \
     CPRT_EOK0(errno = pthread_join(_tid, NULL))
   #define CPRT_GET_THREAD_ID() ((CPRT_THREAD_ID_T)pthread_self())
+  #define CPRT_THREAD_LOCAL __thread
+  #define CPRT_GETPID() ((uint32_t)getpid())
 #endif
 
 #define CPRT_CPU_ZERO(_cprt_cpuset) do { \
@@ -489,14 +606,61 @@ extern "C" {
   *_cprt_cpuset_p = 0; \
 } while (0)
 
+/* Mask form (CPUs 0-63; higher ones are ignored). Use cprt_cpuset_t
+ * for bigger hosts. */
 #define CPRT_CPU_SET(_cprt_cpunum, _cprt_cpuset) do { \
   uint64_t *_cprt_cpuset_p = (_cprt_cpuset); \
-  if ((_cprt_cpunum) == 0) { \
-    *_cprt_cpuset_p |= 1; \
-  } else { \
-    *_cprt_cpuset_p |= (1ull << (_cprt_cpunum)); \
+  if ((_cprt_cpunum) < 64) { \
+    *_cprt_cpuset_p |= (1ull << ((_cprt_cpunum) & 63)); \
+  } \
+} while (0)
+
+#define CPRT_MAX_CPUS 1024
+struct cprt_cpuset_s {
+  uint64_t bits[CPRT_MAX_CPUS / 64];
+};
+typedef struct cprt_cpuset_s cprt_cpuset_t;
+
+#define CPRT_CPUSET_ZERO(_set) memset((_set), 0, sizeof(cprt_cpuset_t))
+#define CPRT_CPUSET_SET(_cpu, _set) do { \
+  if ((unsigned)(_cpu) < CPRT_MAX_CPUS) { \
+    (_set)->bits[(unsigned)(_cpu) / 64] |= (1ull << ((unsigned)(_cpu) % 64)); \
+  } \
+} while (0)
+#define CPRT_CPUSET_CLR(_cpu, _set) do { \
+  if ((unsigned)(_cpu) < CPRT_MAX_CPUS) { \
+    (_set)->bits[(unsigned)(_cpu) / 64] &= ~(1ull << ((unsigned)(_cpu) % 64)); \
   } \
 } while (0)
+#define CPRT_CPUSET_ISSET(_cpu, _set) ((unsigned)(_cpu) < CPRT_MAX_CPUS && \
+  ((_set)->bits[(unsigned)(_cpu) / 64] & (1ull << ((unsigned)(_cpu) % 64))) != 0)
+
+/* CPU topology (cprt_topo_get()). Unknown ids are -1. */
+#define CPRT_TOPO_SMT    0  /* Hardware threads of one core. */
+#define CPRT_TOPO_L3     1  /* CPUs sharing an L3 cache. */
+#define CPRT_TOPO_NUMA   2
+#define CPRT_TOPO_SOCKET 3
+
+struct cprt_topo_cpu_s {
+  int online;
+  int socket;     /* physical_package_id. */
+  int core;       /* core_id; unique within a socket. */
+  int numa_node;
+  int l3_id;      /* Lowest CPU sharing this CPU's L3. */
+};
+typedef struct cprt_topo_cpu_s cprt_topo_cpu_t;
+
+struct cprt_topo_s {
+  int num_cpus;      /* Highest CPU number + 1. */
+  int num_online;
+  int num_sockets;
+  int num_cores;     /* Physical cores, online. */
+  int num_numa_nodes;
+  int num_l3;
+  cprt_cpuset_t online_set;
+  cprt_topo_cpu_t cpus[CPRT_MAX_CPUS];
+};
+typedef struct cprt_topo_s cprt_topo_t;
 
 
 #define CPRT_INITTIME cprt_inittime
@@ -530,12 +694,112 @@ extern "C" {
                          - (uint64_t)diff_ts_start_ts_.tv_nsec; \
 } while (0)  /* DIFF_TS */
 
+/* Spin, then yield, then sleep, for polling loops:
+ *   cprt_backoff_init(&b, 100, 10, 1000);
+ *   while (! ready) { cprt_backoff_wait(&b); } */
+struct cprt_backoff_s {
+  uint32_t max_spins;    /* Waits that spin (pauses double each time). */
+  uint32_t max_yields;   /* Then waits that yield the CPU. */
+  uint32_t max_sleep_us; /* Then sleeps, doubling from 1 us to this. */
+  uint32_t num_waits;
+  uint32_t sleep_us;
+};
+typedef struct cprt_backoff_s cprt_backoff_t;
+
+
+/* Lock-free queues of pointers and a fixed-size object pool. Sizes are
+ * powers of 2. Each side's indexes get their own cache line. */
+#define CPRT_CACHE_LINE 64
+/* Goes between "struct" and the tag; keeps the type (and arrays of it)
+ * on cache-line boundaries. */
+#if defined(_WIN32)
+  #define CPRT_CACHE_ALIGNED __declspec(align(64))
+#else
+  #define CPRT_CACHE_ALIGNED __attribute__((aligned(CPRT_CACHE_LINE)))
+#endif
+
+/* Single producer, single consumer. */
+struct cprt_spsc_s {
+  volatile uint64_t head;  /* Producer's line. */
+  uint64_t cached_tail;
+  char pad1[CPRT_CACHE_LINE - 16];
+  volatile uint64_t tail;  /* Consumer's line. */
+  uint64_t cached_head;
+  char pad2[CPRT_CACHE_LINE - 16];
+  uint32_t num_slots;
+  uint32_t mask;
+  void **slots;
+};
+typedef struct cprt_spsc_s cprt_spsc_t;
+
+/* Bounded, multiple producers, single consumer. A slot's seq is its
+ * position + 1 once its item is written. */
+struct cprt_mpsc_slot_s {
+  volatile uint64_t seq;
+  void *item;
+};
+typedef struct cprt_mpsc_slot_s cprt_mpsc_slot_t;
+
+struct cprt_mpsc_s {
+  volatile uint64_t head;  /* Claimed by producers with CAS. */
+  char pad1[CPRT_CACHE_LINE - 8];
+  volatile uint64_t tail;
+  char pad2[CPRT_CACHE_LINE - 8];
+  uint32_t num_slots;
+  uint32_t mask;
+  cprt_mpsc_slot_t *slots;
+};
+typedef struct cprt_mpsc_s cprt_mpsc_t;
+
+/* Free list head is (tag << 32) | (index + 1); the tag defeats ABA. */
+struct cprt_pool_s {
+  volatile uint64_t free_head;
+  char pad1[CPRT_CACHE_LINE - 8];
+  size_t obj_size;
+  uint32_t num_objs;
+  volatile uint32_t *next;  /* Per object: index + 1 of the next free one. */
+  char *objs;
+};
+typedef struct cprt_pool_s cprt_pool_t;
+
+
 /* externals in cprt.c. */
 char *cprt_strerror(int errnum, char *buffer, size_t buf_sz);
 void cprt_set_affinity(uint64_t in_mask);
 int cprt_try_affinity(uint64_t in_mask);
+int cprt_cpuset_parse(cprt_cpuset_t *set, const char *list);
+char *cprt_cpuset_format(const cprt_cpuset_t *set, char *buf, size_t buf_sz);
+void cprt_cpuset_from_mask(cprt_cpuset_t *set, uint64_t mask);
+int cprt_cpuset_count(const cprt_cpuset_t *set);
+int cprt_cpuset_next(const cprt_cpuset_t *set, int cpu);
+int cprt_try_cpuset_affinity(const cprt_cpuset_t *set);
+int cprt_get_cpuset_affinity(cprt_cpuset_t *set);
+int cprt_topo_get(cprt_topo_t **topo_rtn);
+void cprt_topo_free(cprt_topo_t *topo);
+void cprt_topo_peers(const cprt_topo_t *topo, int cpu, int level, cprt_cpuset_t *set);
+void cprt_topo_print(const cprt_topo_t *topo, FILE *fp);
+void cprt_getcpu(uint32_t *cpu, uint32_t *node);
+int cprt_rdtscp_cpu_ok();
+int cprt_numa_num_nodes();
+uint64_t cprt_gettid();
+int cprt_callers(void **addrs, int max_addrs, void *frame);
+void cprt_get_thread_name(char *buf, size_t buf_sz);
+void cprt_set_thread_name(const char *name);
 void cprt_inittime();
 void cprt_sleep_ns(uint64_t duration_ns);
+void cprt_spin_ns(uint64_t duration_ns);
+uint64_t cprt_sleep_calibrate();
+void cprt_sleep_set_spin_ns(uint64_t spin_ns);
+uint64_t cprt_thread_cpu_ns();
+void cprt_backoff_init(cprt_backoff_t *backoff, uint32_t max_spins, uint32_t max_yields, uint32_t max_sleep_us);
+void cprt_backoff_wait(cprt_backoff_t *backoff);
+void cprt_backoff_reset(cprt_backoff_t *backoff);
+uint64_t cprt_contention_begin(void *lock, int type, const char *file_name, int file_line);
+void cprt_contention_end(void *lock, int type, const char *file_name, int file_line, uint64_t start_ns);
+void cprt_contention_set_hook(cprt_contention_hook_t hook, void *hook_arg);
+int cprt_contention_get(void *lock, cprt_contention_t *stats_rtn);
+void cprt_contention_dump(FILE *fp);
+void cprt_contention_reset();
 void cprt_localtime_r(time_t *timep, struct tm *result);
 
 #if defined(_WIN32)
@@ -547,9 +811,10 @@ void cprt_localtime_r(time_t *timep, struct tm *result);
 extern int cprt_num_events;
 extern int cprt_events[1024];
 void cprt_event(int e);
-void cprt_dump_events();
+void cprt_dump_events(FILE *fd);
 void cprt_perrno(char *msg_str, char *file, int line);
 char *cprt_timestamp(char *str, int bufsz, int do_date, int precision);
+char *cprt_format_timestamp(char *str, int bufsz, int do_date, int precision, struct cprt_timeval *tv);
 void cprt_vts_fprintf(FILE *fp, const char *format, va_list argp);
 void cprt_ts_printf(const char *format, ...);
 void cprt_ts_eprintf(const char *format, ...);
@@ -557,6 +822,10 @@ uint64_t cprt_get_ms_time();
 void cprt_vms_fprintf(FILE *fp, uint64_t start_ms, const char *format, va_list argp);
 void cprt_ms_printf(uint64_t start_ms, const char *format, ...);
 void cprt_ms_eprintf(uint64_t start_ms, const char *format, ...);
+#define CPRT_ASYNC_MSG_SIZE 256  /* Longer async messages are truncated. */
+int cprt_async_printf_start(uint32_t queue_entries);
+void cprt_async_printf_flush();
+void cprt_async_printf_stop();
 
 
 extern char* cprt_optarg;
@@ -565,6 +834,24 @@ extern int cprt_optind;
 extern int cprt_opterr;
 int cprt_getopt(int argc, char* const argv[], const char* optstring);
 
+/* Return 0 on success, -1 on error (sets errno). */
+int cprt_spsc_create(cprt_spsc_t **spsc_rtn, uint32_t num_slots);
+void cprt_spsc_delete(cprt_spsc_t *spsc);
+uint32_t cprt_spsc_enqueue_batch(cprt_spsc_t *spsc, void **items, uint32_t num_items);
+uint32_t cprt_spsc_dequeue_batch(cprt_spsc_t *spsc, void **items, uint32_t max_items);
+#define CPRT_SPSC_ENQUEUE(_spsc, _item) cprt_spsc_enqueue_batch((_spsc), (void **)&(_item), 1)
+#define CPRT_SPSC_DEQUEUE(_spsc, _item) cprt_spsc_dequeue_batch((_spsc), (void **)&(_item), 1)
+int cprt_mpsc_create(cprt_mpsc_t **mpsc_rtn, uint32_t num_slots);
+void cprt_mpsc_delete(cprt_mpsc_t *mpsc);
+uint32_t cprt_mpsc_enqueue_batch(cprt_mpsc_t *mpsc, void **items, uint32_t num_items);
+uint32_t cprt_mpsc_dequeue_batch(cprt_mpsc_t *mpsc, void **items, uint32_t max_items);
+#define CPRT_MPSC_ENQUEUE(_mpsc, _item) cprt_mpsc_enqueue_batch((_mpsc), (void **)&(_item), 1)
+#define CPRT_MPSC_DEQUEUE(_mpsc, _item) cprt_mpsc_dequeue_batch((_mpsc), (void **)&(_item), 1)
+int cprt_pool_create(cprt_pool_t **pool_rtn, size_t obj_size, uint32_t num_objs);
+void cprt_pool_delete(cprt_pool_t *pool);
+void *cprt_pool_get(cprt_pool_t *pool);
+void cprt_pool_put(cprt_pool_t *pool, void *obj);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -13,25 +13,343 @@
 # is https://github.com/fordsfords/trc
 */
 
+#if ! defined(_WIN32)
+/* Unix */
+#define _GNU_SOURCE
+#endif
+
 #include "cprt.h"
 
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#if ! defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #include "trc.h"
+#include "trc_cap.h"
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#if ! defined(MAP_HUGE_SHIFT)
+#define MAP_HUGE_SHIFT 26
+#endif
+#define TRC_MPOL_PREFERRED 1  /* From linux/mempolicy.h. */
+#endif
+
+
+#if defined(__linux__)
+/* Try one mmap() of the event array. Returns NULL on failure. */
+static void *trc_events_mmap(size_t *size_io, size_t page_size, int extra_flags)
+{
+  size_t size = (*size_io + page_size - 1) & ~(page_size - 1);
+  void *addr;
+
+  addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+  if (addr == MAP_FAILED) { return NULL; }
+
+  *size_io = size;
+  return addr;
+}  /* trc_events_mmap */
+
+
+/* Ask the kernel to place not-yet-touched pages on a node. "Preferred"
+ * rather than "bind" so a full or missing node degrades instead of failing. */
+static void trc_node_bind(void *addr, size_t size, int node)
+{
+  unsigned long nodemask;
+
+  if (node < 0 || node >= 64) { return; }
+  nodemask = 1ul << node;
+  (void)syscall(SYS_mbind, addr, size, TRC_MPOL_PREFERRED, &nodemask, 65ul, 0u);
+}  /* trc_node_bind */
+#endif
+
+
+/* The trc_t of a per-node ring lives on its node too, since writers update
+ * its event_count on every trace. */
+static trc_t *trc_struct_alloc(int numa_node)
+{
+#if defined(__linux__)
+  if (numa_node >= 0) {
+    size_t size = sizeof(trc_t);
+    trc_t *trc = (trc_t *)trc_events_mmap(&size, (size_t)sysconf(_SC_PAGESIZE), 0);
+    if (trc != NULL) {
+      trc_node_bind(trc, size, numa_node);
+      memset(trc, 0, sizeof(trc_t));
+    }
+    return trc;
+  }
+#endif
+  return (trc_t *)calloc(1, sizeof(trc_t));
+}  /* trc_struct_alloc */
+
+
+static void trc_struct_free(trc_t *trc)
+{
+#if defined(__linux__)
+  if (trc->numa_node >= 0) {
+    (void)munmap(trc, sizeof(trc_t));
+    return;
+  }
+#endif
+  free(trc);
+}  /* trc_struct_free */
+
+
+/* Allocate trc->events according to the allocation create_flags, falling
+ * back gracefully. Sets trc->alloc_flags to what actually succeeded. */
+static int trc_events_alloc(trc_t *trc)
+{
+  size_t size = sizeof(trc_event_t) * (size_t)trc->num_entries;
+  void *addr = NULL;
+
+  trc->alloc_flags = 0;
+  trc->events_mmapped = 0;
+
+#if defined(__linux__)
+  {
+    int on_node = (trc->numa_node >= 0);
+    /* MAP_POPULATE would fault pages in before mbind() could place them. */
+    int populate = (! on_node && (trc->create_flags & TRC_CREATE_FLAG_PREFAULT)) ? MAP_POPULATE : 0;
+
+    if (trc->create_flags & TRC_CREATE_FLAG_HUGE_1G) {
+      addr = trc_events_mmap(&size, 1ull << 30, MAP_HUGETLB | (30 << MAP_HUGE_SHIFT) | populate);
+      if (addr != NULL) { trc->alloc_flags |= TRC_CREATE_FLAG_HUGE_1G; }
+    }
+    if (addr == NULL && (trc->create_flags & (TRC_CREATE_FLAG_HUGE_1G | TRC_CREATE_FLAG_HUGE_2M))) {
+      addr = trc_events_mmap(&size, 1ull << 21, MAP_HUGETLB | (21 << MAP_HUGE_SHIFT) | populate);
+      if (addr != NULL) { trc->alloc_flags |= TRC_CREATE_FLAG_HUGE_2M; }
+    }
+    if (addr == NULL && (on_node || (trc->create_flags & (TRC_CREATE_FLAG_HUGE_1G | TRC_CREATE_FLAG_HUGE_2M
+        | TRC_CREATE_FLAG_PREFAULT | TRC_CREATE_FLAG_MLOCK)))) {
+      /* No hugetlbfs pages reserved; ask for transparent huge pages instead. */
+      addr = trc_events_mmap(&size, (size_t)sysconf(_SC_PAGESIZE), populate);
+      if (addr != NULL) { (void)madvise(addr, size, MADV_HUGEPAGE); }
+    }
+    if (addr != NULL) {
+      trc->events_mmapped = 1;
+      if (on_node) { trc_node_bind(addr, size, trc->numa_node); }
+    }
+  }
+#endif
+
+  if (addr == NULL) {
+    addr = malloc(size);
+    if (addr == NULL) { return TRC_ERR_NO_MEM; }
+  }
+  trc->events = (trc_event_t *)addr;
+  trc->events_size = size;
+
+  if (trc->create_flags & TRC_CREATE_FLAG_PREFAULT) {
+    /* Write every byte so that no trace takes a page fault. */
+    memset(addr, 0, size);
+    trc->alloc_flags |= TRC_CREATE_FLAG_PREFAULT;
+  }
+  else if (! trc->events_mmapped) {
+    memset(addr, 0, size);  /* Anonymous mmap() is already zero. */
+  }
+
+#if ! defined(_WIN32)
+  if (trc->create_flags & TRC_CREATE_FLAG_MLOCK) {
+    if (mlock(addr, size) == 0) {
+      trc->alloc_flags |= TRC_CREATE_FLAG_MLOCK;
+    }
+  }
+#endif
+
+  return TRC_OK;
+}  /* trc_events_alloc */
+
+
+static void trc_events_free(trc_t *trc)
+{
+#if ! defined(_WIN32)
+  if (trc->alloc_flags & TRC_CREATE_FLAG_MLOCK) {
+    (void)munlock(trc->events, trc->events_size);
+  }
+  if (trc->events_mmapped) {
+    (void)munmap(trc->events, trc->events_size);
+    return;
+  }
+#endif
+  free(trc->events);
+}  /* trc_events_free */
+
+
+/* 1 if rdtscp gives us cpu/node, 0 to use cprt_getcpu(), -1 if not checked. */
+static int trc_use_rdtscp = -1;
+
+static void trc_cpu_node(uint32_t *cpu, uint32_t *node)
+{
+#if defined(CPRT_HAVE_RDTSCP)
+  if (trc_use_rdtscp == 1) {
+    uint64_t tsc;
+    uint32_t aux;
+    CPRT_RDTSCP(tsc, aux);
+    (void)tsc;
+    if (cpu != NULL) { *cpu = aux & 0xfff; }
+    if (node != NULL) { *node = aux >> 12; }
+    return;
+  }
+#endif
+  cprt_getcpu(cpu, node);
+}  /* trc_cpu_node */
+
+
+trc_thread_t trc_threads[TRC_MAX_THREADS];
+uint32_t trc_num_threads = 0;
+static CPRT_THREAD_LOCAL uint16_t trc_my_thread_idx = 0;
+/* Indexes released by exited trc_thread_create() threads, for reuse once
+ * the fresh ones run out. */
+static uint16_t trc_thread_free_next[TRC_MAX_THREADS];
+static uint16_t trc_thread_free_head = 0;  /* 0 = none. */
+static uint64_t trc_thread_free_lock = 0;
+
+
+static void trc_thread_free_lock_get()
+{
+  while (! CPRT_ATOMIC_CAS64(&trc_thread_free_lock, 0, 1)) {
+    CPRT_SLEEP_NS(1000);
+  }
+}  /* trc_thread_free_lock_get */
+
+
+static void trc_thread_free_lock_put()
+{
+  CPRT_MEM_BARRIER();
+  trc_thread_free_lock = 0;
+}  /* trc_thread_free_lock_put */
+
+
+static uint16_t trc_thread_register()
+{
+  uint32_t idx = TRC_MAX_THREADS;
+
+  if (CPRT_VOL32(trc_num_threads) < TRC_MAX_THREADS - 1) {
+    idx = CPRT_ATOMIC_INC_VAL(&trc_num_threads);
+  }
+  /* Only reuse once fresh indexes run out, so old events keep their
+   * thread's name as long as possible. */
+  if (idx >= TRC_MAX_THREADS && *(volatile uint16_t *)&trc_thread_free_head != 0) {
+    trc_thread_free_lock_get();
+    if (trc_thread_free_head != 0) {
+      idx = trc_thread_free_head;
+      trc_thread_free_head = trc_thread_free_next[idx];
+    }
+    trc_thread_free_lock_put();
+  }
+
+  if (idx >= TRC_MAX_THREADS) {
+    trc_my_thread_idx = TRC_THREAD_IDX_OVERFLOW;
+    return trc_my_thread_idx;
+  }
+  trc_threads[idx].kernel_tid = cprt_gettid();
+  cprt_get_thread_name(trc_threads[idx].name, sizeof(trc_threads[idx].name));
+  trc_my_thread_idx = (uint16_t)idx;
+
+  return trc_my_thread_idx;
+}  /* trc_thread_register */
+
+
+/* Give the calling thread's index back for a later thread to reuse. Its
+ * entry keeps naming the old thread's events until then. */
+static void trc_thread_release()
+{
+  uint16_t idx = trc_my_thread_idx;
+
+  trc_my_thread_idx = 0;
+  if (idx == 0 || idx == TRC_THREAD_IDX_OVERFLOW) { return; }
+  trc_thread_free_lock_get();
+  trc_thread_free_next[idx] = trc_thread_free_head;
+  trc_thread_free_head = idx;
+  trc_thread_free_lock_put();
+}  /* trc_thread_release */
+
+
+/* Calling thread's registry index, registering it if needed. */
+uint16_t trc_thread_idx()
+{
+  uint16_t idx = trc_my_thread_idx;
+  if (idx == 0) {
+    idx = trc_thread_register();
+  }
+  return idx;
+}  /* trc_thread_idx */
+
+
+int trc_set_thread_name(const char *name)
+{
+  uint16_t idx = trc_thread_idx();
+
+  if (name == NULL) { return TRC_ERR_BAD_PARM; }
+  if (idx == TRC_THREAD_IDX_OVERFLOW) { return TRC_ERR_NO_MEM; }
+  CPRT_SNPRINTF(trc_threads[idx].name, TRC_THREAD_NAME_LEN, "%s", name);
+
+  return TRC_OK;
+}  /* trc_set_thread_name */
+
+
+/* Create a single ring, optionally placed on a NUMA node. */
+static int trc_create_ring(trc_t **trc_rtn, uint64_t num_entries, uint32_t create_flags, int numa_node)
+{
+  trc_t *trc;
+  int err;
+
+  trc = trc_struct_alloc(numa_node);
+  if (trc == NULL) { return TRC_ERR_NO_MEM; }
+
+  trc->num_entries = num_entries;
+  trc->create_flags = create_flags;
+  trc->event_count = 0;
+  trc->suppress_cnt = 0;
+  trc->numa_node = numa_node;
+  trc->num_nodes = 1;
+  trc->node_trcs = NULL;
+  trc->callers = NULL;
+
+  err = trc_events_alloc(trc);
+  if (err != TRC_OK) { trc_struct_free(trc); return err; }
+
+  if (create_flags & TRC_CREATE_FLAG_CALLERS) {
+    trc->callers = (void **)calloc(num_entries * TRC_MAX_CALLERS, sizeof(void *));
+    if (trc->callers == NULL) { trc_events_free(trc); trc_struct_free(trc); return TRC_ERR_NO_MEM; }
+  }
+
+  *trc_rtn = trc;  /* Return the object. */
+
+  return TRC_OK;
+}  /* trc_create_ring */
+
+
+static void trc_calibrate(trc_t *trc);  /* With the tracing code it times, below. */
 
 
 int trc_create(trc_t **trc_rtn, uint64_t num_entries, uint32_t create_flags)
 {
   trc_t *trc;
-  int i;
+  int num_nodes = 0;
+  int err;
+  int node;
 
   if (num_entries == 0) {
     return TRC_ERR_BAD_PARM;
   }
 
+  if (trc_use_rdtscp == -1) {
+    trc_use_rdtscp = cprt_rdtscp_cpu_ok();
+  }
+
   if (! (create_flags & TRC_CREATE_FLAG_NO_OVERRIDE)) {
     /*
      * Allow env vars to override parameters.
@@ -47,23 +365,44 @@ int trc_create(trc_t **trc_rtn, uint64_t num_entries, uint32_t create_flags)
     }
   }
 
-  trc = (trc_t *)malloc(sizeof(trc_t));
-  if (trc == NULL) { return TRC_ERR_NO_MEM; }
+  if (create_flags & TRC_CREATE_FLAG_NUMA) {
+    if (! (create_flags & TRC_CREATE_FLAG_NO_OVERRIDE)) {
+      char *env_var = getenv("TRC_NUMA_NODES");  /* Mostly for testing on 1-node hosts. */
+      if (env_var != NULL) {
+        CPRT_ATOI(env_var, num_nodes);
+      }
+    }
+    if (num_nodes <= 0) {
+      num_nodes = cprt_numa_num_nodes();
+    }
+  }
+  if (num_nodes <= 1) {
+    err = trc_create_ring(trc_rtn, num_entries, create_flags, -1);
+    if (err == TRC_OK) { trc_calibrate(*trc_rtn); }
+    return err;
+  }
 
+  /* NUMA: a parent object with no events of its own, plus per-node rings. */
+  trc = (trc_t *)calloc(1, sizeof(trc_t));
+  if (trc == NULL) { return TRC_ERR_NO_MEM; }
   trc->num_entries = num_entries;
   trc->create_flags = create_flags;
-  trc->event_count = 0;
-  trc->suppress_cnt = 0;
+  trc->numa_node = -1;
+  trc->num_nodes = num_nodes;
+  trc->node_trcs = (trc_t **)calloc(num_nodes, sizeof(trc_t *));
+  if (trc->node_trcs == NULL) { free(trc); return TRC_ERR_NO_MEM; }
 
-  CPRT_ENULL(trc->events = (trc_event_t *)malloc(sizeof(trc_event_t) * num_entries));
-  if (trc->events == NULL) { free(trc); return TRC_ERR_NO_MEM; }
-
-  /* Allocate physical memory for the event array. */
-  for (i = 0; i < num_entries; i++) {
-    trc->events[i].thread_id = 0;
-    trc->events[i].file_name = NULL;
-    trc->events[i].timestamp.tv_sec = 0;  trc->events[i].timestamp.tv_usec = 0;
+  for (node = 0; node < num_nodes; node++) {
+    err = trc_create_ring(&trc->node_trcs[node], num_entries,
+        (create_flags & ~TRC_CREATE_FLAG_NUMA) | TRC_CREATE_FLAG_NO_OVERRIDE, node);
+    if (err != TRC_OK) {
+      while (--node >= 0) { trc_delete(trc->node_trcs[node]); }
+      free(trc->node_trcs);
+      free(trc);
+      return err;
+    }
   }
+  trc_calibrate(trc);
 
   *trc_rtn = trc;  /* Return the object. */
 
@@ -71,99 +410,2138 @@ int trc_create(trc_t **trc_rtn, uint64_t num_entries, uint32_t create_flags)
 }  /* trc_create */
 
 
+/* Process-local cache of shared-ring site ids. */
+#define TRC_SHM_CACHE_SLOTS 1024  /* Power of 2, well above TRC_SHM_MAX_SITES. */
+struct trc_shm_cache_s {
+  CPRT_MUTEX_T lock;
+  char *names[TRC_SHM_CACHE_SLOTS];
+  uint32_t lines[TRC_SHM_CACHE_SLOTS];
+  uint32_t ids[TRC_SHM_CACHE_SLOTS];  /* 0 = empty, else site id + 1. Written last. */
+};
+typedef struct trc_shm_cache_s trc_shm_cache_t;
+
+
+#if ! defined(_WIN32)
+/* "/name" is a POSIX shm object. Anything else is a file path, which puts
+ * the ring in a regular file that outlives the processes. */
+static int trc_shm_is_file(const char *name)
+{
+  return name[0] != '/' || strchr(name + 1, '/') != NULL;
+}  /* trc_shm_is_file */
+
+
+static int trc_shm_open(const char *name, int oflag, mode_t mode)
+{
+  return trc_shm_is_file(name) ? open(name, oflag, mode) : shm_open(name, oflag, mode);
+}  /* trc_shm_open */
+
+
+static int trc_shm_unlink(const char *name)
+{
+  return trc_shm_is_file(name) ? unlink(name) : shm_unlink(name);
+}  /* trc_shm_unlink */
+#endif
+
+
+/* Create the named segment, or attach to it if another process already
+ * has; an attacher adopts the segment's num_entries and create_flags. */
+int trc_create_shared(trc_t **trc_rtn, const char *name, uint64_t num_entries, uint32_t create_flags)
+{
+#if defined(_WIN32)
+  (void)trc_rtn;  (void)name;  (void)num_entries;  (void)create_flags;
+  return TRC_ERR_BAD_PARM;  /* POSIX shm only. */
+#else
+  trc_t *trc;
+  trc_shm_t *shm;
+  struct stat st;
+  uint64_t events_offset = (sizeof(trc_shm_t) + 63) & ~(uint64_t)63;
+  uint64_t size;
+  uint32_t proc_idx;
+  int creator = 1;
+  int fd, tries;
+
+  if (name == NULL) { return TRC_ERR_BAD_PARM; }
+
+  if (trc_use_rdtscp == -1) {
+    trc_use_rdtscp = cprt_rdtscp_cpu_ok();
+  }
+
+  /* Claims must be atomic across processes. Per-node rings and return
+   * addresses are per-process notions, so they are not offered. */
+  create_flags = (create_flags & ~(TRC_CREATE_FLAG_NUMA | TRC_CREATE_FLAG_CALLERS))
+      | TRC_CREATE_FLAG_ATOMIC_INC | TRC_CREATE_FLAG_NO_OVERRIDE;
+
+  fd = trc_shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) {
+    size = events_offset + num_entries * sizeof(trc_event_t);
+    if (num_entries == 0 || ftruncate(fd, (off_t)size) != 0) {
+      close(fd);
+      trc_shm_unlink(name);
+      return (num_entries == 0) ? TRC_ERR_BAD_PARM : TRC_ERR_NO_MEM;
+    }
+  }
+  else if (errno == EEXIST) {
+    creator = 0;
+    fd = trc_shm_open(name, O_RDWR, 0);
+    if (fd < 0) { return TRC_ERR_IO; }
+    for (tries = 0; ; tries++) {  /* The creator may not have sized it yet. */
+      if (fstat(fd, &st) != 0) { close(fd);  return TRC_ERR_IO; }
+      if ((uint64_t)st.st_size >= events_offset) { break; }
+      if (tries >= 1000) { close(fd);  return TRC_ERR_IO; }
+      CPRT_SLEEP_MS(1);
+    }
+    size = (uint64_t)st.st_size;
+  }
+  else {
+    return TRC_ERR_IO;
+  }
+
+  shm = (trc_shm_t *)mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == (trc_shm_t *)MAP_FAILED) {
+    if (creator) { trc_shm_unlink(name); }
+    return TRC_ERR_NO_MEM;
+  }
+
+  if (creator) {  /* ftruncate() zero-filled everything else. */
+    shm->magic = TRC_SHM_MAGIC;
+    shm->version = TRC_SHM_VERSION;
+    shm->num_entries = num_entries;
+    shm->create_flags = create_flags;
+    shm->events_offset = events_offset;
+    shm->size = size;
+    CPRT_MEM_BARRIER();
+    shm->ready = 1;
+  }
+  else {
+    for (tries = 0; CPRT_VOL32(shm->ready) == 0; tries++) {
+      if (tries >= 1000) { munmap(shm, (size_t)size);  return TRC_ERR_IO; }
+      CPRT_SLEEP_MS(1);
+    }
+    if (shm->magic != TRC_SHM_MAGIC || shm->version != TRC_SHM_VERSION || shm->size != size) {
+      munmap(shm, (size_t)size);
+      return TRC_ERR_BAD_PARM;
+    }
+  }
+
+  /* Slots are not reused after a process detaches. */
+  proc_idx = CPRT_ATOMIC_INC_VAL(&shm->num_procs) - 1;
+  if (proc_idx >= TRC_SHM_MAX_PROCS) { munmap(shm, (size_t)size);  return TRC_ERR_NO_MEM; }
+  shm->procs[proc_idx].pid = CPRT_GETPID();
+  trc_cap_proc_name(shm->procs[proc_idx].proc_name, sizeof(shm->procs[proc_idx].proc_name));
+
+  trc = (trc_t *)calloc(1, sizeof(trc_t));
+  if (trc == NULL) { munmap(shm, (size_t)size);  return TRC_ERR_NO_MEM; }
+  trc->shm_cache = (trc_shm_cache_t *)calloc(1, sizeof(trc_shm_cache_t));
+  if (trc->shm_cache == NULL) { free(trc);  munmap(shm, (size_t)size);  return TRC_ERR_NO_MEM; }
+  CPRT_MUTEX_INIT(trc->shm_cache->lock);
+
+  trc->num_entries = shm->num_entries;
+  trc->create_flags = shm->create_flags;
+  trc->events = (trc_event_t *)((char *)shm + shm->events_offset);
+  trc->events_size = size - shm->events_offset;
+  trc->numa_node = -1;
+  trc->num_nodes = 1;
+  trc->shm = shm;
+  trc->shm_proc_idx = proc_idx;
+  trc_calibrate(trc);
+
+  *trc_rtn = trc;  /* Return the object. */
+
+  return TRC_OK;
+#endif
+}  /* trc_create_shared */
+
+
+/* Read-only attach for an outside observer (e.g. trc_tail). It takes no
+ * process slot and cannot trace; writers are not affected. */
+int trc_attach_shared(trc_t **trc_rtn, const char *name)
+{
+#if defined(_WIN32)
+  (void)trc_rtn;  (void)name;
+  return TRC_ERR_BAD_PARM;  /* POSIX shm only. */
+#else
+  trc_t *trc;
+  trc_shm_t *shm;
+  struct stat st;
+  int fd;
+
+  if (name == NULL) { return TRC_ERR_BAD_PARM; }
+
+  fd = trc_shm_open(name, O_RDONLY, 0);
+  if (fd < 0) { return TRC_ERR_IO; }
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(trc_shm_t)) { close(fd);  return TRC_ERR_IO; }
+  shm = (trc_shm_t *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == (trc_shm_t *)MAP_FAILED) { return TRC_ERR_NO_MEM; }
+
+  if (shm->magic != TRC_SHM_MAGIC || shm->version != TRC_SHM_VERSION ||
+      CPRT_VOL32(shm->ready) == 0 || shm->size != (uint64_t)st.st_size) {
+    munmap(shm, (size_t)st.st_size);
+    return TRC_ERR_BAD_PARM;
+  }
+
+  trc = (trc_t *)calloc(1, sizeof(trc_t));
+  if (trc == NULL) { munmap(shm, (size_t)st.st_size);  return TRC_ERR_NO_MEM; }
+  trc->num_entries = shm->num_entries;
+  trc->create_flags = shm->create_flags;
+  trc->suppress_cnt = 1;  /* The mapping is read-only; make trc_trace() a no-op. */
+  trc->events = (trc_event_t *)((char *)shm + shm->events_offset);
+  trc->events_size = shm->size - shm->events_offset;
+  trc->numa_node = -1;
+  trc->num_nodes = 1;
+  trc->shm = shm;
+  trc->shm_proc_idx = TRC_SHM_MAX_PROCS;  /* Not one of the writers. */
+
+  *trc_rtn = trc;  /* Return the object. */
+
+  return TRC_OK;
+#endif
+}  /* trc_attach_shared */
+
+
+int trc_unlink_shared(const char *name)
+{
+#if defined(_WIN32)
+  (void)name;
+  return TRC_ERR_BAD_PARM;
+#else
+  if (name == NULL) { return TRC_ERR_BAD_PARM; }
+  return (trc_shm_unlink(name) == 0) ? TRC_OK : TRC_ERR_IO;
+#endif
+}  /* trc_unlink_shared */
+
+
 int trc_delete(trc_t *trc)
 {
-  free(trc->events);
+  uint32_t node;
+
+  if (trc->shm != NULL && trc->snap_of == NULL) {  /* Detach; the segment stays for the others. */
+#if ! defined(_WIN32)
+    (void)munmap(trc->shm, (size_t)trc->shm->size);
+#endif
+    if (trc->shm_cache != NULL) {
+      CPRT_MUTEX_DELETE(trc->shm_cache->lock);
+      free(trc->shm_cache);
+    }
+    free(trc);
+    return TRC_OK;
+  }
+
+  if (trc->num_nodes > 1) {
+    for (node = 0; node < trc->num_nodes; node++) {
+      trc_delete(trc->node_trcs[node]);
+    }
+    free(trc->node_trcs);
+    free(trc);
+    return TRC_OK;
+  }
+
+  free(trc->callers);
+  trc_events_free(trc);
   (*(volatile trc_event_t **)(&(trc->events))) = NULL;
-  free(trc);
+  trc_struct_free(trc);
 
   return TRC_OK;
 }  /* trc_delete */
 
 
-int trc_trace(trc_t *trc, char *file_name, uint64_t file_line, uint64_t p1, uint64_t p2)
+/* Site id in this process's table in the segment. Lookups are lock-free;
+ * a miss registers the site under the lock. */
+static uint32_t trc_shm_site_id(trc_t *trc, char *file_name, uint32_t file_line)
+{
+  trc_shm_cache_t *cache = trc->shm_cache;
+  trc_shm_proc_t *proc;
+  trc_shm_site_t *site;
+  const char *name;
+  uint32_t start, slot, n, id;
+  size_t len;
+
+  start = (uint32_t)((((uint64_t)(uintptr_t)file_name >> 3) * 0x9E3779B97F4A7C15ull
+      + file_line) >> 54) & (TRC_SHM_CACHE_SLOTS - 1);
+  for (n = 0, slot = start; n < TRC_SHM_CACHE_SLOTS; n++, slot = (slot + 1) & (TRC_SHM_CACHE_SLOTS - 1)) {
+    id = CPRT_VOL32(cache->ids[slot]);
+    if (id == 0) { break; }
+    if (cache->names[slot] == file_name && cache->lines[slot] == file_line) { return id - 1; }
+  }
+
+  CPRT_MUTEX_LOCK(cache->lock);
+  for (n = 0, slot = start; n < TRC_SHM_CACHE_SLOTS; n++, slot = (slot + 1) & (TRC_SHM_CACHE_SLOTS - 1)) {
+    id = cache->ids[slot];
+    if (id == 0) { break; }
+    if (cache->names[slot] == file_name && cache->lines[slot] == file_line) {
+      CPRT_MUTEX_UNLOCK(cache->lock);
+      return id - 1;
+    }
+  }
+  proc = &trc->shm->procs[trc->shm_proc_idx];
+  if (n == TRC_SHM_CACHE_SLOTS || proc->num_sites >= TRC_SHM_MAX_SITES) {
+    CPRT_MUTEX_UNLOCK(cache->lock);
+    return TRC_SHM_SITE_OVERFLOW;
+  }
+
+  /* Publish the site before anyone can see its id. */
+  id = proc->num_sites;
+  site = &proc->sites[id];
+  site->file_line = file_line;
+  name = (file_name != NULL) ? file_name : "";
+  len = strlen(name);
+  strcpy(site->file_name, (len < TRC_SHM_FILE_LEN) ? name : name + len - (TRC_SHM_FILE_LEN - 1));
+  CPRT_MEM_BARRIER();
+  proc->num_sites = id + 1;
+
+  cache->names[slot] = file_name;
+  cache->lines[slot] = file_line;
+  CPRT_MEM_BARRIER();
+  cache->ids[slot] = id + 1;
+  CPRT_MUTEX_UNLOCK(cache->lock);
+
+  return id;
+}  /* trc_shm_site_id */
+
+
+/* Common to all event kinds. "frame" is the public entry point's frame
+ * pointer, so callers are recorded from the application's perspective. */
+static int trc_record(trc_t *trc, uint32_t kind, uint32_t span_id, char *file_name, uint64_t file_line,
+    uint64_t p1, uint64_t p2, void *frame)
 {
+  trc_event_t *ev;
   uint64_t i;
 
-  if (trc->suppress_cnt > 0) {
+  if (trc->suppress_cnt > 0 || (trc->kinds_off & (1u << kind))) {
     return 0;
   }
 
-  if (trc->create_flags & TRC_CREATE_FLAG_ATOMIC_INC) {
-    i = CPRT_ATOMIC_INC_VAL(&trc->event_count) - 1;  /* Get pre-increment value. */
+  if (trc->num_nodes > 1) {  /* Trace into the local node's ring. */
+    uint32_t node;
+    trc_cpu_node(NULL, &node);
+    trc = trc->node_trcs[node % trc->num_nodes];
+  }
+
+  if (trc->shm != NULL) {  /* Other processes share the count. */
+    i = CPRT_ATOMIC_ADD_VAL(&trc->shm->event_count, 1) - 1;
+  }
+  else if (trc->create_flags & TRC_CREATE_FLAG_ATOMIC_INC) {
+    i = CPRT_ATOMIC_ADD_VAL(&trc->event_count, 1) - 1;  /* Get pre-increment value. */
   }
   else {
     i = trc->event_count++;
   }
-  trc->events[i % trc->num_entries].p1 = p1;
-  trc->events[i % trc->num_entries].p2 = p2;
-  trc->events[i % trc->num_entries].file_name = file_name;
-  trc->events[i % trc->num_entries].file_line = file_line;
+  ev = &trc->events[i % trc->num_entries];
+  ev->p1 = p1;
+  ev->p2 = p2;
+  if (trc->shm != NULL) {
+    ev->file_name = NULL;
+    ev->site_id = trc_shm_site_id(trc, file_name, (uint32_t)file_line);
+    ev->proc_idx = (uint16_t)trc->shm_proc_idx;
+  }
+  else {
+    ev->file_name = file_name;
+  }
+  ev->file_line = file_line;
+  ev->kind = kind;
+  ev->span_id = span_id;
   if (trc->create_flags & TRC_CREATE_FLAG_TIMESTAMP) {
-    CPRT_TIMEOFDAY(&trc->events[i % trc->num_entries].timestamp, NULL);
+    CPRT_TIMEOFDAY(&ev->timestamp, NULL);
   }
   if (trc->create_flags & TRC_CREATE_FLAG_THREAD_ID) {
-    trc->events[i % trc->num_entries].thread_id = (uint64_t)(CPRT_GET_THREAD_ID());
+    ev->thread_idx = trc_thread_idx();
+  }
+  if (trc->create_flags & TRC_CREATE_FLAG_CPU_ID) {
+    uint32_t cpu;
+    trc_cpu_node(&cpu, NULL);
+    ev->cpu_id = (uint16_t)cpu;
   }
+  if (trc->create_flags & TRC_CREATE_FLAG_CALLERS) {
+    cprt_callers(&trc->callers[(i % trc->num_entries) * TRC_MAX_CALLERS],
+        TRC_MAX_CALLERS, frame);
+  }
+  CPRT_ORDER_BARRIER();
+  ev->seq = i + 1;  /* Marks the event complete for trc_tail(). */
 
   return TRC_OK;
-}  /* trc_trace */
+}  /* trc_record */
 
 
-void trc_suppress_inc(trc_t *trc)
+int trc_trace(trc_t *trc, char *file_name, uint64_t file_line, uint64_t p1, uint64_t p2)
 {
-  CPRT_ATOMIC_INC_VAL(&trc->suppress_cnt);
-}  /* trc_suppress_inc */
+  return trc_record(trc, TRC_KIND_TRACE, 0, file_name, file_line, p1, p2, CPRT_FRAME_ADDRESS());
+}  /* trc_trace */
 
 
-void trc_suppress_dec(trc_t *trc)
+static trc_span_site_t *trc_span_sites = NULL;  /* Registered span sites. */
+static CPRT_THREAD_LOCAL uint32_t trc_my_span_seq = 0;
+
+
+static uint64_t trc_now_ns()
 {
-  CPRT_ATOMIC_DEC_VAL(&trc->suppress_cnt);
-}  /* trc_suppress_dec */
+  struct cprt_timespec ts;
+  CPRT_GETTIME(&ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}  /* trc_now_ns */
 
 
-int trc_dump(trc_t *trc, FILE *out_fp)
+int trc_span_begin(trc_t *trc, trc_span_t *span, trc_span_site_t *site, uint64_t p1, uint64_t p2)
 {
-  struct cprt_timeval timestamp;
-  struct tm tm_buf;
-  uint64_t cur_event_num;
-  uint64_t num_loops;
-  uint64_t i;
+  if (! site->registered && CPRT_ATOMIC_CAS64(&site->registered, 0, 1)) {
+    trc_span_site_t *head;
+    do {  /* Lock-free push. */
+      head = trc_span_sites;
+      site->next = head;
+    } while (! CPRT_ATOMIC_CASPTR(&trc_span_sites, head, site));
+  }
 
-  trc_suppress_inc(trc);  /* Disable new traces while dumping. */
+  span->trc = trc;
+  span->site = site;
+  /* Unique per thread for 2^20 spans, and across threads by index. */
+  span->span_id = ((uint32_t)trc_thread_idx() << 20) | (++trc_my_span_seq & 0xfffff);
+  span->start_ns = trc_now_ns();
 
-  CPRT_TIMEOFDAY(&timestamp, NULL);
-  CPRT_LOCALTIME_R(&(timestamp.tv_sec), &tm_buf);
-  fprintf(out_fp, "trc_dump: build: %s %s, dump: %04d/%02d/%02d %02d:%02d:%02d.%06d, event_count=%"PRIu32"\n",
-      __DATE__, __TIME__,
-      (int)tm_buf.tm_year + 1900, (int)tm_buf.tm_mon + 1, (int)tm_buf.tm_mday,
-      (int)tm_buf.tm_hour, (int)tm_buf.tm_min, (int)tm_buf.tm_sec, (int)timestamp.tv_usec,
-      trc->event_count);
+  return trc_record(trc, TRC_KIND_SPAN_BEGIN, span->span_id, site->file_name, site->file_line,
+      p1, p2, CPRT_FRAME_ADDRESS());
+}  /* trc_span_begin */
 
-  if (trc->event_count <= trc->num_entries) {  /* If not full. */
-    cur_event_num = 0;
-    num_loops = trc->event_count;
-  } else {  /* Its full. */
-    cur_event_num = trc->event_count - trc->num_entries;
-    num_loops = trc->num_entries;
+
+int trc_span_end(trc_span_t *span, char *file_name, uint64_t file_line, uint64_t p1)
+{
+  uint64_t duration_ns = trc_now_ns() - span->start_ns;
+
+  if (span->trc->create_flags & TRC_CREATE_FLAG_SPAN_HIST) {
+    trc_hist_record(&span->site->hist, duration_ns);
   }
 
-  for (i = 0; i < num_loops; i++) {
-    trc_event_t *ev = &trc->events[cur_event_num % trc->num_entries];
-    fprintf(out_fp, "  ev[%"PRIu64"].thread_id=%"PRIu64", .p1=%"PRIu64", .p2=%"PRIu64", %s:%"PRIu64,
-        cur_event_num, ev->thread_id, ev->p1, ev->p2, ev->file_name, ev->file_line);
-    if (trc->create_flags & TRC_CREATE_FLAG_TIMESTAMP) {
-      CPRT_LOCALTIME_R(&(ev->timestamp.tv_sec), &tm_buf);
-      fprintf(out_fp, ", %04d/%02d/%02d %02d:%02d:%02d.%06d",
-          (int)tm_buf.tm_year + 1900, (int)tm_buf.tm_mon + 1, (int)tm_buf.tm_mday,
-          (int)tm_buf.tm_hour, (int)tm_buf.tm_min, (int)tm_buf.tm_sec, (int)ev->timestamp.tv_usec);
-    }
-    fprintf(out_fp, "\n");
+  return trc_record(span->trc, TRC_KIND_SPAN_END, span->span_id, file_name, file_line,
+      p1, duration_ns, CPRT_FRAME_ADDRESS());
+}  /* trc_span_end */
+
+
+static CPRT_THREAD_LOCAL uint32_t trc_my_lock_span_id = 0;
 
-    cur_event_num++;
+
+/* cprt contention hook: a contended wait becomes a span at the lock's
+ * call site; p1 is the lock's address, the end's p2 the wait. */
+static void trc_contention_hook(void *hook_arg, int is_end, void *lock, int type,
+    const char *file_name, int file_line, uint64_t wait_ns)
+{
+  trc_t *trc = (trc_t *)hook_arg;
+
+  if (! is_end) {
+    trc_my_lock_span_id = ((uint32_t)trc_thread_idx() << 20) | (++trc_my_span_seq & 0xfffff);
+    (void)trc_record(trc, TRC_KIND_SPAN_BEGIN, trc_my_lock_span_id, (char *)file_name, file_line,
+        (uint64_t)(uintptr_t)lock, (uint64_t)type, CPRT_FRAME_ADDRESS());
+  }
+  else {
+    (void)trc_record(trc, TRC_KIND_SPAN_END, trc_my_lock_span_id, (char *)file_name, file_line,
+        (uint64_t)(uintptr_t)lock, wait_ns, CPRT_FRAME_ADDRESS());
   }
+}  /* trc_contention_hook */
 
-  trc_suppress_dec(trc);  /* Re-enable tracing. */
+
+/* Trace contended CPRT_MUTEX_LOCK/SPIN_LOCK/SEM_WAIT calls (in code built
+ * with CPRT_CONTENTION_TRACE) into trc; NULL stops. */
+int trc_contention_attach(trc_t *trc)
+{
+  if (trc == NULL) {
+    cprt_contention_set_hook(NULL, NULL);
+  }
+  else {
+    cprt_contention_set_hook(trc_contention_hook, trc);
+  }
 
   return TRC_OK;
-}  /* trc_dump */
+}  /* trc_contention_attach */
+
+
+const char *trc_flow_kind_names[3] = { "begin", "step", "end" };
+static uint32_t trc_flow_ids = 0;
+
+
+/* A process-unique flow id (never 0). Applications may use their own. */
+uint32_t trc_flow_new()
+{
+  uint32_t flow_id;
+
+  do {
+    flow_id = CPRT_ATOMIC_INC_VAL(&trc_flow_ids);
+  } while (flow_id == 0);
+
+  return flow_id;
+}  /* trc_flow_new */
+
+
+int trc_flow(trc_t *trc, uint32_t kind, uint32_t flow_id, char *file_name, uint64_t file_line,
+    uint64_t p1, uint64_t p2)
+{
+  if (kind < TRC_KIND_FLOW_BEGIN || kind > TRC_KIND_FLOW_END || flow_id == 0) {
+    return TRC_ERR_BAD_PARM;
+  }
+
+  return trc_record(trc, kind, flow_id, file_name, file_line, p1, p2, CPRT_FRAME_ADDRESS());
+}  /* trc_flow */
+
+
+#define TRC_CALIBRATE_ROUNDS 10
+#define TRC_CALIBRATE_TRACES 1000
+
+
+/* Per-trace cost with trc's flags and clock, measured by trc_create() on
+ * a scratch ring so trc's events are untouched. A shared ring's scratch
+ * gets a private segment header, so the shared count and site lookup are
+ * timed without touching the real segment. An unregistered caller traces
+ * as an overflow thread, so calibrating takes no registry index. The best
+ * of several rounds is taken, to leave out preemptions. */
+static void trc_calibrate(trc_t *trc)
+{
+  trc_t *scratch;
+  uint64_t start_ns, round_ns, best_ns;
+  uint32_t flags;
+  uint16_t my_idx = trc_my_thread_idx;
+  int round, i;
+
+  flags = trc->create_flags & (TRC_CREATE_FLAG_ATOMIC_INC | TRC_CREATE_FLAG_TIMESTAMP |
+      TRC_CREATE_FLAG_THREAD_ID | TRC_CREATE_FLAG_CPU_ID | TRC_CREATE_FLAG_CALLERS);
+  if (trc_create_ring(&scratch, TRC_CALIBRATE_TRACES, flags, -1) != TRC_OK) { return; }  /* Unknown: 0. */
+  if (trc->shm != NULL) {
+    scratch->shm = (trc_shm_t *)calloc(1, sizeof(trc_shm_t));
+    scratch->shm_cache = (trc_shm_cache_t *)calloc(1, sizeof(trc_shm_cache_t));
+    if (scratch->shm == NULL || scratch->shm_cache == NULL) {
+      free(scratch->shm);  free(scratch->shm_cache);
+      scratch->shm = NULL;
+      (void)trc_delete(scratch);
+      return;
+    }
+    CPRT_MUTEX_INIT(scratch->shm_cache->lock);
+  }
+  if (my_idx == 0) { trc_my_thread_idx = TRC_THREAD_IDX_OVERFLOW; }
+
+  (void)trc_trace(scratch, __FILE__, __LINE__, 0, 0);  /* Warm up. */
+  best_ns = UINT64_MAX;
+  for (round = 0; round < TRC_CALIBRATE_ROUNDS; round++) {
+    start_ns = trc_now_ns();
+    for (i = 0; i < TRC_CALIBRATE_TRACES; i++) {
+      (void)trc_trace(scratch, __FILE__, __LINE__, i, round);
+    }
+    round_ns = trc_now_ns() - start_ns;
+    if (round_ns < best_ns) { best_ns = round_ns; }
+  }
+  trc_my_thread_idx = my_idx;
+  if (scratch->shm != NULL) {  /* Not a mapping; trc_delete() would unmap it. */
+    CPRT_MUTEX_DELETE(scratch->shm_cache->lock);
+    free(scratch->shm_cache);
+    free(scratch->shm);
+    scratch->shm = NULL;
+  }
+  (void)trc_delete(scratch);
+
+  trc->overhead_ns = (best_ns + TRC_CALIBRATE_TRACES / 2) / TRC_CALIBRATE_TRACES;
+  if (trc->overhead_ns == 0) { trc->overhead_ns = 1; }  /* Calibrated. */
+}  /* trc_calibrate */
+
+
+/* Per-trace cost measured when trc was created; 0 if unknown (e.g. a
+ * trc_attach_shared() reader). */
+uint64_t trc_overhead_ns(trc_t *trc)
+{
+  return trc->overhead_ns;
+}  /* trc_overhead_ns */
+
+
+/* Passed from trc_thread_create() to the new thread, which frees it. */
+struct trc_thread_start_s {
+  trc_t *trc;
+  char name[TRC_THREAD_NAME_LEN];
+  cprt_cpuset_t cpuset;
+  int have_cpuset;
+  trc_thread_entry_t entry;
+  void *arg;
+  char *file_name;
+  uint64_t file_line;
+  /* Filled in by the new thread, for trc_thread_finish(). */
+  uint16_t idx;
+  uint64_t start_ns;
+  int returned;
+  CPRT_THREAD_ENTRYPOINT rtn;
+};
+typedef struct trc_thread_start_s trc_thread_start_t;
+
+
+/* Runs however the thread leaves: return, CPRT_THREAD_EXIT, or cancel. */
+static void trc_thread_finish(void *in_arg)
+{
+  trc_thread_start_t *start = (trc_thread_start_t *)in_arg;
+
+  if (start->trc != NULL) {
+    (void)trc_record(start->trc, TRC_KIND_THREAD_EXIT, start->idx, start->file_name, start->file_line,
+        start->returned ? (uint64_t)(uintptr_t)start->rtn : TRC_THREAD_EXIT_NO_RTN,
+        trc_now_ns() - start->start_ns, NULL);
+  }
+  trc_my_span_seq = 0;
+  trc_my_lock_span_id = 0;
+  trc_thread_release();
+}  /* trc_thread_finish */
+
+
+/* Set up the thread's tracing state before the application code runs,
+ * so its first trace doesn't pay for it. */
+static CPRT_THREAD_ENTRYPOINT trc_thread_trampoline(void *in_arg)
+{
+  trc_thread_start_t start = *(trc_thread_start_t *)in_arg;
+  uint64_t affinity_err = 0;
+
+  free(in_arg);
+
+  errno = 0;
+  if (start.have_cpuset && cprt_try_cpuset_affinity(&start.cpuset) != 0) {
+    affinity_err = (errno != 0) ? (uint64_t)errno : TRC_THREAD_START_AFFINITY_FAILED;
+  }
+  if (start.name[0] != '\0') {
+    cprt_set_thread_name(start.name);  /* For ps, top, perf, gdb. */
+  }
+  start.idx = trc_thread_idx();  /* Registers. */
+  if (start.name[0] != '\0') {
+    (void)trc_set_thread_name(start.name);
+  }
+  if (start.trc != NULL && (start.trc->create_flags & TRC_CREATE_FLAG_CALLERS)) {
+    void *callers[TRC_MAX_CALLERS];
+    (void)cprt_callers(callers, TRC_MAX_CALLERS, CPRT_FRAME_ADDRESS());  /* Caches stack bounds. */
+  }
+
+  start.start_ns = trc_now_ns();
+  if (start.trc != NULL) {
+    (void)trc_record(start.trc, TRC_KIND_THREAD_START, start.idx, start.file_name, start.file_line,
+        (start.idx == TRC_THREAD_IDX_OVERFLOW) ? cprt_gettid() : trc_threads[start.idx].kernel_tid,
+        affinity_err, NULL);
+  }
+
+#if defined(_WIN32)
+  start.rtn = (*start.entry)(start.arg);
+  start.returned = 1;
+  trc_thread_finish(&start);  /* Not reached after CPRT_THREAD_EXIT. */
+#else
+  pthread_cleanup_push(trc_thread_finish, &start);
+  start.rtn = (*start.entry)(start.arg);
+  start.returned = 1;
+  pthread_cleanup_pop(1);
+#endif
+
+  return start.rtn;
+}  /* trc_thread_trampoline */
+
+
+/* CPRT_THREAD_CREATE() that registers the new thread (as "name", if not
+ * NULL) and pins it to cpuset (if not NULL) before entry runs, and, if
+ * trc is not NULL, traces its start and exit. The start event's p1 is the
+ * kernel thread id and p2 is 0, or if the affinity failed the errno
+ * (TRC_THREAD_START_AFFINITY_FAILED if none was set). The
+ * exit event's p1 is entry's return value (TRC_THREAD_EXIT_NO_RTN if the
+ * thread left with CPRT_THREAD_EXIT or was cancelled) and p2 the thread's
+ * run time in nanoseconds. The thread's registry index is released at
+ * exit, for reuse by later threads. */
+int trc_thread_create(CPRT_THREAD_T *thread_rtn, trc_t *trc, const char *name, const cprt_cpuset_t *cpuset,
+    trc_thread_entry_t entry, void *arg, char *file_name, uint64_t file_line)
+{
+  trc_thread_start_t *start;
+
+  if (thread_rtn == NULL || entry == NULL) { return TRC_ERR_BAD_PARM; }
+  if (cpuset != NULL && cprt_cpuset_count(cpuset) == 0) { return TRC_ERR_BAD_PARM; }
+
+  start = (trc_thread_start_t *)calloc(1, sizeof(trc_thread_start_t));
+  if (start == NULL) { return TRC_ERR_NO_MEM; }
+  start->trc = trc;
+  if (name != NULL) {
+    CPRT_SNPRINTF(start->name, sizeof(start->name), "%s", name);
+  }
+  if (cpuset != NULL) {
+    start->cpuset = *cpuset;
+    start->have_cpuset = 1;
+  }
+  start->entry = entry;
+  start->arg = arg;
+  start->file_name = file_name;
+  start->file_line = file_line;
+
+  CPRT_THREAD_CREATE(*thread_rtn, trc_thread_trampoline, start);
+
+  return TRC_OK;
+}  /* trc_thread_create */
+
+
+static uint32_t trc_hist_bucket(uint64_t value)
+{
+  uint32_t msb;
+
+  if (value < (1u << TRC_HIST_SUB_BITS)) {
+    return (uint32_t)value;
+  }
+  msb = CPRT_MSB64(value);
+  return ((msb - TRC_HIST_SUB_BITS + 1) << TRC_HIST_SUB_BITS)
+      | (uint32_t)((value >> (msb - TRC_HIST_SUB_BITS)) & ((1u << TRC_HIST_SUB_BITS) - 1));
+}  /* trc_hist_bucket */
+
+
+/* Highest value that lands in a bucket. */
+static uint64_t trc_hist_bucket_max(uint32_t bucket)
+{
+  uint32_t magnitude = bucket >> TRC_HIST_SUB_BITS;
+  uint64_t sub = bucket & ((1u << TRC_HIST_SUB_BITS) - 1);
+  uint32_t shift;
+
+  if (magnitude == 0) {
+    return sub;
+  }
+  shift = magnitude - 1;
+  return (((sub | (1u << TRC_HIST_SUB_BITS)) + 1) << shift) - 1;
+}  /* trc_hist_bucket_max */
+
+
+void trc_hist_record(trc_hist_t *hist, uint64_t value)
+{
+  uint64_t old_max;
+
+  CPRT_ATOMIC_ADD_VAL(&hist->buckets[trc_hist_bucket(value)], 1);
+  CPRT_ATOMIC_ADD_VAL(&hist->count, 1);
+  old_max = hist->max;
+  while (value > old_max && ! CPRT_ATOMIC_CAS64(&hist->max, old_max, value)) {
+    old_max = hist->max;
+  }
+}  /* trc_hist_record */
+
+
+/* Value at or below which "percentile" percent of the samples fall
+ * (to the histogram's precision, never above the true maximum). */
+uint64_t trc_hist_percentile(trc_hist_t *hist, double percentile)
+{
+  uint64_t count = hist->count;
+  uint64_t target, seen = 0;
+  uint32_t bucket;
+
+  if (count == 0) { return 0; }
+  target = (uint64_t)((percentile / 100.0) * (double)count + 0.5);
+  if (target == 0) { target = 1; }
+  for (bucket = 0; bucket < TRC_HIST_BUCKETS; bucket++) {
+    seen += hist->buckets[bucket];
+    if (seen >= target) {
+      uint64_t bucket_max = trc_hist_bucket_max(bucket);
+      return (bucket_max < hist->max) ? bucket_max : hist->max;
+    }
+  }
+  return hist->max;
+}  /* trc_hist_percentile */
+
+
+int trc_histograms_dump(FILE *out_fp)
+{
+  trc_span_site_t *site;
+
+  for (site = trc_span_sites; site != NULL; site = site->next) {
+    trc_hist_t *hist = &site->hist;
+    if (hist->count == 0) { continue; }
+    fprintf(out_fp, "span %s:%"PRIu32": count=%"PRIu64", p50=%"PRIu64", p99=%"PRIu64
+        ", p99.9=%"PRIu64", max=%"PRIu64" ns\n",
+        site->file_name, site->file_line, hist->count,
+        trc_hist_percentile(hist, 50.0), trc_hist_percentile(hist, 99.0),
+        trc_hist_percentile(hist, 99.9), hist->max);
+  }
+
+  return TRC_OK;
+}  /* trc_histograms_dump */
+
+
+static trc_count_site_t *trc_count_sites = NULL;  /* Registered counter sites. */
+
+
+static void trc_count_max(uint64_t *max_p, uint64_t value)
+{
+  uint64_t old_max = *max_p;
+  while (value > old_max && ! CPRT_ATOMIC_CAS64(max_p, old_max, value)) {
+    old_max = *max_p;
+  }
+}  /* trc_count_max */
+
+
+int trc_count(trc_t *trc, trc_count_site_t *site, uint64_t p1, uint64_t p2)
+{
+  trc_count_shard_t *shard;
+  uint16_t thread_idx;
+
+  if (! site->registered && CPRT_ATOMIC_CAS64(&site->registered, 0, 1)) {
+    trc_count_site_t *head;
+    site->trc = trc;
+    do {  /* Lock-free push. */
+      head = trc_count_sites;
+      site->next = head;
+    } while (! CPRT_ATOMIC_CASPTR(&trc_count_sites, head, site));
+  }
+  if (trc->suppress_cnt > 0) {
+    return 0;
+  }
+
+  thread_idx = trc_thread_idx();
+  if (thread_idx >= 1 && thread_idx <= TRC_COUNT_SHARDS) {  /* No other writer. */
+    shard = &site->shards[thread_idx - 1];
+    shard->hits++;
+    shard->p1_sum += p1;
+    shard->p2_sum += p2;
+    if (~p1 > shard->p1_min_inv) { shard->p1_min_inv = ~p1; }
+    if (p1 > shard->p1_max) { shard->p1_max = p1; }
+    if (~p2 > shard->p2_min_inv) { shard->p2_min_inv = ~p2; }
+    if (p2 > shard->p2_max) { shard->p2_max = p2; }
+  }
+  else {
+    shard = &site->shards[TRC_COUNT_SHARDS + thread_idx % TRC_COUNT_SHARDS];
+    CPRT_ATOMIC_ADD_VAL(&shard->hits, 1);
+    CPRT_ATOMIC_ADD_VAL(&shard->p1_sum, p1);
+    CPRT_ATOMIC_ADD_VAL(&shard->p2_sum, p2);
+    trc_count_max(&shard->p1_min_inv, ~p1);
+    trc_count_max(&shard->p1_max, p1);
+    trc_count_max(&shard->p2_min_inv, ~p2);
+    trc_count_max(&shard->p2_max, p2);
+  }
+  if (trc->create_flags & TRC_CREATE_FLAG_TIMESTAMP) {
+    struct cprt_timeval tv;
+    CPRT_TIMEOFDAY(&tv, NULL);
+    shard->last_ns = (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+  }
+
+  return TRC_OK;
+}  /* trc_count */
+
+
+void trc_count_totals(trc_count_site_t *site, trc_count_totals_t *totals_rtn)
+{
+  uint64_t p1_min_inv = 0, p2_min_inv = 0;
+  int s;
+
+  memset(totals_rtn, 0, sizeof(*totals_rtn));
+  for (s = 0; s < 2 * TRC_COUNT_SHARDS; s++) {
+    trc_count_shard_t *shard = &site->shards[s];
+    totals_rtn->hits += shard->hits;
+    totals_rtn->p1_sum += shard->p1_sum;
+    totals_rtn->p2_sum += shard->p2_sum;
+    if (shard->p1_min_inv > p1_min_inv) { p1_min_inv = shard->p1_min_inv; }
+    if (shard->p1_max > totals_rtn->p1_max) { totals_rtn->p1_max = shard->p1_max; }
+    if (shard->p2_min_inv > p2_min_inv) { p2_min_inv = shard->p2_min_inv; }
+    if (shard->p2_max > totals_rtn->p2_max) { totals_rtn->p2_max = shard->p2_max; }
+    if (shard->last_ns > totals_rtn->last_ns) { totals_rtn->last_ns = shard->last_ns; }
+  }
+  totals_rtn->p1_min = (totals_rtn->hits > 0) ? ~p1_min_inv : 0;
+  totals_rtn->p2_min = (totals_rtn->hits > 0) ? ~p2_min_inv : 0;
+}  /* trc_count_totals */
+
+
+static void trc_count_site_dump(FILE *out_fp, trc_count_site_t *site)
+{
+  trc_count_totals_t totals;
+
+  trc_count_totals(site, &totals);
+  fprintf(out_fp, "counter %s:%"PRIu32": hits=%"PRIu64", p1.sum=%"PRIu64", .min=%"PRIu64", .max=%"PRIu64
+      ", p2.sum=%"PRIu64", .min=%"PRIu64", .max=%"PRIu64,
+      site->file_name, site->file_line, totals.hits, totals.p1_sum, totals.p1_min, totals.p1_max,
+      totals.p2_sum, totals.p2_min, totals.p2_max);
+  if (totals.last_ns != 0) {
+    struct tm tm_buf;
+    time_t secs = (time_t)(totals.last_ns / 1000000000);
+    CPRT_LOCALTIME_R(&secs, &tm_buf);
+    fprintf(out_fp, ", last=%04d/%02d/%02d %02d:%02d:%02d.%06d",
+        (int)tm_buf.tm_year + 1900, (int)tm_buf.tm_mon + 1, (int)tm_buf.tm_mday,
+        (int)tm_buf.tm_hour, (int)tm_buf.tm_min, (int)tm_buf.tm_sec,
+        (int)((totals.last_ns % 1000000000) / 1000));
+  }
+  fprintf(out_fp, "\n");
+}  /* trc_count_site_dump */
+
+
+/* All counter sites, any trc. Safe to call periodically while counting. */
+int trc_counters_dump(FILE *out_fp)
+{
+  trc_count_site_t *site;
+
+  for (site = trc_count_sites; site != NULL; site = site->next) {
+    trc_count_site_dump(out_fp, site);
+  }
+
+  return TRC_OK;
+}  /* trc_counters_dump */
+
+
+struct trc_gauge_s {
+  trc_t *trc;
+  char *name;  /* Never freed: ring events point at it. */
+  trc_gauge_cb_t cb;
+  void *cb_arg;
+  uint64_t period_ns;
+  uint64_t next_ns;
+  uint32_t ready;  /* Set last by trc_gauge_register(). */
+};
+typedef struct trc_gauge_s trc_gauge_t;
+
+static trc_gauge_t trc_gauges[TRC_MAX_GAUGES];
+static uint32_t trc_num_gauges = 0;
+static uint64_t trc_gauge_started = 0;
+static uint32_t trc_gauge_stop_requested = 0;
+static cprt_cpuset_t trc_gauge_affinity;
+static uint32_t trc_gauge_affinity_set = 0;
+static CPRT_THREAD_T trc_gauge_thread;
+
+
+static CPRT_THREAD_ENTRYPOINT trc_gauge_sampler(void *in_arg)
+{
+  uint64_t now_ns, wait_ns;
+  uint32_t g, num_gauges;
+
+  (void)in_arg;
+  (void)trc_set_thread_name("trc_gauges");
+
+  while (! CPRT_VOL32(trc_gauge_stop_requested)) {
+    if (CPRT_VOL32(trc_gauge_affinity_set)) {
+      trc_gauge_affinity_set = 0;
+      (void)cprt_try_cpuset_affinity(&trc_gauge_affinity);  /* Best effort. */
+    }
+
+    now_ns = trc_now_ns();
+    wait_ns = 10000000;  /* Wake at least every 10 ms to notice a stop. */
+    num_gauges = CPRT_VOL32(trc_num_gauges);
+    if (num_gauges > TRC_MAX_GAUGES) { num_gauges = TRC_MAX_GAUGES; }
+    for (g = 0; g < num_gauges; g++) {
+      trc_gauge_t *gauge = &trc_gauges[g];
+      if (! CPRT_VOL32(gauge->ready)) { continue; }
+      if (now_ns >= gauge->next_ns) {
+        uint64_t value = (*gauge->cb)(gauge->cb_arg);
+        (void)trc_record(gauge->trc, TRC_KIND_GAUGE, 0, gauge->name, 0, value, 0, NULL);
+        /* Keep the cadence, but don't try to catch up after a stall. */
+        gauge->next_ns += gauge->period_ns;
+        if (gauge->next_ns <= now_ns) { gauge->next_ns = now_ns + gauge->period_ns; }
+      }
+      if (gauge->next_ns - now_ns < wait_ns) { wait_ns = gauge->next_ns - now_ns; }
+    }
+    if (wait_ns >= 1000000) {
+      CPRT_SLEEP_MS(wait_ns / 1000000);
+    }
+    else {
+      CPRT_SLEEP_NS(wait_ns);
+    }
+  }
+
+  return 0;
+}  /* trc_gauge_sampler */
+
+
+/* Sample cb every period_ms on the sampler thread, starting it if needed.
+ * Callbacks run on that thread and should be quick. */
+int trc_gauge_register(trc_t *trc, const char *name, trc_gauge_cb_t cb, void *cb_arg, uint32_t period_ms)
+{
+  trc_gauge_t *gauge;
+  uint32_t g;
+
+  if (trc == NULL || name == NULL || cb == NULL || period_ms == 0) { return TRC_ERR_BAD_PARM; }
+
+  g = CPRT_ATOMIC_INC_VAL(&trc_num_gauges) - 1;
+  if (g >= TRC_MAX_GAUGES) { return TRC_ERR_NO_MEM; }
+  gauge = &trc_gauges[g];
+  gauge->trc = trc;
+  gauge->name = CPRT_STRDUP(name);
+  if (gauge->name == NULL) { return TRC_ERR_NO_MEM; }
+  gauge->cb = cb;
+  gauge->cb_arg = cb_arg;
+  gauge->period_ns = (uint64_t)period_ms * 1000000;
+  gauge->next_ns = trc_now_ns();
+  CPRT_MEM_BARRIER();
+  gauge->ready = 1;
+
+  if (! trc_gauge_started && CPRT_ATOMIC_CAS64(&trc_gauge_started, 0, 1)) {
+    trc_gauge_stop_requested = 0;
+    CPRT_THREAD_CREATE(trc_gauge_thread, trc_gauge_sampler, NULL);
+  }
+
+  return TRC_OK;
+}  /* trc_gauge_register */
+
+
+/* Pin the sampler thread (cprt_try_affinity() mask), now or when it starts. */
+int trc_gauge_set_affinity(uint64_t cpu_mask)
+{
+  cprt_cpuset_t cpuset;
+
+  cprt_cpuset_from_mask(&cpuset, cpu_mask);
+  return trc_gauge_set_cpuset(&cpuset);
+}  /* trc_gauge_set_affinity */
+
+
+/* As trc_gauge_set_affinity(), for any CPUs (e.g. from cprt_cpuset_parse()). */
+int trc_gauge_set_cpuset(const cprt_cpuset_t *cpuset)
+{
+  if (cpuset == NULL || cprt_cpuset_count(cpuset) == 0) { return TRC_ERR_BAD_PARM; }
+  trc_gauge_affinity = *cpuset;
+  CPRT_MEM_BARRIER();
+  trc_gauge_affinity_set = 1;
+
+  return TRC_OK;
+}  /* trc_gauge_set_cpuset */
+
+
+/* Stop the sampler and forget all gauges. Call before deleting a trc that
+ * gauges record into. */
+int trc_gauges_stop()
+{
+  uint32_t g;
+
+  if (! trc_gauge_started) { return TRC_OK; }
+  trc_gauge_stop_requested = 1;
+  CPRT_THREAD_JOIN(trc_gauge_thread);
+
+  for (g = 0; g < TRC_MAX_GAUGES; g++) {
+    trc_gauges[g].ready = 0;
+  }
+  trc_num_gauges = 0;
+  trc_gauge_started = 0;
+
+  return TRC_OK;
+}  /* trc_gauges_stop */
+
+
+void trc_suppress_inc(trc_t *trc)
+{
+  CPRT_ATOMIC_INC_VAL(&trc->suppress_cnt);
+}  /* trc_suppress_inc */
+
+
+void trc_suppress_dec(trc_t *trc)
+{
+  CPRT_ATOMIC_DEC_VAL(&trc->suppress_cnt);
+}  /* trc_suppress_dec */
+
+
+/* Record only the kinds whose bit (1 << TRC_KIND_*) is set in kind_mask. */
+int trc_set_kind_mask(trc_t *trc, uint32_t kind_mask)
+{
+  if (trc == NULL) { return TRC_ERR_BAD_PARM; }
+  trc->kinds_off = ~kind_mask;
+
+  return TRC_OK;
+}  /* trc_set_kind_mask */
+
+
+static uint64_t trc_ring_count(trc_t *trc)
+{
+  if (trc->shm != NULL && trc->snap_of == NULL) { return CPRT_VOL64(trc->shm->event_count); }
+  return CPRT_VOL64(trc->event_count);
+}  /* trc_ring_count */
+
+
+/* Find the oldest event still in a ring and how many there are. */
+static void trc_ring_range(trc_t *trc, uint64_t *first_rtn, uint64_t *count_rtn)
+{
+  uint64_t event_count = trc_ring_count(trc);
+
+  if (event_count <= trc->num_entries) {  /* If not full. */
+    *first_rtn = 0;
+    *count_rtn = event_count;
+  } else {  /* Its full. */
+    *first_rtn = event_count - trc->num_entries;
+    *count_rtn = trc->num_entries;
+  }
+  if (trc->snap_first > *first_rtn) {  /* Older ones were overwritten while copying. */
+    *count_rtn -= trc->snap_first - *first_rtn;
+    *first_rtn = trc->snap_first;
+  }
+}  /* trc_ring_range */
+
+
+/* Shared-ring events name their site through the segment. */
+char *trc_event_file(trc_t *trc, trc_event_t *ev)
+{
+  trc_shm_proc_t *proc;
+
+  if (trc->shm == NULL) { return ev->file_name; }
+  if (ev->proc_idx >= TRC_SHM_MAX_PROCS) { return "?"; }
+  proc = &trc->shm->procs[ev->proc_idx];
+  if (ev->site_id >= CPRT_VOL32(proc->num_sites)) { return "?"; }
+  return proc->sites[ev->site_id].file_name;
+}  /* trc_event_file */
+
+
+static void trc_dump_callers(FILE *out_fp, void **callers)
+{
+  int c;
+
+  fprintf(out_fp, "    callers:");
+  for (c = 0; c < TRC_MAX_CALLERS && callers[c] != NULL; c++) {
+#if ! defined(_WIN32)
+    Dl_info info;
+    if (dladdr(callers[c], &info) != 0 && info.dli_sname != NULL) {
+      fprintf(out_fp, " %s+0x%lx", info.dli_sname,
+          (unsigned long)((char *)callers[c] - (char *)info.dli_saddr));
+      continue;
+    }
+    if (dladdr(callers[c], &info) != 0 && info.dli_fname != NULL) {
+      fprintf(out_fp, " %s+0x%lx", CPRT_BASENAME(info.dli_fname),
+          (unsigned long)((char *)callers[c] - (char *)info.dli_fbase));
+      continue;
+    }
+#endif
+    fprintf(out_fp, " %p", callers[c]);
+  }
+  fprintf(out_fp, "\n");
+}  /* trc_dump_callers */
+
+
+/* last_cpu[] is indexed by thread and tracks migrations (0xffff = none yet). */
+static void trc_dump_event(trc_t *trc, FILE *out_fp, uint64_t ev_num, trc_event_t *ev, uint16_t *last_cpu)
+{
+  struct tm tm_buf;
+
+  fprintf(out_fp, "  ev[%"PRIu64"]", ev_num);
+  if (trc->numa_node >= 0) {
+    fprintf(out_fp, ".node=%d, ", trc->numa_node);
+  }
+  if (trc->shm != NULL) {
+    fprintf(out_fp, ".pid=%"PRIu32", ", trc->shm->procs[ev->proc_idx % TRC_SHM_MAX_PROCS].pid);
+  }
+  if (trc->shm != NULL && ev->proc_idx != trc->shm_proc_idx) {
+    /* Another process's thread registry; only the index is known here. */
+    fprintf(out_fp, ".thread=[%"PRIu16"]", ev->thread_idx);
+  }
+  else if (ev->thread_idx == 0) {
+    fprintf(out_fp, ".thread=-");
+  }
+  else if (ev->thread_idx == TRC_THREAD_IDX_OVERFLOW) {
+    fprintf(out_fp, ".thread=overflow");
+  }
+  else {
+    fprintf(out_fp, ".thread=%s[%"PRIu16"]", trc_threads[ev->thread_idx].name, ev->thread_idx);
+  }
+  if (trc->create_flags & TRC_CREATE_FLAG_CPU_ID) {
+    fprintf(out_fp, ", .cpu=%"PRIu16, ev->cpu_id);
+    if (ev->thread_idx != 0 && ev->thread_idx != TRC_THREAD_IDX_OVERFLOW &&
+        (trc->shm == NULL || ev->proc_idx == trc->shm_proc_idx)) {
+      if (last_cpu[ev->thread_idx] != 0xffff && last_cpu[ev->thread_idx] != ev->cpu_id) {
+        fprintf(out_fp, " (MIGRATED from %"PRIu16")", last_cpu[ev->thread_idx]);
+      }
+      last_cpu[ev->thread_idx] = ev->cpu_id;
+    }
+  }
+  if (ev->kind == TRC_KIND_SPAN_BEGIN) {
+    fprintf(out_fp, ", .span_begin=0x%"PRIx32, ev->span_id);
+  }
+  else if (ev->kind == TRC_KIND_SPAN_END) {
+    fprintf(out_fp, ", .span_end=0x%"PRIx32, ev->span_id);
+  }
+  else if (ev->kind == TRC_KIND_GAUGE) {
+    fprintf(out_fp, ", .gauge");
+  }
+  else if (ev->kind >= TRC_KIND_FLOW_BEGIN && ev->kind <= TRC_KIND_FLOW_END) {
+    fprintf(out_fp, ", .flow_%s=0x%"PRIx32, trc_flow_kind_names[ev->kind - TRC_KIND_FLOW_BEGIN], ev->span_id);
+  }
+  else if (ev->kind == TRC_KIND_THREAD_START) {
+    fprintf(out_fp, ", .thread_start");
+  }
+  else if (ev->kind == TRC_KIND_THREAD_EXIT) {
+    fprintf(out_fp, ", .thread_exit");
+  }
+  fprintf(out_fp, ", .p1=%"PRIu64", .p2=%"PRIu64", %s:%"PRIu32,
+      ev->p1, ev->p2, trc_event_file(trc, ev), ev->file_line);
+  if (trc->create_flags & TRC_CREATE_FLAG_TIMESTAMP) {
+    CPRT_LOCALTIME_R(&(ev->timestamp.tv_sec), &tm_buf);
+    fprintf(out_fp, ", %04d/%02d/%02d %02d:%02d:%02d.%06d",
+        (int)tm_buf.tm_year + 1900, (int)tm_buf.tm_mon + 1, (int)tm_buf.tm_mday,
+        (int)tm_buf.tm_hour, (int)tm_buf.tm_min, (int)tm_buf.tm_sec, (int)ev->timestamp.tv_usec);
+  }
+  fprintf(out_fp, "\n");
+  if (trc->callers != NULL) {
+    trc_dump_callers(out_fp, &trc->callers[(ev_num % trc->num_entries) * TRC_MAX_CALLERS]);
+  }
+}  /* trc_dump_event */
+
+
+/* Walks a trc's events oldest first. Per-node rings are merged by
+ * timestamp (node by node without timestamps). */
+#define TRC_ITER_MAX_RINGS 64
+struct trc_iter_s {
+  uint32_t num_rings;
+  int by_time;
+  trc_t *rings[TRC_ITER_MAX_RINGS];
+  uint64_t cur[TRC_ITER_MAX_RINGS];
+  uint64_t end[TRC_ITER_MAX_RINGS];
+};
+typedef struct trc_iter_s trc_iter_t;
+
+
+static void trc_iter_init(trc_iter_t *it, trc_t *trc)
+{
+  uint32_t r;
+  uint64_t count;
+
+  if (trc->num_nodes > 1) {
+    it->num_rings = (trc->num_nodes < TRC_ITER_MAX_RINGS) ? trc->num_nodes : TRC_ITER_MAX_RINGS;
+    for (r = 0; r < it->num_rings; r++) {
+      it->rings[r] = trc->node_trcs[r];
+    }
+  }
+  else {
+    it->num_rings = 1;
+    it->rings[0] = trc;
+  }
+  it->by_time = (trc->create_flags & TRC_CREATE_FLAG_TIMESTAMP) ? 1 : 0;
+
+  for (r = 0; r < it->num_rings; r++) {
+    trc_ring_range(it->rings[r], &it->cur[r], &count);
+    it->end[r] = it->cur[r] + count;
+  }
+}  /* trc_iter_init */
+
+
+/* Returns NULL when done. */
+static trc_event_t *trc_iter_next(trc_iter_t *it, trc_t **ring_rtn, uint64_t *ev_num_rtn)
+{
+  trc_event_t *best_ev = NULL;
+  uint32_t best_r = 0;
+  uint32_t r;
+
+  for (r = 0; r < it->num_rings; r++) {
+    trc_t *ring = it->rings[r];
+    trc_event_t *ev;
+    if (it->cur[r] == it->end[r]) { continue; }
+    ev = &ring->events[it->cur[r] % ring->num_entries];
+    if (best_ev == NULL) {
+      best_ev = ev;  best_r = r;
+      if (! it->by_time) { break; }
+    }
+    else if (ev->timestamp.tv_sec < best_ev->timestamp.tv_sec ||
+        (ev->timestamp.tv_sec == best_ev->timestamp.tv_sec &&
+         ev->timestamp.tv_usec < best_ev->timestamp.tv_usec)) {
+      best_ev = ev;  best_r = r;
+    }
+  }
+  if (best_ev == NULL) { return NULL; }  /* All rings drained. */
+
+  *ring_rtn = it->rings[best_r];
+  *ev_num_rtn = it->cur[best_r]++;
+  return best_ev;
+}  /* trc_iter_next */
+
+
+int trc_dump(trc_t *trc, FILE *out_fp)
+{
+  struct cprt_timeval timestamp;
+  struct tm tm_buf;
+  uint64_t event_count;
+  uint32_t node;
+  uint32_t num_threads;
+  uint16_t last_cpu[TRC_MAX_THREADS];
+  trc_iter_t it;
+  trc_t *ring;
+  trc_event_t *ev;
+  uint64_t ev_num;
+  uint64_t i;
+  trc_count_site_t *site;
+
+  trc_suppress_inc(trc);  /* Disable new traces while dumping. */
+  memset(last_cpu, 0xff, sizeof(last_cpu));
+
+  event_count = trc_ring_count(trc);
+  for (node = 0; trc->num_nodes > 1 && node < trc->num_nodes; node++) {
+    event_count += trc->node_trcs[node]->event_count;
+  }
+
+  CPRT_TIMEOFDAY(&timestamp, NULL);
+  CPRT_LOCALTIME_R(&(timestamp.tv_sec), &tm_buf);
+  fprintf(out_fp, "trc_dump: build: %s %s, dump: %04d/%02d/%02d %02d:%02d:%02d.%06d, event_count=%"PRIu64", alloc_flags=0x%"PRIx32", num_nodes=%"PRIu32", overhead_ns=%"PRIu64"\n",
+      __DATE__, __TIME__,
+      (int)tm_buf.tm_year + 1900, (int)tm_buf.tm_mon + 1, (int)tm_buf.tm_mday,
+      (int)tm_buf.tm_hour, (int)tm_buf.tm_min, (int)tm_buf.tm_sec, (int)timestamp.tv_usec,
+      event_count, (trc->num_nodes > 1) ? trc->node_trcs[0]->alloc_flags : trc->alloc_flags,
+      trc->num_nodes, trc->overhead_ns);
+
+  num_threads = trc_num_threads;
+  if (num_threads >= TRC_MAX_THREADS) { num_threads = TRC_MAX_THREADS - 1; }
+  for (i = 1; i <= num_threads; i++) {
+    fprintf(out_fp, "  thread[%"PRIu64"].tid=%"PRIu64", .name=%s\n",
+        i, trc_threads[i].kernel_tid, trc_threads[i].name);
+  }
+
+  trc_iter_init(&it, trc);
+  while ((ev = trc_iter_next(&it, &ring, &ev_num)) != NULL) {
+    trc_dump_event(ring, out_fp, ev_num, ev, last_cpu);
+  }
+
+  for (site = trc_count_sites; site != NULL; site = site->next) {
+    if (site->trc == trc || (trc->snap_of != NULL && site->trc == trc->snap_of)) {
+      trc_count_site_dump(out_fp, site);
+    }
+  }
+
+  trc_suppress_dec(trc);  /* Re-enable tracing. */
+
+  return TRC_OK;
+}  /* trc_dump */
+
+
+/* Copy event ev_num out of a ring that writers may still be using.
+ * Returns 1 if copied, 0 if its writer has not finished it yet, or -1 if
+ * it was (or is being) overwritten. */
+static int trc_event_copy(trc_t *trc, uint64_t ev_num, trc_event_t *ev_rtn)
+{
+  memcpy(ev_rtn, (void *)&trc->events[ev_num % trc->num_entries], sizeof(*ev_rtn));
+  CPRT_ORDER_BARRIER();
+  /* Writers claim before they write, so this catches a lap in progress. */
+  if (trc_ring_count(trc) > ev_num + trc->num_entries) { return -1; }
+  if (ev_rtn->seq != ev_num + 1) { return 0; }
+  return 1;
+}  /* trc_event_copy */
+
+
+/* Copy up to max_events events recorded at or after *cursor_io into buf,
+ * oldest first, and advance the cursor. Events lost to wrap since the
+ * last call are counted in *num_lost_rtn. Stops at an event that is still
+ * being written. Cost is proportional to the new events, and nothing is
+ * taken from writers. */
+int trc_read_since(trc_t *trc, uint64_t *cursor_io, trc_event_t *buf, uint32_t max_events,
+    uint32_t *num_read_rtn, uint64_t *num_lost_rtn)
+{
+  uint64_t count = trc_ring_count(trc);
+  uint64_t num_lost = 0;
+  uint32_t num_read = 0;
+  int rc;
+
+  if (trc->num_nodes > 1 || buf == NULL) { return TRC_ERR_BAD_PARM; }
+
+  if (count > *cursor_io + trc->num_entries) {  /* Lapped while away. */
+    num_lost += count - trc->num_entries - *cursor_io;
+    *cursor_io = count - trc->num_entries;
+  }
+  while (*cursor_io < count && num_read < max_events) {
+    rc = trc_event_copy(trc, *cursor_io, &buf[num_read]);
+    if (rc == 0) { break; }  /* Still being written. */
+    if (rc < 0) {
+      num_lost++;
+    }
+    else {
+      num_read++;
+    }
+    (*cursor_io)++;
+  }
+
+  if (num_read_rtn != NULL) { *num_read_rtn = num_read; }
+  if (num_lost_rtn != NULL) { *num_lost_rtn = num_lost; }
+  return TRC_OK;
+}  /* trc_read_since */
+
+
+/* Print events from *next_io on, as far as writers have completed them,
+ * and advance *next_io. Events lost to wrap are added to *num_missed_io.
+ * last_cpu_io (TRC_MAX_THREADS entries, filled with 0xff bytes before the
+ * first call) carries each thread's last CPU from call to call, so
+ * migrations between polls are reported; NULL only sees those within a
+ * call. Returns the number printed. */
+int trc_tail(trc_t *trc, uint64_t *next_io, FILE *out_fp, uint64_t *num_missed_io, uint16_t *last_cpu_io)
+{
+  trc_event_t buf[64];
+  uint16_t local_last_cpu[TRC_MAX_THREADS];
+  uint16_t *last_cpu = last_cpu_io;
+  uint64_t num_lost;
+  uint32_t num_read, i;
+  int num_printed = 0;
+  int err;
+
+  if (last_cpu == NULL) {
+    memset(local_last_cpu, 0xff, sizeof(local_last_cpu));
+    last_cpu = local_last_cpu;
+  }
+  do {
+    err = trc_read_since(trc, next_io, buf, 64, &num_read, &num_lost);
+    if (err != TRC_OK) { return err; }
+    *num_missed_io += num_lost;
+    for (i = 0; i < num_read; i++) {
+      trc_dump_event(trc, out_fp, buf[i].seq - 1, &buf[i], last_cpu);
+      num_printed++;
+    }
+  } while (num_read == 64);
+
+  return num_printed;
+}  /* trc_tail */
+
+
+/* Copy one ring's intact events; see trc_snapshot(). */
+static int trc_snapshot_ring(trc_t *ring, trc_t **snap_rtn)
+{
+  trc_t *snap;
+  uint64_t count, first, lo, hi, ev_num, slot;
+  int rc, err;
+
+  err = trc_create_ring(&snap, ring->num_entries, ring->create_flags & (TRC_CREATE_FLAG_ATOMIC_INC |
+      TRC_CREATE_FLAG_TIMESTAMP | TRC_CREATE_FLAG_THREAD_ID | TRC_CREATE_FLAG_CPU_ID |
+      TRC_CREATE_FLAG_CALLERS | TRC_CREATE_FLAG_SPAN_HIST), -1);
+  if (err != TRC_OK) { return err; }
+
+  count = trc_ring_count(ring);
+  first = (count > ring->num_entries) ? count - ring->num_entries : 0;
+  lo = first;
+  hi = count;
+  for (ev_num = first; ev_num < count; ev_num++) {
+    slot = ev_num % ring->num_entries;
+    rc = trc_event_copy(ring, ev_num, &snap->events[slot]);
+    if (rc < 0) {  /* Overwritten, and so is everything older. */
+      lo = ev_num + 1;
+    }
+    else if (rc == 0) {  /* Still being written; stop at the first. */
+      if (hi == count) { hi = ev_num; }
+    }
+    else {
+      if (ring->shm == NULL) { snap->events[slot].file_name = trc_event_file(ring, &snap->events[slot]); }
+      if (ring->callers != NULL) {
+        memcpy(&snap->callers[slot * TRC_MAX_CALLERS], &ring->callers[slot * TRC_MAX_CALLERS],
+            TRC_MAX_CALLERS * sizeof(void *));
+      }
+    }
+  }
+  if (lo > hi) { lo = hi; }
+
+  snap->event_count = hi;
+  snap->snap_first = lo;
+  snap->create_flags = ring->create_flags;  /* As the ring reports them; snap is never traced into. */
+  snap->alloc_flags = ring->alloc_flags;
+  snap->overhead_ns = ring->overhead_ns;
+  snap->snap_of = ring;
+  if (ring->shm != NULL) {  /* Sites and pids stay in the segment; read-only, like trc_attach_shared(). */
+    snap->shm = ring->shm;
+    snap->shm_proc_idx = ring->shm_proc_idx;
+    snap->suppress_cnt = 1;
+  }
+
+  *snap_rtn = snap;
+  return TRC_OK;
+}  /* trc_snapshot_ring */
+
+
+/* A private copy of trc's events, to dump (or inspect) while tracing
+ * goes on: writers are neither paused nor suppressed. Events overwritten
+ * or still being written during the copy are left out. A shared ring's
+ * copy still names sites and processes through trc's segment, so delete
+ * it first. Free with trc_delete(). */
+int trc_snapshot(trc_t *trc, trc_t **snap_rtn)
+{
+  trc_t *snap;
+  uint32_t node;
+  int err;
+
+  if (trc == NULL || snap_rtn == NULL) { return TRC_ERR_BAD_PARM; }
+
+  if (trc->num_nodes <= 1) {
+    err = trc_snapshot_ring(trc, &snap);
+    if (err != TRC_OK) { return err; }
+  }
+  else {
+    snap = (trc_t *)calloc(1, sizeof(trc_t));
+    if (snap == NULL) { return TRC_ERR_NO_MEM; }
+    snap->node_trcs = (trc_t **)calloc(trc->num_nodes, sizeof(trc_t *));
+    if (snap->node_trcs == NULL) { free(snap); return TRC_ERR_NO_MEM; }
+    snap->num_entries = trc->num_entries;
+    snap->create_flags = trc->create_flags;
+    snap->numa_node = -1;
+    for (node = 0; node < trc->num_nodes; node++) {
+      err = trc_snapshot_ring(trc->node_trcs[node], &snap->node_trcs[node]);
+      if (err != TRC_OK) { break; }
+      snap->num_nodes++;
+    }
+    if (snap->num_nodes < trc->num_nodes) {
+      for (node = 0; node < snap->num_nodes; node++) {
+        trc_delete(snap->node_trcs[node]);
+      }
+      free(snap->node_trcs);
+      free(snap);
+      return err;
+    }
+  }
+  snap->overhead_ns = trc->overhead_ns;
+  snap->snap_of = trc;
+
+  *snap_rtn = snap;
+  return TRC_OK;
+}  /* trc_snapshot */
+
+
+static uint32_t trc_num_registered_threads()
+{
+  uint32_t num_threads = trc_num_threads;
+  return (num_threads >= TRC_MAX_THREADS) ? TRC_MAX_THREADS - 1 : num_threads;
+}  /* trc_num_registered_threads */
+
+
+static void trc_cap_event_fill(trc_cap_event_t *cap_ev, trc_t *ring, trc_event_t *ev, uint64_t ev_num, uint32_t site_id)
+{
+  cap_ev->seq = ev_num;
+  cap_ev->timestamp_ns = (uint64_t)ev->timestamp.tv_sec * 1000000000
+      + (uint64_t)ev->timestamp.tv_usec * 1000;
+  cap_ev->p1 = ev->p1;
+  cap_ev->p2 = ev->p2;
+  cap_ev->site_id = site_id;
+  cap_ev->thread_idx = ev->thread_idx;
+  cap_ev->cpu_id = ev->cpu_id;
+  cap_ev->kind = ev->kind;
+  cap_ev->proc_idx = (ring->shm != NULL) ? ev->proc_idx : 0;
+  cap_ev->span_id = ev->span_id;
+}  /* trc_cap_event_fill */
+
+
+/* A shared ring's process table, and which entry this process is (see
+ * trc_cap.h). Other rings leave num_procs 0. */
+static void trc_cap_procs_fill(trc_t *trc, trc_cap_hdr_t *hdr, trc_cap_proc_t *procs)
+{
+  uint32_t p;
+
+  hdr->num_procs = 0;
+  hdr->threads_proc_idx = 0;
+  if (trc->shm == NULL) { return; }
+  hdr->num_procs = CPRT_VOL32(trc->shm->num_procs);
+  if (hdr->num_procs > TRC_CAP_MAX_PROCS) { hdr->num_procs = TRC_CAP_MAX_PROCS; }
+  hdr->threads_proc_idx = trc->shm_proc_idx;
+  for (p = 0; p < hdr->num_procs; p++) {
+    memset(&procs[p], 0, sizeof(procs[p]));
+    procs[p].pid = trc->shm->procs[p].pid;
+    memcpy(procs[p].proc_name, trc->shm->procs[p].proc_name, sizeof(procs[p].proc_name));
+    procs[p].proc_name[sizeof(procs[p].proc_name) - 1] = '\0';
+  }
+}  /* trc_cap_procs_fill */
+
+
+/* Maps (file_name pointer, line) to dense site ids. Open addressing. */
+struct trc_sitemap_s {
+  uint64_t mask;
+  char **names;
+  uint32_t *lines;
+  uint32_t *ids;       /* 0 = empty slot, else site id + 1. */
+  uint64_t *by_id;     /* Slot of each site id. */
+  uint32_t num_sites;
+  uint64_t strings_size;
+};
+typedef struct trc_sitemap_s trc_sitemap_t;
+
+
+static int trc_sitemap_init(trc_sitemap_t *map, uint64_t max_sites)
+{
+  uint64_t size = 16;
+  while (size < max_sites * 2) { size <<= 1; }
+
+  map->mask = size - 1;
+  map->num_sites = 0;
+  map->strings_size = 0;
+  map->names = (char **)calloc(size, sizeof(char *));
+  map->lines = (uint32_t *)calloc(size, sizeof(uint32_t));
+  map->ids = (uint32_t *)calloc(size, sizeof(uint32_t));
+  map->by_id = (uint64_t *)calloc(size, sizeof(uint64_t));
+  if (map->names == NULL || map->lines == NULL || map->ids == NULL || map->by_id == NULL) {
+    free(map->names);  free(map->lines);  free(map->ids);  free(map->by_id);
+    return TRC_ERR_NO_MEM;
+  }
+  return TRC_OK;
+}  /* trc_sitemap_init */
+
+
+static void trc_sitemap_free(trc_sitemap_t *map)
+{
+  free(map->names);  free(map->lines);  free(map->ids);  free(map->by_id);
+}  /* trc_sitemap_free */
+
+
+/* Look up a site, adding it if new. Never fails: sized for every event. */
+static uint32_t trc_sitemap_id(trc_sitemap_t *map, char *file_name, uint32_t file_line)
+{
+  uint64_t slot = (((uint64_t)(uintptr_t)file_name >> 3) * 0x9E3779B97F4A7C15ull
+      + file_line) & map->mask;
+
+  while (map->ids[slot] != 0) {
+    if (map->names[slot] == file_name && map->lines[slot] == file_line) {
+      return map->ids[slot] - 1;
+    }
+    slot = (slot + 1) & map->mask;
+  }
+  map->names[slot] = file_name;
+  map->lines[slot] = file_line;
+  map->by_id[map->num_sites] = slot;
+  map->ids[slot] = ++map->num_sites;
+  map->strings_size += strlen((file_name != NULL) ? file_name : "") + 1;
+
+  return map->num_sites - 1;
+}  /* trc_sitemap_id */
+
+
+/* Write the ring in the binary capture format (see trc_cap.h). The
+ * events are taken from a trc_snapshot(), so tracing goes on meanwhile. */
+int trc_dump_bin(trc_t *trc, FILE *out_fp)
+{
+  trc_cap_hdr_t hdr;
+  trc_cap_proc_t procs[TRC_CAP_MAX_PROCS];
+  trc_cap_thread_t cap_thread;
+  trc_cap_site_t cap_site;
+  trc_cap_event_t cap_ev;
+  trc_cap_index_t *index;
+  trc_sitemap_t map;
+  struct cprt_timeval wall_tv;
+  struct cprt_timespec mono_ts;
+  trc_iter_t it;
+  trc_t *ring;
+  trc_event_t *ev;
+  uint64_t ev_num;
+  uint64_t num_events = 0;
+  uint64_t event_count = 0;
+  uint64_t num_index, k;
+  uint32_t r, i;
+  uint32_t name_offset = 0;
+  int err = TRC_OK;
+  static const char zeros[8] = { 0 };
+
+  if (trc->snap_of == NULL) {  /* The two passes below must see the same events. */
+    trc_t *snap;
+    err = trc_snapshot(trc, &snap);
+    if (err != TRC_OK) { return err; }
+    err = trc_dump_bin(snap, out_fp);
+    trc_delete(snap);
+    return err;
+  }
+
+  /* Pass 1: count events, collect sites, and build the index. */
+  trc_iter_init(&it, trc);
+  for (r = 0; r < it.num_rings; r++) {
+    num_events += it.end[r] - it.cur[r];
+    event_count += trc_ring_count(it.rings[r]);
+  }
+  num_index = (num_events + TRC_CAP_INDEX_BLOCK - 1) / TRC_CAP_INDEX_BLOCK;
+  index = (trc_cap_index_t *)calloc((size_t)num_index + 1, sizeof(trc_cap_index_t));
+  if (index == NULL) { return TRC_ERR_NO_MEM; }
+  err = trc_sitemap_init(&map, num_events);
+  if (err != TRC_OK) { free(index); return err; }
+  k = 0;
+  while ((ev = trc_iter_next(&it, &ring, &ev_num)) != NULL) {
+    trc_cap_event_fill(&cap_ev, ring, ev, ev_num, trc_sitemap_id(&map, trc_event_file(ring, ev), ev->file_line));
+    if (! (trc->create_flags & TRC_CREATE_FLAG_TIMESTAMP)) { cap_ev.timestamp_ns = 0; }
+    trc_cap_index_add(&index[k / TRC_CAP_INDEX_BLOCK], &cap_ev, (k % TRC_CAP_INDEX_BLOCK) == 0);
+    k++;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TRC_CAP_MAGIC, sizeof(TRC_CAP_MAGIC));
+  hdr.version = TRC_CAP_VERSION;
+  hdr.endian = TRC_CAP_ENDIAN;
+  hdr.hdr_size = sizeof(hdr);
+  hdr.event_size = sizeof(trc_cap_event_t);
+  hdr.create_flags = trc->create_flags;
+  hdr.pid = CPRT_GETPID();
+  hdr.num_threads = trc_num_registered_threads();
+  hdr.num_sites = map.num_sites;
+  hdr.strings_size = (map.strings_size + 7) & ~(uint64_t)7;
+  hdr.num_events = num_events;
+  hdr.event_count = event_count;
+  CPRT_TIMEOFDAY(&wall_tv, NULL);
+  CPRT_GETTIME(&mono_ts);
+  hdr.anchor_wall_ns = (uint64_t)wall_tv.tv_sec * 1000000000 + (uint64_t)wall_tv.tv_usec * 1000;
+  hdr.anchor_mono_ns = (uint64_t)mono_ts.tv_sec * 1000000000 + (uint64_t)mono_ts.tv_nsec;
+  hdr.num_index = num_index;
+  hdr.index_block_size = TRC_CAP_INDEX_BLOCK;
+  hdr.overhead_ns = (uint32_t)trc_overhead_ns(trc);
+  trc_cap_proc_name(hdr.proc_name, sizeof(hdr.proc_name));
+  trc_cap_procs_fill(trc, &hdr, procs);
+  if (fwrite(&hdr, sizeof(hdr), 1, out_fp) != 1) { err = TRC_ERR_IO; }
+  if (err == TRC_OK && hdr.num_procs > 0) {
+    if (fwrite(procs, sizeof(trc_cap_proc_t), hdr.num_procs, out_fp) != hdr.num_procs) { err = TRC_ERR_IO; }
+  }
+
+  for (i = 1; i <= hdr.num_threads && err == TRC_OK; i++) {
+    memset(&cap_thread, 0, sizeof(cap_thread));
+    cap_thread.kernel_tid = trc_threads[i].kernel_tid;
+    memcpy(cap_thread.name, trc_threads[i].name, sizeof(cap_thread.name));
+    cap_thread.name[sizeof(cap_thread.name) - 1] = '\0';
+    if (fwrite(&cap_thread, sizeof(cap_thread), 1, out_fp) != 1) { err = TRC_ERR_IO; }
+  }
+
+  for (i = 0; i < map.num_sites && err == TRC_OK; i++) {
+    char *name = map.names[map.by_id[i]];
+    cap_site.file_line = map.lines[map.by_id[i]];
+    cap_site.name_offset = name_offset;
+    name_offset += (uint32_t)strlen((name != NULL) ? name : "") + 1;
+    if (fwrite(&cap_site, sizeof(cap_site), 1, out_fp) != 1) { err = TRC_ERR_IO; }
+  }
+  for (i = 0; i < map.num_sites && err == TRC_OK; i++) {
+    char *name = map.names[map.by_id[i]];
+    if (name == NULL) { name = ""; }
+    if (fwrite(name, strlen(name) + 1, 1, out_fp) != 1) { err = TRC_ERR_IO; }
+  }
+  if (err == TRC_OK && hdr.strings_size > map.strings_size) {
+    if (fwrite(zeros, (size_t)(hdr.strings_size - map.strings_size), 1, out_fp) != 1) { err = TRC_ERR_IO; }
+  }
+  if (err == TRC_OK && num_index > 0) {
+    if (fwrite(index, sizeof(trc_cap_index_t), (size_t)num_index, out_fp) != num_index) { err = TRC_ERR_IO; }
+  }
+
+  /* Pass 2: the events. */
+  trc_iter_init(&it, trc);
+  while (err == TRC_OK && (ev = trc_iter_next(&it, &ring, &ev_num)) != NULL) {
+    trc_cap_event_fill(&cap_ev, ring, ev, ev_num, trc_sitemap_id(&map, trc_event_file(ring, ev), ev->file_line));
+    if (! (trc->create_flags & TRC_CREATE_FLAG_TIMESTAMP)) { cap_ev.timestamp_ns = 0; }
+    if (fwrite(&cap_ev, sizeof(cap_ev), 1, out_fp) != 1) { err = TRC_ERR_IO; }
+  }
+
+  trc_sitemap_free(&map);
+  free(index);
+
+  return err;
+}  /* trc_dump_bin */
+
+
+/* Write the ring as a compressed archive (see trc_cap.h). */
+int trc_dump_arc(trc_t *trc, FILE *out_fp)
+{
+  trc_arc_t *arc;
+  trc_cap_event_t cap_ev;
+  trc_iter_t it;
+  trc_t *ring;
+  trc_event_t *ev;
+  uint64_t ev_num;
+  uint32_t r;
+  int err;
+
+  err = trc_arc_open(&arc, out_fp, trc->create_flags, (uint32_t)trc_overhead_ns(trc));
+  if (err != TRC_OK) { return err; }
+  trc_suppress_inc(trc);  /* Disable new traces while dumping. */
+
+  trc_iter_init(&it, trc);
+  for (r = 0; r < it.num_rings; r++) {
+    arc->hdr.event_count += trc_ring_count(it.rings[r]);
+  }
+  trc_cap_procs_fill(trc, &arc->hdr, arc->procs);
+  while (err == TRC_OK && (ev = trc_iter_next(&it, &ring, &ev_num)) != NULL) {
+    trc_cap_event_fill(&cap_ev, ring, ev, ev_num, trc_arc_site_id(arc, trc_event_file(ring, ev), ev->file_line));
+    if (! (trc->create_flags & TRC_CREATE_FLAG_TIMESTAMP)) { cap_ev.timestamp_ns = 0; }
+    err = trc_arc_write(arc, &cap_ev);
+  }
+
+  trc_suppress_dec(trc);  /* Re-enable tracing. */
+  return trc_arc_close(arc);
+}  /* trc_dump_arc */
+
+
+/* Append the events recorded since *cursor_io to an archive, as
+ * trc_read_since() does, for long-running capture while tracing goes on.
+ * Events lost to wrap are added to *num_lost_io. */
+int trc_drain_arc(trc_t *trc, trc_arc_t *arc, uint64_t *cursor_io, uint64_t *num_lost_io)
+{
+  trc_event_t buf[64];
+  trc_cap_event_t cap_ev;
+  uint64_t num_lost;
+  uint32_t num_read, i;
+  int err;
+
+  trc_cap_procs_fill(trc, &arc->hdr, arc->procs);  /* Processes may have joined since the last drain. */
+  do {
+    err = trc_read_since(trc, cursor_io, buf, 64, &num_read, &num_lost);
+    if (err != TRC_OK) { return err; }
+    if (num_lost_io != NULL) { *num_lost_io += num_lost; }
+    arc->hdr.event_count += num_read + num_lost;
+    for (i = 0; i < num_read; i++) {
+      trc_cap_event_fill(&cap_ev, trc, &buf[i], buf[i].seq - 1,
+          trc_arc_site_id(arc, trc_event_file(trc, &buf[i]), buf[i].file_line));
+      if (! (trc->create_flags & TRC_CREATE_FLAG_TIMESTAMP)) { cap_ev.timestamp_ns = 0; }
+      err = trc_arc_write(arc, &cap_ev);
+      if (err != TRC_OK) { return err; }
+    }
+  } while (num_read == 64);
+
+  return TRC_OK;
+}  /* trc_drain_arc */
+
+
+/* Write the ring as Chrome trace-event JSON. */
+int trc_dump_chrome(trc_t *trc, FILE *out_fp)
+{
+  trc_chrome_t chrome;
+  trc_cap_event_t cap_ev;
+  trc_iter_t it;
+  trc_t *ring;
+  trc_event_t *ev;
+  uint64_t ev_num;
+  char *file_name;
+  uint32_t pid = CPRT_GETPID();
+  uint32_t num_threads = trc_num_registered_threads();
+  uint32_t i;
+
+  trc_suppress_inc(trc);  /* Disable new traces while dumping. */
+
+  trc_chrome_begin(&chrome, out_fp);
+  if (trc->shm != NULL) {  /* Events carry their process; see trc_chrome_cap_names(). */
+    for (i = 0; i < CPRT_VOL32(trc->shm->num_procs) && i < TRC_SHM_MAX_PROCS; i++) {
+      trc_chrome_process(&chrome, trc->shm->procs[i].pid, trc->shm->procs[i].proc_name);
+    }
+    if (trc->shm_proc_idx >= TRC_SHM_MAX_PROCS) { num_threads = 0; }
+  }
+  for (i = 1; i <= num_threads; i++) {
+    trc_chrome_thread(&chrome, pid, i, trc_threads[i].name);
+  }
+  trc_iter_init(&it, trc);
+  while ((ev = trc_iter_next(&it, &ring, &ev_num)) != NULL) {
+    trc_cap_event_fill(&cap_ev, ring, ev, ev_num, 0);
+    if (! (trc->create_flags & TRC_CREATE_FLAG_TIMESTAMP)) { cap_ev.timestamp_ns = 0; }
+    file_name = trc_event_file(ring, ev);
+    trc_chrome_event(&chrome, (ring->shm != NULL) ? ring->shm->procs[ev->proc_idx % TRC_SHM_MAX_PROCS].pid : pid,
+        &cap_ev, (file_name != NULL) ? file_name : "", ev->file_line);
+  }
+  trc_chrome_end(&chrome);
+
+  trc_suppress_dec(trc);  /* Re-enable tracing. */
+
+  return ferror(out_fp) ? TRC_ERR_IO : TRC_OK;
+}  /* trc_dump_chrome */
+
+
+#if ! defined(_WIN32)
+/* Control thread (trc_control_start()). */
+static trc_t *trc_ctl_trc = NULL;
+static int trc_ctl_listen_fd = -1;
+static int trc_ctl_pipe[2] = { -1, -1 };  /* Self-pipe: SIGUSR2 and stop. */
+static char *trc_ctl_socket_path = NULL;
+static char *trc_ctl_signal_cmd = NULL;
+static uint32_t trc_ctl_frozen = 0;
+static uint32_t trc_ctl_started = 0;
+static struct sigaction trc_ctl_old_sigaction;
+static CPRT_THREAD_T trc_ctl_thread;
+
+
+static void trc_ctl_sig_handler(int sig)
+{
+  int save_errno = errno;
+
+  (void)sig;
+  (void)write(trc_ctl_pipe[1], "s", 1);  /* Non-blocking; a full pipe already has one. */
+  errno = save_errno;
+}  /* trc_ctl_sig_handler */
+
+
+/* Dump a snapshot of the control trc to path. */
+static int trc_ctl_dump(const char *format, const char *path)
+{
+  trc_t *snap;
+  FILE *fp;
+  int err;
+
+  fp = fopen(path, (strcmp(format, "text") == 0) ? "w" : "wb");
+  if (fp == NULL) { return TRC_ERR_IO; }
+  err = trc_snapshot(trc_ctl_trc, &snap);
+  if (err == TRC_OK) {
+    if (strcmp(format, "text") == 0) { err = trc_dump(snap, fp); }
+    else if (strcmp(format, "bin") == 0) { err = trc_dump_bin(snap, fp); }
+    else if (strcmp(format, "arc") == 0) { err = trc_dump_arc(snap, fp); }
+    else { err = trc_dump_chrome(snap, fp); }
+    trc_delete(snap);
+  }
+  if (fclose(fp) != 0 && err == TRC_OK) { err = TRC_ERR_IO; }
+
+  return err;
+}  /* trc_ctl_dump */
+
+
+/* Run one command line. Replies go to out_fp if not NULL; the last line
+ * starts with "ok" or "error". */
+static void trc_ctl_command(char *cmd, FILE *out_fp)
+{
+  trc_t *trc = trc_ctl_trc;
+  char *save_ptr = NULL;
+  char *verb, *arg1, *arg2;
+  uint64_t mask;
+  int err;
+
+  if (out_fp == NULL) {
+    out_fp = fopen("/dev/null", "w");
+    if (out_fp == NULL) { return; }
+    trc_ctl_command(cmd, out_fp);
+    fclose(out_fp);
+    return;
+  }
+
+  verb = CPRT_STRTOK(cmd, " \t\r", &save_ptr);
+  arg1 = (verb != NULL) ? CPRT_STRTOK(NULL, " \t\r", &save_ptr) : NULL;
+  arg2 = (arg1 != NULL) ? CPRT_STRTOK(NULL, " \t\r", &save_ptr) : NULL;
+
+  if (verb == NULL) {
+    fprintf(out_fp, "error: empty command\n");
+  }
+  else if (strcmp(verb, "dump") == 0) {
+    if (arg1 == NULL || arg2 == NULL || (strcmp(arg1, "text") != 0 && strcmp(arg1, "bin") != 0 &&
+        strcmp(arg1, "arc") != 0 && strcmp(arg1, "chrome") != 0)) {
+      fprintf(out_fp, "error: usage: dump text|bin|arc|chrome path\n");
+    }
+    else {
+      err = trc_ctl_dump(arg1, arg2);
+      if (err == TRC_OK) { fprintf(out_fp, "ok dumped %s\n", arg2); }
+      else { fprintf(out_fp, "error: dump to %s failed (err=%d)\n", arg2, err); }
+    }
+  }
+  else if (strcmp(verb, "freeze") == 0) {
+    if (! trc_ctl_frozen) {
+      trc_suppress_inc(trc);
+      trc_ctl_frozen = 1;
+    }
+    fprintf(out_fp, "ok frozen\n");
+  }
+  else if (strcmp(verb, "unfreeze") == 0) {
+    if (trc_ctl_frozen) {
+      trc_suppress_dec(trc);
+      trc_ctl_frozen = 0;
+    }
+    fprintf(out_fp, "ok unfrozen\n");
+  }
+  else if (strcmp(verb, "mask") == 0) {
+    char *end = NULL;
+    if (arg1 != NULL) { mask = strtoull(arg1, &end, 0); }
+    if (arg1 == NULL || end == arg1 || *end != '\0' || mask > 0xffffffff) {
+      fprintf(out_fp, "error: usage: mask kind_mask (bit per TRC_KIND_*)\n");
+    }
+    else {
+      (void)trc_set_kind_mask(trc, (uint32_t)mask);
+      fprintf(out_fp, "ok mask=0x%"PRIx32"\n", (uint32_t)mask);
+    }
+  }
+  else if (strcmp(verb, "stats") == 0) {
+    uint64_t event_count = 0;
+    uint32_t node;
+    if (trc->num_nodes > 1) {
+      for (node = 0; node < trc->num_nodes; node++) {
+        event_count += trc_ring_count(trc->node_trcs[node]);
+      }
+    }
+    else {
+      event_count = trc_ring_count(trc);
+    }
+    fprintf(out_fp, "event_count=%"PRIu64", num_entries=%"PRIu64", num_nodes=%"PRIu32
+        ", frozen=%"PRIu32", suppress_cnt=%"PRIu32", kind_mask=0x%"PRIx32
+        ", overhead_ns=%"PRIu64", num_threads=%"PRIu32"\n",
+        event_count, (uint64_t)trc->num_entries, trc->num_nodes, trc_ctl_frozen,
+        (uint32_t)trc->suppress_cnt, ~trc->kinds_off, trc->overhead_ns, trc_num_registered_threads());
+    fprintf(out_fp, "ok\n");
+  }
+  else {
+    fprintf(out_fp, "error: unknown command '%s' (dump, freeze, unfreeze, mask, stats)\n", verb);
+  }
+  fflush(out_fp);
+}  /* trc_ctl_command */
+
+
+/* Run each complete line the client sent. Returns 0 when it hangs up. */
+static int trc_ctl_client_read(int client_fd, char *buf, size_t buf_sz, size_t *len_io)
+{
+  FILE *out_fp;
+  char *line, *nl;
+  ssize_t n;
+
+  n = read(client_fd, buf + *len_io, buf_sz - 1 - *len_io);
+  if (n <= 0) { return 0; }
+  *len_io += (size_t)n;
+  buf[*len_io] = '\0';
+
+  line = buf;
+  while ((nl = strchr(line, '\n')) != NULL) {
+    *nl = '\0';
+    out_fp = fdopen(dup(client_fd), "w");
+    if (out_fp == NULL) { return 0; }
+    trc_ctl_command(line, out_fp);
+    fclose(out_fp);
+    line = nl + 1;
+  }
+  *len_io -= (size_t)(line - buf);
+  memmove(buf, line, *len_io);
+  if (*len_io >= buf_sz - 1) { return 0; }  /* Line too long. */
+
+  return 1;
+}  /* trc_ctl_client_read */
+
+
+static CPRT_THREAD_ENTRYPOINT trc_ctl_main(void *in_arg)
+{
+  struct pollfd fds[3];
+  char buf[1024];
+  char cmd[1024];
+  size_t len = 0;
+  int client_fd = -1;
+  int nfds;
+  char c;
+
+  (void)in_arg;
+  (void)trc_set_thread_name("trc_control");
+
+  for (;;) {
+    fds[0].fd = trc_ctl_pipe[0];
+    fds[0].events = POLLIN;
+    nfds = 1;
+    if (trc_ctl_listen_fd != -1) {
+      fds[nfds].fd = (client_fd == -1) ? trc_ctl_listen_fd : client_fd;  /* One client at a time. */
+      fds[nfds].events = POLLIN;
+      nfds++;
+    }
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      if (read(trc_ctl_pipe[0], &c, 1) == 1) {
+        if (c == 'q') { break; }
+        if (trc_ctl_signal_cmd != NULL) {
+          CPRT_SNPRINTF(cmd, sizeof(cmd), "%s", trc_ctl_signal_cmd);
+          trc_ctl_command(cmd, NULL);
+        }
+      }
+    }
+    if (nfds > 1 && fds[1].revents != 0) {
+      if (client_fd == -1) {
+        client_fd = accept(trc_ctl_listen_fd, NULL, NULL);
+        len = 0;
+      }
+      else if (! trc_ctl_client_read(client_fd, buf, sizeof(buf), &len)) {
+        close(client_fd);
+        client_fd = -1;
+      }
+    }
+  }
+
+  if (client_fd != -1) { close(client_fd); }
+  return 0;
+}  /* trc_ctl_main */
+#endif
+
+
+/* Serve dump/freeze/unfreeze/mask/stats commands for trc on a thread of
+ * its own: from clients of a Unix domain socket at socket_path (see
+ * trc_control_send() and trc_ctl), and on SIGUSR2, which runs signal_cmd
+ * (e.g. "dump bin /tmp/app.trc"). Either may be NULL, not both. Dumps
+ * are of a trc_snapshot(), so traced threads never wait. */
+int trc_control_start(trc_t *trc, const char *socket_path, const char *signal_cmd)
+{
+#if defined(_WIN32)
+  (void)trc;  (void)socket_path;  (void)signal_cmd;
+  return TRC_ERR_BAD_PARM;  /* POSIX only. */
+#else
+  struct sockaddr_un addr;
+  struct sigaction sa;
+
+  if (trc == NULL || (socket_path == NULL && signal_cmd == NULL) || trc_ctl_started) { return TRC_ERR_BAD_PARM; }
+  if (socket_path != NULL && strlen(socket_path) >= sizeof(addr.sun_path)) { return TRC_ERR_BAD_PARM; }
+
+  if (pipe(trc_ctl_pipe) != 0) { return TRC_ERR_IO; }
+  (void)fcntl(trc_ctl_pipe[1], F_SETFL, O_NONBLOCK);
+  trc_ctl_trc = trc;
+  trc_ctl_frozen = 0;
+
+  if (socket_path != NULL) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    (void)unlink(socket_path);  /* Left over from a previous run. */
+    trc_ctl_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    /* "dump" writes files as this process, so only its user may connect.
+     * Restricted before listen(), so no one can connect in between. */
+    if (trc_ctl_listen_fd == -1 || bind(trc_ctl_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(socket_path, 0600) != 0 || listen(trc_ctl_listen_fd, 4) != 0) {
+      if (trc_ctl_listen_fd != -1) { close(trc_ctl_listen_fd);  (void)unlink(socket_path); }
+      trc_ctl_listen_fd = -1;
+      close(trc_ctl_pipe[0]);  close(trc_ctl_pipe[1]);
+      return TRC_ERR_IO;
+    }
+    trc_ctl_socket_path = CPRT_STRDUP(socket_path);
+  }
+
+  if (signal_cmd != NULL) {
+    trc_ctl_signal_cmd = CPRT_STRDUP(signal_cmd);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trc_ctl_sig_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    (void)sigaction(SIGUSR2, &sa, &trc_ctl_old_sigaction);
+  }
+
+  trc_ctl_started = 1;
+  CPRT_THREAD_CREATE(trc_ctl_thread, trc_ctl_main, NULL);
+
+  return TRC_OK;
+#endif
+}  /* trc_control_start */
+
+
+/* Stop the control thread, remove its socket and undo a "freeze". */
+int trc_control_stop()
+{
+#if defined(_WIN32)
+  return TRC_OK;
+#else
+  if (! trc_ctl_started) { return TRC_OK; }
+
+  if (trc_ctl_signal_cmd != NULL) {
+    (void)sigaction(SIGUSR2, &trc_ctl_old_sigaction, NULL);
+  }
+  while (write(trc_ctl_pipe[1], "q", 1) != 1) {
+    CPRT_SLEEP_MS(1);  /* Full of signals; the thread is draining it. */
+  }
+  CPRT_THREAD_JOIN(trc_ctl_thread);
+
+  if (trc_ctl_listen_fd != -1) {
+    close(trc_ctl_listen_fd);
+    trc_ctl_listen_fd = -1;
+  }
+  if (trc_ctl_socket_path != NULL) {
+    (void)unlink(trc_ctl_socket_path);
+    free(trc_ctl_socket_path);
+    trc_ctl_socket_path = NULL;
+  }
+  free(trc_ctl_signal_cmd);
+  trc_ctl_signal_cmd = NULL;
+  close(trc_ctl_pipe[0]);  close(trc_ctl_pipe[1]);
+  if (trc_ctl_frozen) {
+    trc_suppress_dec(trc_ctl_trc);
+    trc_ctl_frozen = 0;
+  }
+  trc_ctl_trc = NULL;
+  trc_ctl_started = 0;
+
+  return TRC_OK;
+#endif
+}  /* trc_control_stop */
+
+
+/* Send one command to a trc_control_start() socket and copy the reply to
+ * out_fp (if not NULL). Returns TRC_OK if the reply was "ok". */
+int trc_control_send(const char *socket_path, const char *cmd, FILE *out_fp)
+{
+#if defined(_WIN32)
+  (void)socket_path;  (void)cmd;  (void)out_fp;
+  return TRC_ERR_BAD_PARM;  /* POSIX only. */
+#else
+  struct sockaddr_un addr;
+  char line[1024];
+  FILE *in_fp;
+  int fd;
+  int err = TRC_ERR_IO;
+
+  if (socket_path == NULL || cmd == NULL || strlen(socket_path) >= sizeof(addr.sun_path) ||
+      strchr(cmd, '\n') != NULL) {
+    return TRC_ERR_BAD_PARM;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) { return TRC_ERR_IO; }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      write(fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd) || write(fd, "\n", 1) != 1) {
+    close(fd);
+    return TRC_ERR_IO;
+  }
+
+  in_fp = fdopen(fd, "r");
+  if (in_fp == NULL) { close(fd); return TRC_ERR_IO; }
+  while (fgets(line, sizeof(line), in_fp) != NULL) {
+    if (out_fp != NULL) { fputs(line, out_fp); }
+    if (strncmp(line, "ok", 2) == 0) { err = TRC_OK;  break; }
+    if (strncmp(line, "error", 5) == 0) { err = TRC_ERR_BAD_PARM;  break; }
+  }
+  fclose(in_fp);
+
+  return err;
+#endif
+}  /* trc_control_send */
@@ -25,46 +25,328 @@ extern "C" {
 
 
 struct trc_event_s {
-  uint64_t thread_id;
   uint64_t p1;  /* Application-specific parameter. */
   uint64_t p2;  /* Application-specific parameter. */
-  uint64_t file_line;
   char     *file_name;
+  uint32_t file_line;
+  uint16_t thread_idx;  /* Index into trc_threads[]; 0 if not recorded. */
+  uint16_t cpu_id;      /* TRC_CREATE_FLAG_CPU_ID. */
   struct cprt_timeval timestamp;
+  uint16_t kind;        /* TRC_KIND_*. */
+  uint16_t proc_idx;    /* Shared rings: file_name is NULL and these name */
+  uint32_t site_id;     /*   the site in the segment's per-process tables. */
+  uint32_t span_id;     /* Pairs TRC_KIND_SPAN_BEGIN with its SPAN_END; flow id. */
+  uint64_t seq;         /* Event number + 1, written last. */
 };
 typedef struct trc_event_s trc_event_t;
 
+/* Event kinds. */
+#define TRC_KIND_TRACE      0
+#define TRC_KIND_SPAN_BEGIN 1
+#define TRC_KIND_SPAN_END   2  /* p2 is the span duration in nanoseconds. */
+#define TRC_KIND_GAUGE      3  /* file_name is the gauge name, p1 its value. */
+/* Flow events carry a flow id in span_id, linking one request's events
+ * across threads (TRC_FLOW_BEGIN/STEP/END). */
+#define TRC_KIND_FLOW_BEGIN 4
+#define TRC_KIND_FLOW_STEP  5
+#define TRC_KIND_FLOW_END   6
+/* trc_thread_create() threads; span_id is the thread index. */
+#define TRC_KIND_THREAD_START 7
+#define TRC_KIND_THREAD_EXIT  8
+#define TRC_THREAD_EXIT_NO_RTN 0xffffffffffffffffull  /* Exit p1 without a return value. */
+#define TRC_THREAD_START_AFFINITY_FAILED 0xffffffffffffffffull  /* Start p2, affinity failed without errno. */
+
+
+/* Process-wide thread registry. A thread gets the next small index on its
+ * first trace (or trc_set_thread_name() call, or at start under
+ * TRC_THREAD_CREATE). Once all are handed out, indexes of exited
+ * TRC_THREAD_CREATE threads are reused. Index 0 is never assigned;
+ * TRC_THREAD_IDX_OVERFLOW is shared by threads beyond TRC_MAX_THREADS. */
+#define TRC_MAX_THREADS 1024
+#define TRC_THREAD_IDX_OVERFLOW 0xffff
+#define TRC_THREAD_NAME_LEN 16  /* Includes null; same as Linux. */
+struct trc_thread_s {
+  uint64_t kernel_tid;
+  char name[TRC_THREAD_NAME_LEN];
+};
+typedef struct trc_thread_s trc_thread_t;
+
+extern trc_thread_t trc_threads[TRC_MAX_THREADS];
+extern uint32_t trc_num_threads;  /* Highest index handed out so far. */
+
 
 #define TRC_CREATE_FLAG_NO_OVERRIDE 0x0000000000000001
 #define TRC_CREATE_FLAG_ATOMIC_INC  0x0000000000000002
 #define TRC_CREATE_FLAG_TIMESTAMP   0x0000000000000004
 #define TRC_CREATE_FLAG_THREAD_ID   0x0000000000000008
+/* Event array allocation options (Linux; elsewhere they fall back to malloc).
+ * After trc_create(), trc->alloc_flags reports which ones succeeded. */
+#define TRC_CREATE_FLAG_HUGE_2M     0x0000000000000010  /* MAP_HUGETLB, 2MB pages. */
+#define TRC_CREATE_FLAG_HUGE_1G     0x0000000000000020  /* MAP_HUGETLB, 1GB pages. */
+#define TRC_CREATE_FLAG_PREFAULT    0x0000000000000040  /* MAP_POPULATE + touch every page. */
+#define TRC_CREATE_FLAG_MLOCK       0x0000000000000080  /* Lock event array in RAM. */
+/* One ring per NUMA node, each writer tracing into its local node's ring. */
+#define TRC_CREATE_FLAG_NUMA        0x0000000000000100
+#define TRC_CREATE_FLAG_CPU_ID      0x0000000000000200
+/* Capture the top TRC_MAX_CALLERS return addresses into a side ring;
+ * symbolized at dump time. Needs frame pointers beyond the first. */
+#define TRC_CREATE_FLAG_CALLERS     0x0000000000000400
+#define TRC_MAX_CALLERS 4
+/* Feed span durations into the span site's latency histogram. */
+#define TRC_CREATE_FLAG_SPAN_HIST   0x0000000000000800
 struct trc_s {
-  uint32_t num_entries;   /* Allocated size of event array. */
-  uint32_t event_count;   /* Number of events that have happened so far. */
+  uint64_t num_entries;   /* Allocated size of event array. */
+  uint64_t event_count;   /* Number of events that have happened so far. */
   uint32_t create_flags;
   uint32_t suppress_cnt;  /* If > 0, prevents trace. */
   trc_event_t *events;
+  uint32_t alloc_flags;   /* Allocation create_flags that actually succeeded. */
+  int events_mmapped;     /* Non-zero if events came from mmap(), not malloc(). */
+  size_t events_size;     /* Bytes allocated for events (rounded to page size). */
+  int numa_node;          /* Node this ring's memory is bound to, or -1. */
+  uint32_t num_nodes;     /* If > 1, events are in node_trcs[], not here. */
+  struct trc_s **node_trcs;  /* Per-node rings (TRC_CREATE_FLAG_NUMA). */
+  void **callers;         /* TRC_MAX_CALLERS per event (TRC_CREATE_FLAG_CALLERS). */
+  struct trc_shm_s *shm;  /* Shared segment (trc_create_shared(), or a snapshot's source), or NULL. */
+  uint32_t shm_proc_idx;  /* This process's slot in shm->procs[]. */
+  struct trc_shm_cache_s *shm_cache;  /* Process-local (file_name, line) -> site id. */
+  uint64_t overhead_ns;   /* Cost of one trace, measured by trc_create(); 0 if unknown. */
+  uint32_t kinds_off;     /* Bit per TRC_KIND_* not recorded (trc_set_kind_mask()). */
+  struct trc_s *snap_of;  /* Snapshots (trc_snapshot()): the trc copied. */
+  uint64_t snap_first;    /* Snapshots: oldest event copied intact. */
 };
 typedef struct trc_s trc_t;
 
 
+/* Cross-process ring (trc_create_shared()). A POSIX shm segment ("/name")
+ * or a regular file (any other path) holds this header followed by the
+ * event array. Writers in every attached process
+ * claim slots with an atomic increment of shm->event_count. A file_name
+ * pointer means nothing in another process, so each process registers its
+ * sites in its own table in the segment and events carry (proc_idx,
+ * site_id) instead. */
+#define TRC_SHM_MAGIC 0x53435254  /* "TRCS" */
+#define TRC_SHM_VERSION 3
+#define TRC_SHM_MAX_PROCS 16
+#define TRC_SHM_MAX_SITES 256     /* Per process. */
+#define TRC_SHM_FILE_LEN 56       /* Includes null; longer names keep their tail. */
+#define TRC_SHM_SITE_OVERFLOW 0xffffffff
+struct trc_shm_site_s {
+  uint32_t file_line;
+  uint32_t reserved;
+  char file_name[TRC_SHM_FILE_LEN];
+};
+typedef struct trc_shm_site_s trc_shm_site_t;
+
+struct trc_shm_proc_s {
+  uint32_t pid;
+  uint32_t num_sites;
+  char proc_name[32];
+  trc_shm_site_t sites[TRC_SHM_MAX_SITES];
+};
+typedef struct trc_shm_proc_s trc_shm_proc_t;
+
+struct trc_shm_s {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t create_flags;
+  uint32_t num_procs;
+  uint32_t ready;          /* Set by the creator once the header is valid. */
+  uint32_t reserved;
+  uint64_t num_entries;
+  uint64_t event_count;
+  uint64_t events_offset;  /* From the start of the segment. */
+  uint64_t size;
+  trc_shm_proc_t procs[TRC_SHM_MAX_PROCS];
+};
+typedef struct trc_shm_s trc_shm_t;
+
+
+/* Log-linear latency histogram: values below 2^TRC_HIST_SUB_BITS get their
+ * own bucket, above that each power of 2 is split into 2^TRC_HIST_SUB_BITS
+ * linear sub-buckets (about 6% precision). Updated with atomic adds only. */
+#define TRC_HIST_SUB_BITS 4
+#define TRC_HIST_BUCKETS ((64 - TRC_HIST_SUB_BITS + 1) << TRC_HIST_SUB_BITS)
+struct trc_hist_s {
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[TRC_HIST_BUCKETS];
+};
+typedef struct trc_hist_s trc_hist_t;
+
+/* One per TRC_SPAN_BEGIN call site (a static), registered on first use. */
+struct trc_span_site_s {
+  char *file_name;
+  uint32_t file_line;
+  uint64_t registered;
+  struct trc_span_site_s *next;
+  trc_hist_t hist;
+};
+typedef struct trc_span_site_s trc_span_site_t;
+#define TRC_SPAN_SITE_INIT(_file, _line) { (char *)(_file), (_line), 0, NULL, { 0, 0, { 0 } } }
+
+/* A span in progress; normally a local variable of the instrumented code. */
+struct trc_span_s {
+  trc_t *trc;
+  trc_span_site_t *site;
+  uint64_t start_ns;
+  uint32_t span_id;
+};
+typedef struct trc_span_s trc_span_t;
+
+#define TRC_SPAN_BEGIN(_trc, _span, _p1, _p2) do { \
+  static trc_span_site_t trc_span_site_ = TRC_SPAN_SITE_INIT(__FILE__, __LINE__); \
+  trc_span_begin((_trc), &(_span), &trc_span_site_, (_p1), (_p2)); \
+} while (0)
+/* The END event's p2 is the duration, so only p1 is application-supplied. */
+#define TRC_SPAN_END(_span, _p1) trc_span_end(&(_span), __FILE__, __LINE__, (_p1))
+
+
+#define TRC_FLOW_BEGIN(_trc, _flow_id, _p1, _p2) \
+  trc_flow((_trc), TRC_KIND_FLOW_BEGIN, (_flow_id), __FILE__, __LINE__, (_p1), (_p2))
+#define TRC_FLOW_STEP(_trc, _flow_id, _p1, _p2) \
+  trc_flow((_trc), TRC_KIND_FLOW_STEP, (_flow_id), __FILE__, __LINE__, (_p1), (_p2))
+#define TRC_FLOW_END(_trc, _flow_id, _p1, _p2) \
+  trc_flow((_trc), TRC_KIND_FLOW_END, (_flow_id), __FILE__, __LINE__, (_p1), (_p2))
+
+
+/* CPRT_THREAD_CREATE() with tracing set up before entry runs. */
+typedef CPRT_THREAD_ENTRYPOINT (*trc_thread_entry_t)(void *arg);
+#define TRC_THREAD_CREATE(_thread, _trc, _name, _cpuset, _entry, _arg) \
+  trc_thread_create(&(_thread), (_trc), (_name), (_cpuset), (_entry), (_arg), __FILE__, __LINE__)
+
+
+/* Counter-only site (TRC_COUNT): writes no ring entries, only hit counts
+ * and p1/p2 statistics. Threads 1..TRC_COUNT_SHARDS each own a shard and
+ * update it with plain stores; later threads share the other
+ * TRC_COUNT_SHARDS shards by (thread_idx % TRC_COUNT_SHARDS) and update
+ * them atomically. Every shard is a cache line of its own; a report
+ * merges the shards. Minimums are kept inverted so a zeroed shard means
+ * "none yet". */
+#define TRC_COUNT_SHARDS 16
+struct CPRT_CACHE_ALIGNED trc_count_shard_s {
+  uint64_t hits;
+  uint64_t p1_sum;
+  uint64_t p1_min_inv;  /* ~min */
+  uint64_t p1_max;
+  uint64_t p2_sum;
+  uint64_t p2_min_inv;  /* ~min */
+  uint64_t p2_max;
+  uint64_t last_ns;     /* Wall clock; 0 without TRC_CREATE_FLAG_TIMESTAMP. */
+};
+typedef struct trc_count_shard_s trc_count_shard_t;
+
+struct CPRT_CACHE_ALIGNED trc_count_site_s {
+  char *file_name;
+  uint32_t file_line;
+  uint64_t registered;
+  trc_t *trc;  /* First trc counted into; trc_dump() reports the site. */
+  struct trc_count_site_s *next;
+  trc_count_shard_t shards[2 * TRC_COUNT_SHARDS];  /* Owned, then shared; padded to a line. */
+};
+typedef struct trc_count_site_s trc_count_site_t;
+#define TRC_COUNT_SITE_INIT(_file, _line) { (char *)(_file), (_line), 0, NULL, NULL, { { 0 } } }
+
+/* Merged shards. */
+struct trc_count_totals_s {
+  uint64_t hits;
+  uint64_t p1_sum;
+  uint64_t p1_min;
+  uint64_t p1_max;
+  uint64_t p2_sum;
+  uint64_t p2_min;
+  uint64_t p2_max;
+  uint64_t last_ns;
+};
+typedef struct trc_count_totals_s trc_count_totals_t;
+
+/* Gauges: one sampler thread calls each registered callback every
+ * period_ms and records the value as a TRC_KIND_GAUGE event. */
+#define TRC_MAX_GAUGES 64
+typedef uint64_t (*trc_gauge_cb_t)(void *cb_arg);
+
+#define TRC_COUNT(_trc, _p1, _p2) do { \
+  static trc_count_site_t trc_count_site_ = TRC_COUNT_SITE_INIT(__FILE__, __LINE__); \
+  trc_count((_trc), &trc_count_site_, (_p1), (_p2)); \
+} while (0)
+
+
 /* Return codes. */
 #define TRC_OK 0
 #define TRC_ERR_BAD_PARM -1
 #define TRC_ERR_NO_MEM   -2
+#define TRC_ERR_IO       -3
 
 
 int trc_create(trc_t **trc_rtn, uint64_t num_entries, uint32_t create_flags);
 int trc_delete(trc_t *trc);
 int trc_trace(trc_t *trc, char *file_name, uint64_t file_line, uint64_t p1, uint64_t p2);
+uint64_t trc_overhead_ns(trc_t *trc);
 void trc_suppress_inc(trc_t *trc);
 void trc_suppress_dec(trc_t *trc);
+int trc_set_kind_mask(trc_t *trc, uint32_t kind_mask);
+int trc_snapshot(trc_t *trc, trc_t **snap_rtn);
 int trc_dump(trc_t *trc, FILE *out_fp);
+uint16_t trc_thread_idx();
+int trc_set_thread_name(const char *name);
+int trc_span_begin(trc_t *trc, trc_span_t *span, trc_span_site_t *site, uint64_t p1, uint64_t p2);
+int trc_span_end(trc_span_t *span, char *file_name, uint64_t file_line, uint64_t p1);
+int trc_contention_attach(trc_t *trc);
+int trc_thread_create(CPRT_THREAD_T *thread_rtn, trc_t *trc, const char *name, const cprt_cpuset_t *cpuset,
+    trc_thread_entry_t entry, void *arg, char *file_name, uint64_t file_line);
+extern const char *trc_flow_kind_names[3];  /* "begin", "step", "end". */
+uint32_t trc_flow_new();
+int trc_flow(trc_t *trc, uint32_t kind, uint32_t flow_id, char *file_name, uint64_t file_line,
+    uint64_t p1, uint64_t p2);
+void trc_hist_record(trc_hist_t *hist, uint64_t value);
+uint64_t trc_hist_percentile(trc_hist_t *hist, double percentile);
+int trc_histograms_dump(FILE *out_fp);
+int trc_dump_bin(trc_t *trc, FILE *out_fp);
+int trc_dump_chrome(trc_t *trc, FILE *out_fp);
+int trc_dump_arc(trc_t *trc, FILE *out_fp);
+struct trc_arc_s;
+int trc_drain_arc(trc_t *trc, struct trc_arc_s *arc, uint64_t *cursor_io, uint64_t *num_lost_io);
+int trc_create_shared(trc_t **trc_rtn, const char *name, uint64_t num_entries, uint32_t create_flags);
+int trc_attach_shared(trc_t **trc_rtn, const char *name);
+int trc_unlink_shared(const char *name);
+int trc_tail(trc_t *trc, uint64_t *next_io, FILE *out_fp, uint64_t *num_missed_io, uint16_t *last_cpu_io);
+int trc_read_since(trc_t *trc, uint64_t *cursor_io, trc_event_t *buf, uint32_t max_events,
+    uint32_t *num_read_rtn, uint64_t *num_lost_rtn);
+char *trc_event_file(trc_t *trc, trc_event_t *ev);
+int trc_count(trc_t *trc, trc_count_site_t *site, uint64_t p1, uint64_t p2);
+void trc_count_totals(trc_count_site_t *site, trc_count_totals_t *totals_rtn);
+int trc_counters_dump(FILE *out_fp);
+int trc_gauge_register(trc_t *trc, const char *name, trc_gauge_cb_t cb, void *cb_arg, uint32_t period_ms);
+int trc_gauge_set_affinity(uint64_t cpu_mask);
+int trc_gauge_set_cpuset(const cprt_cpuset_t *cpuset);
+int trc_gauges_stop();
+int trc_control_start(trc_t *trc, const char *socket_path, const char *signal_cmd);
+int trc_control_stop();
+int trc_control_send(const char *socket_path, const char *cmd, FILE *out_fp);
 
 
 #ifdef __cplusplus
 }
+
+/* Scoped span for C++: begins at declaration, ends when it goes out of scope. */
+class trc_span_guard {
+ public:
+  trc_span_guard(trc_t *trc, trc_span_site_t *site, uint64_t p1, uint64_t p2) {
+    trc_span_begin(trc, &span_, site, p1, p2);
+  }
+  ~trc_span_guard() {
+    trc_span_end(&span_, span_.site->file_name, span_.site->file_line, 0);
+  }
+ private:
+  trc_span_t span_;
+  trc_span_guard(const trc_span_guard &);
+  trc_span_guard &operator=(const trc_span_guard &);
+};
+#define TRC_CAT2(_a, _b) _a##_b
+#define TRC_CAT(_a, _b) TRC_CAT2(_a, _b)
+#define TRC_SPAN_SCOPED(_trc, _p1, _p2) \
+  static trc_span_site_t TRC_CAT(trc_span_site_, __LINE__) = TRC_SPAN_SITE_INIT(__FILE__, __LINE__); \
+  trc_span_guard TRC_CAT(trc_span_guard_, __LINE__)((_trc), &TRC_CAT(trc_span_site_, __LINE__), (_p1), (_p2))
 #endif
 
 #endif  /* TRC_H */
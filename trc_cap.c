@@ -0,0 +1,1101 @@
+/* trc_cap.c - binary trace capture readers and exporters.
+ * See https://github.com/fordsfords/trc
+ * This tries to be portable between Mac, Linux, and Windows.
+ */
+/*
+# This code and its documentation is Copyright 2023 Steven Ford
+# and licensed "public domain" style under Creative Commons "CC0":
+#   http://creativecommons.org/publicdomain/zero/1.0/
+# To the extent possible under law, the contributors to this project have
+# waived all copyright and related or neighboring rights to this work.
+# In other words, you can use this code for any purpose without any
+# restrictions.  This work is published from: United States.  The project home
+# is https://github.com/fordsfords/trc
+*/
+
+#if ! defined(_WIN32)
+/* Unix */
+#define _GNU_SOURCE
+#endif
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if ! defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "trc.h"
+#include "trc_cap.h"
+
+
+uint64_t trc_cap_events_offset(const trc_cap_hdr_t *hdr)
+{
+  return (uint64_t)hdr->hdr_size
+      + (uint64_t)hdr->num_procs * sizeof(trc_cap_proc_t)
+      + (uint64_t)hdr->num_threads * sizeof(trc_cap_thread_t)
+      + (uint64_t)hdr->num_sites * sizeof(trc_cap_site_t)
+      + hdr->strings_size
+      + hdr->num_index * sizeof(trc_cap_index_t);
+}  /* trc_cap_events_offset */
+
+
+/* Short name of the running program, for the capture header. */
+void trc_cap_proc_name(char *buf, size_t buf_sz)
+{
+#if defined(__linux__)
+  FILE *fp;
+  buf[0] = '\0';
+  fp = fopen("/proc/self/comm", "r");
+  if (fp != NULL) {
+    if (fgets(buf, (int)buf_sz, fp) != NULL) {
+      buf[strcspn(buf, "\n")] = '\0';
+    }
+    fclose(fp);
+  }
+#elif defined(__APPLE__)
+  strncpy(buf, getprogname(), buf_sz);
+#else
+  buf[0] = '\0';
+#endif
+  buf[buf_sz - 1] = '\0';
+}  /* trc_cap_proc_name */
+
+
+/* Process, thread, site and string tables, from the current file position. */
+static int trc_cap_load_tables(trc_cap_t *cap)
+{
+  size_t size;
+
+  /* Tables are small compared to the events; load them. */
+  if (cap->hdr.num_procs > TRC_CAP_MAX_PROCS) { return TRC_CAP_ERR_FORMAT; }
+  cap->procs = (trc_cap_proc_t *)calloc(cap->hdr.num_procs + 1, sizeof(trc_cap_proc_t));
+  cap->threads = (trc_cap_thread_t *)calloc(cap->hdr.num_threads + 1, sizeof(trc_cap_thread_t));
+  cap->sites = (trc_cap_site_t *)calloc(cap->hdr.num_sites + 1, sizeof(trc_cap_site_t));
+  cap->strings = (char *)calloc((size_t)cap->hdr.strings_size + 1, 1);
+  if (cap->procs == NULL || cap->threads == NULL || cap->sites == NULL || cap->strings == NULL) {
+    return TRC_ERR_NO_MEM;
+  }
+  size = fread(cap->procs, sizeof(trc_cap_proc_t), cap->hdr.num_procs, cap->fp);
+  if (size != cap->hdr.num_procs) { return TRC_CAP_ERR_FORMAT; }
+  size = fread(cap->threads, sizeof(trc_cap_thread_t), cap->hdr.num_threads, cap->fp);
+  if (size != cap->hdr.num_threads) { return TRC_CAP_ERR_FORMAT; }
+  size = fread(cap->sites, sizeof(trc_cap_site_t), cap->hdr.num_sites, cap->fp);
+  if (size != cap->hdr.num_sites) { return TRC_CAP_ERR_FORMAT; }
+  size = fread(cap->strings, 1, (size_t)cap->hdr.strings_size, cap->fp);
+  if (size != cap->hdr.strings_size) { return TRC_CAP_ERR_FORMAT; }
+
+  return TRC_OK;
+}  /* trc_cap_load_tables */
+
+
+/* Worst case for one block's columns: 10-byte varints, and 2 per event
+ * for runs. */
+#define TRC_ARC_MAX_DATA (TRC_ARC_NUM_COLS * (TRC_ARC_BLOCK_EVENTS * 20 + 10))
+
+
+/* The header at the start of an archive was written before its counts
+ * were known; the real one is in the trailer. */
+static int trc_arc_load(trc_cap_t *cap)
+{
+  trc_arc_footer_t footer;
+  size_t size;
+  int err;
+
+  if (cap->hdr.endian != TRC_CAP_ENDIAN || cap->hdr.version != TRC_ARC_VERSION) {
+    return TRC_CAP_ERR_FORMAT;
+  }
+  if (fseek(cap->fp, -(long)sizeof(footer), SEEK_END) != 0 ||
+      fread(&footer, sizeof(footer), 1, cap->fp) != 1 ||
+      memcmp(footer.magic, TRC_ARC_MAGIC, sizeof(TRC_ARC_MAGIC)) != 0) {
+    return TRC_CAP_ERR_FORMAT;  /* Not closed. */
+  }
+  fseek(cap->fp, (long)footer.trailer_offset, SEEK_SET);
+  if (fread(&cap->hdr, sizeof(cap->hdr), 1, cap->fp) != 1 ||
+      memcmp(cap->hdr.magic, TRC_ARC_MAGIC, sizeof(TRC_ARC_MAGIC)) != 0 ||
+      cap->hdr.hdr_size < sizeof(cap->hdr) ||
+      cap->hdr.event_size != sizeof(trc_cap_event_t)) {
+    return TRC_CAP_ERR_FORMAT;
+  }
+  fseek(cap->fp, (long)(footer.trailer_offset + cap->hdr.hdr_size), SEEK_SET);
+  err = trc_cap_load_tables(cap);
+  if (err != TRC_OK) { return err; }
+
+  cap->blocks = (trc_arc_block_t *)calloc((size_t)cap->hdr.num_index + 1, sizeof(trc_arc_block_t));
+  cap->block_events = (trc_cap_event_t *)malloc(TRC_ARC_BLOCK_EVENTS * sizeof(trc_cap_event_t));
+  cap->block_data = (uint8_t *)malloc(TRC_ARC_MAX_DATA);
+  if (cap->blocks == NULL || cap->block_events == NULL || cap->block_data == NULL) {
+    return TRC_ERR_NO_MEM;
+  }
+  size = fread(cap->blocks, sizeof(trc_arc_block_t), (size_t)cap->hdr.num_index, cap->fp);
+  if (size != cap->hdr.num_index) { return TRC_CAP_ERR_FORMAT; }
+  cap->is_arc = 1;
+
+  return TRC_OK;
+}  /* trc_arc_load */
+
+
+/* Opens a capture or an archive. */
+int trc_cap_open(trc_cap_t **cap_rtn, const char *path)
+{
+  trc_cap_t *cap;
+  int err;
+
+  cap = (trc_cap_t *)calloc(1, sizeof(trc_cap_t));
+  if (cap == NULL) { return TRC_ERR_NO_MEM; }
+
+  cap->fp = fopen(path, "rb");
+  if (cap->fp == NULL) { free(cap); return TRC_ERR_IO; }
+
+  if (fread(&cap->hdr, sizeof(cap->hdr), 1, cap->fp) != 1) {
+    trc_cap_close(cap);
+    return TRC_CAP_ERR_FORMAT;
+  }
+  if (memcmp(cap->hdr.magic, TRC_ARC_MAGIC, sizeof(TRC_ARC_MAGIC)) == 0) {
+    err = trc_arc_load(cap);
+    if (err != TRC_OK) { trc_cap_close(cap); return err; }
+    *cap_rtn = cap;
+    return TRC_OK;
+  }
+  if (memcmp(cap->hdr.magic, TRC_CAP_MAGIC, sizeof(TRC_CAP_MAGIC)) != 0 ||
+      cap->hdr.endian != TRC_CAP_ENDIAN ||
+      cap->hdr.version != TRC_CAP_VERSION ||
+      cap->hdr.hdr_size < sizeof(cap->hdr) ||
+      cap->hdr.event_size != sizeof(trc_cap_event_t)) {
+    trc_cap_close(cap);
+    return TRC_CAP_ERR_FORMAT;
+  }
+
+  fseek(cap->fp, cap->hdr.hdr_size, SEEK_SET);
+  err = trc_cap_load_tables(cap);
+  if (err != TRC_OK) { trc_cap_close(cap); return err; }
+
+  cap->events_offset = trc_cap_events_offset(&cap->hdr);
+  cap->next_event = 0;
+  fseek(cap->fp, (long)cap->events_offset, SEEK_SET);  /* Past the index. */
+
+  *cap_rtn = cap;
+  return TRC_OK;
+}  /* trc_cap_open */
+
+
+int trc_cap_close(trc_cap_t *cap)
+{
+  if (cap->map_base != NULL) {
+#if ! defined(_WIN32)
+    munmap(cap->map_base, (size_t)cap->map_size);
+#else
+    free(cap->map_base);
+#endif
+  }
+  if (cap->index_built) { free(cap->index); }
+  if (cap->fp != NULL) { fclose(cap->fp); }
+  free(cap->blocks);
+  free(cap->block_events);
+  free(cap->block_data);
+  free(cap->procs);
+  free(cap->threads);
+  free(cap->sites);
+  free(cap->strings);
+  free(cap);
+
+  return TRC_OK;
+}  /* trc_cap_close */
+
+
+int trc_cap_next(trc_cap_t *cap, trc_cap_event_t *ev)
+{
+  if (cap->is_arc) {
+    while (cap->block_next >= cap->block_num_events) {
+      if (cap->next_block >= cap->hdr.num_index) { return 0; }
+      if (trc_arc_read_block(cap, cap->next_block, cap->block_events) != TRC_OK) { return 0; }
+      cap->block_num_events = cap->blocks[cap->next_block].num_events;
+      cap->block_next = 0;
+      cap->next_block++;
+    }
+    *ev = cap->block_events[cap->block_next++];
+    cap->next_event++;
+    return 1;
+  }
+
+  if (cap->next_event >= cap->hdr.num_events) { return 0; }
+  if (fread(ev, sizeof(*ev), 1, cap->fp) != 1) { return 0; }  /* Truncated. */
+  cap->next_event++;
+
+  return 1;
+}  /* trc_cap_next */
+
+
+const char *trc_cap_site_file(trc_cap_t *cap, uint32_t site_id)
+{
+  if (site_id >= cap->hdr.num_sites ||
+      cap->sites[site_id].name_offset >= cap->hdr.strings_size) {
+    return "?";
+  }
+  return &cap->strings[cap->sites[site_id].name_offset];
+}  /* trc_cap_site_file */
+
+
+uint32_t trc_cap_site_line(trc_cap_t *cap, uint32_t site_id)
+{
+  if (site_id >= cap->hdr.num_sites) { return 0; }
+  return cap->sites[site_id].file_line;
+}  /* trc_cap_site_line */
+
+
+/* Pid of the process that traced proc_idx's events; 0 if unknown. */
+uint32_t trc_cap_pid(trc_cap_t *cap, uint16_t proc_idx)
+{
+  if (cap->hdr.num_procs == 0) { return cap->hdr.pid; }
+  if (proc_idx >= cap->hdr.num_procs) { return 0; }
+  return cap->procs[proc_idx].pid;
+}  /* trc_cap_pid */
+
+
+/* Another process's thread has no name here (""), as in trc_dump(). */
+const char *trc_cap_thread_name(trc_cap_t *cap, uint16_t proc_idx, uint16_t thread_idx)
+{
+  if (cap->hdr.num_procs > 0 && proc_idx != cap->hdr.threads_proc_idx) {
+    return "";
+  }
+  if (thread_idx == 0 || thread_idx > cap->hdr.num_threads) {
+    return "-";
+  }
+  return cap->threads[thread_idx - 1].name;
+}  /* trc_cap_thread_name */
+
+
+void trc_cap_print_event(trc_cap_t *cap, FILE *out_fp, const trc_cap_event_t *ev)
+{
+  fprintf(out_fp, "  ev[%"PRIu64"]", ev->seq);
+  if (cap->hdr.num_procs > 0) {
+    fprintf(out_fp, ".pid=%"PRIu32", ", trc_cap_pid(cap, ev->proc_idx));
+  }
+  fprintf(out_fp, ".thread=%s[%"PRIu16"]",
+      trc_cap_thread_name(cap, ev->proc_idx, ev->thread_idx), ev->thread_idx);
+  if (cap->hdr.create_flags & TRC_CREATE_FLAG_CPU_ID) {
+    fprintf(out_fp, ", .cpu=%"PRIu16, ev->cpu_id);
+  }
+  if (ev->kind == TRC_KIND_SPAN_BEGIN) {
+    fprintf(out_fp, ", .span_begin=0x%"PRIx32, ev->span_id);
+  }
+  else if (ev->kind == TRC_KIND_SPAN_END) {
+    fprintf(out_fp, ", .span_end=0x%"PRIx32, ev->span_id);
+  }
+  else if (ev->kind == TRC_KIND_GAUGE) {
+    fprintf(out_fp, ", .gauge");
+  }
+  else if (ev->kind >= TRC_KIND_FLOW_BEGIN && ev->kind <= TRC_KIND_FLOW_END) {
+    fprintf(out_fp, ", .flow_%s=0x%"PRIx32, trc_flow_kind_names[ev->kind - TRC_KIND_FLOW_BEGIN], ev->span_id);
+  }
+  else if (ev->kind == TRC_KIND_THREAD_START) {
+    fprintf(out_fp, ", .thread_start");
+  }
+  else if (ev->kind == TRC_KIND_THREAD_EXIT) {
+    fprintf(out_fp, ", .thread_exit");
+  }
+  fprintf(out_fp, ", .p1=%"PRIu64", .p2=%"PRIu64", %s:%"PRIu32,
+      ev->p1, ev->p2, trc_cap_site_file(cap, ev->site_id), trc_cap_site_line(cap, ev->site_id));
+  if (ev->timestamp_ns != 0) {
+    struct tm tm_buf;
+    time_t secs = (time_t)(ev->timestamp_ns / 1000000000);
+    CPRT_LOCALTIME_R(&secs, &tm_buf);
+    fprintf(out_fp, ", %04d/%02d/%02d %02d:%02d:%02d.%06d",
+        (int)tm_buf.tm_year + 1900, (int)tm_buf.tm_mon + 1, (int)tm_buf.tm_mday,
+        (int)tm_buf.tm_hour, (int)tm_buf.tm_min, (int)tm_buf.tm_sec,
+        (int)((ev->timestamp_ns % 1000000000) / 1000));
+  }
+  fprintf(out_fp, "\n");
+}  /* trc_cap_print_event */
+
+
+/* Fold an event into its block's index entry. */
+void trc_cap_index_add(trc_cap_index_t *index, const trc_cap_event_t *ev, int first_in_block)
+{
+  if (first_in_block) {
+    index->min_ts_ns = ev->timestamp_ns;
+    index->max_ts_ns = ev->timestamp_ns;
+    index->site_bits = 0;
+    index->thread_bits = 0;
+  }
+  if (ev->timestamp_ns < index->min_ts_ns) { index->min_ts_ns = ev->timestamp_ns; }
+  if (ev->timestamp_ns > index->max_ts_ns) { index->max_ts_ns = ev->timestamp_ns; }
+  index->site_bits |= (uint64_t)1 << (ev->site_id % 64);
+  index->thread_bits |= (uint64_t)1 << (ev->thread_idx % 64);
+}  /* trc_cap_index_add */
+
+
+static int trc_cap_build_index(trc_cap_t *cap)
+{
+  uint64_t num_index = (cap->hdr.num_events + TRC_CAP_INDEX_BLOCK - 1) / TRC_CAP_INDEX_BLOCK;
+  uint64_t k;
+
+  cap->index = (trc_cap_index_t *)calloc((size_t)num_index + 1, sizeof(trc_cap_index_t));
+  if (cap->index == NULL) { return TRC_ERR_NO_MEM; }
+  cap->index_built = 1;
+  for (k = 0; k < cap->hdr.num_events; k++) {
+    trc_cap_index_add(&cap->index[k / TRC_CAP_INDEX_BLOCK], &cap->events[k],
+        (k % TRC_CAP_INDEX_BLOCK) == 0);
+  }
+
+  return TRC_OK;
+}  /* trc_cap_build_index */
+
+
+/* Map the whole capture for random access. Uses the embedded index, or
+ * builds one if the capture has none. An archive is left compressed;
+ * trc_cap_query() decodes only the blocks it needs. */
+int trc_cap_mmap(trc_cap_t *cap)
+{
+  uint64_t events_end;
+  char *base;
+
+  if (cap->events != NULL || cap->is_arc) { return TRC_OK; }
+  events_end = cap->events_offset + cap->hdr.num_events * sizeof(trc_cap_event_t);
+
+#if ! defined(_WIN32)
+  {
+    struct stat st;
+    if (fstat(fileno(cap->fp), &st) != 0) { return TRC_ERR_IO; }
+    if ((uint64_t)st.st_size < events_end) { return TRC_CAP_ERR_FORMAT; }
+    cap->map_size = (uint64_t)st.st_size;
+    base = (char *)mmap(NULL, (size_t)cap->map_size, PROT_READ, MAP_SHARED, fileno(cap->fp), 0);
+    if (base == (char *)MAP_FAILED) { return TRC_ERR_IO; }
+  }
+#else
+  /* No mmap; read it in. */
+  cap->map_size = events_end;
+  base = (char *)malloc((size_t)events_end);
+  if (base == NULL) { return TRC_ERR_NO_MEM; }
+  fseek(cap->fp, 0, SEEK_SET);
+  if (fread(base, 1, (size_t)events_end, cap->fp) != events_end) {
+    free(base);
+    return TRC_CAP_ERR_FORMAT;
+  }
+#endif
+  cap->map_base = base;
+  cap->events = (const trc_cap_event_t *)(base + cap->events_offset);
+
+  if (cap->hdr.num_index > 0 && cap->hdr.index_block_size == TRC_CAP_INDEX_BLOCK) {
+    cap->index = (trc_cap_index_t *)(base + cap->events_offset
+        - cap->hdr.num_index * sizeof(trc_cap_index_t));
+    return TRC_OK;
+  }
+
+  return trc_cap_build_index(cap);
+}  /* trc_cap_mmap */
+
+
+/* Site by file basename and line. Returns the site id, or -1. */
+int trc_cap_find_site(trc_cap_t *cap, const char *file_name, uint32_t file_line)
+{
+  uint32_t i;
+  const char *base = CPRT_BASENAME(file_name);
+
+  for (i = 0; i < cap->hdr.num_sites; i++) {
+    const char *site_file = trc_cap_site_file(cap, i);
+    if (cap->sites[i].file_line == file_line &&
+        strcmp(CPRT_BASENAME(site_file), base) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}  /* trc_cap_find_site */
+
+
+/* Thread index (1-based) by name. Returns -1 if not found. */
+int trc_cap_find_thread(trc_cap_t *cap, const char *name)
+{
+  uint32_t i;
+
+  for (i = 0; i < cap->hdr.num_threads; i++) {
+    if (strcmp(cap->threads[i].name, name) == 0) {
+      return (int)i + 1;
+    }
+  }
+  return -1;
+}  /* trc_cap_find_thread */
+
+
+static int trc_cap_match(const trc_cap_filter_t *filter, const trc_cap_event_t *ev)
+{
+  uint32_t i;
+
+  if (filter->min_ts_ns != 0 && ev->timestamp_ns < filter->min_ts_ns) { return 0; }
+  if (filter->max_ts_ns != 0 && ev->timestamp_ns > filter->max_ts_ns) { return 0; }
+  if (filter->have_p1 && ev->p1 != filter->p1) { return 0; }
+  if (filter->have_thread && ev->thread_idx != filter->thread_idx) { return 0; }
+  if (filter->have_proc && ev->proc_idx != filter->proc_idx) { return 0; }
+  if (filter->num_sites == 0) { return 1; }
+  for (i = 0; i < filter->num_sites; i++) {
+    if (ev->site_id == filter->site_ids[i]) { return 1; }
+  }
+  return 0;
+}  /* trc_cap_match */
+
+
+/* Number of query blocks: index entries, or an archive's blocks. */
+uint64_t trc_cap_num_blocks(trc_cap_t *cap)
+{
+  if (cap->is_arc) { return cap->hdr.num_index; }
+  return (cap->hdr.num_events + TRC_CAP_INDEX_BLOCK - 1) / TRC_CAP_INDEX_BLOCK;
+}  /* trc_cap_num_blocks */
+
+
+static const trc_cap_index_t *trc_cap_block_summary(trc_cap_t *cap, uint64_t b)
+{
+  if (cap->is_arc) { return &cap->blocks[b].summary; }
+  return &cap->index[b];
+}  /* trc_cap_block_summary */
+
+
+/* Call cb for each matching event, oldest first. Blocks whose index entry
+ * (an archive block's summary) rules them out are skipped without touching
+ * their events. Events are in time order, so the first block for min_ts_ns
+ * is found by binary search and the scan stops after max_ts_ns. */
+int trc_cap_query(trc_cap_t *cap, const trc_cap_filter_t *filter,
+    trc_cap_query_cb_t cb, void *cb_arg, uint64_t *blocks_scanned_rtn)
+{
+  uint64_t num_blocks = trc_cap_num_blocks(cap);
+  uint64_t site_mask = 0;
+  uint64_t thread_mask = 0;
+  uint64_t blocks_scanned = 0;
+  trc_cap_event_t *arc_events = NULL;
+  const trc_cap_event_t *events;
+  uint64_t lo, hi, b, k, end;
+  uint32_t i;
+  int err = TRC_OK;
+
+  if ((cap->events == NULL && ! cap->is_arc) || filter->num_sites > TRC_CAP_FILTER_MAX_SITES) {
+    return TRC_ERR_BAD_PARM;
+  }
+  if (cap->is_arc) {  /* Not block_events; that belongs to trc_cap_next(). */
+    arc_events = (trc_cap_event_t *)malloc(TRC_ARC_BLOCK_EVENTS * sizeof(trc_cap_event_t));
+    if (arc_events == NULL) { return TRC_ERR_NO_MEM; }
+  }
+
+  for (i = 0; i < filter->num_sites; i++) {
+    site_mask |= (uint64_t)1 << (filter->site_ids[i] % 64);
+  }
+  if (filter->have_thread) {
+    thread_mask = (uint64_t)1 << (filter->thread_idx % 64);
+  }
+
+  /* First block that can hold an event at or after min_ts_ns. */
+  lo = 0;  hi = num_blocks;
+  if (filter->min_ts_ns != 0) {
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (trc_cap_block_summary(cap, mid)->max_ts_ns < filter->min_ts_ns) { lo = mid + 1; }
+      else { hi = mid; }
+    }
+  }
+
+  for (b = lo; b < num_blocks; b++) {
+    const trc_cap_index_t *index = trc_cap_block_summary(cap, b);
+    if (filter->max_ts_ns != 0 && index->min_ts_ns > filter->max_ts_ns) { break; }
+    if (filter->min_ts_ns != 0 && index->max_ts_ns < filter->min_ts_ns) { continue; }
+    if (site_mask != 0 && (index->site_bits & site_mask) == 0) { continue; }
+    if (thread_mask != 0 && (index->thread_bits & thread_mask) == 0) { continue; }
+
+    blocks_scanned++;
+    if (cap->is_arc) {
+      err = trc_arc_read_block(cap, b, arc_events);
+      if (err != TRC_OK) { break; }
+      events = arc_events;
+      end = cap->blocks[b].num_events;
+    }
+    else {
+      events = &cap->events[b * TRC_CAP_INDEX_BLOCK];
+      end = cap->hdr.num_events - b * TRC_CAP_INDEX_BLOCK;
+      if (end > TRC_CAP_INDEX_BLOCK) { end = TRC_CAP_INDEX_BLOCK; }
+    }
+    for (k = 0; k < end; k++) {
+      if (trc_cap_match(filter, &events[k])) {
+        (*cb)(cap, &events[k], cb_arg);
+      }
+    }
+  }
+
+  free(arc_events);
+  if (blocks_scanned_rtn != NULL) { *blocks_scanned_rtn = blocks_scanned; }
+  return err;
+}  /* trc_cap_query */
+
+
+/* Archive columns, in file order. The first TRC_ARC_NUM_DELTA_COLS are
+ * delta coded, the rest run-length coded. */
+#define TRC_ARC_COL_SEQ    0
+#define TRC_ARC_COL_TS     1
+#define TRC_ARC_COL_SPAN   2
+#define TRC_ARC_COL_P1     3
+#define TRC_ARC_COL_P2     4
+#define TRC_ARC_COL_SITE   5
+#define TRC_ARC_COL_THREAD 6
+#define TRC_ARC_COL_CPU    7
+#define TRC_ARC_COL_KIND   8
+#define TRC_ARC_COL_PROC   9
+#define TRC_ARC_NUM_DELTA_COLS 5
+
+
+static uint64_t trc_arc_field(const trc_cap_event_t *ev, int col)
+{
+  switch (col) {
+    case TRC_ARC_COL_SEQ:    return ev->seq;
+    case TRC_ARC_COL_TS:     return ev->timestamp_ns;
+    case TRC_ARC_COL_SPAN:   return ev->span_id;
+    case TRC_ARC_COL_P1:     return ev->p1;
+    case TRC_ARC_COL_P2:     return ev->p2;
+    case TRC_ARC_COL_SITE:   return ev->site_id;
+    case TRC_ARC_COL_THREAD: return ev->thread_idx;
+    case TRC_ARC_COL_CPU:    return ev->cpu_id;
+    case TRC_ARC_COL_KIND:   return ev->kind;
+    default:                 return ev->proc_idx;
+  }
+}  /* trc_arc_field */
+
+
+static uint8_t *trc_arc_put_varint(uint8_t *p, uint64_t v)
+{
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}  /* trc_arc_put_varint */
+
+
+/* Returns the byte after the varint, or NULL if it runs past end. */
+static const uint8_t *trc_arc_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v_rtn)
+{
+  uint64_t v = 0;
+  int shift;
+
+  for (shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (b < 0x80) {
+      *v_rtn = v;
+      return p;
+    }
+  }
+  return NULL;
+}  /* trc_arc_get_varint */
+
+
+static uint8_t *trc_arc_encode_col(uint8_t *p, const trc_cap_event_t *events, uint32_t num_events, int col)
+{
+  uint64_t prev = 0;
+  uint64_t v, delta;
+  uint32_t i, run;
+
+  if (col < TRC_ARC_NUM_DELTA_COLS) {
+    for (i = 0; i < num_events; i++) {
+      v = trc_arc_field(&events[i], col);
+      delta = v - prev;
+      prev = v;
+      p = trc_arc_put_varint(p, (delta << 1) ^ (uint64_t)((int64_t)delta >> 63));  /* Zig-zag. */
+    }
+  }
+  else {
+    for (i = 0; i < num_events; i += run) {
+      v = trc_arc_field(&events[i], col);
+      for (run = 1; i + run < num_events && trc_arc_field(&events[i + run], col) == v; run++) { }
+      p = trc_arc_put_varint(p, v);
+      p = trc_arc_put_varint(p, run);
+    }
+  }
+  return p;
+}  /* trc_arc_encode_col */
+
+
+/* The decoders write straight into the events' fields, one tight loop
+ * per column; most varints are a single byte. */
+#define TRC_ARC_GET_VARINT(_p, _end, _v) do { \
+  if ((_p) < (_end) && *(_p) < 0x80) { \
+    (_v) = *(_p)++; \
+  } \
+  else { \
+    (_p) = trc_arc_get_varint((_p), (_end), &(_v)); \
+    if ((_p) == NULL) { return TRC_CAP_ERR_FORMAT; } \
+  } \
+} while (0)
+
+#define TRC_ARC_DECODE_DELTA(_field, _type) do { \
+  uint64_t prev_ = 0; \
+  for (i = 0; i < num_events; i++) { \
+    TRC_ARC_GET_VARINT(p, col_end, v); \
+    prev_ += (v >> 1) ^ (0 - (v & 1));  /* Un-zig-zag. */ \
+    events[i]._field = (_type)prev_; \
+  } \
+} while (0)
+
+#define TRC_ARC_DECODE_RLE(_field, _type) do { \
+  for (i = 0; i < num_events; ) { \
+    TRC_ARC_GET_VARINT(p, col_end, v); \
+    TRC_ARC_GET_VARINT(p, col_end, run); \
+    if (run == 0 || run > num_events - i) { return TRC_CAP_ERR_FORMAT; } \
+    for (; run > 0; run--) { \
+      events[i++]._field = (_type)v; \
+    } \
+  } \
+} while (0)
+
+
+static int trc_arc_decode(const uint8_t *data, uint32_t data_size, uint32_t num_events, trc_cap_event_t *events)
+{
+  const uint8_t *p = data;
+  const uint8_t *end = data + data_size;
+  const uint8_t *col_end;
+  uint64_t len, v, run;
+  uint32_t i;
+  int col;
+
+  for (col = 0; col < TRC_ARC_NUM_COLS; col++) {
+    p = trc_arc_get_varint(p, end, &len);
+    if (p == NULL || len > (uint64_t)(end - p)) { return TRC_CAP_ERR_FORMAT; }
+    col_end = p + len;
+
+    switch (col) {
+      case TRC_ARC_COL_SEQ:    TRC_ARC_DECODE_DELTA(seq, uint64_t);  break;
+      case TRC_ARC_COL_TS:     TRC_ARC_DECODE_DELTA(timestamp_ns, uint64_t);  break;
+      case TRC_ARC_COL_SPAN:   TRC_ARC_DECODE_DELTA(span_id, uint32_t);  break;
+      case TRC_ARC_COL_P1:     TRC_ARC_DECODE_DELTA(p1, uint64_t);  break;
+      case TRC_ARC_COL_P2:     TRC_ARC_DECODE_DELTA(p2, uint64_t);  break;
+      case TRC_ARC_COL_SITE:   TRC_ARC_DECODE_RLE(site_id, uint32_t);  break;
+      case TRC_ARC_COL_THREAD: TRC_ARC_DECODE_RLE(thread_idx, uint16_t);  break;
+      case TRC_ARC_COL_CPU:    TRC_ARC_DECODE_RLE(cpu_id, uint16_t);  break;
+      case TRC_ARC_COL_KIND:   TRC_ARC_DECODE_RLE(kind, uint16_t);  break;
+      default:                 TRC_ARC_DECODE_RLE(proc_idx, uint16_t);  break;
+    }
+    if (p != col_end) { return TRC_CAP_ERR_FORMAT; }
+  }
+  return (p == end) ? TRC_OK : TRC_CAP_ERR_FORMAT;
+}  /* trc_arc_decode */
+
+
+/* Decode block number "block" of an archive into events[] (room for the
+ * block's num_events). */
+int trc_arc_read_block(trc_cap_t *cap, uint64_t block, trc_cap_event_t *events)
+{
+  trc_arc_block_t *blk;
+
+  if (! cap->is_arc || block >= cap->hdr.num_index) { return TRC_ERR_BAD_PARM; }
+  blk = &cap->blocks[block];
+  if (blk->num_events > TRC_ARC_BLOCK_EVENTS || blk->data_size > TRC_ARC_MAX_DATA) {
+    return TRC_CAP_ERR_FORMAT;
+  }
+  if (fseek(cap->fp, (long)(blk->offset + sizeof(trc_arc_block_t)), SEEK_SET) != 0 ||
+      fread(cap->block_data, 1, blk->data_size, cap->fp) != blk->data_size) {
+    return TRC_CAP_ERR_FORMAT;
+  }
+
+  return trc_arc_decode(cap->block_data, blk->data_size, blk->num_events, events);
+}  /* trc_arc_read_block */
+
+
+/* Start an archive on out_fp. The stream is written as events arrive, and
+ * needs no seeking; trc_arc_close() finishes it. */
+int trc_arc_open(trc_arc_t **arc_rtn, FILE *out_fp, uint32_t create_flags, uint32_t overhead_ns)
+{
+  trc_arc_t *arc;
+  struct cprt_timeval wall_tv;
+  struct cprt_timespec mono_ts;
+  uint64_t map_size = 256;
+
+  arc = (trc_arc_t *)calloc(1, sizeof(trc_arc_t));
+  if (arc == NULL) { return TRC_ERR_NO_MEM; }
+  arc->fp = out_fp;
+  arc->pending = (trc_cap_event_t *)malloc(TRC_ARC_BLOCK_EVENTS * sizeof(trc_cap_event_t));
+  arc->buf = (uint8_t *)malloc(TRC_ARC_MAX_DATA);
+  arc->map_names = (const char **)calloc(map_size, sizeof(char *));
+  arc->map_lines = (uint32_t *)calloc(map_size, sizeof(uint32_t));
+  arc->map_ids = (uint32_t *)calloc(map_size, sizeof(uint32_t));
+  arc->map_mask = map_size - 1;
+  if (arc->pending == NULL || arc->buf == NULL || arc->map_names == NULL ||
+      arc->map_lines == NULL || arc->map_ids == NULL) {
+    arc->err = TRC_ERR_NO_MEM;
+    (void)trc_arc_close(arc);
+    return TRC_ERR_NO_MEM;
+  }
+
+  memcpy(arc->hdr.magic, TRC_ARC_MAGIC, sizeof(TRC_ARC_MAGIC));
+  arc->hdr.version = TRC_ARC_VERSION;
+  arc->hdr.endian = TRC_CAP_ENDIAN;
+  arc->hdr.hdr_size = sizeof(arc->hdr);
+  arc->hdr.event_size = sizeof(trc_cap_event_t);
+  arc->hdr.create_flags = create_flags;
+  arc->hdr.pid = CPRT_GETPID();
+  CPRT_TIMEOFDAY(&wall_tv, NULL);
+  CPRT_GETTIME(&mono_ts);
+  arc->hdr.anchor_wall_ns = (uint64_t)wall_tv.tv_sec * 1000000000 + (uint64_t)wall_tv.tv_usec * 1000;
+  arc->hdr.anchor_mono_ns = (uint64_t)mono_ts.tv_sec * 1000000000 + (uint64_t)mono_ts.tv_nsec;
+  arc->hdr.index_block_size = TRC_ARC_BLOCK_EVENTS;
+  arc->hdr.overhead_ns = overhead_ns;
+  trc_cap_proc_name(arc->hdr.proc_name, sizeof(arc->hdr.proc_name));
+
+  if (fwrite(&arc->hdr, sizeof(arc->hdr), 1, out_fp) != 1) {
+    arc->err = TRC_ERR_IO;
+    (void)trc_arc_close(arc);
+    return TRC_ERR_IO;
+  }
+  arc->offset = sizeof(arc->hdr);
+
+  *arc_rtn = arc;
+  return TRC_OK;
+}  /* trc_arc_open */
+
+
+static void trc_arc_map_insert(trc_arc_t *arc, const char *file_name, uint32_t file_line, uint32_t id)
+{
+  uint64_t slot = (((uint64_t)(uintptr_t)file_name >> 3) * 0x9E3779B97F4A7C15ull
+      + file_line) & arc->map_mask;
+
+  while (arc->map_ids[slot] != 0) {
+    slot = (slot + 1) & arc->map_mask;
+  }
+  arc->map_names[slot] = file_name;
+  arc->map_lines[slot] = file_line;
+  arc->map_ids[slot] = id + 1;
+}  /* trc_arc_map_insert */
+
+
+/* Double the site map. */
+static int trc_arc_map_grow(trc_arc_t *arc)
+{
+  const char **old_names = arc->map_names;
+  uint32_t *old_lines = arc->map_lines;
+  uint32_t *old_ids = arc->map_ids;
+  uint64_t old_size = arc->map_mask + 1;
+  uint64_t slot;
+
+  arc->map_names = (const char **)calloc(old_size * 2, sizeof(char *));
+  arc->map_lines = (uint32_t *)calloc(old_size * 2, sizeof(uint32_t));
+  arc->map_ids = (uint32_t *)calloc(old_size * 2, sizeof(uint32_t));
+  if (arc->map_names == NULL || arc->map_lines == NULL || arc->map_ids == NULL) {
+    free(arc->map_names);  free(arc->map_lines);  free(arc->map_ids);
+    arc->map_names = old_names;  arc->map_lines = old_lines;  arc->map_ids = old_ids;
+    return TRC_ERR_NO_MEM;
+  }
+  arc->map_mask = old_size * 2 - 1;
+  for (slot = 0; slot < old_size; slot++) {
+    if (old_ids[slot] != 0) {
+      trc_arc_map_insert(arc, old_names[slot], old_lines[slot], old_ids[slot] - 1);
+    }
+  }
+  free(old_names);  free(old_lines);  free(old_ids);
+
+  return TRC_OK;
+}  /* trc_arc_map_grow */
+
+
+/* Archive site id for a (file_name, line), adding it if new. Sites are
+ * told apart by the file_name pointer, as in trc_dump_bin(). */
+uint32_t trc_arc_site_id(trc_arc_t *arc, const char *file_name, uint32_t file_line)
+{
+  uint64_t slot = (((uint64_t)(uintptr_t)file_name >> 3) * 0x9E3779B97F4A7C15ull
+      + file_line) & arc->map_mask;
+  uint32_t id = arc->hdr.num_sites;
+  size_t len;
+
+  while (arc->map_ids[slot] != 0) {
+    if (arc->map_names[slot] == file_name && arc->map_lines[slot] == file_line) {
+      return arc->map_ids[slot] - 1;
+    }
+    slot = (slot + 1) & arc->map_mask;
+  }
+  if (arc->err != TRC_OK) { return 0; }
+
+  if ((uint64_t)(id + 1) * 2 > arc->map_mask + 1 && trc_arc_map_grow(arc) != TRC_OK) {
+    arc->err = TRC_ERR_NO_MEM;
+    return 0;
+  }
+  if (id >= arc->sites_alloc) {
+    uint32_t sites_alloc = (arc->sites_alloc == 0) ? 64 : arc->sites_alloc * 2;
+    trc_cap_site_t *sites = (trc_cap_site_t *)realloc(arc->sites, sites_alloc * sizeof(trc_cap_site_t));
+    if (sites == NULL) { arc->err = TRC_ERR_NO_MEM; return 0; }
+    arc->sites = sites;
+    arc->sites_alloc = sites_alloc;
+  }
+  len = strlen((file_name != NULL) ? file_name : "") + 1;
+  if (arc->hdr.strings_size + len > arc->strings_alloc) {
+    uint64_t strings_alloc = (arc->strings_alloc == 0) ? 4096 : arc->strings_alloc;
+    char *strings;
+    while (arc->hdr.strings_size + len > strings_alloc) { strings_alloc *= 2; }
+    strings = (char *)realloc(arc->strings, (size_t)strings_alloc);
+    if (strings == NULL) { arc->err = TRC_ERR_NO_MEM; return 0; }
+    arc->strings = strings;
+    arc->strings_alloc = strings_alloc;
+  }
+
+  arc->sites[id].file_line = file_line;
+  arc->sites[id].name_offset = (uint32_t)arc->hdr.strings_size;
+  memcpy(&arc->strings[arc->hdr.strings_size], (file_name != NULL) ? file_name : "", len);
+  arc->hdr.strings_size += len;
+  arc->hdr.num_sites++;
+  trc_arc_map_insert(arc, file_name, file_line, id);
+
+  return id;
+}  /* trc_arc_site_id */
+
+
+/* Encode and write the pending events as one block. */
+static void trc_arc_flush(trc_arc_t *arc)
+{
+  trc_arc_block_t blk;
+  uint8_t *p = arc->buf;
+  uint32_t num_events = arc->num_pending;
+  uint32_t i;
+  int col;
+
+  arc->num_pending = 0;
+  if (num_events == 0 || arc->err != TRC_OK) { return; }
+
+  for (col = 0; col < TRC_ARC_NUM_COLS; col++) {
+    uint8_t *data = p + 10;  /* Room for the length. */
+    uint64_t len = (uint64_t)(trc_arc_encode_col(data, arc->pending, num_events, col) - data);
+    p = trc_arc_put_varint(p, len);
+    memmove(p, data, (size_t)len);
+    p += len;
+  }
+
+  memset(&blk, 0, sizeof(blk));
+  blk.offset = arc->offset;
+  blk.first_seq = arc->pending[0].seq;
+  blk.num_events = num_events;
+  blk.data_size = (uint32_t)(p - arc->buf);
+  for (i = 0; i < num_events; i++) {
+    trc_cap_index_add(&blk.summary, &arc->pending[i], i == 0);
+  }
+
+  if (arc->hdr.num_index >= arc->blocks_alloc) {
+    uint64_t blocks_alloc = (arc->blocks_alloc == 0) ? 64 : arc->blocks_alloc * 2;
+    trc_arc_block_t *blocks = (trc_arc_block_t *)realloc(arc->blocks, (size_t)blocks_alloc * sizeof(trc_arc_block_t));
+    if (blocks == NULL) { arc->err = TRC_ERR_NO_MEM; return; }
+    arc->blocks = blocks;
+    arc->blocks_alloc = blocks_alloc;
+  }
+  arc->blocks[arc->hdr.num_index++] = blk;
+
+  if (fwrite(&blk, sizeof(blk), 1, arc->fp) != 1 ||
+      fwrite(arc->buf, 1, blk.data_size, arc->fp) != blk.data_size) {
+    arc->err = TRC_ERR_IO;
+    return;
+  }
+  arc->offset += sizeof(blk) + blk.data_size;
+}  /* trc_arc_flush */
+
+
+/* Add an event (site_id from trc_arc_site_id()). Events are buffered
+ * and written a block at a time. */
+int trc_arc_write(trc_arc_t *arc, const trc_cap_event_t *ev)
+{
+  if (arc->err != TRC_OK) { return arc->err; }
+
+  arc->pending[arc->num_pending++] = *ev;
+  arc->hdr.num_events++;
+  if (arc->num_pending == TRC_ARC_BLOCK_EVENTS) {
+    trc_arc_flush(arc);
+  }
+
+  return arc->err;
+}  /* trc_arc_write */
+
+
+/* Write the last block and the trailer (with the process table and this
+ * process's thread registry), and free arc. Does not close the FILE. */
+int trc_arc_close(trc_arc_t *arc)
+{
+  trc_arc_footer_t footer;
+  trc_cap_thread_t cap_thread;
+  uint64_t strings_size;
+  uint32_t i;
+  int err;
+  static const char zeros[8] = { 0 };
+
+  trc_arc_flush(arc);
+
+  if (arc->err == TRC_OK) {
+    memset(&footer, 0, sizeof(footer));
+    footer.trailer_offset = arc->offset;
+    memcpy(footer.magic, TRC_ARC_MAGIC, sizeof(TRC_ARC_MAGIC));
+    strings_size = arc->hdr.strings_size;
+    arc->hdr.strings_size = (strings_size + 7) & ~(uint64_t)7;
+    arc->hdr.num_threads = trc_num_threads;
+    if (arc->hdr.num_threads >= TRC_MAX_THREADS) { arc->hdr.num_threads = TRC_MAX_THREADS - 1; }
+
+    if (fwrite(&arc->hdr, sizeof(arc->hdr), 1, arc->fp) != 1) { arc->err = TRC_ERR_IO; }
+    if (arc->err == TRC_OK && arc->hdr.num_procs > 0) {
+      if (fwrite(arc->procs, sizeof(trc_cap_proc_t), arc->hdr.num_procs, arc->fp) != arc->hdr.num_procs) {
+        arc->err = TRC_ERR_IO;
+      }
+    }
+    for (i = 1; i <= arc->hdr.num_threads && arc->err == TRC_OK; i++) {
+      memset(&cap_thread, 0, sizeof(cap_thread));
+      cap_thread.kernel_tid = trc_threads[i].kernel_tid;
+      memcpy(cap_thread.name, trc_threads[i].name, sizeof(cap_thread.name));
+      cap_thread.name[sizeof(cap_thread.name) - 1] = '\0';
+      if (fwrite(&cap_thread, sizeof(cap_thread), 1, arc->fp) != 1) { arc->err = TRC_ERR_IO; }
+    }
+    if (arc->err == TRC_OK && arc->hdr.num_sites > 0) {
+      if (fwrite(arc->sites, sizeof(trc_cap_site_t), arc->hdr.num_sites, arc->fp) != arc->hdr.num_sites ||
+          fwrite(arc->strings, 1, (size_t)strings_size, arc->fp) != strings_size) {
+        arc->err = TRC_ERR_IO;
+      }
+    }
+    if (arc->err == TRC_OK && arc->hdr.strings_size > strings_size) {
+      if (fwrite(zeros, (size_t)(arc->hdr.strings_size - strings_size), 1, arc->fp) != 1) { arc->err = TRC_ERR_IO; }
+    }
+    if (arc->err == TRC_OK && arc->hdr.num_index > 0) {
+      if (fwrite(arc->blocks, sizeof(trc_arc_block_t), (size_t)arc->hdr.num_index, arc->fp) != arc->hdr.num_index) {
+        arc->err = TRC_ERR_IO;
+      }
+    }
+    if (arc->err == TRC_OK && fwrite(&footer, sizeof(footer), 1, arc->fp) != 1) { arc->err = TRC_ERR_IO; }
+    if (arc->err == TRC_OK && fflush(arc->fp) != 0) { arc->err = TRC_ERR_IO; }
+  }
+
+  err = arc->err;
+  free(arc->pending);
+  free(arc->buf);
+  free(arc->blocks);
+  free((void *)arc->map_names);
+  free(arc->map_lines);
+  free(arc->map_ids);
+  free(arc->sites);
+  free(arc->strings);
+  free(arc);
+
+  return err;
+}  /* trc_arc_close */
+
+
+static void trc_chrome_sep(trc_chrome_t *chrome)
+{
+  fprintf(chrome->fp, (chrome->num_written == 0) ? "\n" : ",\n");
+  chrome->num_written++;
+}  /* trc_chrome_sep */
+
+
+static void trc_chrome_str(FILE *fp, const char *str)
+{
+  fputc('"', fp);
+  for (; *str != '\0'; str++) {
+    if (*str == '"' || *str == '\\') {
+      fputc('\\', fp);  fputc(*str, fp);
+    }
+    else if ((unsigned char)*str < 0x20) {
+      fprintf(fp, "\\u%04x", (unsigned char)*str);
+    }
+    else {
+      fputc(*str, fp);
+    }
+  }
+  fputc('"', fp);
+}  /* trc_chrome_str */
+
+
+void trc_chrome_begin(trc_chrome_t *chrome, FILE *fp)
+{
+  chrome->fp = fp;
+  chrome->num_written = 0;
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+}  /* trc_chrome_begin */
+
+
+void trc_chrome_thread(trc_chrome_t *chrome, uint32_t pid, uint32_t thread_idx, const char *name)
+{
+  trc_chrome_sep(chrome);
+  fprintf(chrome->fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%"PRIu32",\"tid\":%"PRIu32",\"args\":{\"name\":",
+      pid, thread_idx);
+  trc_chrome_str(chrome->fp, name);
+  fprintf(chrome->fp, "}}");
+}  /* trc_chrome_thread */
+
+
+void trc_chrome_process(trc_chrome_t *chrome, uint32_t pid, const char *name)
+{
+  trc_chrome_sep(chrome);
+  fprintf(chrome->fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%"PRIu32",\"args\":{\"name\":", pid);
+  trc_chrome_str(chrome->fp, name);
+  fprintf(chrome->fp, "}}");
+}  /* trc_chrome_process */
+
+
+/* Process (with_procs, or a shared ring's) and thread name metadata
+ * for a capture's events. */
+void trc_chrome_cap_names(trc_chrome_t *chrome, trc_cap_t *cap, int with_procs)
+{
+  uint32_t i;
+
+  if (cap->hdr.num_procs == 0 && with_procs) {
+    trc_chrome_process(chrome, cap->hdr.pid, cap->hdr.proc_name);
+  }
+  for (i = 0; i < cap->hdr.num_procs; i++) {
+    trc_chrome_process(chrome, cap->procs[i].pid, cap->procs[i].proc_name);
+  }
+  if (cap->hdr.num_procs > 0 && cap->hdr.threads_proc_idx >= cap->hdr.num_procs) {
+    return;  /* A reader that traces nothing into the ring. */
+  }
+  for (i = 0; i < cap->hdr.num_threads; i++) {
+    trc_chrome_thread(chrome, trc_cap_pid(cap, (uint16_t)cap->hdr.threads_proc_idx), i + 1, cap->threads[i].name);
+  }
+}  /* trc_chrome_cap_names */
+
+
+/* Spans become async ("b"/"e") events paired by span id, since spans on
+ * one thread need not nest (and a begin may have been overwritten).
+ * Gauges become counter ("C") events, everything else instant events.
+ * Without timestamps the event number stands in for microseconds. */
+void trc_chrome_event(trc_chrome_t *chrome, uint32_t pid, const trc_cap_event_t *ev,
+    const char *file_name, uint32_t file_line)
+{
+  char ph[80];
+  char name[1024];
+  uint64_t ts_ns = (ev->timestamp_ns != 0) ? ev->timestamp_ns : ev->seq * 1000;
+
+  if (ev->kind == TRC_KIND_SPAN_BEGIN || ev->kind == TRC_KIND_SPAN_END) {
+    CPRT_SNPRINTF(ph, sizeof(ph), "\"cat\":\"span\",\"ph\":\"%c\",\"id2\":{\"local\":\"0x%"PRIx32"\"},",
+        (ev->kind == TRC_KIND_SPAN_BEGIN) ? 'b' : 'e', ev->span_id);
+  }
+  else {
+    CPRT_SNPRINTF(ph, sizeof(ph), "\"ph\":\"i\",\"s\":\"t\",");
+  }
+  if (ev->kind == TRC_KIND_GAUGE) {  /* A counter track named after the gauge. */
+    trc_chrome_sep(chrome);
+    fprintf(chrome->fp, "{\"name\":");
+    trc_chrome_str(chrome->fp, file_name);
+    fprintf(chrome->fp, ",\"ph\":\"C\",\"ts\":%"PRIu64".%03"PRIu64",\"pid\":%"PRIu32",\"args\":{\"value\":%"PRIu64"}}",
+        ts_ns / 1000, ts_ns % 1000, pid, ev->p1);
+    return;
+  }
+  CPRT_SNPRINTF(name, sizeof(name), "%s:%"PRIu32, CPRT_BASENAME(file_name), file_line);
+
+  trc_chrome_sep(chrome);
+  fprintf(chrome->fp, "{\"name\":");
+  trc_chrome_str(chrome->fp, name);
+  fprintf(chrome->fp, ",%s\"ts\":%"PRIu64".%03"PRIu64",\"pid\":%"PRIu32",\"tid\":%"PRIu16
+      ",\"args\":{\"seq\":%"PRIu64",\"p1\":%"PRIu64",\"p2\":%"PRIu64"}}",
+      ph, ts_ns / 1000, ts_ns % 1000, pid, ev->thread_idx,
+      ev->seq, ev->p1, ev->p2);
+
+  if (ev->kind >= TRC_KIND_FLOW_BEGIN && ev->kind <= TRC_KIND_FLOW_END) {
+    /* Arrows from each hop to the next; "bp":"e" binds them to the instant. */
+    trc_chrome_sep(chrome);
+    fprintf(chrome->fp, "{\"name\":\"flow\",\"cat\":\"flow\",\"ph\":\"%c\",\"bp\":\"e\",\"id\":%"PRIu32
+        ",\"ts\":%"PRIu64".%03"PRIu64",\"pid\":%"PRIu32",\"tid\":%"PRIu16"}",
+        "stf"[ev->kind - TRC_KIND_FLOW_BEGIN], ev->span_id,
+        ts_ns / 1000, ts_ns % 1000, pid, ev->thread_idx);
+  }
+}  /* trc_chrome_event */
+
+
+void trc_chrome_end(trc_chrome_t *chrome)
+{
+  fprintf(chrome->fp, "\n]}\n");
+}  /* trc_chrome_end */
@@ -0,0 +1,266 @@
+/* trc_cap.h - binary trace capture format and readers. */
+/*
+# This code and its documentation is Copyright 2023 Steven Ford
+# and licensed "public domain" style under Creative Commons "CC0":
+#   http://creativecommons.org/publicdomain/zero/1.0/
+# To the extent possible under law, the contributors to this project have
+# waived all copyright and related or neighboring rights to this work.
+# In other words, you can use this code for any purpose without any
+# restrictions.  This work is published from: United States.  The project home
+# is https://github.com/fordsfords/trc
+*/
+#ifndef TRC_CAP_H
+#define TRC_CAP_H
+
+#include "cprt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * A capture (written by trc_dump_bin()) is laid out as:
+ *   trc_cap_hdr_t
+ *   trc_cap_proc_t[num_procs]      (shared rings only)
+ *   trc_cap_thread_t[num_threads]  (thread index 1 is the first entry)
+ *   trc_cap_site_t[num_sites]
+ *   strings_size bytes of null-terminated file names
+ *   trc_cap_index_t[num_index]     (one per index_block_size events)
+ *   trc_cap_event_t[num_events]    (oldest first)
+ * All in the writer's byte order; readers check "endian".
+ * A shared ring's events come from several processes. Each event's
+ * proc_idx picks its process, and only threads_proc_idx's thread indexes
+ * are in the thread table.
+ */
+#define TRC_CAP_MAGIC "TRC_CAP"  /* 8 bytes including the null. */
+#define TRC_CAP_VERSION 3
+#define TRC_CAP_MAX_PROCS 16  /* TRC_SHM_MAX_PROCS. */
+#define TRC_CAP_INDEX_BLOCK 1024  /* Events per index entry. */
+#define TRC_CAP_ENDIAN 0x01020304
+
+struct trc_cap_hdr_s {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint32_t hdr_size;
+  uint32_t event_size;
+  uint32_t create_flags;
+  uint32_t pid;
+  uint32_t num_threads;
+  uint32_t num_sites;
+  uint64_t strings_size;    /* Padded to a multiple of 8. */
+  uint64_t num_events;
+  uint64_t event_count;     /* Events ever traced (> num_events if wrapped). */
+  uint64_t anchor_wall_ns;  /* Wall clock and monotonic clock, */
+  uint64_t anchor_mono_ns;  /*   read back-to-back at dump time. */
+  uint64_t num_index;
+  uint32_t index_block_size;
+  uint32_t overhead_ns;     /* Per-trace cost (trc_overhead_ns()); 0 if unknown. */
+  char proc_name[32];
+  uint32_t num_procs;       /* Shared rings: process table entries; 0 otherwise. */
+  uint32_t threads_proc_idx;  /* Shared rings: whose threads the thread table holds. */
+};
+typedef struct trc_cap_hdr_s trc_cap_hdr_t;
+
+struct trc_cap_proc_s {
+  uint32_t pid;
+  uint32_t reserved;
+  char proc_name[32];
+};
+typedef struct trc_cap_proc_s trc_cap_proc_t;
+
+/* Sparse index: a summary of each block of events, so queries can skip
+ * blocks by time, site and thread. Bitmaps use (id % 64). */
+struct trc_cap_index_s {
+  uint64_t min_ts_ns;
+  uint64_t max_ts_ns;
+  uint64_t site_bits;
+  uint64_t thread_bits;
+};
+typedef struct trc_cap_index_s trc_cap_index_t;
+
+struct trc_cap_thread_s {
+  uint64_t kernel_tid;
+  char name[16];
+};
+typedef struct trc_cap_thread_s trc_cap_thread_t;
+
+struct trc_cap_site_s {
+  uint32_t file_line;
+  uint32_t name_offset;  /* Into the strings section. */
+};
+typedef struct trc_cap_site_s trc_cap_site_t;
+
+struct trc_cap_event_s {
+  uint64_t seq;           /* Event number (ev[N] in trc_dump()). */
+  uint64_t timestamp_ns;  /* Wall clock; 0 without TRC_CREATE_FLAG_TIMESTAMP. */
+  uint64_t p1;
+  uint64_t p2;
+  uint32_t site_id;       /* Index into the site table. */
+  uint16_t thread_idx;
+  uint16_t cpu_id;
+  uint16_t kind;
+  uint16_t proc_idx;      /* Shared rings: index into the process table. */
+  uint32_t span_id;
+};
+typedef struct trc_cap_event_s trc_cap_event_t;
+
+
+/*
+ * An archive (trc_dump_arc(), or trc_arc_open() and trc_drain_arc()) holds
+ * the same events, compressed, in a form that can be streamed:
+ *   trc_cap_hdr_t                (magic TRC_ARC; counts not yet known)
+ *   blocks: trc_arc_block_t + TRC_ARC_NUM_COLS columns, repeated
+ *   trc_cap_hdr_t                (final)
+ *   trc_cap_proc_t[num_procs]
+ *   trc_cap_thread_t[num_threads]
+ *   trc_cap_site_t[num_sites]
+ *   strings_size bytes of null-terminated file names
+ *   trc_arc_block_t[num_index]   (every block header: the block index)
+ *   trc_arc_footer_t
+ * Each column is a varint byte length and then, per event, in order:
+ *   seq, timestamp_ns, span_id, p1, p2: zig-zag varint delta from the
+ *     previous event in the block (the first from 0);
+ *   site_id, thread_idx, cpu_id, kind, proc_idx: runs of (varint value,
+ *     varint count).
+ * Site ids index the archive's site table. trc_cap_open() reads archives
+ * too, a block at a time.
+ */
+#define TRC_ARC_MAGIC "TRC_ARC"  /* 8 bytes including the null. */
+#define TRC_ARC_VERSION 2
+#define TRC_ARC_BLOCK_EVENTS 4096
+#define TRC_ARC_NUM_COLS 10
+
+struct trc_arc_block_s {
+  uint64_t offset;      /* Of this header, from the start of the file. */
+  uint64_t first_seq;
+  uint32_t num_events;
+  uint32_t data_size;   /* Bytes of columns following the header. */
+  trc_cap_index_t summary;  /* Time range and site/thread bitmaps. */
+};
+typedef struct trc_arc_block_s trc_arc_block_t;
+
+struct trc_arc_footer_s {
+  uint64_t trailer_offset;  /* Of the final trc_cap_hdr_t. */
+  char magic[8];
+};
+typedef struct trc_arc_footer_s trc_arc_footer_t;
+
+/* Archive writer. */
+struct trc_arc_s {
+  FILE *fp;
+  int err;               /* First error; later writes are dropped. */
+  uint64_t offset;       /* Bytes written so far. */
+  trc_cap_hdr_t hdr;     /* num_events, event_count, ... as of now. */
+  trc_cap_proc_t procs[TRC_CAP_MAX_PROCS];  /* hdr.num_procs of them. */
+  trc_cap_event_t *pending;
+  uint32_t num_pending;
+  uint8_t *buf;          /* One encoded block. */
+  trc_arc_block_t *blocks;
+  uint64_t blocks_alloc;
+  /* Site dictionary: (file_name pointer, line) -> site id. Open addressing. */
+  const char **map_names;
+  uint32_t *map_lines;
+  uint32_t *map_ids;     /* 0 = empty slot, else site id + 1. */
+  uint64_t map_mask;
+  trc_cap_site_t *sites;
+  uint32_t sites_alloc;
+  char *strings;
+  uint64_t strings_alloc;
+};
+typedef struct trc_arc_s trc_arc_t;
+
+
+/* Streaming reader: tables are loaded, events are read one at a time. */
+struct trc_cap_s {
+  FILE *fp;
+  trc_cap_hdr_t hdr;
+  trc_cap_proc_t *procs;
+  trc_cap_thread_t *threads;
+  trc_cap_site_t *sites;
+  char *strings;
+  uint64_t events_offset;
+  uint64_t next_event;  /* Number of events read so far. */
+  /* Set by trc_cap_mmap(). */
+  void *map_base;
+  uint64_t map_size;
+  const trc_cap_event_t *events;
+  trc_cap_index_t *index;  /* Embedded, or built by trc_cap_mmap(). */
+  int index_built;         /* If 1, index was malloced. */
+  /* Archives: hdr is the trailer's, and num_index counts blocks. */
+  int is_arc;
+  trc_arc_block_t *blocks;
+  uint64_t next_block;
+  trc_cap_event_t *block_events;  /* Decoded block being read. */
+  uint32_t block_num_events;
+  uint32_t block_next;
+  uint8_t *block_data;
+};
+typedef struct trc_cap_s trc_cap_t;
+
+/* Query filter. Zero-initialize, then set what matters. */
+#define TRC_CAP_FILTER_MAX_SITES 16
+struct trc_cap_filter_s {
+  uint64_t min_ts_ns;  /* 0 = unbounded. */
+  uint64_t max_ts_ns;  /* 0 = unbounded. */
+  int have_p1;
+  uint64_t p1;
+  int have_thread;
+  uint16_t thread_idx;
+  int have_proc;       /* Shared rings: thread_idx is this process's. */
+  uint16_t proc_idx;
+  uint32_t num_sites;  /* 0 = all sites. */
+  uint32_t site_ids[TRC_CAP_FILTER_MAX_SITES];
+};
+typedef struct trc_cap_filter_s trc_cap_filter_t;
+typedef void (*trc_cap_query_cb_t)(trc_cap_t *cap, const trc_cap_event_t *ev, void *cb_arg);
+
+#define TRC_CAP_ERR_FORMAT -4  /* Not a capture, or unsupported version. */
+
+int trc_cap_open(trc_cap_t **cap_rtn, const char *path);
+int trc_cap_close(trc_cap_t *cap);
+int trc_cap_next(trc_cap_t *cap, trc_cap_event_t *ev);  /* Returns 1, or 0 at end. */
+const char *trc_cap_site_file(trc_cap_t *cap, uint32_t site_id);
+uint32_t trc_cap_site_line(trc_cap_t *cap, uint32_t site_id);
+uint32_t trc_cap_pid(trc_cap_t *cap, uint16_t proc_idx);
+const char *trc_cap_thread_name(trc_cap_t *cap, uint16_t proc_idx, uint16_t thread_idx);
+uint64_t trc_cap_events_offset(const trc_cap_hdr_t *hdr);
+void trc_cap_proc_name(char *buf, size_t buf_sz);
+void trc_cap_print_event(trc_cap_t *cap, FILE *out_fp, const trc_cap_event_t *ev);
+void trc_cap_index_add(trc_cap_index_t *index, const trc_cap_event_t *ev, int first_in_block);
+int trc_cap_mmap(trc_cap_t *cap);
+int trc_cap_find_site(trc_cap_t *cap, const char *file_name, uint32_t file_line);
+int trc_cap_find_thread(trc_cap_t *cap, const char *name);
+uint64_t trc_cap_num_blocks(trc_cap_t *cap);
+int trc_cap_query(trc_cap_t *cap, const trc_cap_filter_t *filter,
+    trc_cap_query_cb_t cb, void *cb_arg, uint64_t *blocks_scanned_rtn);
+int trc_arc_open(trc_arc_t **arc_rtn, FILE *out_fp, uint32_t create_flags, uint32_t overhead_ns);
+uint32_t trc_arc_site_id(trc_arc_t *arc, const char *file_name, uint32_t file_line);
+int trc_arc_write(trc_arc_t *arc, const trc_cap_event_t *ev);
+int trc_arc_close(trc_arc_t *arc);
+int trc_arc_read_block(trc_cap_t *cap, uint64_t block, trc_cap_event_t *events);
+
+
+/* Chrome trace-event JSON writer (chrome://tracing, ui.perfetto.dev).
+ * Streams; memory use does not depend on the number of events. */
+struct trc_chrome_s {
+  FILE *fp;
+  uint64_t num_written;
+};
+typedef struct trc_chrome_s trc_chrome_t;
+
+void trc_chrome_begin(trc_chrome_t *chrome, FILE *fp);
+void trc_chrome_process(trc_chrome_t *chrome, uint32_t pid, const char *name);
+void trc_chrome_thread(trc_chrome_t *chrome, uint32_t pid, uint32_t thread_idx, const char *name);
+void trc_chrome_cap_names(trc_chrome_t *chrome, trc_cap_t *cap, int with_procs);
+void trc_chrome_event(trc_chrome_t *chrome, uint32_t pid, const trc_cap_event_t *ev,
+    const char *file_name, uint32_t file_line);
+void trc_chrome_end(trc_chrome_t *chrome);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* TRC_CAP_H */
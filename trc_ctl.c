@@ -0,0 +1,87 @@
+/* trc_ctl.c - send a command to a process's trace control socket.
+ * See https://github.com/fordsfords/trc
+ * This tries to be portable between Mac, Linux, and Windows.
+ */
+/*
+# This code and its documentation is Copyright 2023 Steven Ford
+# and licensed "public domain" style under Creative Commons "CC0":
+#   http://creativecommons.org/publicdomain/zero/1.0/
+# To the extent possible under law, the contributors to this project have
+# waived all copyright and related or neighboring rights to this work.
+# In other words, you can use this code for any purpose without any
+# restrictions.  This work is published from: United States.  The project home
+# is https://github.com/fordsfords/trc
+*/
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trc.h"
+
+
+char usage_str[] = "Usage: trc_ctl [-h] socket_path command [arg...]";
+
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "%s\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}
+
+void help() {
+  printf("%s\n", usage_str);
+  printf("Where:\n"
+      "  -h : print help\n"
+      "  socket_path : passed to trc_control_start() by the traced process\n"
+      "  command : one of:\n"
+      "    dump text|bin|arc|chrome path : dump a snapshot (path is opened by the traced process)\n"
+      "    freeze : stop recording\n"
+      "    unfreeze : resume recording\n"
+      "    mask kind_mask : record only kinds with bit (1 << TRC_KIND_*) set\n"
+      "    stats : print ring statistics\n");
+  exit(0);
+}
+
+
+void parse_cmdline(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "h")) != EOF) {
+    switch (opt) {
+      case 'h':
+        help();
+        break;
+      default:
+        usage(NULL);
+    }  /* switch opt */
+  }  /* while getopt */
+
+  if (optind > argc - 2) { usage("Need a socket path and a command"); }
+}  /* parse_cmdline */
+
+
+int main(int argc, char **argv)
+{
+  char cmd[1024];
+  size_t len = 0;
+  int i, err;
+
+  parse_cmdline(argc, argv);
+
+  cmd[0] = '\0';
+  for (i = optind + 1; i < argc; i++) {
+    if (len + strlen(argv[i]) + 2 > sizeof(cmd)) { usage("Command too long"); }
+    if (len > 0) { cmd[len++] = ' '; }
+    strcpy(&cmd[len], argv[i]);
+    len += strlen(argv[i]);
+  }
+
+  err = trc_control_send(argv[optind], cmd, stdout);
+  if (err == TRC_ERR_IO) {
+    fprintf(stderr, "trc_ctl: cannot reach '%s'\n", argv[optind]);
+  }
+
+  return (err == TRC_OK) ? 0 : 1;
+}  /* main */
@@ -0,0 +1,436 @@
+/* trc_decode.c - print or export a binary trace capture.
+ * See https://github.com/fordsfords/trc
+ * This tries to be portable between Mac, Linux, and Windows.
+ */
+/*
+# This code and its documentation is Copyright 2023 Steven Ford
+# and licensed "public domain" style under Creative Commons "CC0":
+#   http://creativecommons.org/publicdomain/zero/1.0/
+# To the extent possible under law, the contributors to this project have
+# waived all copyright and related or neighboring rights to this work.
+# In other words, you can use this code for any purpose without any
+# restrictions.  This work is published from: United States.  The project home
+# is https://github.com/fordsfords/trc
+*/
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trc.h"
+#include "trc_cap.h"
+
+
+/* Options and their defaults */
+int o_chrome = 0;
+int o_deltas = 0;
+int o_flows = 0;
+int o_num_slowest = 5;
+int o_overhead = 0;
+char *o_capture = NULL;
+
+
+char usage_str[] = "Usage: trc_decode [-h] [-c] [-d] [-f] [-k num_slowest] [-o] capture_file";
+
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "%s\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}
+
+void help() {
+  printf("%s\n", usage_str);
+  printf("Where:\n"
+      "  -h : print help\n"
+      "  -c : write Chrome trace-event JSON (default: text)\n"
+      "  -d : after each event, print the time since its thread's previous event\n"
+      "  -f : report flows: per-hop latency and the slowest flows\n"
+      "  -k num_slowest : flows to show with -f (default: 5)\n"
+      "  -o : subtract the capture's tracing overhead from span durations, -d deltas and flow hops\n"
+      "  capture_file : written by trc_dump_bin() or trc_dump_arc()\n");
+  exit(0);
+}
+
+
+void parse_cmdline(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hcdfk:o")) != EOF) {
+    switch (opt) {
+      case 'c':
+        o_chrome = 1;
+        break;
+      case 'd':
+        o_deltas = 1;
+        break;
+      case 'f':
+        o_flows = 1;
+        break;
+      case 'k':
+        CPRT_ATOI(optarg, o_num_slowest);
+        if (o_num_slowest < 1) { usage("num_slowest must be at least 1"); }
+        break;
+      case 'o':
+        o_overhead = 1;
+        break;
+      case 'h':
+        help();
+        break;
+      default:
+        usage(NULL);
+    }  /* switch opt */
+  }  /* while getopt */
+
+  if (optind != argc - 1) { usage("Need exactly one capture file"); }
+  o_capture = argv[optind];
+}  /* parse_cmdline */
+
+
+uint64_t overhead_ns = 0;  /* Set by -o. */
+
+
+/* A measured interval less the tracer's own share of it. */
+uint64_t adjust_ns(uint64_t ns, uint64_t num_traces)
+{
+  uint64_t trc_ns = overhead_ns * num_traces;
+  return (ns > trc_ns) ? ns - trc_ns : 0;
+}  /* adjust_ns */
+
+
+uint64_t prev_ts_ns[TRC_CAP_MAX_PROCS][0x10000];  /* By process and thread index, for -d. */
+
+
+void decode_text(trc_cap_t *cap)
+{
+  trc_cap_event_t ev;
+  uint32_t i;
+
+  printf("trc_decode: proc=%s, pid=%"PRIu32", event_count=%"PRIu64", num_events=%"PRIu64", overhead_ns=%"PRIu32"\n",
+      cap->hdr.proc_name, cap->hdr.pid, cap->hdr.event_count, cap->hdr.num_events, cap->hdr.overhead_ns);
+  for (i = 0; i < cap->hdr.num_threads; i++) {
+    printf("  thread[%"PRIu32"].tid=%"PRIu64", .name=%s\n",
+        i + 1, cap->threads[i].kernel_tid, cap->threads[i].name);
+  }
+
+  while (trc_cap_next(cap, &ev)) {
+    if (ev.kind == TRC_KIND_SPAN_END) { ev.p2 = adjust_ns(ev.p2, 1); }
+    trc_cap_print_event(cap, stdout, &ev);
+    /* The previous event's trace call is part of the gap. */
+    if (o_deltas && ev.timestamp_ns != 0) {
+      uint64_t *prev_ns = &prev_ts_ns[ev.proc_idx % TRC_CAP_MAX_PROCS][ev.thread_idx];
+      if (*prev_ns != 0 && ev.timestamp_ns >= *prev_ns) {
+        printf("    delta_ns=%"PRIu64"\n", adjust_ns(ev.timestamp_ns - *prev_ns, 1));
+      }
+      *prev_ns = ev.timestamp_ns;
+    }
+  }
+}  /* decode_text */
+
+
+void decode_chrome(trc_cap_t *cap)
+{
+  trc_chrome_t chrome;
+  trc_cap_event_t ev;
+
+  trc_chrome_begin(&chrome, stdout);
+  trc_chrome_cap_names(&chrome, cap, 0);
+  while (trc_cap_next(cap, &ev)) {
+    if (ev.kind == TRC_KIND_SPAN_END && ev.timestamp_ns != 0) {  /* Pull the end in; the begin stays put. */
+      ev.timestamp_ns -= ev.p2 - adjust_ns(ev.p2, 1);
+      ev.p2 = adjust_ns(ev.p2, 1);
+    }
+    trc_chrome_event(&chrome, trc_cap_pid(cap, ev.proc_idx), &ev,
+        trc_cap_site_file(cap, ev.site_id), trc_cap_site_line(cap, ev.site_id));
+  }
+  trc_chrome_end(&chrome);
+}  /* decode_chrome */
+
+
+#define FLOW_MAX_HOPS 32  /* Hops kept per flow; later ones are still timed. */
+
+struct flow_hop_s {
+  uint64_t timestamp_ns;
+  uint32_t site_id;
+  uint16_t thread_idx;
+  uint16_t proc_idx;
+  uint16_t kind;
+};
+typedef struct flow_hop_s flow_hop_t;
+
+struct flow_s {
+  uint32_t flow_id;    /* 0 = free table slot. */
+  uint32_t num_hops;   /* Including any past FLOW_MAX_HOPS. */
+  uint64_t total_ns;
+  uint64_t last_ns;
+  uint32_t last_site;
+  flow_hop_t hops[FLOW_MAX_HOPS];
+};
+typedef struct flow_s flow_t;
+
+/* Latency from one site to the next, over all flows. */
+struct flow_edge_s {
+  uint32_t from_site;
+  uint32_t to_site;
+  trc_hist_t hist;
+};
+typedef struct flow_edge_s flow_edge_t;
+
+/* Flows in progress are in an open-addressed table keyed by flow id, so
+ * memory follows the number in flight, not the size of the capture. */
+struct flow_state_s {
+  flow_t *active;
+  uint32_t table_size;  /* Power of 2. */
+  uint32_t num_active;
+  flow_edge_t *edges;
+  uint32_t num_edges;
+  flow_t *slowest;      /* Sorted, slowest first. */
+  int num_slowest;
+  uint64_t num_completed;
+  uint64_t num_orphaned;  /* Steps or ends whose begin was not captured. */
+  uint64_t num_restarted;
+};
+typedef struct flow_state_s flow_state_t;
+
+
+uint32_t flow_home(flow_state_t *state, uint32_t flow_id)
+{
+  return (flow_id * 2654435761u) & (state->table_size - 1);
+}  /* flow_home */
+
+
+flow_t *flow_find(flow_state_t *state, uint32_t flow_id)
+{
+  uint32_t i;
+
+  if (state->table_size == 0) { return NULL; }
+  i = flow_home(state, flow_id);
+  while (state->active[i].flow_id != 0) {
+    if (state->active[i].flow_id == flow_id) { return &state->active[i]; }
+    i = (i + 1) & (state->table_size - 1);
+  }
+  return NULL;
+}  /* flow_find */
+
+
+flow_t *flow_insert(flow_state_t *state, uint32_t flow_id)
+{
+  uint32_t i;
+
+  if ((state->num_active + 1) * 2 > state->table_size) {
+    flow_t *old = state->active;
+    uint32_t old_size = state->table_size;
+    uint32_t j;
+
+    state->table_size = (old_size == 0) ? 1024 : old_size * 2;
+    state->active = (flow_t *)calloc(state->table_size, sizeof(flow_t));
+    CPRT_ASSERT(state->active != NULL);
+    for (j = 0; j < old_size; j++) {
+      if (old[j].flow_id == 0) { continue; }
+      i = flow_home(state, old[j].flow_id);
+      while (state->active[i].flow_id != 0) { i = (i + 1) & (state->table_size - 1); }
+      state->active[i] = old[j];
+    }
+    free(old);
+  }
+
+  i = flow_home(state, flow_id);
+  while (state->active[i].flow_id != 0) { i = (i + 1) & (state->table_size - 1); }
+  memset(&state->active[i], 0, sizeof(flow_t));
+  state->active[i].flow_id = flow_id;
+  state->num_active++;
+  return &state->active[i];
+}  /* flow_insert */
+
+
+/* Linear-probing delete: pull later entries of the same run back into the
+ * hole so lookups never stop early. */
+void flow_remove(flow_state_t *state, flow_t *flow)
+{
+  uint32_t mask = state->table_size - 1;
+  uint32_t hole = (uint32_t)(flow - state->active);
+  uint32_t i = hole;
+
+  for (;;) {
+    uint32_t home;
+    i = (i + 1) & mask;
+    if (state->active[i].flow_id == 0) { break; }
+    home = flow_home(state, state->active[i].flow_id);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      state->active[hole] = state->active[i];
+      hole = i;
+    }
+  }
+  state->active[hole].flow_id = 0;
+  state->num_active--;
+}  /* flow_remove */
+
+
+void flow_edge_record(flow_state_t *state, uint32_t from_site, uint32_t to_site, uint64_t ns)
+{
+  flow_edge_t *edge = NULL;
+  uint32_t i;
+
+  for (i = 0; i < state->num_edges; i++) {
+    if (state->edges[i].from_site == from_site && state->edges[i].to_site == to_site) {
+      edge = &state->edges[i];
+      break;
+    }
+  }
+  if (edge == NULL) {
+    state->edges = (flow_edge_t *)realloc(state->edges, (state->num_edges + 1) * sizeof(flow_edge_t));
+    CPRT_ASSERT(state->edges != NULL);
+    edge = &state->edges[state->num_edges++];
+    memset(edge, 0, sizeof(*edge));
+    edge->from_site = from_site;
+    edge->to_site = to_site;
+  }
+  trc_hist_record(&edge->hist, ns);
+}  /* flow_edge_record */
+
+
+void flow_complete(flow_state_t *state, flow_t *flow)
+{
+  int i;
+
+  state->num_completed++;
+  flow->total_ns = (flow->last_ns > flow->hops[0].timestamp_ns) ? flow->last_ns - flow->hops[0].timestamp_ns : 0;
+  flow->total_ns = adjust_ns(flow->total_ns, flow->num_hops - 1);
+
+  if (state->num_slowest == o_num_slowest &&
+      flow->total_ns <= state->slowest[state->num_slowest - 1].total_ns) {
+    return;
+  }
+  if (state->num_slowest < o_num_slowest) { state->num_slowest++; }
+  i = state->num_slowest - 1;
+  while (i > 0 && state->slowest[i - 1].total_ns < flow->total_ns) {
+    state->slowest[i] = state->slowest[i - 1];
+    i--;
+  }
+  state->slowest[i] = *flow;
+}  /* flow_complete */
+
+
+void flow_event(flow_state_t *state, const trc_cap_event_t *ev)
+{
+  flow_t *flow = flow_find(state, ev->span_id);
+
+  if (ev->kind == TRC_KIND_FLOW_BEGIN) {
+    if (flow != NULL) {  /* Id reused before its end was traced. */
+      state->num_restarted++;
+      flow_remove(state, flow);
+    }
+    flow = flow_insert(state, ev->span_id);
+  }
+  else if (flow == NULL) {
+    state->num_orphaned++;
+    return;
+  }
+  else {
+    /* Clocks on different CPUs can disagree slightly. */
+    flow_edge_record(state, flow->last_site, ev->site_id,
+        adjust_ns((ev->timestamp_ns > flow->last_ns) ? ev->timestamp_ns - flow->last_ns : 0, 1));
+  }
+
+  if (flow->num_hops < FLOW_MAX_HOPS) {
+    flow_hop_t *hop = &flow->hops[flow->num_hops];
+    hop->timestamp_ns = ev->timestamp_ns;
+    hop->site_id = ev->site_id;
+    hop->thread_idx = ev->thread_idx;
+    hop->proc_idx = ev->proc_idx;
+    hop->kind = (uint16_t)ev->kind;
+  }
+  flow->num_hops++;
+  flow->last_ns = ev->timestamp_ns;
+  flow->last_site = ev->site_id;
+
+  if (ev->kind == TRC_KIND_FLOW_END) {
+    flow_complete(state, flow);
+    flow_remove(state, flow);
+  }
+}  /* flow_event */
+
+
+void decode_flows(trc_cap_t *cap)
+{
+  flow_state_t state;
+  trc_cap_event_t ev;
+  uint32_t i, h;
+  int s;
+
+  if ((cap->hdr.create_flags & TRC_CREATE_FLAG_TIMESTAMP) == 0) {
+    fprintf(stderr, "trc_decode: flow report needs a capture with timestamps\n");
+    exit(1);
+  }
+  memset(&state, 0, sizeof(state));
+  state.slowest = (flow_t *)calloc(o_num_slowest, sizeof(flow_t));
+  CPRT_ASSERT(state.slowest != NULL);
+
+  while (trc_cap_next(cap, &ev)) {
+    if (ev.kind >= TRC_KIND_FLOW_BEGIN && ev.kind <= TRC_KIND_FLOW_END && ev.span_id != 0) {
+      flow_event(&state, &ev);
+    }
+  }
+
+  printf("trc_decode: flows completed=%"PRIu64", incomplete=%"PRIu32", orphaned=%"PRIu64", restarted=%"PRIu64"\n",
+      state.num_completed, state.num_active, state.num_orphaned, state.num_restarted);
+  for (i = 0; i < state.num_edges; i++) {
+    flow_edge_t *edge = &state.edges[i];
+    printf("  hop %s:%"PRIu32, trc_cap_site_file(cap, edge->from_site), trc_cap_site_line(cap, edge->from_site));
+    printf(" -> %s:%"PRIu32": count=%"PRIu64", p50=%"PRIu64", p90=%"PRIu64", p99=%"PRIu64", max=%"PRIu64" ns\n",
+        trc_cap_site_file(cap, edge->to_site), trc_cap_site_line(cap, edge->to_site), edge->hist.count,
+        trc_hist_percentile(&edge->hist, 50.0), trc_hist_percentile(&edge->hist, 90.0),
+        trc_hist_percentile(&edge->hist, 99.0), edge->hist.max);
+  }
+  for (s = 0; s < state.num_slowest; s++) {
+    flow_t *flow = &state.slowest[s];
+    printf("  slowest[%d]: flow=0x%"PRIx32", total_ns=%"PRIu64", hops=%"PRIu32"\n",
+        s, flow->flow_id, flow->total_ns, flow->num_hops);
+    for (h = 0; h < flow->num_hops && h < FLOW_MAX_HOPS; h++) {
+      flow_hop_t *hop = &flow->hops[h];
+      printf("    %s +%"PRIu64" ns, thread=%s[%"PRIu16"], %s:%"PRIu32"\n",
+          trc_flow_kind_names[hop->kind - TRC_KIND_FLOW_BEGIN],
+          (h == 0 || hop->timestamp_ns < flow->hops[h - 1].timestamp_ns) ? 0 :
+          adjust_ns(hop->timestamp_ns - flow->hops[h - 1].timestamp_ns, 1),
+          trc_cap_thread_name(cap, hop->proc_idx, hop->thread_idx), hop->thread_idx,
+          trc_cap_site_file(cap, hop->site_id), trc_cap_site_line(cap, hop->site_id));
+    }
+  }
+
+  free(state.edges);
+  free(state.slowest);
+  free(state.active);
+}  /* decode_flows */
+
+
+int main(int argc, char **argv)
+{
+  trc_cap_t *cap;
+  int err;
+
+  parse_cmdline(argc, argv);
+
+  err = trc_cap_open(&cap, o_capture);
+  if (err != TRC_OK) {
+    fprintf(stderr, "trc_decode: cannot read capture '%s' (err=%d)\n", o_capture, err);
+    exit(1);
+  }
+
+  if (o_overhead) {
+    overhead_ns = cap->hdr.overhead_ns;
+  }
+
+  if (o_flows) {
+    decode_flows(cap);
+  }
+  else if (o_chrome) {
+    decode_chrome(cap);
+  }
+  else {
+    decode_text(cap);
+  }
+
+  trc_cap_close(cap);
+  return 0;
+}  /* main */
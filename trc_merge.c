@@ -0,0 +1,200 @@
+/* trc_merge.c - merge binary trace captures from several processes.
+ * See https://github.com/fordsfords/trc
+ * This tries to be portable between Mac, Linux, and Windows.
+ */
+/*
+# This code and its documentation is Copyright 2023 Steven Ford
+# and licensed "public domain" style under Creative Commons "CC0":
+#   http://creativecommons.org/publicdomain/zero/1.0/
+# To the extent possible under law, the contributors to this project have
+# waived all copyright and related or neighboring rights to this work.
+# In other words, you can use this code for any purpose without any
+# restrictions.  This work is published from: United States.  The project home
+# is https://github.com/fordsfords/trc
+*/
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trc.h"
+#include "trc_cap.h"
+
+
+/* Options and their defaults */
+int o_chrome = 0;
+
+
+char usage_str[] = "Usage: trc_merge [-h] [-c] capture_file...";
+
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "%s\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}
+
+void help() {
+  printf("%s\n", usage_str);
+  printf("Where:\n"
+      "  -h : print help\n"
+      "  -c : write Chrome trace-event JSON (default: text)\n"
+      "  capture_file : written by trc_dump_bin() or trc_dump_arc(), one or more\n");
+  exit(0);
+}
+
+
+void parse_cmdline(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hc")) != EOF) {
+    switch (opt) {
+      case 'c':
+        o_chrome = 1;
+        break;
+      case 'h':
+        help();
+        break;
+      default:
+        usage(NULL);
+    }  /* switch opt */
+  }  /* while getopt */
+
+  if (optind >= argc) { usage("Need at least one capture file"); }
+}  /* parse_cmdline */
+
+
+/* One per input capture. Only the next event of each is held. */
+struct merge_input_s {
+  trc_cap_t *cap;
+  const char *path;
+  int64_t adjust_ns;    /* Added to timestamps to get the common timeline. */
+  trc_cap_event_t ev;   /* Next event, adjusted. */
+};
+typedef struct merge_input_s merge_input_t;
+
+
+/* Heap order: earlier timestamp first, ties in input order. */
+int merge_before(merge_input_t *a, merge_input_t *b)
+{
+  if (a->ev.timestamp_ns != b->ev.timestamp_ns) { return a->ev.timestamp_ns < b->ev.timestamp_ns; }
+  return a < b;
+}  /* merge_before */
+
+
+void heap_down(merge_input_t **heap, int heap_len, int i)
+{
+  for (;;) {
+    int smallest = i;
+    int left = 2 * i + 1;
+    int right = 2 * i + 2;
+    merge_input_t *temp;
+
+    if (left < heap_len && merge_before(heap[left], heap[smallest])) { smallest = left; }
+    if (right < heap_len && merge_before(heap[right], heap[smallest])) { smallest = right; }
+    if (smallest == i) { break; }
+    temp = heap[i];  heap[i] = heap[smallest];  heap[smallest] = temp;
+    i = smallest;
+  }
+}  /* heap_down */
+
+
+/* Read the input's next event onto the timeline. Returns 0 at end. */
+int input_next(merge_input_t *input)
+{
+  if (! trc_cap_next(input->cap, &input->ev)) { return 0; }
+  if (input->ev.timestamp_ns != 0) {
+    input->ev.timestamp_ns = (uint64_t)((int64_t)input->ev.timestamp_ns + input->adjust_ns);
+  }
+  return 1;
+}  /* input_next */
+
+
+int main(int argc, char **argv)
+{
+  merge_input_t *inputs;
+  merge_input_t **heap;
+  trc_chrome_t chrome;
+  int num_inputs, heap_len;
+  int64_t ref_offset_ns = 0;
+  int i, err;
+
+  parse_cmdline(argc, argv);
+
+  num_inputs = argc - optind;
+  inputs = (merge_input_t *)calloc(num_inputs, sizeof(merge_input_t));
+  heap = (merge_input_t **)calloc(num_inputs, sizeof(merge_input_t *));
+  CPRT_ASSERT(inputs != NULL && heap != NULL);
+
+  /* Timestamps are wall clock, which can be stepped between dumps. Each
+   * capture's anchors give its wall-minus-monotonic offset; moving every
+   * capture onto the shared monotonic clock, expressed in the first
+   * capture's wall time, lines them up. */
+  for (i = 0; i < num_inputs; i++) {
+    trc_cap_hdr_t *hdr;
+    inputs[i].path = argv[optind + i];
+    err = trc_cap_open(&inputs[i].cap, inputs[i].path);
+    if (err != TRC_OK) {
+      fprintf(stderr, "trc_merge: cannot read capture '%s' (err=%d)\n", inputs[i].path, err);
+      exit(1);
+    }
+    hdr = &inputs[i].cap->hdr;
+    if (i == 0) {
+      ref_offset_ns = (int64_t)(hdr->anchor_wall_ns - hdr->anchor_mono_ns);
+    }
+    inputs[i].adjust_ns = ref_offset_ns - (int64_t)(hdr->anchor_wall_ns - hdr->anchor_mono_ns);
+  }
+
+  if (o_chrome) {
+    trc_chrome_begin(&chrome, stdout);
+  }
+  for (i = 0; i < num_inputs; i++) {
+    trc_cap_t *cap = inputs[i].cap;
+    if (o_chrome) {
+      trc_chrome_cap_names(&chrome, cap, 1);
+    }
+    else {
+      printf("trc_merge: input[%d]=%s, proc=%s, pid=%"PRIu32", num_events=%"PRIu64", adjust_ns=%"PRId64"\n",
+          i, inputs[i].path, cap->hdr.proc_name, cap->hdr.pid, cap->hdr.num_events, inputs[i].adjust_ns);
+    }
+  }
+
+  heap_len = 0;
+  for (i = 0; i < num_inputs; i++) {
+    if (input_next(&inputs[i])) { heap[heap_len++] = &inputs[i]; }
+  }
+  for (i = heap_len / 2 - 1; i >= 0; i--) {
+    heap_down(heap, heap_len, i);
+  }
+
+  while (heap_len > 0) {
+    merge_input_t *input = heap[0];
+    trc_cap_t *cap = input->cap;
+
+    if (o_chrome) {
+      trc_chrome_event(&chrome, trc_cap_pid(cap, input->ev.proc_idx), &input->ev,
+          trc_cap_site_file(cap, input->ev.site_id), trc_cap_site_line(cap, input->ev.site_id));
+    }
+    else {
+      printf("%s[%"PRIu32"]", cap->hdr.proc_name, cap->hdr.pid);
+      trc_cap_print_event(cap, stdout, &input->ev);
+    }
+
+    if (! input_next(input)) {
+      heap[0] = heap[--heap_len];
+    }
+    heap_down(heap, heap_len, 0);
+  }
+
+  if (o_chrome) {
+    trc_chrome_end(&chrome);
+  }
+
+  for (i = 0; i < num_inputs; i++) {
+    trc_cap_close(inputs[i].cap);
+  }
+  free(heap);
+  free(inputs);
+  return 0;
+}  /* main */
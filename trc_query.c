@@ -0,0 +1,250 @@
+/* trc_query.c - filter and aggregate a binary trace capture.
+ * See https://github.com/fordsfords/trc
+ * This tries to be portable between Mac, Linux, and Windows.
+ */
+/*
+# This code and its documentation is Copyright 2023 Steven Ford
+# and licensed "public domain" style under Creative Commons "CC0":
+#   http://creativecommons.org/publicdomain/zero/1.0/
+# To the extent possible under law, the contributors to this project have
+# waived all copyright and related or neighboring rights to this work.
+# In other words, you can use this code for any purpose without any
+# restrictions.  This work is published from: United States.  The project home
+# is https://github.com/fordsfords/trc
+*/
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trc.h"
+#include "trc_cap.h"
+
+
+/* Options and their defaults */
+int o_agg = 0;
+char *o_begin = NULL;
+char *o_end = NULL;
+int o_gaps = 0;
+char *o_p1 = NULL;
+char *o_sites = NULL;
+char *o_thread = NULL;
+char *o_capture = NULL;
+
+
+char usage_str[] = "Usage: trc_query [-h] [-a] [-g] [-b begin_us] [-e end_us] [-p p1] [-s sites] [-t thread] capture_file";
+
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "%s\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}
+
+void help() {
+  printf("%s\n", usage_str);
+  printf("Where:\n"
+      "  -h : print help\n"
+      "  -a : print per-site counts and rates instead of events\n"
+      "  -g : print the distribution of gaps between matching events\n"
+      "  -b begin_us : skip events before this (microseconds after first event)\n"
+      "  -e end_us : skip events after this (microseconds after first event)\n"
+      "  -p p1 : only events with this p1 (decimal or 0x hex)\n"
+      "  -s sites : only these sites, 'file:line|file:line...'\n"
+      "  -t thread : only this thread (name or index)\n"
+      "  capture_file : written by trc_dump_bin() or trc_dump_arc()\n");
+  exit(0);
+}
+
+
+void parse_cmdline(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hab:e:gp:s:t:")) != EOF) {
+    switch (opt) {
+      case 'a':
+        o_agg = 1;
+        break;
+      case 'b':
+        o_begin = optarg;
+        break;
+      case 'e':
+        o_end = optarg;
+        break;
+      case 'g':
+        o_gaps = 1;
+        break;
+      case 'p':
+        o_p1 = optarg;
+        break;
+      case 's':
+        o_sites = optarg;
+        break;
+      case 't':
+        o_thread = optarg;
+        break;
+      case 'h':
+        help();
+        break;
+      default:
+        usage(NULL);
+    }  /* switch opt */
+  }  /* while getopt */
+
+  if (optind != argc - 1) { usage("Need exactly one capture file"); }
+  o_capture = argv[optind];
+}  /* parse_cmdline */
+
+
+/* Fill the filter from the command-line options. */
+void build_filter(trc_cap_t *cap, trc_cap_filter_t *filter)
+{
+  uint64_t base_ns;  /* First event's time. */
+  uint64_t us;
+
+  memset(filter, 0, sizeof(*filter));
+  base_ns = cap->is_arc ? cap->blocks[0].summary.min_ts_ns : cap->index[0].min_ts_ns;
+
+  if (o_begin != NULL) {
+    CPRT_ATOI(o_begin, us);
+    filter->min_ts_ns = base_ns + us * 1000;
+    if (filter->min_ts_ns == 0) { filter->min_ts_ns = 1; }
+  }
+  if (o_end != NULL) {
+    CPRT_ATOI(o_end, us);
+    filter->max_ts_ns = base_ns + us * 1000;
+    if (filter->max_ts_ns == 0) { filter->max_ts_ns = 1; }
+  }
+  if (o_p1 != NULL) {
+    CPRT_ATOI(o_p1, filter->p1);
+    filter->have_p1 = 1;
+  }
+  if (o_thread != NULL) {
+    int thread_idx = trc_cap_find_thread(cap, o_thread);
+    if (thread_idx < 0) {
+      CPRT_ATOI(o_thread, filter->thread_idx);
+    }
+    else {
+      filter->thread_idx = (uint16_t)thread_idx;
+      filter->have_proc = (cap->hdr.num_procs > 0);  /* Another process's thread may share the index. */
+      filter->proc_idx = (uint16_t)cap->hdr.threads_proc_idx;
+    }
+    filter->have_thread = 1;
+  }
+  if (o_sites != NULL) {
+    char *sites = CPRT_STRDUP(o_sites);
+    char *save_ptr = NULL;
+    char *site;
+    CPRT_ASSERT(sites != NULL);
+    for (site = CPRT_STRTOK(sites, "|", &save_ptr); site != NULL;
+        site = CPRT_STRTOK(NULL, "|", &save_ptr)) {
+      char *colon = strrchr(site, ':');
+      uint32_t line;
+      int site_id;
+      if (colon == NULL) { usage("Site must be file:line"); }
+      *colon = '\0';
+      CPRT_ATOI(colon + 1, line);
+      site_id = trc_cap_find_site(cap, site, line);
+      if (site_id < 0) {
+        fprintf(stderr, "trc_query: site %s:%"PRIu32" not in capture\n", site, line);
+        continue;  /* Cannot match; leave it out. */
+      }
+      if (filter->num_sites >= TRC_CAP_FILTER_MAX_SITES) { usage("Too many sites"); }
+      filter->site_ids[filter->num_sites++] = (uint32_t)site_id;
+    }
+    if (filter->num_sites == 0) {
+      filter->num_sites = 1;
+      filter->site_ids[0] = cap->hdr.num_sites;  /* Matches nothing. */
+    }
+    free(sites);
+  }
+}  /* build_filter */
+
+
+struct query_state_s {
+  uint64_t num_matched;
+  uint64_t prev_ts_ns;
+  uint64_t *site_counts;
+  uint64_t *site_first_ns;
+  uint64_t *site_last_ns;
+  trc_hist_t gaps;
+};
+typedef struct query_state_s query_state_t;
+
+
+void query_cb(trc_cap_t *cap, const trc_cap_event_t *ev, void *cb_arg)
+{
+  query_state_t *state = (query_state_t *)cb_arg;
+
+  if (o_gaps && state->num_matched > 0 && ev->timestamp_ns >= state->prev_ts_ns) {
+    trc_hist_record(&state->gaps, ev->timestamp_ns - state->prev_ts_ns);
+  }
+  state->prev_ts_ns = ev->timestamp_ns;
+  state->num_matched++;
+
+  if (o_agg) {
+    if (state->site_counts[ev->site_id] == 0) { state->site_first_ns[ev->site_id] = ev->timestamp_ns; }
+    state->site_last_ns[ev->site_id] = ev->timestamp_ns;
+    state->site_counts[ev->site_id]++;
+  }
+  else if (! o_gaps) {
+    trc_cap_print_event(cap, stdout, ev);
+  }
+}  /* query_cb */
+
+
+int main(int argc, char **argv)
+{
+  trc_cap_t *cap;
+  trc_cap_filter_t filter;
+  query_state_t state;
+  uint64_t blocks_scanned;
+  uint32_t i;
+  int err;
+
+  parse_cmdline(argc, argv);
+
+  err = trc_cap_open(&cap, o_capture);
+  if (err == TRC_OK) { err = trc_cap_mmap(cap); }
+  if (err != TRC_OK) {
+    fprintf(stderr, "trc_query: cannot read capture '%s' (err=%d)\n", o_capture, err);
+    exit(1);
+  }
+  build_filter(cap, &filter);
+
+  memset(&state, 0, sizeof(state));
+  state.site_counts = (uint64_t *)calloc(cap->hdr.num_sites + 1, sizeof(uint64_t));
+  state.site_first_ns = (uint64_t *)calloc(cap->hdr.num_sites + 1, sizeof(uint64_t));
+  state.site_last_ns = (uint64_t *)calloc(cap->hdr.num_sites + 1, sizeof(uint64_t));
+  CPRT_ASSERT(state.site_counts != NULL && state.site_first_ns != NULL && state.site_last_ns != NULL);
+
+  err = trc_cap_query(cap, &filter, query_cb, &state, &blocks_scanned);
+  CPRT_ASSERT(err == TRC_OK);
+
+  if (o_agg) {
+    for (i = 0; i < cap->hdr.num_sites; i++) {
+      uint64_t span_ns = state.site_last_ns[i] - state.site_first_ns[i];
+      if (state.site_counts[i] == 0) { continue; }
+      printf("  site %s:%"PRIu32": count=%"PRIu64, trc_cap_site_file(cap, i),
+          trc_cap_site_line(cap, i), state.site_counts[i]);
+      if (state.site_counts[i] > 1 && span_ns > 0) {
+        printf(", rate=%.1f/s", (double)(state.site_counts[i] - 1) * 1e9 / (double)span_ns);
+      }
+      printf("\n");
+    }
+  }
+  if (o_gaps) {
+    printf("  gaps: count=%"PRIu64", p50=%"PRIu64", p90=%"PRIu64", p99=%"PRIu64", max=%"PRIu64" ns\n",
+        state.gaps.count, trc_hist_percentile(&state.gaps, 50.0), trc_hist_percentile(&state.gaps, 90.0),
+        trc_hist_percentile(&state.gaps, 99.0), state.gaps.max);
+  }
+  printf("trc_query: matched=%"PRIu64", %s=%"PRIu64"/%"PRIu64"\n", state.num_matched,
+      cap->is_arc ? "arc_blocks_scanned" : "blocks_scanned", blocks_scanned, trc_cap_num_blocks(cap));
+
+  free(state.site_counts);
+  free(state.site_first_ns);
+  free(state.site_last_ns);
+  trc_cap_close(cap);
+  return 0;
+}  /* main */
@@ -0,0 +1,141 @@
+/* trc_tail.c - follow a shared or file-backed trace ring from outside.
+ * See https://github.com/fordsfords/trc
+ * This tries to be portable between Mac, Linux, and Windows.
+ */
+/*
+# This code and its documentation is Copyright 2023 Steven Ford
+# and licensed "public domain" style under Creative Commons "CC0":
+#   http://creativecommons.org/publicdomain/zero/1.0/
+# To the extent possible under law, the contributors to this project have
+# waived all copyright and related or neighboring rights to this work.
+# In other words, you can use this code for any purpose without any
+# restrictions.  This work is published from: United States.  The project home
+# is https://github.com/fordsfords/trc
+*/
+
+#include "cprt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include "trc.h"
+
+
+/* Options and their defaults */
+int o_all = 0;
+int o_interval_ms = 10;
+int o_no_follow = 0;
+char *o_name = NULL;
+
+
+char usage_str[] = "Usage: trc_tail [-h] [-a] [-i interval_ms] [-n] name";
+
+void usage(char *msg) {
+  if (msg) fprintf(stderr, "%s\n", msg);
+  fprintf(stderr, "%s\n", usage_str);
+  exit(1);
+}
+
+void help() {
+  printf("%s\n", usage_str);
+  printf("Where:\n"
+      "  -h : print help\n"
+      "  -a : start with the oldest event still in the ring (default: new events only)\n"
+      "  -i interval_ms : poll interval (default: 10)\n"
+      "  -n : exit once caught up instead of following\n"
+      "  name : passed to trc_create_shared() by the traced processes\n");
+  exit(0);
+}
+
+
+void parse_cmdline(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hai:n")) != EOF) {
+    switch (opt) {
+      case 'a':
+        o_all = 1;
+        break;
+      case 'i':
+        CPRT_ATOI(optarg, o_interval_ms);
+        break;
+      case 'n':
+        o_no_follow = 1;
+        break;
+      case 'h':
+        help();
+        break;
+      default:
+        usage(NULL);
+    }  /* switch opt */
+  }  /* while getopt */
+
+  if (optind != argc - 1) { usage("Need exactly one ring name"); }
+  o_name = argv[optind];
+}  /* parse_cmdline */
+
+
+volatile int stop_requested = 0;
+
+void stop_handler(int sig)
+{
+  (void)sig;
+  stop_requested = 1;
+}  /* stop_handler */
+
+
+int main(int argc, char **argv)
+{
+  trc_t *trc;
+  static uint16_t last_cpu[TRC_MAX_THREADS];
+  uint64_t next, count;
+  uint64_t num_printed = 0;
+  uint64_t num_missed = 0;
+  int stuck_ms = 0;
+  int n, err;
+
+  parse_cmdline(argc, argv);
+
+  err = trc_attach_shared(&trc, o_name);
+  if (err != TRC_OK) {
+    fprintf(stderr, "trc_tail: cannot attach to '%s' (err=%d)\n", o_name, err);
+    exit(1);
+  }
+  signal(SIGINT, stop_handler);
+  memset(last_cpu, 0xff, sizeof(last_cpu));
+
+  count = CPRT_VOL64(trc->shm->event_count);
+  next = count;
+  if (o_all) {
+    next = (count > trc->num_entries) ? count - trc->num_entries : 0;
+  }
+
+  while (! stop_requested) {
+    n = trc_tail(trc, &next, stdout, &num_missed, last_cpu);
+    fflush(stdout);
+    num_printed += n;
+    count = CPRT_VOL64(trc->shm->event_count);
+
+    if (n > 0 || next >= count) {
+      stuck_ms = 0;
+    }
+    else if (stuck_ms >= 1000) {
+      /* Its writer has probably died mid-event; don't wait forever. */
+      next++;
+      num_missed++;
+      stuck_ms = 0;
+      continue;
+    }
+    if (o_no_follow && next >= count) { break; }
+
+    CPRT_SLEEP_MS(o_interval_ms);
+    stuck_ms += o_interval_ms;
+  }
+
+  printf("trc_tail: printed=%"PRIu64", missed=%"PRIu64"\n", num_printed, num_missed);
+
+  trc_delete(trc);
+  return 0;
+}  /* main */
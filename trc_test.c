@@ -17,14 +17,297 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
+#if ! defined(_WIN32)
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <signal.h>
+#endif
 
 #include "trc.h"
+#include "trc_cap.h"
 
 
 /* Options and their defaults */
 int o_testnum = 0;
 
 
+trc_t *test_trc;
+
+CPRT_THREAD_ENTRYPOINT test_named_thread(void *in_arg)
+{
+  char *name = (char *)in_arg;
+
+  TRC_ERR(trc_set_thread_name(name));
+  TRC_ERR(trc_trace(test_trc, __FILE__, __LINE__, 1, 0));
+  TRC_ERR(trc_trace(test_trc, __FILE__, __LINE__, 2, 0));
+
+  return 0;
+}  /* test_named_thread */
+
+
+#if defined(__GNUC__)
+#define TEST_NOINLINE __attribute__((noinline))
+#else
+#define TEST_NOINLINE
+#endif
+
+TEST_NOINLINE void test_caller_inner(trc_t *trc)
+{
+  TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 1, 0));
+}  /* test_caller_inner */
+
+TEST_NOINLINE void test_caller_outer(trc_t *trc)
+{
+  test_caller_inner(trc);
+}  /* test_caller_outer */
+
+
+trc_count_site_t test_count_site = TRC_COUNT_SITE_INIT(__FILE__, __LINE__);
+
+CPRT_THREAD_ENTRYPOINT test_count_thread(void *in_arg)
+{
+  uint64_t p2 = (uint64_t)(uintptr_t)in_arg;
+  int i;
+
+  for (i = 0; i < 1000; i++) {
+    TRC_ERR(trc_count(test_trc, &test_count_site, i, p2));
+  }
+
+  return 0;
+}  /* test_count_thread */
+
+
+uint64_t test_gauge_cb(void *cb_arg)
+{
+  return ++(*(uint64_t *)cb_arg);
+}  /* test_gauge_cb */
+
+
+/* Three stages handing the same requests along; flow_a starts
+ * test_flow_ids[6] 20 ms before the others, so it is the slowest. */
+uint32_t test_flow_ids[20];
+
+CPRT_THREAD_ENTRYPOINT test_flow_thread(void *in_arg)
+{
+  char *name = (char *)in_arg;
+  int i;
+
+  TRC_ERR(trc_set_thread_name(name));
+  for (i = 0; i < 20; i++) {
+    if (strcmp(name, "flow_a") == 0) {
+      if (i == 0) {
+        TRC_ERR(TRC_FLOW_BEGIN(test_trc, test_flow_ids[6], 6, 0));
+        CPRT_SLEEP_MS(20);
+      }
+      if (i != 6) { TRC_ERR(TRC_FLOW_BEGIN(test_trc, test_flow_ids[i], i, 0)); }
+    }
+    else if (strcmp(name, "flow_b") == 0) {
+      TRC_ERR(TRC_FLOW_STEP(test_trc, test_flow_ids[i], i, 0));
+    }
+    else {
+      TRC_ERR(TRC_FLOW_END(test_trc, test_flow_ids[i], i, 0));
+    }
+  }
+
+  return 0;
+}  /* test_flow_thread */
+
+
+FILE *test_async_fp;
+
+void test_ts_fprintf(FILE *fp, const char *format, ...)
+{
+  va_list argp;
+  va_start(argp, format);
+  cprt_vts_fprintf(fp, format, argp);
+  va_end(argp);
+}  /* test_ts_fprintf */
+
+
+CPRT_THREAD_ENTRYPOINT test_async_thread(void *in_arg)
+{
+  int thread_num = (int)(uintptr_t)in_arg;
+  int i;
+
+  for (i = 0; i < 500; i++) {
+    test_ts_fprintf(test_async_fp, "thread=%d, i=%d\n", thread_num, i);
+  }
+
+  return 0;
+}  /* test_async_thread */
+
+
+#define TEST_Q_ITEMS 1000000
+cprt_spsc_t *test_spsc;
+cprt_mpsc_t *test_mpsc;
+cprt_pool_t *test_pool;
+
+CPRT_THREAD_ENTRYPOINT test_spsc_producer(void *in_arg)
+{
+  uint32_t batch = (uint32_t)(uintptr_t)in_arg;
+  void *items[64];
+  uint32_t i, j, n;
+
+  for (i = 0; i < TEST_Q_ITEMS; i += n) {
+    n = (TEST_Q_ITEMS - i < batch) ? TEST_Q_ITEMS - i : batch;
+    for (j = 0; j < n; j++) {
+      items[j] = (void *)(uintptr_t)(i + j + 1);
+    }
+    n = cprt_spsc_enqueue_batch(test_spsc, items, n);  /* Partial if full. */
+    if (n == 0) { CPRT_SLEEP_MS(0); }  /* Let the consumer run (maybe 1 CPU). */
+  }
+
+  return 0;
+}  /* test_spsc_producer */
+
+
+CPRT_THREAD_ENTRYPOINT test_mpsc_producer(void *in_arg)
+{
+  uintptr_t thread_num = (uintptr_t)in_arg;
+  void *item;
+  uint32_t i;
+
+  for (i = 0; i < TEST_Q_ITEMS / 4; i++) {
+    item = (void *)((thread_num << 24) | i);
+    while (CPRT_MPSC_ENQUEUE(test_mpsc, item) == 0) { CPRT_SLEEP_MS(0); }
+  }
+
+  return 0;
+}  /* test_mpsc_producer */
+
+
+CPRT_THREAD_ENTRYPOINT test_pool_thread(void *in_arg)
+{
+  uint32_t thread_num = (uint32_t)(uintptr_t)in_arg;
+  uint32_t *objs[8];
+  int i, j;
+
+  for (i = 0; i < TEST_Q_ITEMS / 32; i++) {
+    for (j = 0; j < 8; j++) {
+      objs[j] = (uint32_t *)cprt_pool_get(test_pool);
+      CPRT_ASSERT(objs[j] != NULL);  /* 32 objects, at most 4 x 8 held. */
+      CPRT_ASSERT(*objs[j] == 0);  /* Not handed out twice. */
+      *objs[j] = thread_num;
+    }
+    for (j = 0; j < 8; j++) {
+      CPRT_ASSERT(*objs[j] == thread_num);
+      *objs[j] = 0;
+      cprt_pool_put(test_pool, objs[j]);
+    }
+  }
+
+  return 0;
+}  /* test_pool_thread */
+
+
+uint64_t test_elapsed_ns(struct cprt_timespec *start_ts)
+{
+  struct cprt_timespec end_ts;
+  uint64_t ns;
+
+  CPRT_GETTIME(&end_ts);
+  CPRT_DIFF_TS(ns, end_ts, (*start_ts));
+  return (ns == 0) ? 1 : ns;
+}  /* test_elapsed_ns */
+
+
+volatile uint32_t test_backoff_flag = 0;
+uint64_t test_backoff_cpu_ns = 0;
+
+CPRT_THREAD_ENTRYPOINT test_backoff_thread(void *in_arg)
+{
+  cprt_backoff_t backoff;
+  uint64_t start_cpu_ns = cprt_thread_cpu_ns();
+  (void)in_arg;
+
+  cprt_backoff_init(&backoff, 100, 10, 1000);
+  while (! test_backoff_flag) {
+    cprt_backoff_wait(&backoff);
+  }
+  test_backoff_cpu_ns = cprt_thread_cpu_ns() - start_cpu_ns;
+
+  return 0;
+}  /* test_backoff_thread */
+
+
+CPRT_MUTEX_T test_mutex;
+CPRT_SPIN_T test_spin;
+CPRT_SEM_T test_sem;
+
+uint16_t test_worker_idx[2];
+uint64_t test_worker_tid[2];
+char test_worker_name[2][TRC_THREAD_NAME_LEN];
+cprt_cpuset_t test_worker_cpuset;
+
+CPRT_THREAD_ENTRYPOINT test_worker_thread(void *in_arg)
+{
+  int w = (int)(uintptr_t)in_arg;
+  uint32_t num_threads = trc_num_threads;
+
+  /* Already registered, so tracing doesn't register. */
+  test_worker_idx[w] = trc_thread_idx();
+  CPRT_ASSERT(trc_num_threads == num_threads);
+  strcpy(test_worker_name[w], trc_threads[test_worker_idx[w]].name);
+  test_worker_tid[w] = trc_threads[test_worker_idx[w]].kernel_tid;
+  if (w == 1) {
+    CPRT_ASSERT(cprt_get_cpuset_affinity(&test_worker_cpuset) == 0);
+  }
+  TRC_ERR(trc_trace(test_trc, __FILE__, __LINE__, w, 0));
+
+  return (CPRT_THREAD_ENTRYPOINT)(uintptr_t)(w + 100);
+}  /* test_worker_thread */
+
+
+uint16_t test_exit_idx;
+
+CPRT_THREAD_ENTRYPOINT test_exit_thread(void *in_arg)
+{
+  test_exit_idx = trc_thread_idx();
+  if (in_arg != NULL) {
+    CPRT_THREAD_EXIT;
+  }
+
+  return 0;
+}  /* test_exit_thread */
+
+
+CPRT_THREAD_ENTRYPOINT test_contend_thread(void *in_arg)
+{
+  (void)in_arg;
+
+  CPRT_MUTEX_LOCK(test_mutex);
+  CPRT_MUTEX_UNLOCK(test_mutex);
+  CPRT_SPIN_LOCK(test_spin);
+  CPRT_SPIN_UNLOCK(test_spin);
+  CPRT_SEM_WAIT(test_sem);
+
+  return 0;
+}  /* test_contend_thread */
+
+
+volatile uint32_t test_tracer_stop = 0;
+
+CPRT_THREAD_ENTRYPOINT test_tracer_thread(void *in_arg)
+{
+  trc_t *trc = (trc_t *)in_arg;
+  uint64_t i;
+
+  for (i = 0; ! test_tracer_stop; i++) {
+    TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 0));
+  }
+
+  return 0;
+}  /* test_tracer_thread */
+
+
+void test_query_cb(trc_cap_t *cap, const trc_cap_event_t *ev, void *cb_arg)
+{
+  (void)cap;  (void)ev;
+  (*(uint64_t *)cb_arg)++;
+}  /* test_query_cb */
+
+
 char usage_str[] = "Usage: trc_test [-h] [-t testnum]";
 
 void usage(char *msg) {
@@ -81,7 +364,7 @@ int main(int argc, char **argv)
       err = trc_trace(trc, __FILE__, __LINE__, 11, 12);  TRC_ERR(err);
       CPRT_ASSERT(trc->event_count == 1);
       CPRT_ASSERT(trc->events[0].timestamp.tv_sec == 0);
-      CPRT_ASSERT(trc->events[0].thread_id == 0);
+      CPRT_ASSERT(trc->events[0].thread_idx == 0);
       CPRT_ASSERT(trc->events[0].p1 == 11);
       CPRT_ASSERT(trc->events[0].p2 == 12);
 
@@ -123,7 +406,7 @@ int main(int argc, char **argv)
       TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 11, 12));
       CPRT_ASSERT(trc->event_count == 1);
       CPRT_ASSERT(trc->events[0].timestamp.tv_sec != 0);
-      CPRT_ASSERT(trc->events[0].thread_id != 0);
+      CPRT_ASSERT(trc->events[0].thread_idx != 0);
       CPRT_ASSERT(trc->events[0].p1 == 11);
       CPRT_ASSERT(trc->events[0].p2 == 12);
 
@@ -207,6 +490,1427 @@ int main(int argc, char **argv)
       break;
     }
 
+    case 9:
+    {
+      trc_t *trc;  int i;
+      uint32_t alloc_opts = TRC_CREATE_FLAG_HUGE_2M | TRC_CREATE_FLAG_PREFAULT | TRC_CREATE_FLAG_MLOCK;
+
+      TRC_ERR(trc_create(&trc, 100000, TRC_CREATE_FLAG_NO_OVERRIDE | alloc_opts));
+      /* Huge pages and mlock depend on the host; prefault always works. */
+      CPRT_ASSERT((trc->alloc_flags & ~alloc_opts) == 0);
+      CPRT_ASSERT(trc->alloc_flags & TRC_CREATE_FLAG_PREFAULT);
+      CPRT_ASSERT(trc->events_size >= sizeof(trc_event_t) * 100000);
+      CPRT_ASSERT(trc->events[99999].p1 == 0);
+
+      for (i = 0; i < 100001; i++) {
+        TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 0));
+      }
+      CPRT_ASSERT(trc->events[0].p1 == 100000);
+      CPRT_ASSERT(trc->events[99999].p1 == 99999);
+
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 10:
+    {
+      trc_t *trc;  int i;
+      FILE *out_fd;
+      char line[1024];
+      uint64_t p1, last_p1 = 0;
+
+      TRC_ERR(trc_create(&trc, 10, TRC_CREATE_FLAG_NUMA | TRC_CREATE_FLAG_TIMESTAMP));
+      /* Must match TRC_NUMA_NODES in tst.sh. */
+      CPRT_ASSERT(trc->num_nodes == 2);
+      CPRT_ASSERT(trc->events == NULL);
+      CPRT_ASSERT(trc->node_trcs[0]->numa_node == 0);
+      CPRT_ASSERT(trc->node_trcs[1]->numa_node == 1);
+
+      /* Alternate between node rings; the dump must interleave them by time. */
+      for (i = 1; i <= 6; i++) {
+        TRC_ERR(trc_trace(trc->node_trcs[i % 2], __FILE__, __LINE__, i, 0));
+        CPRT_SLEEP_MS(2);
+      }
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 7, 0));  /* Local node. */
+      CPRT_ASSERT(trc->node_trcs[0]->event_count + trc->node_trcs[1]->event_count == 7);
+
+      CPRT_ENULL(out_fd = fopen("dump10.x", "w+"));
+      TRC_ERR(trc_dump(trc, out_fd));
+      rewind(out_fd);
+      while (fgets(line, sizeof(line), out_fd) != NULL) {
+        char *p1_str = strstr(line, ".p1=");
+        if (p1_str == NULL) { continue; }
+        CPRT_EOK1(sscanf(p1_str, ".p1=%"SCNu64, &p1));
+        CPRT_ASSERT(p1 == last_p1 + 1);
+        last_p1 = p1;
+      }
+      CPRT_ASSERT(last_p1 == 7);
+      fclose(out_fd);
+
+      TRC_ERR(trc_delete(trc));
+
+      /* The env var does not make rings per-node unless asked for. */
+      TRC_ERR(trc_create(&trc, 10, TRC_CREATE_FLAG_TIMESTAMP));
+      CPRT_ASSERT(trc->num_nodes == 1 && trc->events != NULL);
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 11:
+    {
+      CPRT_THREAD_T thr_a, thr_b;
+      FILE *out_fd;
+      char line[1024];
+      int found_a = 0, found_b = 0;
+      uint16_t main_idx;
+
+      TRC_ERR(trc_create(&test_trc, 10, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_THREAD_ID));
+      TRC_ERR(trc_trace(test_trc, __FILE__, __LINE__, 0, 0));
+      main_idx = test_trc->events[0].thread_idx;
+      CPRT_ASSERT(main_idx == trc_thread_idx());
+      CPRT_ASSERT(trc_threads[main_idx].kernel_tid == cprt_gettid());
+
+      CPRT_THREAD_CREATE(thr_a, test_named_thread, "worker_a");
+      CPRT_THREAD_JOIN(thr_a);
+      CPRT_THREAD_CREATE(thr_b, test_named_thread, "worker_b");
+      CPRT_THREAD_JOIN(thr_b);
+
+      CPRT_ASSERT(test_trc->event_count == 5);
+      CPRT_ASSERT(test_trc->events[1].thread_idx == test_trc->events[2].thread_idx);
+      CPRT_ASSERT(test_trc->events[3].thread_idx == test_trc->events[4].thread_idx);
+      CPRT_ASSERT(test_trc->events[1].thread_idx != main_idx);
+      CPRT_ASSERT(test_trc->events[3].thread_idx != main_idx);
+      CPRT_ASSERT(test_trc->events[1].thread_idx != test_trc->events[3].thread_idx);
+      CPRT_ASSERT(strcmp(trc_threads[test_trc->events[1].thread_idx].name, "worker_a") == 0);
+      CPRT_ASSERT(strcmp(trc_threads[test_trc->events[3].thread_idx].name, "worker_b") == 0);
+
+      CPRT_ENULL(out_fd = fopen("dump11.x", "w+"));
+      TRC_ERR(trc_dump(test_trc, out_fd));
+      rewind(out_fd);
+      while (fgets(line, sizeof(line), out_fd) != NULL) {
+        if (strstr(line, ".thread=worker_a[") != NULL) { found_a++; }
+        if (strstr(line, ".thread=worker_b[") != NULL) { found_b++; }
+      }
+      CPRT_ASSERT(found_a == 2 && found_b == 2);
+      fclose(out_fd);
+
+      TRC_ERR(trc_delete(test_trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 12:
+    {
+      trc_t *trc;
+      FILE *out_fd;
+      char line[1024];
+      uint32_t cpu;
+      int migrations = 0;
+
+      TRC_ERR(trc_create(&trc, 10, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_THREAD_ID | TRC_CREATE_FLAG_CPU_ID));
+      cprt_set_affinity(1);  /* Stay on CPU 0 so the recorded CPU is known. */
+      cprt_getcpu(&cpu, NULL);
+      CPRT_ASSERT(cpu == 0);
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 1, 0));
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 2, 0));
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 3, 0));
+      CPRT_ASSERT(trc->events[0].cpu_id == 0);
+      CPRT_ASSERT(trc->events[2].cpu_id == 0);
+
+      /* Fake a migration to CPU 1 and back. */
+      trc->events[1].cpu_id = 1;
+      CPRT_ENULL(out_fd = fopen("dump12.x", "w+"));
+      TRC_ERR(trc_dump(trc, out_fd));
+      rewind(out_fd);
+      while (fgets(line, sizeof(line), out_fd) != NULL) {
+        if (strstr(line, "MIGRATED") != NULL) { migrations++; }
+      }
+      CPRT_ASSERT(migrations == 2);
+      fclose(out_fd);
+
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 13:
+    {
+      trc_t *trc;
+      FILE *out_fd;
+      char line[1024];
+      int found = 0;
+
+      TRC_ERR(trc_create(&trc, 10, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_CALLERS));
+      test_caller_outer(trc);
+      CPRT_ASSERT(trc->callers[0] != NULL);
+      CPRT_ASSERT(trc->callers[1] != NULL);
+
+      CPRT_ENULL(out_fd = fopen("dump13.x", "w+"));
+      TRC_ERR(trc_dump(trc, out_fd));
+      rewind(out_fd);
+      while (fgets(line, sizeof(line), out_fd) != NULL) {
+        /* Requires -rdynamic so dladdr() sees the executable's symbols. */
+        if (strstr(line, "callers: test_caller_inner+0x") != NULL &&
+            strstr(line, " test_caller_outer+0x") != NULL) {
+          found++;
+        }
+      }
+      CPRT_ASSERT(found == 1);
+      fclose(out_fd);
+
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 14:
+    {
+      trc_t *trc;  int i;
+      trc_span_t span;
+      trc_hist_t *hist;
+      FILE *out_fd;
+      char line[1024];
+      int found = 0;
+      uint64_t p50;
+
+      /* Histogram precision. */
+      CPRT_ENULL(hist = (trc_hist_t *)calloc(1, sizeof(trc_hist_t)));
+      for (i = 1; i <= 100000; i++) {
+        trc_hist_record(hist, i);
+      }
+      CPRT_ASSERT(hist->count == 100000 && hist->max == 100000);
+      p50 = trc_hist_percentile(hist, 50.0);
+      CPRT_ASSERT(p50 >= 50000 && p50 <= 50000 + 50000/16);
+      CPRT_ASSERT(trc_hist_percentile(hist, 99.9) >= 99900);
+      CPRT_ASSERT(trc_hist_percentile(hist, 100.0) == 100000);
+      trc_hist_record(hist, 7);  /* Small values are exact. */
+      CPRT_ASSERT(trc_hist_percentile(hist, 0.0) == 1);
+      free(hist);
+
+      TRC_ERR(trc_create(&trc, 100, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_THREAD_ID | TRC_CREATE_FLAG_SPAN_HIST));
+      for (i = 0; i < 10; i++) {
+        TRC_SPAN_BEGIN(trc, span, i, 0);
+        TRC_SPAN_END(span, i);
+      }
+      CPRT_ASSERT(trc->event_count == 20);
+      for (i = 0; i < 20; i += 2) {
+        CPRT_ASSERT(trc->events[i].kind == TRC_KIND_SPAN_BEGIN);
+        CPRT_ASSERT(trc->events[i+1].kind == TRC_KIND_SPAN_END);
+        CPRT_ASSERT(trc->events[i].span_id == trc->events[i+1].span_id);
+        CPRT_ASSERT(trc->events[i+1].p1 == i / 2);
+        CPRT_ASSERT(trc->events[i].file_line == trc->events[i+1].file_line - 1);
+      }
+      CPRT_ASSERT(trc->events[0].span_id != trc->events[2].span_id);
+
+      CPRT_ENULL(out_fd = fopen("hist14.x", "w+"));
+      TRC_ERR(trc_histograms_dump(out_fd));
+      rewind(out_fd);
+      while (fgets(line, sizeof(line), out_fd) != NULL) {
+        if (strstr(line, "count=10, p50=") != NULL) { found++; }
+      }
+      CPRT_ASSERT(found == 1);
+      fclose(out_fd);
+
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 15:
+    {
+      trc_t *trc;  int i;
+      trc_span_t span, span2;
+      FILE *out_fd;
+      trc_cap_t *cap;
+      trc_cap_event_t cap_ev;
+
+      TRC_ERR(trc_create(&trc, 8, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_THREAD_ID | TRC_CREATE_FLAG_TIMESTAMP));
+      TRC_ERR(trc_set_thread_name("cap_main"));
+      for (i = 0; i < 7; i++) {
+        TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 100 + i));
+      }
+      TRC_SPAN_BEGIN(trc, span, 7, 8);
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 5, 105));
+      TRC_SPAN_END(span, 9);  /* 10 events in 8 slots: wrapped by 2. */
+
+      CPRT_ENULL(out_fd = fopen("cap15.x", "wb"));
+      TRC_ERR(trc_dump_bin(trc, out_fd));
+      fclose(out_fd);
+      CPRT_ENULL(out_fd = fopen("chrome15.x", "w"));
+      TRC_ERR(trc_dump_chrome(trc, out_fd));
+      fclose(out_fd);
+
+      TRC_ERR(trc_cap_open(&cap, "cap15.x"));
+      CPRT_ASSERT(cap->hdr.num_events == 8);
+      CPRT_ASSERT(cap->hdr.event_count == 10);
+      CPRT_ASSERT(cap->hdr.pid == CPRT_GETPID());
+      CPRT_ASSERT(cap->hdr.num_sites == 4);
+      for (i = 2; i < 10; i++) {
+        trc_event_t *ev = &trc->events[i % 8];
+        CPRT_ASSERT(trc_cap_next(cap, &cap_ev) == 1);
+        CPRT_ASSERT(cap_ev.seq == i);
+        CPRT_ASSERT(cap_ev.p1 == ev->p1 && cap_ev.p2 == ev->p2);
+        CPRT_ASSERT(cap_ev.kind == ev->kind && cap_ev.span_id == ev->span_id);
+        CPRT_ASSERT(cap_ev.timestamp_ns / 1000 == (uint64_t)ev->timestamp.tv_sec * 1000000 + ev->timestamp.tv_usec);
+        CPRT_ASSERT(trc_cap_site_line(cap, cap_ev.site_id) == ev->file_line);
+        CPRT_ASSERT(strcmp(trc_cap_site_file(cap, cap_ev.site_id), ev->file_name) == 0);
+        CPRT_ASSERT(strcmp(trc_cap_thread_name(cap, cap_ev.proc_idx, cap_ev.thread_idx), "cap_main") == 0);
+      }
+      CPRT_ASSERT(trc_cap_next(cap, &cap_ev) == 0);
+      TRC_ERR(trc_cap_close(cap));
+      TRC_ERR(trc_delete(trc));
+
+      /* Spans that overlap without nesting. */
+      TRC_ERR(trc_create(&trc, 8, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_THREAD_ID | TRC_CREATE_FLAG_TIMESTAMP));
+      TRC_SPAN_BEGIN(trc, span, 1, 0);
+      TRC_SPAN_BEGIN(trc, span2, 2, 0);
+      TRC_SPAN_END(span, 1);
+      TRC_SPAN_END(span2, 2);
+      CPRT_ENULL(out_fd = fopen("chrome15b.x", "w"));
+      TRC_ERR(trc_dump_chrome(trc, out_fd));
+      fclose(out_fd);
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 16:
+    {
+      trc_t *trc;  int i;
+      FILE *out_fd;
+      trc_cap_t *cap;
+      trc_cap_filter_t filter;
+      uint64_t num_matched;
+      uint64_t blocks_scanned;
+      int site_b;
+
+      TRC_ERR(trc_create(&trc, 20000, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_THREAD_ID | TRC_CREATE_FLAG_TIMESTAMP));
+      TRC_ERR(trc_set_thread_name("query_main"));
+      for (i = 0; i < 20000; i++) {
+        if (i == 500 || i == 15000) {
+          TRC_ERR(trc_trace(trc, __FILE__, 9999, 0xdead, i));
+        }
+        else {
+          TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 0));
+        }
+      }
+      CPRT_ENULL(out_fd = fopen("cap16.x", "wb"));
+      TRC_ERR(trc_dump_bin(trc, out_fd));
+      fclose(out_fd);
+
+      TRC_ERR(trc_cap_open(&cap, "cap16.x"));
+      TRC_ERR(trc_cap_mmap(cap));
+      CPRT_ASSERT(cap->hdr.num_index == 20);
+      CPRT_ASSERT(cap->events[15000].p2 == 15000);
+
+      /* Site filter only visits the 2 blocks holding that site. */
+      site_b = trc_cap_find_site(cap, "trc_test.c", 9999);
+      CPRT_ASSERT(site_b >= 0);
+      memset(&filter, 0, sizeof(filter));
+      filter.num_sites = 1;
+      filter.site_ids[0] = (uint32_t)site_b;
+      num_matched = 0;
+      TRC_ERR(trc_cap_query(cap, &filter, test_query_cb, &num_matched, &blocks_scanned));
+      CPRT_ASSERT(num_matched == 2);
+      CPRT_ASSERT(blocks_scanned == 2);
+
+      /* Time filter starts at the right block. */
+      filter.min_ts_ns = cap->events[10000].timestamp_ns;
+      num_matched = 0;
+      TRC_ERR(trc_cap_query(cap, &filter, test_query_cb, &num_matched, &blocks_scanned));
+      CPRT_ASSERT(num_matched == 1);
+      CPRT_ASSERT(blocks_scanned == 1);
+
+      memset(&filter, 0, sizeof(filter));
+      filter.have_p1 = 1;
+      filter.p1 = 0xdead;
+      filter.have_thread = 1;
+      filter.thread_idx = (uint16_t)trc_cap_find_thread(cap, "query_main");
+      num_matched = 0;
+      TRC_ERR(trc_cap_query(cap, &filter, test_query_cb, &num_matched, &blocks_scanned));
+      CPRT_ASSERT(num_matched == 2);
+      filter.thread_idx++;
+      num_matched = 0;
+      TRC_ERR(trc_cap_query(cap, &filter, test_query_cb, &num_matched, &blocks_scanned));
+      CPRT_ASSERT(num_matched == 0);
+      CPRT_ASSERT(blocks_scanned == 0);
+      TRC_ERR(trc_cap_close(cap));
+
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 17:
+    {
+      trc_t *trc;  int i;
+      FILE *out_fd;
+      char shm_name[64];
+      pid_t child;
+      int status;
+      int num_child_evs = 0;
+
+      CPRT_SNPRINTF(shm_name, sizeof(shm_name), "/trc_test17_%d", (int)CPRT_GETPID());
+      (void)trc_unlink_shared(shm_name);
+      TRC_ERR(trc_create_shared(&trc, shm_name, 64, TRC_CREATE_FLAG_THREAD_ID | TRC_CREATE_FLAG_TIMESTAMP));
+      CPRT_ASSERT(trc->create_flags & TRC_CREATE_FLAG_ATOMIC_INC);
+      /* Calibration left the segment alone. */
+      CPRT_ASSERT(trc_overhead_ns(trc) > 0 && trc->shm->event_count == 0);
+      CPRT_ASSERT(trc->shm->procs[trc->shm_proc_idx].num_sites == 0);
+      for (i = 0; i < 5; i++) {
+        TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 0));
+      }
+
+      child = fork();
+      CPRT_ASSERT(child >= 0);
+      if (child == 0) {
+        trc_t *child_trc;
+        /* Attach adopts the segment's size. */
+        TRC_ERR(trc_create_shared(&child_trc, shm_name, 1, 0));
+        CPRT_ASSERT(child_trc->num_entries == 64 && child_trc->shm_proc_idx == 1);
+        for (i = 0; i < 10; i++) {
+          TRC_ERR(trc_trace(child_trc, __FILE__, __LINE__, 100 + i, 0));
+        }
+        TRC_ERR(trc_delete(child_trc));
+        _exit(0);
+      }
+      CPRT_ASSERT(waitpid(child, &status, 0) == child);
+      CPRT_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+      for (i = 0; i < 5; i++) {
+        TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 200 + i, 0));
+      }
+
+      CPRT_ASSERT(trc->shm->event_count == 20);
+      CPRT_ASSERT(trc->shm->num_procs == 2);
+      CPRT_ASSERT(trc->shm->procs[1].pid == (uint32_t)child);
+      CPRT_ASSERT(trc->shm->procs[0].num_sites == 2);
+      CPRT_ASSERT(trc->shm->procs[1].num_sites == 1);
+      CPRT_ASSERT(strcmp(trc->shm->procs[1].sites[0].file_name, __FILE__) == 0);
+      for (i = 0; i < 20; i++) {
+        trc_event_t *ev = &trc->events[i];
+        CPRT_ASSERT(ev->file_name == NULL);
+        if (ev->proc_idx == 1) {
+          CPRT_ASSERT(ev->p1 == (uint64_t)(100 + num_child_evs));
+          num_child_evs++;
+        }
+      }
+      CPRT_ASSERT(num_child_evs == 10);
+
+      CPRT_ENULL(out_fd = fopen("dump17.x", "w"));
+      TRC_ERR(trc_dump(trc, out_fd));
+      fclose(out_fd);
+
+      TRC_ERR(trc_delete(trc));
+      TRC_ERR(trc_unlink_shared(shm_name));
+      CPRT_ASSERT(trc_unlink_shared(shm_name) == TRC_ERR_IO);
+      printf("OK\n");
+      break;
+    }
+
+    case 18:
+    {
+      trc_t *trc;  int i;
+      trc_t *reader;
+      FILE *out_fd;
+      uint64_t next, num_missed;
+      uint16_t last_cpu[TRC_MAX_THREADS];
+
+      /* A file-backed ring outlives its writer. */
+      (void)trc_unlink_shared("ring18.x");
+      TRC_ERR(trc_create_shared(&trc, "ring18.x", 16, TRC_CREATE_FLAG_THREAD_ID));
+      for (i = 0; i < 40; i++) {
+        TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 0));
+      }
+      TRC_ERR(trc_attach_shared(&reader, "ring18.x"));
+      TRC_ERR(trc_trace(reader, __FILE__, __LINE__, 99, 0));  /* No-op. */
+      CPRT_ASSERT(reader->shm->event_count == 40);
+      TRC_ERR(trc_delete(reader));
+      TRC_ERR(trc_delete(trc));
+
+      /* In-process tail: lapped events are counted, not printed, and an
+       * event still being written stops the tail. */
+      TRC_ERR(trc_create(&trc, 8, TRC_CREATE_FLAG_NO_OVERRIDE));
+      CPRT_ENULL(out_fd = fopen("tail18.x", "w"));
+      next = 0;  num_missed = 0;
+      CPRT_ASSERT(trc_tail(trc, &next, out_fd, &num_missed, NULL) == 0);
+      for (i = 0; i < 20; i++) {
+        TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 0));
+      }
+      trc->events[19 % 8].seq = 0;  /* As if ev[19] were still in progress. */
+      CPRT_ASSERT(trc_tail(trc, &next, out_fd, &num_missed, NULL) == 7);
+      CPRT_ASSERT(next == 19 && num_missed == 12);
+      trc->events[19 % 8].seq = 20;
+      CPRT_ASSERT(trc_tail(trc, &next, out_fd, &num_missed, NULL) == 1);
+      CPRT_ASSERT(next == 20 && num_missed == 12);
+      TRC_ERR(trc_delete(trc));
+
+      /* A migration between polls is still reported. */
+      TRC_ERR(trc_create(&trc, 8, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_THREAD_ID | TRC_CREATE_FLAG_CPU_ID));
+      memset(last_cpu, 0xff, sizeof(last_cpu));
+      next = 0;  num_missed = 0;
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 100, 0));
+      CPRT_ASSERT(trc_tail(trc, &next, out_fd, &num_missed, last_cpu) == 1);
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 101, 0));
+      trc->events[1].cpu_id = trc->events[0].cpu_id + 1;
+      CPRT_ASSERT(trc_tail(trc, &next, out_fd, &num_missed, last_cpu) == 1);
+      fclose(out_fd);
+
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 19:
+    {
+      trc_t *trc;  int i;
+      trc_event_t buf[100];
+      uint64_t cursor, num_lost;
+      uint32_t num_read;
+
+      TRC_ERR(trc_create(&trc, 16, TRC_CREATE_FLAG_NO_OVERRIDE));
+      cursor = 0;
+      for (i = 0; i < 10; i++) {
+        TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 0));
+      }
+      TRC_ERR(trc_read_since(trc, &cursor, buf, 100, &num_read, &num_lost));
+      CPRT_ASSERT(num_read == 10 && num_lost == 0 && cursor == 10);
+      CPRT_ASSERT(buf[0].p1 == 0 && buf[9].p1 == 9);
+      CPRT_ASSERT(strcmp(trc_event_file(trc, &buf[9]), __FILE__) == 0);
+      TRC_ERR(trc_read_since(trc, &cursor, buf, 100, &num_read, &num_lost));
+      CPRT_ASSERT(num_read == 0 && num_lost == 0 && cursor == 10);
+
+      /* 30 more into 16 slots: 14 lost, then read in two batches. */
+      for (i = 10; i < 40; i++) {
+        TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 0));
+      }
+      TRC_ERR(trc_read_since(trc, &cursor, buf, 4, &num_read, &num_lost));
+      CPRT_ASSERT(num_read == 4 && num_lost == 14 && cursor == 28);
+      CPRT_ASSERT(buf[0].p1 == 24 && buf[3].p1 == 27);
+      TRC_ERR(trc_read_since(trc, &cursor, buf, 100, &num_read, &num_lost));
+      CPRT_ASSERT(num_read == 12 && num_lost == 0 && cursor == 40);
+      CPRT_ASSERT(buf[0].p1 == 28 && buf[11].p1 == 39);
+      TRC_ERR(trc_delete(trc));
+
+      printf("OK\n");
+      break;
+    }
+
+    case 20:
+    {
+      trc_t *trc;  int i;
+      CPRT_THREAD_T thrs[24];
+      trc_count_totals_t totals;
+      FILE *out_fd;
+
+      /* No two shards share a cache line. */
+      CPRT_ASSERT((uintptr_t)&test_count_site % CPRT_CACHE_LINE == 0);
+      CPRT_ASSERT((uintptr_t)&test_count_site.shards[0] % CPRT_CACHE_LINE == 0);
+      CPRT_ASSERT(sizeof(trc_count_shard_t) == CPRT_CACHE_LINE);
+
+      /* More threads than owned shards; the rest share. */
+      TRC_ERR(trc_create(&trc, 8, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_TIMESTAMP));
+      test_trc = trc;
+      for (i = 0; i < 24; i++) {
+        CPRT_THREAD_CREATE(thrs[i], test_count_thread, (void *)(uintptr_t)(10 + i % 4));
+      }
+      for (i = 0; i < 24; i++) {
+        CPRT_THREAD_JOIN(thrs[i]);
+      }
+      TRC_COUNT(trc, 7, 8);
+
+      CPRT_ASSERT(trc->event_count == 0);  /* No ring entries. */
+      trc_count_totals(&test_count_site, &totals);
+      CPRT_ASSERT(totals.hits == 24000);
+      CPRT_ASSERT(totals.p1_sum == 24 * 499500);
+      CPRT_ASSERT(totals.p1_min == 0 && totals.p1_max == 999);
+      CPRT_ASSERT(totals.p2_sum == 6000 * (10 + 11 + 12 + 13));
+      CPRT_ASSERT(totals.p2_min == 10 && totals.p2_max == 13);
+      CPRT_ASSERT(totals.last_ns != 0);
+
+      CPRT_ENULL(out_fd = fopen("dump20.x", "w"));
+      TRC_ERR(trc_dump(trc, out_fd));
+      TRC_ERR(trc_counters_dump(out_fd));
+      fclose(out_fd);
+
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 21:
+    {
+      trc_t *trc;  int i;
+      uint64_t fast_val = 0, slow_val = 1000;
+      uint64_t last_fast = 0;
+      int num_fast = 0, num_slow = 0;
+      FILE *out_fd;
+
+      TRC_ERR(trc_create(&trc, 1000, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_TIMESTAMP | TRC_CREATE_FLAG_THREAD_ID));
+      TRC_ERR(trc_gauge_set_affinity(1));
+      TRC_ERR(trc_gauge_register(trc, "fast_gauge", test_gauge_cb, &fast_val, 5));
+      TRC_ERR(trc_gauge_register(trc, "slow_gauge", test_gauge_cb, &slow_val, 50));
+      CPRT_ASSERT(trc_gauge_register(trc, "bad", test_gauge_cb, NULL, 0) == TRC_ERR_BAD_PARM);
+      CPRT_SLEEP_MS(200);
+      TRC_ERR(trc_gauges_stop());
+
+      for (i = 0; i < (int)trc->event_count; i++) {
+        trc_event_t *ev = &trc->events[i];
+        CPRT_ASSERT(ev->kind == TRC_KIND_GAUGE);
+        CPRT_ASSERT(strcmp(trc_threads[ev->thread_idx].name, "trc_gauges") == 0);
+        if (strcmp(ev->file_name, "fast_gauge") == 0) {
+          CPRT_ASSERT(ev->p1 == last_fast + 1);
+          last_fast = ev->p1;
+          num_fast++;
+        }
+        else {
+          CPRT_ASSERT(strcmp(ev->file_name, "slow_gauge") == 0);
+          num_slow++;
+        }
+      }
+      /* Generous bounds; the sampler may be descheduled. */
+      CPRT_ASSERT(num_fast >= 10 && num_fast <= 45);
+      CPRT_ASSERT(num_slow >= 2 && num_slow <= 6);
+      CPRT_ASSERT(num_fast > num_slow);
+
+      CPRT_ENULL(out_fd = fopen("chrome21.x", "w"));
+      TRC_ERR(trc_dump_chrome(trc, out_fd));
+      fclose(out_fd);
+
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 22:
+    {
+      trc_t *trc;  int i;
+      CPRT_THREAD_T thr;
+      static char *stages[3] = { "flow_a", "flow_b", "flow_c" };
+      FILE *out_fd;
+
+      TRC_ERR(trc_create(&trc, 100, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_TIMESTAMP | TRC_CREATE_FLAG_THREAD_ID));
+      test_trc = trc;
+      for (i = 0; i < 20; i++) {
+        test_flow_ids[i] = trc_flow_new();
+      }
+      CPRT_ASSERT(test_flow_ids[6] == 7);
+      CPRT_ASSERT(trc_flow(trc, TRC_KIND_FLOW_STEP, 0, __FILE__, __LINE__, 0, 0) == TRC_ERR_BAD_PARM);
+      CPRT_ASSERT(trc_flow(trc, TRC_KIND_TRACE, 1, __FILE__, __LINE__, 0, 0) == TRC_ERR_BAD_PARM);
+
+      for (i = 0; i < 3; i++) {  /* One after the other, so the order is known. */
+        CPRT_THREAD_CREATE(thr, test_flow_thread, stages[i]);
+        CPRT_THREAD_JOIN(thr);
+      }
+      TRC_ERR(TRC_FLOW_BEGIN(trc, trc_flow_new(), 99, 0));  /* Never ends. */
+      CPRT_ASSERT(trc->event_count == 61);
+      CPRT_ASSERT(trc->events[0].kind == TRC_KIND_FLOW_BEGIN && trc->events[0].span_id == 7);
+
+      CPRT_ENULL(out_fd = fopen("dump22.x", "w"));
+      TRC_ERR(trc_dump(trc, out_fd));
+      fclose(out_fd);
+      CPRT_ENULL(out_fd = fopen("cap22.x", "wb"));
+      TRC_ERR(trc_dump_bin(trc, out_fd));
+      fclose(out_fd);
+
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 23:
+    {
+      CPRT_THREAD_T thrs[4];
+      char line[512];
+      char long_msg[400];
+      int next_i[4] = { 0, 0, 0, 0 };
+      int num_lines = 0;
+      int thread_num, i;
+      pid_t child;
+      int status;
+
+      CPRT_ENULL(test_async_fp = fopen("async23.x", "w"));
+      CPRT_ASSERT(cprt_async_printf_start(16) == 0);  /* Small, so writers wait. */
+      CPRT_ASSERT(cprt_async_printf_start(16) == -1);
+      for (i = 0; i < 4; i++) {
+        CPRT_THREAD_CREATE(thrs[i], test_async_thread, (void *)(uintptr_t)i);
+      }
+      for (i = 0; i < 4; i++) {
+        CPRT_THREAD_JOIN(thrs[i]);
+      }
+      memset(long_msg, 'x', sizeof(long_msg) - 1);
+      long_msg[sizeof(long_msg) - 1] = '\0';
+      test_ts_fprintf(test_async_fp, "long=%s\n", long_msg);
+      cprt_async_printf_stop();
+      test_ts_fprintf(test_async_fp, "sync\n");  /* Printed directly now. */
+      fclose(test_async_fp);
+
+      CPRT_ENULL(test_async_fp = fopen("async23.x", "r"));
+      while (fgets(line, sizeof(line), test_async_fp) != NULL) {
+        char *msg = strstr(line, ": ");
+        CPRT_ASSERT(msg != NULL && line[4] == '-');  /* Date first. */
+        msg += 2;
+        if (sscanf(msg, "thread=%d, i=%d", &thread_num, &i) == 2) {
+          CPRT_ASSERT(thread_num >= 0 && thread_num < 4);
+          CPRT_ASSERT(i == next_i[thread_num]);  /* Each thread's order kept. */
+          next_i[thread_num]++;
+        }
+        else if (strncmp(msg, "long=", 5) == 0) {
+          CPRT_ASSERT(strlen(msg) == CPRT_ASYNC_MSG_SIZE - 1);
+          CPRT_ASSERT(strcmp(&msg[strlen(msg) - 4], "...\n") == 0);
+          CPRT_ASSERT(num_lines == 2000);
+        }
+        else {
+          CPRT_ASSERT(strcmp(msg, "sync\n") == 0 && num_lines == 2001);
+        }
+        num_lines++;
+      }
+      fclose(test_async_fp);
+      CPRT_ASSERT(num_lines == 2002);
+
+      /* A crash must not lose what was queued. */
+      child = fork();
+      CPRT_ASSERT(child >= 0);
+      if (child == 0) {
+        CPRT_ENULL(test_async_fp = fopen("async23b.x", "w"));
+        CPRT_ASSERT(cprt_async_printf_start(16) == 0);
+        test_ts_fprintf(test_async_fp, "before abort\n");
+        abort();
+      }
+      CPRT_ASSERT(waitpid(child, &status, 0) == child);
+      CPRT_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+      CPRT_ENULL(test_async_fp = fopen("async23b.x", "r"));
+      CPRT_ASSERT(fgets(line, sizeof(line), test_async_fp) != NULL);
+      CPRT_ASSERT(strstr(line, ": before abort\n") != NULL);
+      fclose(test_async_fp);
+
+      printf("OK\n");
+      break;
+    }
+
+    case 24:
+    {
+      CPRT_THREAD_T thrs[4];
+      struct cprt_timespec start_ts;
+      uint64_t ns;
+      void *items[64];
+      uint32_t batch, next_item, n, i;
+      uint32_t next_seq[4];
+      void *obj;
+      FILE *out_fd;
+
+      CPRT_ASSERT(cprt_spsc_create(&test_spsc, 1000) == -1 && errno == EINVAL);
+      CPRT_ASSERT(cprt_spsc_create(&test_spsc, 4) == 0);
+      items[0] = (void *)1;  items[1] = (void *)2;  items[2] = (void *)3;
+      CPRT_ASSERT(cprt_spsc_enqueue_batch(test_spsc, items, 3) == 3);
+      CPRT_ASSERT(cprt_spsc_enqueue_batch(test_spsc, items, 3) == 1);  /* Full. */
+      CPRT_ASSERT(CPRT_SPSC_ENQUEUE(test_spsc, items[0]) == 0);
+      CPRT_ASSERT(cprt_spsc_dequeue_batch(test_spsc, items, 64) == 4);
+      CPRT_ASSERT(items[0] == (void *)1 && items[3] == (void *)1);
+      CPRT_ASSERT(CPRT_SPSC_DEQUEUE(test_spsc, obj) == 0);
+      cprt_spsc_delete(test_spsc);
+
+      CPRT_ENULL(out_fd = fopen("perf24.x", "w"));
+
+      /* SPSC, one at a time and batched. */
+      for (batch = 1; batch <= 32; batch *= 32) {
+        CPRT_ASSERT(cprt_spsc_create(&test_spsc, 1024) == 0);
+        CPRT_GETTIME(&start_ts);
+        CPRT_THREAD_CREATE(thrs[0], test_spsc_producer, (void *)(uintptr_t)batch);
+        next_item = 1;
+        while (next_item <= TEST_Q_ITEMS) {
+          n = cprt_spsc_dequeue_batch(test_spsc, items, batch);
+          if (n == 0) { CPRT_SLEEP_MS(0); }
+          for (i = 0; i < n; i++) {
+            CPRT_ASSERT(items[i] == (void *)(uintptr_t)next_item);
+            next_item++;
+          }
+        }
+        CPRT_THREAD_JOIN(thrs[0]);
+        ns = test_elapsed_ns(&start_ts);
+        fprintf(out_fd, "spsc batch=%"PRIu32": %.1f Mitems/s\n", batch, (double)TEST_Q_ITEMS * 1000.0 / (double)ns);
+        CPRT_ASSERT(CPRT_SPSC_DEQUEUE(test_spsc, obj) == 0);
+        cprt_spsc_delete(test_spsc);
+      }
+
+      /* MPSC, 4 producers; each producer's items stay in order. */
+      CPRT_ASSERT(cprt_mpsc_create(&test_mpsc, 1024) == 0);
+      memset(next_seq, 0, sizeof(next_seq));
+      CPRT_GETTIME(&start_ts);
+      for (i = 0; i < 4; i++) {
+        CPRT_THREAD_CREATE(thrs[i], test_mpsc_producer, (void *)(uintptr_t)i);
+      }
+      next_item = 0;
+      while (next_item < TEST_Q_ITEMS) {
+        n = cprt_mpsc_dequeue_batch(test_mpsc, items, 32);
+        if (n == 0) { CPRT_SLEEP_MS(0); }
+        for (i = 0; i < n; i++) {
+          uintptr_t item = (uintptr_t)items[i];
+          uint32_t thread_num = (uint32_t)(item >> 24);
+          CPRT_ASSERT(thread_num < 4);
+          CPRT_ASSERT((item & 0xffffff) == next_seq[thread_num]);
+          next_seq[thread_num]++;
+        }
+        next_item += n;
+      }
+      for (i = 0; i < 4; i++) {
+        CPRT_THREAD_JOIN(thrs[i]);
+        CPRT_ASSERT(next_seq[i] == TEST_Q_ITEMS / 4);
+      }
+      ns = test_elapsed_ns(&start_ts);
+      fprintf(out_fd, "mpsc producers=4: %.1f Mitems/s\n", (double)TEST_Q_ITEMS * 1000.0 / (double)ns);
+      CPRT_ASSERT(CPRT_MPSC_DEQUEUE(test_mpsc, obj) == 0);
+      cprt_mpsc_delete(test_mpsc);
+
+      /* Pool, 4 threads getting and putting 8 at a time. */
+      CPRT_ASSERT(cprt_pool_create(&test_pool, sizeof(uint32_t), 32) == 0);
+      memset(test_pool->objs, 0, 32 * test_pool->obj_size);
+      CPRT_GETTIME(&start_ts);
+      for (i = 0; i < 4; i++) {
+        CPRT_THREAD_CREATE(thrs[i], test_pool_thread, (void *)(uintptr_t)(i + 1));
+      }
+      for (i = 0; i < 4; i++) {
+        CPRT_THREAD_JOIN(thrs[i]);
+      }
+      ns = test_elapsed_ns(&start_ts);
+      fprintf(out_fd, "pool threads=4: %.1f Mgets/s\n", (double)(TEST_Q_ITEMS / 32 * 8 * 4) * 1000.0 / (double)ns);
+      for (i = 0; i < 32; i++) {
+        CPRT_ASSERT(cprt_pool_get(test_pool) != NULL);
+      }
+      CPRT_ASSERT(cprt_pool_get(test_pool) == NULL);
+      cprt_pool_delete(test_pool);
+      fclose(out_fd);
+
+      printf("OK\n");
+      break;
+    }
+
+    case 25:
+    {
+      cprt_cpuset_t set, cur_set, peers;
+      cprt_topo_t *topo;
+      char list[256];
+      int cpu;
+      uint64_t mask = 0;
+      FILE *out_fd;
+
+      CPRT_ASSERT(cprt_cpuset_parse(&set, "0-3,64-67, 1023") == 0);
+      CPRT_ASSERT(cprt_cpuset_count(&set) == 9);
+      CPRT_ASSERT(CPRT_CPUSET_ISSET(65, &set) && ! CPRT_CPUSET_ISSET(4, &set) && ! CPRT_CPUSET_ISSET(63, &set));
+      CPRT_ASSERT(cprt_cpuset_next(&set, 4) == 64 && cprt_cpuset_next(&set, 68) == 1023);
+      CPRT_ASSERT(cprt_cpuset_next(&set, 1024) == -1);
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(&set, list, sizeof(list)), "0-3,64-67,1023") == 0);
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(&set, list, 8), "0-3") == 0);  /* Cut at a range. */
+      CPRT_CPUSET_CLR(2, &set);
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(&set, list, sizeof(list)), "0-1,3,64-67,1023") == 0);
+      CPRT_ASSERT(cprt_cpuset_parse(&set, "3-1") == -1 && errno == EINVAL);
+      CPRT_ASSERT(cprt_cpuset_parse(&set, "1024") == -1);
+      CPRT_ASSERT(cprt_cpuset_parse(&set, "1,x") == -1);
+      CPRT_ASSERT(cprt_cpuset_parse(&set, "5-") == -1);
+      CPRT_CPU_SET(70, &mask);  /* Beyond the mask; ignored. */
+      CPRT_CPU_SET(0, &mask);
+      CPRT_CPU_SET(63, &mask);
+      CPRT_ASSERT(mask == 0x8000000000000001ull);
+      cprt_cpuset_from_mask(&set, mask);
+      CPRT_ASSERT(strcmp(cprt_cpuset_format(&set, list, sizeof(list)), "0,63") == 0);
+
+      CPRT_ASSERT(cprt_topo_get(&topo) == 0);
+      CPRT_ASSERT(topo->num_online >= 1 && topo->cpus[0].online);
+      CPRT_ASSERT(topo->num_cores >= 1 && topo->num_cores <= topo->num_online);
+      CPRT_ASSERT(topo->num_sockets >= 1 && topo->num_numa_nodes >= 1);
+      for (cpu = CPRT_TOPO_SMT; cpu <= CPRT_TOPO_SOCKET; cpu++) {
+        cprt_topo_peers(topo, 0, cpu, &peers);
+        CPRT_ASSERT(CPRT_CPUSET_ISSET(0, &peers));
+      }
+      CPRT_ENULL(out_fd = fopen("topo25.x", "w"));
+      cprt_topo_print(topo, out_fd);
+      fclose(out_fd);
+
+      /* Pin to the last online CPU and read it back. */
+      cpu = topo->num_cpus - 1;
+      CPRT_CPUSET_ZERO(&set);
+      CPRT_CPUSET_SET(cpu, &set);
+      CPRT_ASSERT(cprt_try_cpuset_affinity(&set) == 0);
+      CPRT_ASSERT(cprt_get_cpuset_affinity(&cur_set) == 0);
+      CPRT_ASSERT(memcmp(&set, &cur_set, sizeof(set)) == 0);
+      CPRT_ASSERT(cprt_try_cpuset_affinity(&topo->online_set) == 0);
+      CPRT_CPUSET_ZERO(&set);
+      CPRT_CPUSET_SET(CPRT_MAX_CPUS - 1, &set);  /* Not present. */
+      CPRT_ASSERT(cprt_try_cpuset_affinity(&set) == -1);
+      cprt_topo_free(topo);
+
+      printf("OK\n");
+      break;
+    }
+
+    case 26:
+    {
+      static const char *modes[3] = { "spin", "hybrid", "os" };
+      static uint64_t targets_us[3] = { 10, 100, 1000 };
+      CPRT_THREAD_T thr;
+      struct cprt_timespec start_ts, end_ts;
+      uint64_t spin_window_ns, ns, late_ns, late_sum, late_max, cpu_ns;
+      int mode, t, i;
+      FILE *out_fd;
+
+      CPRT_ENULL(out_fd = fopen("perf26.x", "w"));
+      spin_window_ns = cprt_sleep_calibrate();
+      CPRT_ASSERT(spin_window_ns >= 2000 && spin_window_ns <= 2000000);
+      fprintf(out_fd, "sleep spin_window_ns=%"PRIu64"\n", spin_window_ns);
+
+      /* Wake-up accuracy against CPU cost. */
+      for (mode = 0; mode < 3; mode++) {
+        cprt_sleep_set_spin_ns((mode == 2) ? 0 : spin_window_ns);
+        for (t = 0; t < 3; t++) {
+          late_sum = 0;  late_max = 0;
+          cpu_ns = cprt_thread_cpu_ns();
+          for (i = 0; i < 20; i++) {
+            CPRT_GETTIME(&start_ts);
+            if (mode == 0) { cprt_spin_ns(targets_us[t] * 1000); }
+            else { cprt_sleep_ns(targets_us[t] * 1000); }
+            CPRT_GETTIME(&end_ts);
+            CPRT_DIFF_TS(ns, end_ts, start_ts);
+            CPRT_ASSERT(ns >= targets_us[t] * 1000);  /* Never early. */
+            late_ns = ns - targets_us[t] * 1000;
+            late_sum += late_ns;
+            if (late_ns > late_max) { late_max = late_ns; }
+          }
+          cpu_ns = cprt_thread_cpu_ns() - cpu_ns;
+          fprintf(out_fd, "sleep mode=%s, target_us=%"PRIu64": late_avg_ns=%"PRIu64", late_max_ns=%"PRIu64", cpu_pct=%.0f\n",
+              modes[mode], targets_us[t], late_sum / 20, late_max,
+              100.0 * (double)cpu_ns / (double)(20 * targets_us[t] * 1000 + late_sum));
+          if (mode == 1 && t == 2 && spin_window_ns < 250000) {
+            CPRT_ASSERT(cpu_ns < 20 * 1000000 / 2);  /* 1 ms sleeps are mostly off-CPU. */
+          }
+        }
+      }
+      cprt_sleep_set_spin_ns(spin_window_ns);
+
+      /* A waiter backing off to sleeps costs little CPU. */
+      CPRT_THREAD_CREATE(thr, test_backoff_thread, NULL);
+      CPRT_SLEEP_MS(50);
+      test_backoff_flag = 1;
+      CPRT_THREAD_JOIN(thr);
+      fprintf(out_fd, "backoff wait_ms=50: cpu_ns=%"PRIu64"\n", test_backoff_cpu_ns);
+      CPRT_ASSERT(test_backoff_cpu_ns < 25000000);
+      fclose(out_fd);
+
+      printf("OK\n");
+      break;
+    }
+
+    case 27:
+    {
+      trc_t *trc;  int i;
+      CPRT_THREAD_T thr;
+      CPRT_MUTEX_T free_mutex;
+      cprt_contention_t stats;
+      int num_begins = 0, num_ends = 0;
+      FILE *out_fd;
+
+      TRC_ERR(trc_create(&trc, 100, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_TIMESTAMP | TRC_CREATE_FLAG_THREAD_ID));
+      TRC_ERR(trc_contention_attach(trc));
+      CPRT_MUTEX_INIT(test_mutex);
+      CPRT_SPIN_INIT(test_spin);
+      CPRT_SEM_INIT(test_sem, 0);
+      CPRT_MUTEX_INIT(free_mutex);
+
+      CPRT_MUTEX_LOCK(free_mutex);  /* Uncontended: not seen. */
+      CPRT_MUTEX_UNLOCK(free_mutex);
+      CPRT_ASSERT(cprt_contention_get(&free_mutex, &stats) == -1);
+
+      /* The thread waits on each in turn while we hold it. */
+      CPRT_MUTEX_LOCK(test_mutex);
+      CPRT_SPIN_LOCK(test_spin);
+      CPRT_THREAD_CREATE(thr, test_contend_thread, NULL);
+      CPRT_SLEEP_MS(20);
+      CPRT_MUTEX_UNLOCK(test_mutex);
+      CPRT_SLEEP_MS(20);
+      CPRT_SPIN_UNLOCK(test_spin);
+      CPRT_SLEEP_MS(20);
+      CPRT_SEM_POST(test_sem);
+      CPRT_THREAD_JOIN(thr);
+      TRC_ERR(trc_contention_attach(NULL));
+
+      CPRT_ASSERT(cprt_contention_get(&test_mutex, &stats) == 0);
+      CPRT_ASSERT(stats.type == CPRT_CONTENTION_MUTEX && stats.count == 1);
+      CPRT_ASSERT(stats.max_ns >= 15000000 && stats.total_ns == stats.max_ns);
+      CPRT_ASSERT(cprt_contention_get((void *)&test_spin, &stats) == 0);
+      CPRT_ASSERT(stats.type == CPRT_CONTENTION_SPIN && stats.count == 1 && stats.max_ns >= 15000000);
+      CPRT_ASSERT(cprt_contention_get(&test_sem, &stats) == 0);
+      CPRT_ASSERT(stats.type == CPRT_CONTENTION_SEM && stats.count == 1 && stats.max_ns >= 15000000);
+
+      for (i = 0; i < (int)trc->event_count; i++) {
+        trc_event_t *ev = &trc->events[i];
+        if (ev->kind == TRC_KIND_SPAN_BEGIN) { num_begins++; }
+        if (ev->kind == TRC_KIND_SPAN_END) {
+          CPRT_ASSERT(ev->p2 >= 15000000);
+          num_ends++;
+        }
+      }
+      CPRT_ASSERT(num_begins == 3 && num_ends == 3);
+      CPRT_ASSERT(trc->events[0].p1 == (uint64_t)(uintptr_t)&test_mutex);
+
+      CPRT_ENULL(out_fd = fopen("dump27.x", "w"));
+      TRC_ERR(trc_dump(trc, out_fd));
+      cprt_contention_dump(out_fd);
+      fclose(out_fd);
+      cprt_contention_reset();
+      CPRT_ASSERT(cprt_contention_get(&test_mutex, &stats) == -1);
+
+      CPRT_MUTEX_DELETE(test_mutex);
+      CPRT_SPIN_DELETE(test_spin);
+      CPRT_SEM_DELETE(test_sem);
+      CPRT_MUTEX_DELETE(free_mutex);
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 28:
+    {
+      CPRT_THREAD_T thr[2];
+      cprt_cpuset_t cpuset;
+      uint32_t num_threads;
+      int num_starts = 0, num_exits = 0;
+      int i;
+      FILE *out_fd;
+
+      TRC_ERR(trc_create(&test_trc, 100, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_ATOMIC_INC |
+          TRC_CREATE_FLAG_THREAD_ID | TRC_CREATE_FLAG_CALLERS));
+      CPRT_ASSERT(trc_thread_create(NULL, test_trc, "x", NULL, test_worker_thread, NULL, __FILE__, __LINE__)
+          == TRC_ERR_BAD_PARM);
+      CPRT_CPUSET_ZERO(&cpuset);
+      CPRT_ASSERT(TRC_THREAD_CREATE(thr[0], test_trc, "worker", &cpuset, test_worker_thread, NULL)
+          == TRC_ERR_BAD_PARM);
+
+      TRC_ERR(TRC_THREAD_CREATE(thr[0], test_trc, "worker0", NULL, test_worker_thread, (void *)0));
+      CPRT_THREAD_JOIN(thr[0]);
+      CPRT_CPUSET_SET(0, &cpuset);
+      TRC_ERR(TRC_THREAD_CREATE(thr[1], test_trc, "worker1", &cpuset, test_worker_thread, (void *)1));
+      CPRT_THREAD_JOIN(thr[1]);
+
+      CPRT_ASSERT(strcmp(test_worker_name[0], "worker0") == 0);
+      CPRT_ASSERT(strcmp(test_worker_name[1], "worker1") == 0);
+      CPRT_ASSERT(cprt_cpuset_count(&test_worker_cpuset) == 1 && CPRT_CPUSET_ISSET(0, &test_worker_cpuset));
+
+      /* start, trace, exit per thread, in order. */
+      CPRT_ASSERT(test_trc->event_count == 6);
+      for (i = 0; i < (int)test_trc->event_count; i++) {
+        trc_event_t *ev = &test_trc->events[i];
+        int w = i / 3;
+        CPRT_ASSERT(ev->thread_idx == test_worker_idx[w]);
+        if (ev->kind == TRC_KIND_THREAD_START) {
+          CPRT_ASSERT(i % 3 == 0 && ev->span_id == test_worker_idx[w] && ev->p2 == 0);
+          CPRT_ASSERT(ev->p1 == test_worker_tid[w]);
+          CPRT_ASSERT(strcmp(ev->file_name, __FILE__) == 0);
+          num_starts++;
+        }
+        if (ev->kind == TRC_KIND_THREAD_EXIT) {
+          CPRT_ASSERT(i % 3 == 2 && ev->p1 == (uint64_t)(100 + w) && ev->p2 > 0);
+          num_exits++;
+        }
+      }
+      CPRT_ASSERT(num_starts == 2 && num_exits == 2);
+
+      CPRT_ENULL(out_fd = fopen("dump28.x", "w"));
+      TRC_ERR(trc_dump(test_trc, out_fd));
+      fclose(out_fd);
+
+      /* Leaving with CPRT_THREAD_EXIT is still traced. */
+      TRC_ERR(TRC_THREAD_CREATE(thr[0], test_trc, "exiter", NULL, test_exit_thread, (void *)1));
+      CPRT_THREAD_JOIN(thr[0]);
+      CPRT_ASSERT(test_trc->event_count == 8);
+      CPRT_ASSERT(test_trc->events[7].kind == TRC_KIND_THREAD_EXIT && test_trc->events[7].p1 == TRC_THREAD_EXIT_NO_RTN);
+
+      /* A failed affinity still starts the thread; the start event says why. */
+      CPRT_CPUSET_ZERO(&cpuset);
+      CPRT_CPUSET_SET(CPRT_MAX_CPUS - 1, &cpuset);  /* Not present. */
+      TRC_ERR(TRC_THREAD_CREATE(thr[0], test_trc, "unpinned", &cpuset, test_exit_thread, (void *)1));
+      CPRT_THREAD_JOIN(thr[0]);
+      CPRT_ASSERT(test_trc->event_count == 10);
+      CPRT_ASSERT(test_trc->events[8].kind == TRC_KIND_THREAD_START && test_trc->events[8].p2 != 0);
+
+      /* Once fresh indexes run out, exited threads' are reused. */
+      num_threads = trc_num_threads;
+      for (i = 0; i < TRC_MAX_THREADS + 10; i++) {
+        TRC_ERR(TRC_THREAD_CREATE(thr[0], NULL, "reuser", NULL, test_exit_thread, NULL));
+        CPRT_THREAD_JOIN(thr[0]);
+        CPRT_ASSERT(test_exit_idx != TRC_THREAD_IDX_OVERFLOW);
+      }
+      CPRT_ASSERT(num_threads < 10 && trc_num_threads == TRC_MAX_THREADS - 1);
+      TRC_ERR(trc_delete(test_trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 29:
+    {
+      trc_t *trc;
+      trc_span_t span;
+      trc_cap_t *cap;
+      uint64_t overhead_ns;
+      uint32_t num_threads;
+      int i;
+      FILE *out_fd;
+
+      num_threads = trc_num_threads;
+      TRC_ERR(trc_create(&trc, 100, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_TIMESTAMP | TRC_CREATE_FLAG_THREAD_ID));
+      overhead_ns = trc_overhead_ns(trc);  /* Measured by trc_create(). */
+      CPRT_ASSERT(overhead_ns > 0 && overhead_ns < 100000);
+      CPRT_ASSERT(trc_num_threads == num_threads);  /* Nor registered this thread. */
+      for (i = 0; i < 4; i++) {
+        TRC_SPAN_BEGIN(trc, span, i, 0);
+        TRC_SPAN_END(span, i);
+      }
+      CPRT_ASSERT(trc_overhead_ns(trc) == overhead_ns);
+      CPRT_ASSERT(trc->event_count == 8);  /* Calibration left the ring alone. */
+
+      CPRT_ENULL(out_fd = fopen("dump29.x", "w"));
+      TRC_ERR(trc_dump(trc, out_fd));
+      fclose(out_fd);
+      CPRT_ENULL(out_fd = fopen("cap29.x", "wb"));
+      TRC_ERR(trc_dump_bin(trc, out_fd));
+      fclose(out_fd);
+      TRC_ERR(trc_cap_open(&cap, "cap29.x"));
+      CPRT_ASSERT(cap->hdr.overhead_ns == overhead_ns);
+      TRC_ERR(trc_cap_close(cap));
+
+      TRC_ERR(trc_delete(trc));
+      printf("OK\n");
+      break;
+    }
+
+    case 30:
+    {
+      trc_t *trc;
+      trc_arc_t *arc;
+      trc_cap_t *cap, *arc_cap;
+      trc_cap_event_t ev, arc_ev;
+      trc_cap_event_t *events;
+      trc_cap_filter_t filter;
+      struct cprt_timespec start_ts;
+      struct stat bin_st, arc_st;
+      uint64_t cursor, num_lost, num_matched, b, decode_ns, num_decoded;
+      int i, round;
+      FILE *out_fd;
+
+      TRC_ERR(trc_create(&trc, 50000, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_TIMESTAMP | TRC_CREATE_FLAG_THREAD_ID));
+      for (i = 0; i < 50000; i++) {
+        if (i % 3 == 0) {
+          TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, (uint64_t)i * 64 + 0x7f0000000000ull));
+        }
+        else {
+          TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i / 1000, 0));
+        }
+      }
+      CPRT_ENULL(out_fd = fopen("cap30.x", "wb"));
+      TRC_ERR(trc_dump_bin(trc, out_fd));
+      fclose(out_fd);
+      CPRT_ENULL(out_fd = fopen("arc30.x", "wb"));
+      TRC_ERR(trc_dump_arc(trc, out_fd));
+      fclose(out_fd);
+      CPRT_EM1(stat("cap30.x", &bin_st));
+      CPRT_EM1(stat("arc30.x", &arc_st));
+      CPRT_ASSERT(arc_st.st_size * 4 < bin_st.st_size);
+
+      /* Same events, read through either format. */
+      TRC_ERR(trc_cap_open(&cap, "cap30.x"));
+      TRC_ERR(trc_cap_open(&arc_cap, "arc30.x"));
+      CPRT_ASSERT(arc_cap->is_arc && arc_cap->hdr.num_events == 50000 && arc_cap->hdr.num_sites == 2);
+      CPRT_ASSERT(arc_cap->hdr.event_count == cap->hdr.event_count);
+      CPRT_ASSERT(arc_cap->hdr.overhead_ns == cap->hdr.overhead_ns);
+      CPRT_ASSERT(arc_cap->hdr.num_index == (50000 + TRC_ARC_BLOCK_EVENTS - 1) / TRC_ARC_BLOCK_EVENTS);
+      for (i = 0; trc_cap_next(cap, &ev); i++) {
+        CPRT_ASSERT(trc_cap_next(arc_cap, &arc_ev));
+        CPRT_ASSERT(memcmp(&ev, &arc_ev, sizeof(ev)) == 0);
+      }
+      CPRT_ASSERT(i == 50000 && ! trc_cap_next(arc_cap, &arc_ev));
+
+      /* Queries decode only the blocks whose summary can match. */
+      TRC_ERR(trc_cap_mmap(arc_cap));
+      CPRT_ASSERT(arc_cap->events == NULL && trc_cap_num_blocks(arc_cap) == 13);
+      memset(&filter, 0, sizeof(filter));
+      filter.have_p1 = 1;
+      filter.p1 = 3000;
+      num_matched = 0;
+      TRC_ERR(trc_cap_query(arc_cap, &filter, test_query_cb, &num_matched, &b));
+      CPRT_ASSERT(num_matched == 1 && b == 13);
+      filter.min_ts_ns = arc_cap->blocks[5].summary.min_ts_ns + 1;
+      filter.max_ts_ns = arc_cap->blocks[5].summary.max_ts_ns - 1;
+      filter.have_p1 = 0;
+      num_matched = 0;
+      TRC_ERR(trc_cap_query(arc_cap, &filter, test_query_cb, &num_matched, &b));
+      CPRT_ASSERT(num_matched > 0 && b == 1);
+      TRC_ERR(trc_cap_close(cap));
+
+      /* Decode speed, in uncompressed bytes (informational). */
+      events = (trc_cap_event_t *)malloc(TRC_ARC_BLOCK_EVENTS * sizeof(trc_cap_event_t));
+      CPRT_ASSERT(events != NULL);
+      num_decoded = 0;
+      CPRT_GETTIME(&start_ts);
+      for (round = 0; round < 20; round++) {
+        for (b = 0; b < arc_cap->hdr.num_index; b++) {
+          TRC_ERR(trc_arc_read_block(arc_cap, b, events));
+          num_decoded += arc_cap->blocks[b].num_events;
+        }
+      }
+      decode_ns = test_elapsed_ns(&start_ts);
+      free(events);
+      CPRT_ENULL(out_fd = fopen("perf30.x", "w"));
+      fprintf(out_fd, "arc bin_bytes=%"PRIu64", arc_bytes=%"PRIu64", ratio=%.1f, decode=%.0f MB/s\n",
+          (uint64_t)bin_st.st_size, (uint64_t)arc_st.st_size, (double)bin_st.st_size / (double)arc_st.st_size,
+          (double)num_decoded * sizeof(trc_cap_event_t) * 1000.0 / (double)decode_ns);
+      fclose(out_fd);
+      TRC_ERR(trc_cap_close(arc_cap));
+      TRC_ERR(trc_delete(trc));
+
+      /* Drain while tracing. */
+      TRC_ERR(trc_create(&trc, 1000, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_TIMESTAMP));
+      CPRT_ENULL(out_fd = fopen("arc30b.x", "wb"));
+      TRC_ERR(trc_arc_open(&arc, out_fd, trc->create_flags, 0));
+      cursor = 0;
+      num_lost = 0;
+      for (round = 0; round < 10; round++) {
+        for (i = 0; i < 900; i++) {
+          TRC_ERR(trc_trace(trc, __FILE__, __LINE__, round, i));
+        }
+        TRC_ERR(trc_drain_arc(trc, arc, &cursor, &num_lost));
+      }
+      CPRT_ASSERT(cursor == 9000 && num_lost == 0);
+      TRC_ERR(trc_arc_close(arc));
+      fclose(out_fd);
+      TRC_ERR(trc_cap_open(&arc_cap, "arc30b.x"));
+      CPRT_ASSERT(arc_cap->hdr.num_events == 9000 && arc_cap->hdr.event_count == 9000);
+      for (i = 0; trc_cap_next(arc_cap, &ev); i++) {
+        CPRT_ASSERT(ev.seq == (uint64_t)i && ev.p1 == (uint64_t)(i / 900) && ev.p2 == (uint64_t)(i % 900));
+      }
+      CPRT_ASSERT(i == 9000);
+      TRC_ERR(trc_cap_close(arc_cap));
+      TRC_ERR(trc_delete(trc));
+
+      printf("OK\n");
+      break;
+    }
+
+    case 31:
+    {
+      trc_t *trc, *snap;
+      trc_span_t span;
+      trc_cap_t *cap;
+      trc_cap_event_t cap_ev;
+      CPRT_THREAD_T thr;
+      uint64_t count, first, ev_num;
+      struct stat st;
+      char shm_name[64];
+      pid_t child;
+      int status;
+      int i, round;
+      FILE *out_fd;
+
+      TRC_ERR(trc_create(&trc, 1000, TRC_CREATE_FLAG_NO_OVERRIDE | TRC_CREATE_FLAG_TIMESTAMP | TRC_CREATE_FLAG_THREAD_ID));
+      for (i = 0; i < 10; i++) {
+        TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 0));
+      }
+      CPRT_ASSERT(trc_control_start(trc, NULL, NULL) == TRC_ERR_BAD_PARM);
+      (void)unlink("ctl31.sock");
+      TRC_ERR(trc_control_start(trc, "ctl31.sock", "dump text dump31s.x"));
+      CPRT_ASSERT(trc_control_start(trc, "ctl31.sock", NULL) == TRC_ERR_BAD_PARM);  /* Already running. */
+      CPRT_EM1(stat("ctl31.sock", &st));
+      CPRT_ASSERT((st.st_mode & 0777) == 0600);
+
+      CPRT_ENULL(out_fd = fopen("ctl31.x", "w"));
+      TRC_ERR(trc_control_send("ctl31.sock", "stats", out_fd));
+
+      TRC_ERR(trc_control_send("ctl31.sock", "freeze", out_fd));
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 99, 0));
+      CPRT_ASSERT(trc->event_count == 10);
+      TRC_ERR(trc_control_send("ctl31.sock", "unfreeze", out_fd));
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 10, 0));
+      CPRT_ASSERT(trc->event_count == 11);
+
+      /* Traces only. */
+      TRC_ERR(trc_control_send("ctl31.sock", "mask 0x1", out_fd));
+      TRC_SPAN_BEGIN(trc, span, 0, 0);
+      TRC_SPAN_END(span, 0);
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 11, 0));
+      CPRT_ASSERT(trc->event_count == 12 && trc->events[11].kind == TRC_KIND_TRACE);
+      TRC_ERR(trc_control_send("ctl31.sock", "mask 0xffffffff", out_fd));
+      CPRT_ASSERT(trc_control_send("ctl31.sock", "mask zz", out_fd) == TRC_ERR_BAD_PARM);
+      CPRT_ASSERT(trc_control_send("ctl31.sock", "bogus", out_fd) == TRC_ERR_BAD_PARM);
+      CPRT_ASSERT(trc_control_send("ctl31.sock", "dump xml x", out_fd) == TRC_ERR_BAD_PARM);
+
+      TRC_ERR(trc_control_send("ctl31.sock", "dump bin cap31.x", out_fd));
+      TRC_ERR(trc_cap_open(&cap, "cap31.x"));
+      CPRT_ASSERT(cap->hdr.num_events == 12);
+      TRC_ERR(trc_cap_close(cap));
+
+      /* The signal's dump runs before the next client is served. */
+      (void)unlink("dump31s.x");
+      CPRT_EM1(raise(SIGUSR2));
+      TRC_ERR(trc_control_send("ctl31.sock", "stats", out_fd));
+      CPRT_EM1(stat("dump31s.x", &st));
+      fclose(out_fd);
+
+      TRC_ERR(trc_control_stop());
+      CPRT_ASSERT(stat("ctl31.sock", &st) == -1);
+      CPRT_ASSERT(trc_control_send("ctl31.sock", "stats", NULL) == TRC_ERR_IO);
+      TRC_ERR(trc_delete(trc));
+
+      /* Snapshots are consistent while another thread traces. */
+      TRC_ERR(trc_create(&trc, 1000, TRC_CREATE_FLAG_NO_OVERRIDE));
+      test_tracer_stop = 0;
+      CPRT_THREAD_CREATE(thr, test_tracer_thread, trc);
+      for (round = 0; round < 200; round++) {
+        TRC_ERR(trc_snapshot(trc, &snap));
+        count = snap->event_count;
+        first = snap->snap_first;
+        CPRT_ASSERT(first <= count && count - first <= 1000);
+        for (ev_num = first; ev_num < count; ev_num++) {
+          CPRT_ASSERT(snap->events[ev_num % 1000].p1 == ev_num);
+        }
+        TRC_ERR(trc_delete(snap));
+        if (round % 10 == 0) { CPRT_SLEEP_MS(1); }
+      }
+      /* So are captures: the header, sites and index match the events. */
+      for (round = 0; round < 20; round++) {
+        CPRT_ENULL(out_fd = fopen("cap31.x", "wb"));
+        TRC_ERR(trc_dump_bin(trc, out_fd));
+        fclose(out_fd);
+        TRC_ERR(trc_cap_open(&cap, "cap31.x"));
+        for (i = 0; trc_cap_next(cap, &cap_ev); i++) {
+          CPRT_ASSERT(cap_ev.site_id < cap->hdr.num_sites && cap_ev.p1 == cap_ev.seq);
+          CPRT_ASSERT(cap_ev.seq == cap->hdr.event_count - cap->hdr.num_events + i);
+        }
+        CPRT_ASSERT((uint64_t)i == cap->hdr.num_events);
+        TRC_ERR(trc_cap_close(cap));
+      }
+      test_tracer_stop = 1;
+      CPRT_THREAD_JOIN(thr);
+      TRC_ERR(trc_delete(trc));
+
+      /* A shared ring's snapshot keeps each event's process. */
+      CPRT_SNPRINTF(shm_name, sizeof(shm_name), "/trc_test31_%d", (int)CPRT_GETPID());
+      (void)trc_unlink_shared(shm_name);
+      TRC_ERR(trc_create_shared(&trc, shm_name, 64, TRC_CREATE_FLAG_THREAD_ID));
+      TRC_ERR(trc_set_thread_name("snapshm"));
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 0, 0));
+      child = fork();
+      CPRT_ASSERT(child >= 0);
+      if (child == 0) {
+        trc_t *child_trc;
+        TRC_ERR(trc_create_shared(&child_trc, shm_name, 1, 0));
+        for (i = 0; i < 3; i++) {
+          TRC_ERR(trc_trace(child_trc, __FILE__, __LINE__, 100 + i, 0));
+        }
+        TRC_ERR(trc_delete(child_trc));
+        _exit(0);
+      }
+      CPRT_ASSERT(waitpid(child, &status, 0) == child);
+      CPRT_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+      TRC_ERR(trc_trace(trc, __FILE__, __LINE__, 1, 0));
+      TRC_ERR(trc_snapshot(trc, &snap));
+      CPRT_ASSERT(snap->shm == trc->shm && snap->event_count == 5);
+      TRC_ERR(trc_trace(snap, __FILE__, __LINE__, 99, 0));  /* No-op. */
+      CPRT_ASSERT(trc->shm->event_count == 5);
+      CPRT_ENULL(out_fd = fopen("dump31l.x", "w"));
+      TRC_ERR(trc_dump(trc, out_fd));
+      fclose(out_fd);
+      CPRT_ENULL(out_fd = fopen("dump31p.x", "w"));
+      TRC_ERR(trc_dump(snap, out_fd));
+      fclose(out_fd);
+      TRC_ERR(trc_delete(snap));
+      /* So do captures and archives. */
+      CPRT_ENULL(out_fd = fopen("cap31p.x", "wb"));
+      TRC_ERR(trc_dump_bin(trc, out_fd));
+      fclose(out_fd);
+      CPRT_ENULL(out_fd = fopen("arc31p.x", "wb"));
+      TRC_ERR(trc_dump_arc(trc, out_fd));
+      fclose(out_fd);
+      TRC_ERR(trc_cap_open(&cap, "cap31p.x"));
+      CPRT_ASSERT(cap->hdr.num_procs == 2 && cap->hdr.threads_proc_idx == 0);
+      CPRT_ASSERT(cap->procs[0].pid == (uint32_t)CPRT_GETPID() && cap->procs[1].pid == (uint32_t)child);
+      for (i = 0; trc_cap_next(cap, &cap_ev); i++) {
+        CPRT_ASSERT(cap_ev.proc_idx == ((i >= 1 && i <= 3) ? 1 : 0));
+        CPRT_ASSERT(strcmp(trc_cap_thread_name(cap, cap_ev.proc_idx, cap_ev.thread_idx),
+            (cap_ev.proc_idx == 0) ? "snapshm" : "") == 0);
+      }
+      CPRT_ASSERT(i == 5);
+      TRC_ERR(trc_cap_close(cap));
+      TRC_ERR(trc_delete(trc));
+      TRC_ERR(trc_unlink_shared(shm_name));
+
+      printf("OK\n");
+      break;
+    }
+
+    case 32:
+    {
+      trc_t *trc, *snap;
+      trc_cap_t *cap;
+      trc_cap_event_t cap_ev;
+      trc_event_t buf[20];
+      uint64_t start, cursor, num_lost, next, num_missed, ev_num;
+      uint32_t num_read;
+      uint32_t flags[2] = { 0, TRC_CREATE_FLAG_ATOMIC_INC };
+      int f, i;
+      FILE *out_fd;
+
+      /* Counting across 2^32 keeps the ring in order. */
+      start = 0xffffffffull - 5;
+      for (f = 0; f < 2; f++) {
+        TRC_ERR(trc_create(&trc, 10, TRC_CREATE_FLAG_NO_OVERRIDE | flags[f]));
+        trc->event_count = start;
+        for (i = 0; i < 20; i++) {
+          TRC_ERR(trc_trace(trc, __FILE__, __LINE__, i, 0));
+        }
+        CPRT_ASSERT(trc->event_count == start + 20);
+        for (i = 0; i < 10; i++) {
+          ev_num = start + 10 + i;
+          CPRT_ASSERT(trc->events[ev_num % 10].p1 == (uint64_t)(10 + i));
+          CPRT_ASSERT(trc->events[ev_num % 10].seq == ev_num + 1);
+        }
+
+        cursor = start;
+        TRC_ERR(trc_read_since(trc, &cursor, buf, 20, &num_read, &num_lost));
+        CPRT_ASSERT(num_read == 10 && num_lost == 10 && cursor == start + 20);
+        for (i = 0; i < 10; i++) {
+          CPRT_ASSERT(buf[i].p1 == (uint64_t)(10 + i));
+        }
+
+        TRC_ERR(trc_snapshot(trc, &snap));
+        CPRT_ASSERT(snap->event_count == start + 20 && snap->snap_first == start + 10);
+        TRC_ERR(trc_delete(snap));
+
+        CPRT_ENULL(out_fd = fopen("cap32.x", "wb"));
+        TRC_ERR(trc_dump_bin(trc, out_fd));
+        fclose(out_fd);
+        TRC_ERR(trc_cap_open(&cap, "cap32.x"));
+        CPRT_ASSERT(cap->hdr.event_count == start + 20 && cap->hdr.num_events == 10);
+        for (i = 0; trc_cap_next(cap, &cap_ev); i++) {
+          CPRT_ASSERT(cap_ev.seq == start + 10 + i && cap_ev.p1 == (uint64_t)(10 + i));
+        }
+        CPRT_ASSERT(i == 10);
+        TRC_ERR(trc_cap_close(cap));
+
+        if (f == 0) {
+          CPRT_ENULL(out_fd = fopen("dump32.x", "w"));
+          TRC_ERR(trc_dump(trc, out_fd));
+          next = start + 15;
+          num_missed = 0;
+          CPRT_ASSERT(trc_tail(trc, &next, out_fd, &num_missed, NULL) == 5);
+          CPRT_ASSERT(next == start + 20 && num_missed == 0);
+          fclose(out_fd);
+        }
+        TRC_ERR(trc_delete(trc));
+      }
+
+      printf("OK\n");
+      break;
+    }
+
     default: /* CPRT_ABORT */
       CPRT_ABORT("unknown option, aborting.");
   }
@@ -18,7 +18,12 @@ else echo "FYI: mdtoc.pl not found; see https://github.com/fordsfords/mdtoc"
 fi
 
 
-gcc -Wall -pthread -o trc_test cprt.c trc.c trc_test.c -l pthread ; ASSRT "$? -eq 0"
+gcc -Wall -pthread -rdynamic -DCPRT_CONTENTION_TRACE -o trc_test cprt.c trc.c trc_cap.c trc_test.c -l pthread -l dl ; ASSRT "$? -eq 0"
+gcc -Wall -pthread -o trc_decode cprt.c trc.c trc_cap.c trc_decode.c -l pthread -l dl ; ASSRT "$? -eq 0"
+gcc -Wall -pthread -o trc_query cprt.c trc.c trc_cap.c trc_query.c -l pthread -l dl ; ASSRT "$? -eq 0"
+gcc -Wall -pthread -o trc_merge cprt.c trc.c trc_cap.c trc_merge.c -l pthread -l dl ; ASSRT "$? -eq 0"
+gcc -Wall -pthread -o trc_tail cprt.c trc.c trc_cap.c trc_tail.c -l pthread -l dl ; ASSRT "$? -eq 0"
+gcc -Wall -pthread -o trc_ctl cprt.c trc.c trc_cap.c trc_ctl.c -l pthread -l dl ; ASSRT "$? -eq 0"
 
 ./trc_test -h >x.1 2>&1 ; ASSRT "$? -eq 0"
 egrep "^[Ww]here:" x.1 >/dev/null ; ASSRT "$? -eq 0"
@@ -36,3 +41,254 @@ TRC_NUM_ENTRIES=11 TRC_CREATE_FLAGS=0x0f ./trc_test -t 2 >x.1 2>&1 ; ASSRT "$? -
 # Check for unexpected lines
 egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
 egrep "^Test [0-9]*\.\.\.OK$" x.1 ; ASSRT "! -s x.2"
+
+
+# Event array allocation options (huge pages, prefault, mlock).
+./trc_test -t 9 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+
+
+# Per-NUMA-node rings, faking two nodes.
+TRC_NUMA_NODES=2 ./trc_test -t 10 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+
+
+# Small thread indexes and the thread-name registry.
+./trc_test -t 11 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+
+
+# CPU number per event and migration flagging.
+./trc_test -t 12 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+
+
+# Caller capture with dump-time symbolization.
+./trc_test -t 13 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+
+
+# Spans and per-site latency histograms.
+./trc_test -t 14 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+
+# C++ scoped span guard.
+if which g++ >/dev/null; then
+  cat >x.cpp <<__EOF__
+#include <string.h>
+#include "trc.h"
+int main() {
+  trc_t *trc;
+  TRC_ERR(trc_create(&trc, 10, TRC_CREATE_FLAG_NO_OVERRIDE));
+  { TRC_SPAN_SCOPED(trc, 1, 2); }
+  CPRT_ASSERT(trc->event_count == 2 && trc->events[1].kind == TRC_KIND_SPAN_END);
+  return 0;
+}
+__EOF__
+  gcc -Wall -c cprt.c trc.c trc_cap.c ; ASSRT "$? -eq 0"
+  g++ -Wall -pthread -o x_cpp x.cpp cprt.o trc.o trc_cap.o -l pthread -l dl ; ASSRT "$? -eq 0"
+  ./x_cpp ; ASSRT "$? -eq 0"
+else echo "FYI: g++ not found; skipping C++ test"
+fi
+
+
+# Binary capture, offline decoder and Chrome trace JSON export.
+./trc_test -t 15 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+./trc_decode cap15.x >x.1 ; ASSRT "$? -eq 0"
+egrep -c "^  ev\[[0-9]*\]\.thread=cap_main" x.1 >x.2 ; ASSRT "`cat x.2` -eq 8"
+# The offline export must match the in-process one.
+./trc_decode -c cap15.x >x.1 ; ASSRT "$? -eq 0"
+cmp x.1 chrome15.x ; ASSRT "$? -eq 0"
+egrep '"cat":"span","ph":"e","id2":\{"local":"0x[0-9a-f]*"\},' x.1 >/dev/null ; ASSRT "$? -eq 0"
+# Each end names its own begin's id, even when spans do not nest.
+sed -n 's/.*"ph":"\([be]\)","id2":{"local":"\(0x[0-9a-f]*\)"}.*"p1":\([0-9]*\),.*/\1 \2 \3/p' chrome15b.x >x.2
+awk '{ if ($1 == "b") id[$3] = $2; else if (id[$3] != $2) bad++ } END { print (NR == 4 && bad == 0) }' x.2 >x.3
+ASSRT "`cat x.3` -eq 1"
+rm -f x.3 chrome15b.x
+
+
+# Indexed queries over a capture.
+./trc_test -t 16 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+./trc_query -s trc_test.c:9999 cap16.x >x.1 ; ASSRT "$? -eq 0"
+egrep -c "\.p1=57005, .*trc_test.c:9999" x.1 >x.2 ; ASSRT "`cat x.2` -eq 2"
+egrep "^trc_query: matched=2, blocks_scanned=2/20$" x.1 >/dev/null ; ASSRT "$? -eq 0"
+./trc_query -a -p 0xdead -t query_main cap16.x >x.1 ; ASSRT "$? -eq 0"
+egrep "^  site trc_test.c:9999: count=2" x.1 >/dev/null ; ASSRT "$? -eq 0"
+./trc_query -g -s 'trc_test.c:9999|nosuch.c:1' cap16.x >x.1 2>x.2 ; ASSRT "$? -eq 0"
+egrep "^  gaps: count=1," x.1 >/dev/null ; ASSRT "$? -eq 0"
+egrep "nosuch.c:1 not in capture" x.2 >/dev/null ; ASSRT "$? -eq 0"
+
+
+# Merge captures from two processes (tests 15 and 16 ran in that order).
+./trc_merge cap16.x cap15.x >x.1 ; ASSRT "$? -eq 0"
+egrep -c "^trc_test\[[0-9]*\]  ev\[" x.1 >x.2 ; ASSRT "`cat x.2` -eq 20008"
+sed -n 3,10p x.1 | egrep -c "thread=cap_main" >x.2 ; ASSRT "`cat x.2` -eq 8"
+./trc_merge -c cap15.x cap16.x >x.1 ; ASSRT "$? -eq 0"
+egrep -c '"name":"process_name"' x.1 >x.2 ; ASSRT "`cat x.2` -eq 2"
+
+
+# Shared-memory ring written by two processes.
+./trc_test -t 17 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep -c "^  ev\[[0-9]*\]\.pid=[0-9]*, \.thread=\[[0-9]*\], \.p1=10[0-9], .*trc_test.c:" dump17.x >x.2 ; ASSRT "`cat x.2` -eq 10"
+egrep -c "^  ev\[[0-9]*\]\.pid=[0-9]*, \.thread=trc_test\[1\]" dump17.x >x.2 ; ASSRT "`cat x.2` -eq 10"
+
+
+# Tailing a ring from outside the writer.
+rm -f ring18.x
+./trc_test -t 18 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep -c "^  ev\[1[2-9]\]\.thread=-, \.p1=1[2-9]," tail18.x >x.2 ; ASSRT "`cat x.2` -eq 8"
+egrep "^  ev\[1\]\.thread=trc_test\[[0-9]*\], \.cpu=[0-9]* \(MIGRATED from [0-9]*\), \.p1=101," tail18.x >/dev/null ; ASSRT "$? -eq 0"
+./trc_tail -a -n ring18.x >x.1 ; ASSRT "$? -eq 0"
+egrep -c "^  ev\[(2[4-9]|3[0-9])\]\.pid=[0-9]*, \.thread=\[1\], \.p1=(2[4-9]|3[0-9])," x.1 >x.2 ; ASSRT "`cat x.2` -eq 16"
+egrep "^trc_tail: printed=16, missed=0$" x.1 >/dev/null ; ASSRT "$? -eq 0"
+./trc_tail -n ring18.x >x.1 ; ASSRT "$? -eq 0"
+egrep "^trc_tail: printed=0, missed=0$" x.1 >/dev/null ; ASSRT "$? -eq 0"
+rm -f ring18.x
+
+
+# Incremental harvesting.
+./trc_test -t 19 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+
+
+# Counter-only sites.
+./trc_test -t 20 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep -c "^counter trc_test.c:[0-9]*: hits=24000, p1.sum=11988000, .min=0, .max=999, p2.sum=276000, .min=10, .max=13, last=" dump20.x >x.2 ; ASSRT "`cat x.2` -eq 2"
+egrep -c "^counter trc_test.c:[0-9]*: hits=1, p1.sum=7," dump20.x >x.2 ; ASSRT "`cat x.2` -eq 2"
+
+
+# Gauge sampler thread.
+./trc_test -t 21 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep '"name":"slow_gauge","ph":"C",.*"args":\{"value":1001\}' chrome21.x >/dev/null ; ASSRT "$? -eq 0"
+
+
+# Flows across threads.
+./trc_test -t 22 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep -c "\.flow_step=0x[0-9a-f]*, .p1=" dump22.x >x.2 ; ASSRT "`cat x.2` -eq 20"
+./trc_decode -f -k 2 cap22.x >x.1 ; ASSRT "$? -eq 0"
+egrep "^trc_decode: flows completed=20, incomplete=1, orphaned=0, restarted=0$" x.1 >/dev/null ; ASSRT "$? -eq 0"
+egrep -c "^  hop trc_test.c:[0-9]* -> trc_test.c:[0-9]*: count=" x.1 >x.2 ; ASSRT "`cat x.2` -eq 3"
+egrep "^  hop trc_test.c:[0-9]* -> trc_test.c:[0-9]*: count=20, " x.1 >/dev/null ; ASSRT "$? -eq 0"
+egrep "^  slowest\[0\]: flow=0x7, total_ns=[0-9]*, hops=3$" x.1 >/dev/null ; ASSRT "$? -eq 0"
+egrep -c "^  slowest\[" x.1 >x.2 ; ASSRT "`cat x.2` -eq 2"
+egrep "^    begin \+0 ns, thread=flow_a\[[0-9]*\], trc_test.c:[0-9]*$" x.1 >/dev/null ; ASSRT "$? -eq 0"
+egrep "^    end \+[0-9]* ns, thread=flow_c\[[0-9]*\], trc_test.c:[0-9]*$" x.1 >/dev/null ; ASSRT "$? -eq 0"
+./trc_decode -c cap22.x >x.1 ; ASSRT "$? -eq 0"
+egrep -c '"ph":"f","bp":"e","id":7,' x.1 >x.2 ; ASSRT "`cat x.2` -eq 1"
+
+
+# Asynchronous timestamped printing.
+./trc_test -t 23 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep -c "^[0-9-]* [0-9:.]*: thread=[0-3], i=[0-9]*$" async23.x >x.2 ; ASSRT "`cat x.2` -eq 2000"
+rm -f async23.x async23b.x
+
+
+# Lock-free queues and pool (throughput is informational).
+./trc_test -t 24 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+cat perf24.x
+
+
+# CPU sets and topology.
+./trc_test -t 25 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep "^cprt_topo: online=[0-9,-]*, num_online=[1-9][0-9]*, sockets=[1-9][0-9]*, cores=[1-9]" topo25.x >/dev/null ; ASSRT "$? -eq 0"
+egrep "^  cpu\[0\]: socket=[0-9-]*, core=[0-9-]*, numa_node=[0-9-]*, l3=[0-9-]*, smt=0" topo25.x >/dev/null ; ASSRT "$? -eq 0"
+
+
+# Hybrid sleep and backoff (accuracy and CPU cost are informational).
+./trc_test -t 26 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+cat perf26.x
+
+
+# Contention tracing (trc_test is built with CPRT_CONTENTION_TRACE).
+./trc_test -t 27 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep -c "^contention (mutex|spin|sem) 0x[0-9a-f]* \(trc_test.c:[0-9]*\): count=1, total_ns=[0-9]*, avg_ns=[0-9]*, max_ns=" dump27.x >x.2 ; ASSRT "`cat x.2` -eq 3"
+egrep -c "\.span_end=0x[0-9a-f]*, .p1=[0-9]*, .p2=[0-9]*, trc_test.c:" dump27.x >x.2 ; ASSRT "`cat x.2` -eq 3"
+
+
+# Instrumented thread creation.
+./trc_test -t 28 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep -c "^  ev\[[0-9]*\]\.thread=worker[01]\[[0-9]*\], \.thread_(start|exit), \.p1=" dump28.x >x.2 ; ASSRT "`cat x.2` -eq 4"
+
+
+# Tracing overhead calibration.
+./trc_test -t 29 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep "^trc_dump: build: .*, overhead_ns=[1-9][0-9]*$" dump29.x >/dev/null ; ASSRT "$? -eq 0"
+./trc_decode cap29.x >x.1 ; ASSRT "$? -eq 0"
+egrep "^trc_decode: proc=.*, overhead_ns=[1-9][0-9]*$" x.1 >/dev/null ; ASSRT "$? -eq 0"
+./trc_decode -o cap29.x >x.2 ; ASSRT "$? -eq 0"
+# Each span is shorter by the overhead (or down to 0).
+OVERHEAD=`sed -n "s/^trc_decode: .*overhead_ns=\([0-9]*\)$/\1/p" x.1`
+sed -n "s/.*span_end=.*, \.p2=\([0-9]*\),.*/\1/p" x.1 >x.3
+sed -n "s/.*span_end=.*, \.p2=\([0-9]*\),.*/\1/p" x.2 >x.4
+paste x.3 x.4 | awk -v o=$OVERHEAD '{ if ($1 - o != $2 && $2 != 0) bad++ } END { print (NR == 4 && bad == 0) }' >x.2
+ASSRT "`cat x.2` -eq 1"
+# So is each gap between a thread's events.
+./trc_decode -d cap29.x | sed -n "s/^    delta_ns=//p" >x.3 ; ASSRT "$? -eq 0"
+./trc_decode -d -o cap29.x | sed -n "s/^    delta_ns=//p" >x.4 ; ASSRT "$? -eq 0"
+paste x.3 x.4 | awk -v o=$OVERHEAD '{ if ($1 - o != $2 && $2 != 0) bad++ } END { print (NR == 7 && bad == 0) }' >x.2
+ASSRT "`cat x.2` -eq 1"
+rm -f x.3 x.4
+
+
+# Compressed archives (size and decode speed are informational).
+./trc_test -t 30 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+cat perf30.x
+./trc_decode cap30.x >x.1 ; ASSRT "$? -eq 0"
+./trc_decode arc30.x >x.2 ; ASSRT "$? -eq 0"
+cmp -s x.1 x.2 ; ASSRT "$? -eq 0"
+./trc_query -a -b 100 arc30.x >x.1 ; ASSRT "$? -eq 0"
+egrep "^trc_query: matched=[0-9]*, arc_blocks_scanned=[0-9]*/13$" x.1 >/dev/null ; ASSRT "$? -eq 0"
+./trc_merge cap30.x arc30b.x >x.1 ; ASSRT "$? -eq 0"
+egrep -c "^trc_merge: input\[[01]\]=" x.1 >x.2 ; ASSRT "`cat x.2` -eq 2"
+rm -f cap30.x arc30.x arc30b.x
+
+
+# Control socket and SIGUSR2 dump trigger.
+./trc_test -t 31 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep -c "^event_count=1[012], num_entries=1000, num_nodes=[0-9]*, frozen=0, " ctl31.x >x.2 ; ASSRT "`cat x.2` -eq 2"
+egrep -c "^ok (frozen|unfrozen|mask=0x1|mask=0xffffffff|dumped cap31.x)$" ctl31.x >x.2 ; ASSRT "`cat x.2` -eq 5"
+egrep -c "^error: " ctl31.x >x.2 ; ASSRT "`cat x.2` -eq 3"
+egrep -c "^  ev\[[0-9]*\]\.thread=.*, \.p1=[0-9]*, \.p2=0, trc_test.c:" dump31s.x >x.2 ; ASSRT "`cat x.2` -eq 12"
+# A shared ring's snapshot dumps the same events as the live ring.
+grep "^  ev\[" dump31l.x >x.3
+grep "^  ev\[" dump31p.x >x.4
+cmp -s x.3 x.4 ; ASSRT "$? -eq 0"
+egrep -c "^  ev\[[0-9]*\]\.pid=[0-9]*, \.thread=snapshm\[[0-9]*\], \.p1=[01], " x.4 >x.2 ; ASSRT "`cat x.2` -eq 2"
+egrep -c "^  ev\[[0-9]*\]\.pid=[0-9]*, \.thread=\[[0-9]*\], \.p1=10[0-2], " x.4 >x.2 ; ASSRT "`cat x.2` -eq 3"
+./trc_decode cap31p.x >x.1 ; ASSRT "$? -eq 0"
+./trc_decode arc31p.x >x.2 ; ASSRT "$? -eq 0"
+cmp -s x.1 x.2 ; ASSRT "$? -eq 0"
+grep "^  ev\[" x.1 | sed "s/, [0-9/]* [0-9:.]*$//" >x.3
+sed "s/, [0-9/]* [0-9:.]*$//" x.4 >x.1
+cmp -s x.1 x.3 ; ASSRT "$? -eq 0"
+rm -f x.3 x.4 dump31l.x dump31p.x cap31p.x arc31p.x
+./trc_ctl nosuch.sock stats >x.1 2>&1 ; ASSRT "$? -eq 1"
+egrep "^trc_ctl: cannot reach 'nosuch.sock'$" x.1 >/dev/null ; ASSRT "$? -eq 0"
+rm -f cap31.x
+
+
+# Event counts past 2^32.
+./trc_test -t 32 >x.1 2>&1 ; ASSRT "$? -eq 0"
+egrep -v "^Test [0-9]*...OK$" x.1 >x.2 ; ASSRT "! -s x.2"
+egrep "^trc_dump: .*, event_count=4294967310, " dump32.x >/dev/null ; ASSRT "$? -eq 0"
+sed -n "s/^  ev\[\([0-9]*\)\]\..*, \.p1=\([0-9]*\), .*/\1 \2/p" dump32.x | awk '{ if ($1 - $2 != 4294967290) bad++ } END { print (NR == 15 && bad == 0) }' >x.2
+ASSRT "`cat x.2` -eq 1"
+./trc_decode cap32.x >x.1 ; ASSRT "$? -eq 0"
+egrep -c "^  ev\[42949673(0[0-9])\]\." x.1 >x.2 ; ASSRT "`cat x.2` -eq 10"
+rm -f cap32.x